@@ -0,0 +1,314 @@
+/*
+calcbench.c - Mide lo que tarda mycalc -b segun el numero de linea
+
+Genera en un directorio temporal un mycalc.log de muchas lineas, con el
+mismo formato que escribe mycalc, y mide cuanto tarda ./mycalc -b N para
+lineas del principio, del medio y del final. La primera consulta crea
+mycalc.log.idx leyendo el log entero; las demas solo leen la linea pedida,
+asi que deberian tardar lo mismo sea cual sea N. Al final mide tambien un
+rango de mil lineas en medio del log (-b A:B) y las cien ultimas (-t 100),
+y cuantas operaciones por segundo calcula el modo por lotes (-f) con un
+fichero de tantas operaciones como lineas tiene el log.
+
+Despues pasa el log a binario (--convert), compara lo que ocupan los dos y
+repite las mismas consultas y el modo por lotes con --binlog.
+
+Modo de uso:
+./bench/calcbench <mycalc> <lineas> [repeticiones]
+*/
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* repeticiones por defecto de cada consulta */
+#define DEFAULT_REPS 20
+/* maximo de repeticiones */
+#define MAX_REPS 1000
+/* maximo de lineas del log generado */
+#define MAX_LINES 500000000L
+
+/* ruta absoluta de mycalc */
+char mycalc_path[PATH_MAX];
+/* directorio temporal donde se crea el log */
+char work_dir[] = "/tmp/mycalc-bench-XXXXXX";
+/* opcion que va delante en todas las ejecuciones (--binlog), o NULL */
+const char *log_option = NULL;
+
+/*
+ now_us: reloj monotono en microsegundos
+ */
+double now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/*
+ write_log: crea mycalc.log con lines operaciones "i + 1 = i+1"
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_log(long lines) {
+  FILE *log;
+  long i;
+
+  log = fopen("mycalc.log", "w");
+  if (log == NULL) {
+    perror("mycalc.log");
+    return -1;
+  }
+  for (i = 1; i <= lines; i++) {
+    fprintf(log, "Operación: %ld + 1 = %ld\n", i % 1000000, i % 1000000 + 1);
+  }
+  if (fclose(log) != 0) {
+    perror("mycalc.log");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ write_ops: crea ops.txt con lines operaciones para el modo por lotes
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_ops(long lines) {
+  static const char ops[4] = {'+', '-', 'x', '/'};
+  FILE *file;
+  long i;
+
+  file = fopen("ops.txt", "w");
+  if (file == NULL) {
+    perror("ops.txt");
+    return -1;
+  }
+  for (i = 0; i < lines; i++) {
+    fprintf(file, "%ld %c %ld\n", (i * 7919) % 200000 - 100000, ops[i % 4], i % 999 + 1);
+  }
+  if (fclose(file) != 0) {
+    perror("ops.txt");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ run_query: ejecuta ./mycalc option arg con la salida descartada
+ Si log_option no es NULL va delante de option; arg puede ser NULL.
+ Devuelve los microsegundos que ha tardado, o -1 si fallo.
+ */
+double run_query(const char *option, const char *arg) {
+  double start;
+  pid_t pid;
+  int status;
+  int devnull;
+
+  start = now_us();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+      _exit(127);
+    }
+    dup2(devnull, STDOUT_FILENO);
+    if (log_option != NULL) {
+      execl(mycalc_path, mycalc_path, log_option, option, arg, (char *)NULL);
+    } else {
+      execl(mycalc_path, mycalc_path, option, arg, (char *)NULL);
+    }
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Error: mycalc %s %s fallo\n", option, arg != NULL ? arg : "");
+    return -1;
+  }
+  return now_us() - start;
+}
+
+/*
+ compare_double: orden para qsort de los tiempos
+ */
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ measure: ejecuta reps veces ./mycalc option arg y escribe la fila de la tabla
+ Devuelve 0 si fue bien, -1 si alguna ejecucion fallo.
+ */
+int measure(const char *label, const char *option, const char *arg, long reps) {
+  double times[MAX_REPS];
+  long i;
+
+  for (i = 0; i < reps; i++) {
+    times[i] = run_query(option, arg);
+    if (times[i] < 0) {
+      return -1;
+    }
+  }
+  qsort(times, (size_t)reps, sizeof(double), compare_double);
+  printf("%-26s %12.0f %12.0f %12.0f\n", label, times[reps / 2], times[0], times[reps - 1]);
+  return 0;
+}
+
+/*
+ cleanup_work_dir: borra el log, su indice y el directorio temporal
+ */
+void cleanup_work_dir(void) {
+  unlink("mycalc.log");
+  unlink("mycalc.log.idx");
+  unlink("mycalc.log.bin");
+  unlink("ops.txt");
+  if (chdir("/") == 0) {
+    rmdir(work_dir);
+  }
+}
+
+/*
+ file_size: tamano de un fichero en bytes (0 si no existe)
+ */
+long long file_size(const char *path) {
+  struct stat st;
+
+  if (stat(path, &st) < 0) {
+    return 0;
+  }
+  return (long long)st.st_size;
+}
+
+/*
+ measure_lookups: mide -b al principio, al 1%, a la mitad y al final, un rango y -t
+ prefix va delante de cada etiqueta ("" o "--binlog ").
+ Devuelve 0 si fue bien, -1 si alguna ejecucion fallo.
+ */
+int measure_lookups(const char *prefix, long lines, long reps) {
+  long targets[4];
+  char label[64];
+  char arg[64];
+  int i;
+
+  targets[0] = 1;
+  targets[1] = lines / 100 > 0 ? lines / 100 : 1;
+  targets[2] = lines / 2 > 0 ? lines / 2 : 1;
+  targets[3] = lines;
+  for (i = 0; i < 4; i++) {
+    snprintf(label, sizeof(label), "%s-b %ld", prefix, targets[i]);
+    snprintf(arg, sizeof(arg), "%ld", targets[i]);
+    if (measure(label, "-b", arg, reps) < 0) {
+      return -1;
+    }
+  }
+  snprintf(label, sizeof(label), "%s-b (1000 lineas)", prefix);
+  snprintf(arg, sizeof(arg), "%ld:%ld", targets[2], targets[2] + 999);
+  if (measure(label, "-b", arg, reps) < 0) {
+    return -1;
+  }
+  snprintf(label, sizeof(label), "%s-t 100", prefix);
+  return measure(label, "-t", "100", reps);
+}
+
+int main(int argc, char *argv[]) {
+  char arg[64];
+  double first;
+  char *end;
+  long lines;
+  long reps;
+
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "Uso: ./bench/calcbench <mycalc> <lineas> [repeticiones]\n");
+    return -1;
+  }
+  lines = strtol(argv[2], &end, 10);
+  if (argv[2][0] == '\0' || *end != '\0' || lines < 1 || lines > MAX_LINES) {
+    fprintf(stderr, "Error: lineas debe estar entre 1 y %ld\n", MAX_LINES);
+    return -1;
+  }
+  reps = DEFAULT_REPS;
+  if (argc == 4) {
+    reps = strtol(argv[3], &end, 10);
+    if (argv[3][0] == '\0' || *end != '\0' || reps < 1 || reps > MAX_REPS) {
+      fprintf(stderr, "Error: repeticiones debe estar entre 1 y %d\n", MAX_REPS);
+      return -1;
+    }
+  }
+  if (realpath(argv[1], mycalc_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0) {
+    perror("mkdtemp");
+    return -1;
+  }
+  if (write_log(lines) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  /* la primera consulta crea el indice */
+  snprintf(arg, sizeof(arg), "%ld", lines);
+  first = run_query("-b", arg);
+  if (first < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("log: %ld lineas  repeticiones: %ld\n", lines, reps);
+  printf("primera consulta (crea mycalc.log.idx): %.0f us\n", first);
+  printf("%-26s %12s %12s %12s\n", "consulta", "mediana us", "min us", "max us");
+  if (measure_lookups("", lines, reps) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  /* el mismo log en binario: lo que ocupa y las mismas consultas */
+  first = run_query("--convert", NULL);
+  if (first < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("--convert: %.0f us\n", first);
+  printf("mycalc.log: %lld bytes (+ %lld de mycalc.log.idx)  mycalc.log.bin: %lld bytes\n", file_size("mycalc.log"),
+         file_size("mycalc.log.idx"), file_size("mycalc.log.bin"));
+  log_option = "--binlog";
+  if (measure_lookups("--binlog ", lines, reps) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  /* modo por lotes: una sola ejecucion, que ya calcula lines operaciones */
+  if (write_ops(lines) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  log_option = NULL;
+  first = run_query("-f", "ops.txt");
+  if (first < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("-f con %ld operaciones: %.0f us (%.1f millones de operaciones/s)\n", lines, first,
+         (double)lines / first);
+  log_option = "--binlog";
+  first = run_query("-f", "ops.txt");
+  if (first < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("--binlog -f con %ld operaciones: %.0f us (%.1f millones de operaciones/s)\n", lines, first,
+         (double)lines / first);
+
+  cleanup_work_dir();
+  return 0;
+}
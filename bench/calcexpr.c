@@ -0,0 +1,414 @@
+/*
+calcexpr.c - Mide mycalc -e frente a la misma formula con una llamada por operacion
+
+Genera un fichero de filas con las columnas a b c d (valores que a veces
+desbordan) y calcula con ./mycalc -e la formula (a + b) x c - d / 7 para
+todas las filas en un solo proceso. Comprueba que la salida y los errores
+son exactamente los que salen calculando cada paso por su cuenta con enteros
+de 64 bits.
+
+Despues calcula la misma formula como la calculaban nuestros scripts, con
+cuatro llamadas a ./mycalc <num1> <op> <num2> por fila, pasando el
+resultado de cada una a la siguiente. Como eso es muy lento solo se hace con
+las primeras filas (200 por defecto); se comprueba que da lo mismo que -e y
+se estima lo que tardaria con todas.
+
+Modo de uso:
+./bench/calcexpr <mycalc> <filas> [filas de la cadena]
+*/
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* maximo de filas */
+#define MAX_ROWS 100000000L
+/* filas que se calculan con la cadena de llamadas si no se dice otra cosa */
+#define DEFAULT_CHAIN_ROWS 200
+/* maximo de filas de la cadena */
+#define MAX_CHAIN_ROWS 100000
+/* tamano del buffer para la salida de una llamada */
+#define STEP_OUT_SIZE 512
+/* tamano de cada linea de la salida de -e */
+#define LINE_SIZE 128
+
+/* la formula que se mide */
+const char formula[] = "(a + b) x c - d / 7";
+
+/* ruta absoluta de mycalc */
+char mycalc_path[PATH_MAX];
+/* directorio temporal donde se ejecuta todo */
+char work_dir[] = "/tmp/mycalc-expr-XXXXXX";
+/* estado del generador de numeros aleatorios */
+unsigned long long rng_state = 88172645463325252ULL;
+
+/*
+ now_us: reloj monotono en microsegundos
+ */
+double now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/*
+ next_random: siguiente numero del generador (xorshift64*)
+ */
+unsigned long long next_random(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ fits: dice si value cabe en un int
+ */
+int fits(long long value) {
+  return value >= INT_MIN && value <= INT_MAX;
+}
+
+/*
+ write_rows: crea rows.txt y lo que deberia salir por stdout (expected.out) y stderr (expected.err)
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_rows(long rows) {
+  FILE *in;
+  FILE *out;
+  FILE *err;
+  long long sum;
+  long long product;
+  long long result;
+  long a;
+  long b;
+  long c;
+  long d;
+  long i;
+
+  in = fopen("rows.txt", "w");
+  out = fopen("expected.out", "w");
+  err = fopen("expected.err", "w");
+  if (in == NULL || out == NULL || err == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  fprintf(in, "a b c d\n");
+  for (i = 0; i < rows; i++) {
+    a = (long)(next_random() % 100001) - 50000;
+    b = (long)(next_random() % 100001) - 50000;
+    c = (long)(next_random() % 100001) - 50000;
+    d = (long)(int)(unsigned int)next_random();
+    fprintf(in, "%ld %ld %ld %ld\n", a, b, c, d);
+    /* los pasos en el mismo orden que el programa: a + b, x c, d / 7, - */
+    sum = (long long)a + b;
+    product = sum * c;
+    result = product - d / 7;
+    if (!fits(sum) || !fits(product) || !fits(result)) {
+      fprintf(err, "Error: linea %ld: overflow en operacion\n", i + 2);
+    } else {
+      fprintf(out, "%lld\n", result);
+    }
+  }
+  if (fclose(in) != 0 || fclose(out) != 0 || fclose(err) != 0) {
+    perror("fclose");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ run_expression: ejecuta ./mycalc -e formula rows.txt con la salida en got.out y got.err
+ Devuelve los microsegundos que ha tardado, o -1 si no se pudo ejecutar.
+ */
+double run_expression(void) {
+  double start;
+  pid_t pid;
+  int status;
+  int out_fd;
+  int err_fd;
+
+  start = now_us();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    out_fd = open("got.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    err_fd = open("got.err", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || err_fd < 0) {
+      _exit(127);
+    }
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(err_fd, STDERR_FILENO);
+    execl(mycalc_path, mycalc_path, "-e", formula, "rows.txt", (char *)NULL);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    fprintf(stderr, "Error: no se pudo ejecutar mycalc\n");
+    return -1;
+  }
+  return now_us() - start;
+}
+
+/*
+ same_file: compara dos ficheros byte a byte
+ Devuelve 1 si son iguales, 0 si no (o si no se pueden leer).
+ */
+int same_file(const char *path1, const char *path2) {
+  FILE *f1;
+  FILE *f2;
+  int c1;
+  int c2;
+
+  f1 = fopen(path1, "r");
+  f2 = fopen(path2, "r");
+  c1 = 0;
+  c2 = 0;
+  while (f1 != NULL && f2 != NULL && c1 == c2 && c1 != EOF) {
+    c1 = getc(f1);
+    c2 = getc(f2);
+  }
+  if (f1 != NULL) {
+    fclose(f1);
+  }
+  if (f2 != NULL) {
+    fclose(f2);
+  }
+  return f1 != NULL && f2 != NULL && c1 == c2;
+}
+
+/*
+ run_step: ejecuta ./mycalc a op b y lee el resultado de "Operación: a op b = r"
+ Devuelve 0 y deja el resultado en *result, 1 si mycalc dio error, -1 si no se pudo ejecutar.
+ */
+int run_step(long a, const char *op, long b, long *result) {
+  char out[STEP_OUT_SIZE];
+  char num1[32];
+  char num2[32];
+  const char *equal;
+  size_t used;
+  ssize_t n;
+  pid_t pid;
+  int pipe_fd[2];
+  int status;
+  int devnull;
+
+  snprintf(num1, sizeof(num1), "%ld", a);
+  snprintf(num2, sizeof(num2), "%ld", b);
+  if (pipe(pipe_fd) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+      _exit(127);
+    }
+    dup2(pipe_fd[1], STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    close(pipe_fd[0]);
+    execl(mycalc_path, mycalc_path, num1, op, num2, (char *)NULL);
+    _exit(127);
+  }
+  close(pipe_fd[1]);
+  used = 0;
+  while (used < sizeof(out) - 1 && (n = read(pipe_fd[0], out + used, sizeof(out) - 1 - used)) > 0) {
+    used += (size_t)n;
+  }
+  out[used] = '\0';
+  close(pipe_fd[0]);
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    fprintf(stderr, "Error: no se pudo ejecutar mycalc\n");
+    return -1;
+  }
+  if (WEXITSTATUS(status) != 0) {
+    return 1;
+  }
+  equal = strstr(out, "= ");
+  if (equal == NULL) {
+    fprintf(stderr, "Error: salida inesperada de mycalc: %s\n", out);
+    return -1;
+  }
+  *result = strtol(equal + 2, NULL, 10);
+  return 0;
+}
+
+/*
+ next_error_line: numero de linea del siguiente error de -e en got.err (0 si no quedan)
+ */
+long next_error_line(FILE *err) {
+  long line;
+
+  if (fscanf(err, "Error: linea %ld: %*[^\n]\n", &line) != 1) {
+    return 0;
+  }
+  return line;
+}
+
+/*
+ run_chain: calcula la formula con cuatro llamadas por fila para las primeras rows filas
+ Cada resultado (o "error") se compara con la linea que dio -e para esa fila.
+ Devuelve los microsegundos que ha tardado, o -1 si algo fallo o no coincide.
+ */
+double run_chain(long rows) {
+  char expected[LINE_SIZE];
+  char line[LINE_SIZE];
+  long values[4];
+  long sum;
+  long product;
+  long quotient;
+  long result;
+  double start;
+  FILE *in;
+  FILE *out;
+  FILE *err;
+  long error_line;
+  long i;
+  int status;
+
+  in = fopen("rows.txt", "r");
+  out = fopen("got.out", "r");
+  err = fopen("got.err", "r");
+  if (in == NULL || out == NULL || err == NULL || fgets(line, sizeof(line), in) == NULL) {
+    fprintf(stderr, "Error: no se pudieron leer las filas\n");
+    return -1;
+  }
+  error_line = next_error_line(err);
+  start = now_us();
+  for (i = 0; i < rows; i++) {
+    if (fgets(line, sizeof(line), in) == NULL ||
+        sscanf(line, "%ld %ld %ld %ld", &values[0], &values[1], &values[2], &values[3]) != 4) {
+      break;
+    }
+    status = run_step(values[0], "+", values[1], &sum);
+    if (status == 0) {
+      status = run_step(sum, "x", values[2], &product);
+    }
+    if (status == 0) {
+      status = run_step(values[3], "/", 7, &quotient);
+    }
+    if (status == 0) {
+      status = run_step(product, "-", quotient, &result);
+    }
+    if (status < 0) {
+      return -1;
+    }
+    /* -e tiene que haber dado error justo en las mismas filas, y si no el mismo resultado */
+    if (status == 1) {
+      if (error_line != i + 2) {
+        fprintf(stderr, "Error: la fila %ld da error con la cadena y no con -e\n", i + 2);
+        return -1;
+      }
+      error_line = next_error_line(err);
+      continue;
+    }
+    snprintf(expected, sizeof(expected), "%ld\n", result);
+    if (error_line == i + 2 || fgets(line, sizeof(line), out) == NULL || strcmp(line, expected) != 0) {
+      fprintf(stderr, "Error: la fila %ld no da lo mismo con la cadena y con -e\n", i + 2);
+      return -1;
+    }
+  }
+  fclose(in);
+  fclose(out);
+  fclose(err);
+  return now_us() - start;
+}
+
+/*
+ cleanup_work_dir: borra lo generado y el directorio temporal
+ */
+void cleanup_work_dir(void) {
+  unlink("rows.txt");
+  unlink("expected.out");
+  unlink("expected.err");
+  unlink("got.out");
+  unlink("got.err");
+  unlink("mycalc.log");
+  unlink("mycalc.log.idx");
+  if (chdir("/") == 0) {
+    rmdir(work_dir);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  double expression_us;
+  double chain_us;
+  double per_row;
+  char *end;
+  long rows;
+  long chain_rows;
+  int same;
+
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "Uso: ./bench/calcexpr <mycalc> <filas> [filas de la cadena]\n");
+    return -1;
+  }
+  rows = strtol(argv[2], &end, 10);
+  if (argv[2][0] == '\0' || *end != '\0' || rows < 1 || rows > MAX_ROWS) {
+    fprintf(stderr, "Error: filas debe estar entre 1 y %ld\n", MAX_ROWS);
+    return -1;
+  }
+  chain_rows = DEFAULT_CHAIN_ROWS;
+  if (argc == 4) {
+    chain_rows = strtol(argv[3], &end, 10);
+    if (argv[3][0] == '\0' || *end != '\0' || chain_rows < 1 || chain_rows > MAX_CHAIN_ROWS) {
+      fprintf(stderr, "Error: filas de la cadena debe estar entre 1 y %d\n", MAX_CHAIN_ROWS);
+      return -1;
+    }
+  }
+  if (chain_rows > rows) {
+    chain_rows = rows;
+  }
+  if (realpath(argv[1], mycalc_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0) {
+    perror("mkdtemp");
+    return -1;
+  }
+  if (write_rows(rows) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  expression_us = run_expression();
+  if (expression_us < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  same = same_file("got.out", "expected.out") && same_file("got.err", "expected.err");
+  printf("formula: %s  filas: %ld\n", formula, rows);
+  printf("-e: %.0f us (%.1f millones de filas/s), resultado %s\n", expression_us, (double)rows / expression_us,
+         same ? "igual" : "DISTINTO");
+  if (!same) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  chain_us = run_chain(chain_rows);
+  if (chain_us < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  per_row = chain_us / (double)chain_rows;
+  printf("cadena de 4 llamadas por fila: %.0f us por fila (%ld filas, mismo resultado que -e)\n", per_row,
+         chain_rows);
+  printf("con todas las filas tardaria unos %.1f s: %.0f veces mas que -e\n", per_row * (double)rows / 1e6,
+         per_row * (double)rows / expression_us);
+
+  cleanup_work_dir();
+  return 0;
+}
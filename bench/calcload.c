@@ -0,0 +1,515 @@
+/*
+calcload.c - Carga sobre mycalc: un proceso por operacion contra el servidor
+
+Lanza varios clientes a la vez (hilos) que calculan operaciones con mycalc
+de dos formas: ejecutando ./mycalc <num1> <op> <num2> para cada una, como
+hasta ahora, y mandandolas por una conexion persistente a ./mycalc -s.
+Para cada forma muestra la latencia de cada operacion (mediana y p99) y
+cuantas operaciones por segundo salen entre todos los clientes.
+
+Al final comprueba que mycalc.log tiene una linea entera y bien calculada
+por cada operacion, y que las entradas de mycalc.log.idx caen justo al final
+de sus lineas. La prueba de que muchos mycalc escribiendo a la vez no
+cortan ni mezclan lineas es bench/calcwriters (make check-mycalc).
+
+Modo de uso:
+./bench/calcload <mycalc> <operaciones> [clientes] [none|batch|always]
+
+El ultimo argumento se pasa a mycalc como --sync= (por defecto none).
+
+Crear un proceso por operacion es mucho mas lento, asi que esa forma solo
+hace como mucho MAX_SPAWN_OPS operaciones. Todo se ejecuta en un directorio
+temporal, asi el mycalc.log del usuario no cambia.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* clientes por defecto */
+#define DEFAULT_CLIENTS 8
+/* maximo de clientes */
+#define MAX_CLIENTS 256
+/* maximo de operaciones */
+#define MAX_OPS 100000000L
+/* operaciones como mucho en el modo de un proceso por operacion */
+#define MAX_SPAWN_OPS 4000L
+/* tamano de la respuesta mas larga del servidor */
+#define REPLY_MAX 512
+/* longitud maxima de una linea del log */
+#define LINE_MAX_LEN 512
+/* bytes de la cabecera de mycalc.log.idx, antes de las entradas */
+#define INDEX_HEADER_SIZE 32
+
+extern char **environ;
+
+/*
+ Worker: un cliente, con sus operaciones y la latencia de cada una
+ */
+typedef struct {
+  pthread_t thread;
+  int use_server;
+  long first;
+  long count;
+  double *latency_us;
+  int failed;
+} Worker;
+
+/* ruta absoluta de mycalc */
+char mycalc_path[PATH_MAX];
+/* directorio temporal donde se ejecuta todo */
+char work_dir[] = "/tmp/mycalc-load-XXXXXX";
+/* socket del servidor, dentro de work_dir */
+char socket_path[sizeof(work_dir) + 8];
+/* --sync=... que se pasa a mycalc */
+char sync_option[32] = "--sync=none";
+
+/*
+ now_us: reloj monotono en microsegundos
+ */
+double now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/*
+ make_operation: escribe en num1, op y num2 la operacion numero i
+ */
+void make_operation(long i, char *num1, char *op, char *num2) {
+  static const char ops[4] = {'+', '-', 'x', '/'};
+
+  snprintf(num1, 16, "%ld", (i * 7919) % 200000 - 100000);
+  op[0] = ops[i % 4];
+  op[1] = '\0';
+  snprintf(num2, 16, "%ld", i % 999 + 1);
+}
+
+/*
+ spawn_mycalc: lanza mycalc con args y la salida normal descartada
+ Devuelve el pid del hijo, o -1 si no se pudo lanzar.
+ */
+pid_t spawn_mycalc(char *const args[]) {
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int error;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  error = posix_spawn(&pid, mycalc_path, &actions, NULL, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    fprintf(stderr, "Error: no se pudo lanzar mycalc: %s\n", strerror(error));
+    return -1;
+  }
+  return pid;
+}
+
+/*
+ run_spawned: calcula las operaciones del cliente con un proceso para cada una
+ Devuelve 0 si fue bien, -1 si alguna fallo.
+ */
+int run_spawned(Worker *w) {
+  char num1[16];
+  char op[2];
+  char num2[16];
+  char *args[6];
+  double start;
+  pid_t pid;
+  int status;
+  long i;
+
+  args[0] = mycalc_path;
+  args[1] = sync_option;
+  args[2] = num1;
+  args[3] = op;
+  args[4] = num2;
+  args[5] = NULL;
+  for (i = 0; i < w->count; i++) {
+    make_operation(w->first + i, num1, op, num2);
+    start = now_us();
+    pid = spawn_mycalc(args);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Error: mycalc %s %s %s fallo\n", num1, op, num2);
+      return -1;
+    }
+    w->latency_us[i] = now_us() - start;
+  }
+  return 0;
+}
+
+/*
+ connect_server: abre una conexion con el servidor
+ Devuelve su descriptor, o -1 si no se pudo conectar.
+ */
+int connect_server(void) {
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ run_connected: calcula las operaciones del cliente por una sola conexion
+ Manda cada operacion y espera su respuesta antes de mandar la siguiente.
+ Devuelve 0 si fue bien, -1 si alguna fallo.
+ */
+int run_connected(Worker *w) {
+  char num1[16];
+  char op[2];
+  char num2[16];
+  char request[64];
+  char reply[REPLY_MAX];
+  size_t used;
+  ssize_t n;
+  double start;
+  int len;
+  int fd;
+  long i;
+
+  fd = connect_server();
+  if (fd < 0) {
+    fprintf(stderr, "Error: no se pudo conectar con el servidor\n");
+    return -1;
+  }
+  for (i = 0; i < w->count; i++) {
+    make_operation(w->first + i, num1, op, num2);
+    len = snprintf(request, sizeof(request), "%s %s %s\n", num1, op, num2);
+    start = now_us();
+    if (write(fd, request, (size_t)len) != len) {
+      close(fd);
+      return -1;
+    }
+    used = 0;
+    while (used == 0 || reply[used - 1] != '\n') {
+      n = read(fd, reply + used, sizeof(reply) - used);
+      if (n <= 0 || used + (size_t)n == sizeof(reply)) {
+        fprintf(stderr, "Error: el servidor no respondio a %s", request);
+        close(fd);
+        return -1;
+      }
+      used += (size_t)n;
+    }
+    w->latency_us[i] = now_us() - start;
+    if (strncmp(reply, "Operación: ", strlen("Operación: ")) != 0) {
+      fprintf(stderr, "Error: respuesta inesperada a %s", request);
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+/*
+ worker_main: cuerpo de cada hilo cliente
+ */
+void *worker_main(void *arg) {
+  Worker *w = arg;
+
+  if (w->use_server) {
+    w->failed = run_connected(w) < 0;
+  } else {
+    w->failed = run_spawned(w) < 0;
+  }
+  return NULL;
+}
+
+/*
+ compare_double: orden para qsort de las latencias
+ */
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ run_load: reparte ops operaciones entre clients clientes y escribe la fila de la tabla
+ first es el numero de la primera operacion (para no repetir las de otra forma).
+ Devuelve 0 si fue bien, -1 si algun cliente fallo.
+ */
+int run_load(const char *label, int use_server, long first, long ops, int clients) {
+  Worker workers[MAX_CLIENTS];
+  double *latency_us;
+  double start;
+  double elapsed;
+  long done;
+  int failed;
+  int started;
+  int i;
+
+  latency_us = malloc((size_t)ops * sizeof(double));
+  if (latency_us == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  done = 0;
+  for (i = 0; i < clients; i++) {
+    workers[i].use_server = use_server;
+    workers[i].first = first + done;
+    workers[i].count = ops / clients + (i < ops % clients ? 1 : 0);
+    workers[i].latency_us = latency_us + done;
+    workers[i].failed = 0;
+    done += workers[i].count;
+  }
+
+  failed = 0;
+  start = now_us();
+  for (started = 0; started < clients; started++) {
+    if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+      fprintf(stderr, "Error: no se pudo crear el hilo\n");
+      failed = 1;
+      break;
+    }
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+    failed |= workers[i].failed;
+  }
+  elapsed = now_us() - start;
+  if (failed) {
+    free(latency_us);
+    return -1;
+  }
+
+  qsort(latency_us, (size_t)ops, sizeof(double), compare_double);
+  printf("%-22s %10ld %8d %10.1f %10.1f %12.0f\n", label, ops, clients, latency_us[ops / 2],
+         latency_us[(size_t)((double)ops * 0.99)], (double)ops / (elapsed / 1e6));
+  free(latency_us);
+  return 0;
+}
+
+/*
+ start_server: lanza ./mycalc -s y espera a que acepte conexiones
+ Devuelve el pid del servidor, o -1 si no llego a arrancar.
+ */
+pid_t start_server(void) {
+  char *args[5];
+  pid_t pid;
+  int tries;
+  int fd;
+
+  args[0] = mycalc_path;
+  args[1] = sync_option;
+  args[2] = "-s";
+  args[3] = socket_path;
+  args[4] = NULL;
+  pid = spawn_mycalc(args);
+  if (pid < 0) {
+    return -1;
+  }
+  for (tries = 0; tries < 500; tries++) {
+    fd = connect_server();
+    if (fd >= 0) {
+      close(fd);
+      return pid;
+    }
+    usleep(10000);
+  }
+  fprintf(stderr, "Error: el servidor no arranco\n");
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  return -1;
+}
+
+/*
+ check_line: comprueba que line es una linea "Operación: a op b = r" bien calculada
+ Devuelve 0 si lo es, -1 si no.
+ */
+int check_line(const char *line) {
+  long long a;
+  long long b;
+  long long r;
+  long long expected;
+  char op;
+  char end;
+
+  if (sscanf(line, "Operación: %lld %c %lld = %lld%c", &a, &op, &b, &r, &end) != 5 || end != '\n') {
+    return -1;
+  }
+  if (op == '+') {
+    expected = a + b;
+  } else if (op == '-') {
+    expected = a - b;
+  } else if (op == 'x') {
+    expected = a * b;
+  } else if (op == '/' && b != 0) {
+    expected = a / b;
+  } else {
+    return -1;
+  }
+  return r == expected ? 0 : -1;
+}
+
+/*
+ check_log: comprueba mycalc.log y mycalc.log.idx despues de la carga
+
+ Cada linea tiene que ser una operacion entera y bien calculada (una linea
+ cortada o mezclada con otra no lo es) y tiene que haber expected lineas. El
+ indice puede tener menos entradas que lineas (lo completa mycalc -b), pero
+ cada una tiene que ser el final de su linea.
+ Devuelve 0 si todo esta bien, -1 si no.
+ */
+int check_log(long expected) {
+  unsigned char entry[8];
+  char line[LINE_MAX_LEN];
+  unsigned long long end;
+  unsigned long long pos;
+  long lines;
+  long entries;
+  long bad;
+  FILE *log;
+  FILE *idx;
+  int i;
+
+  log = fopen("mycalc.log", "r");
+  if (log == NULL) {
+    perror("mycalc.log");
+    return -1;
+  }
+  idx = fopen("mycalc.log.idx", "r");
+  /* las entradas van despues de la cabecera del indice */
+  if (idx != NULL && fseek(idx, INDEX_HEADER_SIZE, SEEK_SET) != 0) {
+    fclose(idx);
+    idx = NULL;
+  }
+  lines = 0;
+  entries = 0;
+  bad = 0;
+  pos = 0;
+  while (fgets(line, sizeof(line), log) != NULL) {
+    lines++;
+    pos += strlen(line);
+    if (check_line(line) < 0) {
+      if (bad == 0) {
+        fprintf(stderr, "Error: linea %ld rota: %s\n", lines, line);
+      }
+      bad++;
+    }
+    /* la entrada k del indice es donde termina la linea k+1 */
+    if (idx != NULL && fread(entry, sizeof(entry), 1, idx) == 1) {
+      end = 0;
+      for (i = 7; i >= 0; i--) {
+        end = end << 8 | entry[i];
+      }
+      if (end != pos) {
+        fprintf(stderr, "Error: la entrada %ld del indice no es el final de su linea\n", lines);
+        bad++;
+      }
+      entries++;
+    }
+  }
+  fclose(log);
+  if (idx != NULL) {
+    fclose(idx);
+  }
+  printf("mycalc.log: %ld lineas (%ld esperadas), %ld rotas; mycalc.log.idx: %ld entradas\n", lines, expected, bad,
+         entries);
+  return lines == expected && bad == 0 ? 0 : -1;
+}
+
+/*
+ cleanup_work_dir: borra el log, su indice, el socket y el directorio temporal
+ */
+void cleanup_work_dir(void) {
+  unlink("mycalc.log");
+  unlink("mycalc.log.idx");
+  unlink(socket_path);
+  if (chdir("/") == 0) {
+    rmdir(work_dir);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  pid_t server;
+  long spawn_ops;
+  long ops;
+  long clients;
+  char *end;
+  int status;
+
+  if (argc < 3 || argc > 5) {
+    fprintf(stderr, "Uso: ./bench/calcload <mycalc> <operaciones> [clientes] [none|batch|always]\n");
+    return -1;
+  }
+  ops = strtol(argv[2], &end, 10);
+  if (argv[2][0] == '\0' || *end != '\0' || ops < 1 || ops > MAX_OPS) {
+    fprintf(stderr, "Error: operaciones debe estar entre 1 y %ld\n", MAX_OPS);
+    return -1;
+  }
+  clients = DEFAULT_CLIENTS;
+  if (argc >= 4) {
+    clients = strtol(argv[3], &end, 10);
+    if (argv[3][0] == '\0' || *end != '\0' || clients < 1 || clients > MAX_CLIENTS) {
+      fprintf(stderr, "Error: clientes debe estar entre 1 y %d\n", MAX_CLIENTS);
+      return -1;
+    }
+  }
+  if (argc == 5) {
+    if (strcmp(argv[4], "none") != 0 && strcmp(argv[4], "batch") != 0 && strcmp(argv[4], "always") != 0) {
+      fprintf(stderr, "Error: la politica de --sync debe ser none, batch o always\n");
+      return -1;
+    }
+    snprintf(sync_option, sizeof(sync_option), "--sync=%s", argv[4]);
+  }
+  if (clients > ops) {
+    clients = ops;
+  }
+  if (realpath(argv[1], mycalc_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0) {
+    perror("mkdtemp");
+    return -1;
+  }
+  snprintf(socket_path, sizeof(socket_path), "%s/sock", work_dir);
+  spawn_ops = ops < MAX_SPAWN_OPS ? ops : MAX_SPAWN_OPS;
+
+  printf("%s, %ld clientes\n", sync_option, clients);
+  printf("%-22s %10s %8s %10s %10s %12s\n", "modo", "operac.", "clientes", "p50 us", "p99 us", "operac./s");
+  if (run_load("un proceso por op.", 0, 0, spawn_ops, (int)(clients < spawn_ops ? clients : spawn_ops)) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  server = start_server();
+  if (server < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  status = run_load("servidor (-s)", 1, spawn_ops, ops, (int)clients);
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  /* el servidor solo contesta cuando la linea ya esta en el log */
+  if (status == 0) {
+    status = check_log(spawn_ops + ops);
+  }
+  cleanup_work_dir();
+  return status;
+}
@@ -0,0 +1,590 @@
+/*
+calcseg.c - Comprueba y mide mycalc.log partido en segmentos
+
+Genera un fichero de operaciones (siempre las mismas) y lo calcula con
+./mycalc -f dos veces, en dos directorios: en "unico" mycalc.log es un solo
+fichero y en "segmentos" se rota con --segment-lines=<lineas por segmento>.
+
+Despues comprueba en "segmentos" que -b N da la linea esperada (calculada
+aqui por su cuenta) para la primera y la ultima linea, las dos de cada
+lado de cada cambio de segmento y otras al azar, que los rangos que cruzan
+un cambio de segmento y -t con mas lineas de las que tiene mycalc.log
+salen enteros, y que el manifiesto cuadra con los segmentos: al menos dos
+cerrados y cada uno con justo las lineas pedidas.
+
+Mide la primera consulta sin indices (en "unico" hay que leer todo el log
+para rehacerlo, en "segmentos" solo un segmento) y las consultas de
+siempre en los dos. Por ultimo comprime los segmentos (--compress), dice lo
+que ocupan antes y despues, y repite las comprobaciones y las medidas.
+
+Modo de uso:
+./bench/calcseg <mycalc> <lineas> [lineas por segmento]
+*/
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* lineas por segmento por defecto */
+#define DEFAULT_SEGMENT_LINES 100000
+/* maximo de lineas del log generado */
+#define MAX_LINES 100000000L
+/* repeticiones de cada consulta */
+#define REPS 20
+/* lineas al azar que se comprueban con -b */
+#define RANDOM_CHECKS 50
+/* lineas a cada lado de un cambio de segmento en los rangos */
+#define RANGE_SIDE 3
+/* maximo de segmentos que se comprueban uno a uno */
+#define MAX_SEGMENTS 4096
+/* longitud maxima de una linea esperada */
+#define LINE_MAX_LEN 96
+
+/* ruta absoluta de mycalc */
+char mycalc_path[PATH_MAX];
+/* directorio temporal donde se ejecuta todo */
+char work_dir[] = "/tmp/mycalc-seg-XXXXXX";
+/* primera linea de cada segmento cerrado, leida del manifiesto */
+long segment_first[MAX_SEGMENTS];
+long segments;
+/* salida de la ultima consulta que se comprueba */
+char *output;
+size_t output_len;
+size_t output_cap;
+/* estado del generador de numeros aleatorios */
+unsigned long long rng_state = 88172645463325252ULL;
+
+/*
+ now_us: reloj monotono en microsegundos
+ */
+double now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/*
+ next_random: siguiente numero del generador (xorshift64*)
+ */
+unsigned long long next_random(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ expected_line: escribe en out la linea n del log ("Operación: ...\n") y devuelve su longitud
+ La operacion i de ops.txt es la linea i+1: todas se pueden calcular.
+ */
+int expected_line(long n, char *out) {
+  static const char ops[4] = {'+', '-', 'x', '/'};
+  long a;
+  long b;
+  long result;
+  long i;
+
+  i = n - 1;
+  a = (i * 7919) % 200000 - 100000;
+  b = i % 999 + 1;
+  if (ops[i % 4] == '+') {
+    result = a + b;
+  } else if (ops[i % 4] == '-') {
+    result = a - b;
+  } else if (ops[i % 4] == 'x') {
+    result = a * b;
+  } else {
+    result = a / b;
+  }
+  return snprintf(out, LINE_MAX_LEN, "Operación: %ld %c %ld = %ld\n", a, ops[i % 4], b, result);
+}
+
+/*
+ write_ops: crea ops.txt con lines operaciones
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_ops(long lines) {
+  static const char ops[4] = {'+', '-', 'x', '/'};
+  FILE *file;
+  long i;
+
+  file = fopen("ops.txt", "w");
+  if (file == NULL) {
+    perror("ops.txt");
+    return -1;
+  }
+  for (i = 0; i < lines; i++) {
+    fprintf(file, "%ld %c %ld\n", (i * 7919) % 200000 - 100000, ops[i % 4], i % 999 + 1);
+  }
+  if (fclose(file) != 0) {
+    perror("ops.txt");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ run_mycalc: ejecuta mycalc con los argumentos args (args[0] se rellena aqui, terminados en NULL)
+ Con capture = 1 la salida se guarda en output (output_len bytes); si no, se descarta.
+ Devuelve los microsegundos que ha tardado, o -1 si fallo.
+ */
+double run_mycalc(char *args[], int capture) {
+  char *grown;
+  ssize_t nread;
+  double start;
+  pid_t pid;
+  int pipe_fd[2];
+  int status;
+  int failed;
+  int fd;
+
+  if (capture && pipe(pipe_fd) < 0) {
+    perror("pipe");
+    return -1;
+  }
+  args[0] = mycalc_path;
+  start = now_us();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    fd = capture ? pipe_fd[1] : open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+      _exit(127);
+    }
+    dup2(fd, STDOUT_FILENO);
+    if (capture) {
+      close(pipe_fd[0]);
+    }
+    execv(mycalc_path, args);
+    _exit(127);
+  }
+  failed = 0;
+  if (capture) {
+    close(pipe_fd[1]);
+    output_len = 0;
+    while (1) {
+      if (output_len == output_cap) {
+        grown = realloc(output, output_cap > 0 ? output_cap * 2 : 65536);
+        if (grown == NULL) {
+          failed = 1;
+          break;
+        }
+        output = grown;
+        output_cap = output_cap > 0 ? output_cap * 2 : 65536;
+      }
+      nread = read(pipe_fd[0], output + output_len, output_cap - output_len);
+      if (nread <= 0) {
+        break;
+      }
+      output_len += (size_t)nread;
+    }
+    close(pipe_fd[0]);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || failed) {
+    fprintf(stderr, "Error: mycalc %s %s fallo\n", args[1], args[2] != NULL ? args[2] : "");
+    return -1;
+  }
+  return now_us() - start;
+}
+
+/*
+ check_query: ejecuta ./mycalc option arg y comprueba que salen las lineas first..last ("Linea N: ...")
+ Devuelve 1 si salen bien, 0 si no.
+ */
+int check_query(const char *option, const char *arg, long first, long last) {
+  char expected[LINE_MAX_LEN + 32];
+  char line[LINE_MAX_LEN];
+  char *args[4];
+  size_t pos;
+  long n;
+  int len;
+
+  args[1] = (char *)option;
+  args[2] = (char *)arg;
+  args[3] = NULL;
+  if (run_mycalc(args, 1) < 0) {
+    return 0;
+  }
+  pos = 0;
+  for (n = first; n <= last; n++) {
+    expected_line(n, line);
+    len = snprintf(expected, sizeof(expected), "Linea %ld: %s", n, line);
+    if (pos + (size_t)len > output_len || memcmp(output + pos, expected, (size_t)len) != 0) {
+      break;
+    }
+    pos += (size_t)len;
+  }
+  if (n <= last || pos != output_len) {
+    fprintf(stderr, "Error: ./mycalc %s %s no da lo esperado\n", option, arg);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ read_manifest: lee la primera linea de cada segmento y comprueba que van seguidas
+ Con un solo ./mycalc -f escribiendo, cada segmento cerrado tiene que
+ tener justo segment_lines lineas: -f parte lo que escribe en el limite.
+ Devuelve cuantas lineas hay en los segmentos cerrados, o -1 si el manifiesto no cuadra.
+ */
+long read_manifest(long segment_lines) {
+  unsigned char record[32];
+  uint64_t first;
+  uint64_t lines;
+  long next;
+  FILE *file;
+  int i;
+
+  file = fopen("mycalc.log.manifest", "rb");
+  segments = 0;
+  next = 1;
+  if (file == NULL) {
+    return 0;
+  }
+  while (fread(record, sizeof(record), 1, file) == 1 && segments < MAX_SEGMENTS) {
+    first = 0;
+    lines = 0;
+    for (i = 7; i >= 0; i--) {
+      first = first << 8 | record[i];
+      lines = lines << 8 | record[8 + i];
+    }
+    if ((long)first != next || (long)lines != segment_lines) {
+      fclose(file);
+      return -1;
+    }
+    segment_first[segments++] = (long)first;
+    next = (long)(first + lines);
+  }
+  fclose(file);
+  return next - 1;
+}
+
+/*
+ check_segments: comprueba -b N, rangos y -t en el directorio actual, con lines lineas en total
+ Tiene que haber al menos dos segmentos cerrados, o no se comprueba nada
+ de lo que cruza de un segmento a otro.
+ Devuelve 0 si todo sale bien, -1 si no.
+ */
+int check_segments(long lines, long segment_lines) {
+  char arg[64];
+  long sealed;
+  long first;
+  long last;
+  long n;
+  long k;
+  int ok;
+
+  sealed = read_manifest(segment_lines);
+  if (sealed < 0 || sealed >= lines) {
+    fprintf(stderr, "Error: mycalc.log.manifest no cuadra con el log\n");
+    return -1;
+  }
+  if (segments < 2) {
+    fprintf(stderr, "Error: solo %ld segmentos cerrados, tienen que ser al menos 2 "
+            "(mas lineas o segmentos mas pequenos)\n", segments);
+    return -1;
+  }
+  ok = 1;
+  for (k = 0; k <= segments && ok; k++) {
+    /*la primera linea de cada segmento (y de mycalc.log) y la anterior*/
+    n = k < segments ? segment_first[k] : sealed + 1;
+    snprintf(arg, sizeof(arg), "%ld", n);
+    ok = check_query("-b", arg, n, n);
+    if (ok && n > 1) {
+      snprintf(arg, sizeof(arg), "%ld", n - 1);
+      ok = check_query("-b", arg, n - 1, n - 1);
+      first = n - RANGE_SIDE > 1 ? n - RANGE_SIDE : 1;
+      last = n + RANGE_SIDE < lines ? n + RANGE_SIDE : lines;
+      snprintf(arg, sizeof(arg), "%ld:%ld", first, last);
+      ok = ok && check_query("-b", arg, first, last);
+    }
+  }
+  for (k = 0; k < RANDOM_CHECKS && ok; k++) {
+    n = (long)(next_random() % (unsigned long long)lines) + 1;
+    snprintf(arg, sizeof(arg), "%ld", n);
+    ok = check_query("-b", arg, n, n);
+  }
+  snprintf(arg, sizeof(arg), "%ld", lines);
+  ok = ok && check_query("-b", arg, lines, lines);
+  /*las de mycalc.log y unas cuantas del segmento anterior*/
+  snprintf(arg, sizeof(arg), "%ld", lines - sealed + RANGE_SIDE);
+  ok = ok && check_query("-t", arg, sealed + 1 - RANGE_SIDE > 1 ? sealed + 1 - RANGE_SIDE : 1, lines);
+  return ok ? 0 : -1;
+}
+
+/*
+ compare_double: orden para qsort de los tiempos
+ */
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ measure: mediana de REPS ejecuciones de ./mycalc option arg
+ Devuelve los microsegundos, o -1 si alguna ejecucion fallo.
+ */
+double measure(const char *option, const char *arg) {
+  double times[REPS];
+  char *args[4];
+  int i;
+
+  args[1] = (char *)option;
+  args[2] = (char *)arg;
+  args[3] = NULL;
+  for (i = 0; i < REPS; i++) {
+    times[i] = run_mycalc(args, 0);
+    if (times[i] < 0) {
+      return -1;
+    }
+  }
+  qsort(times, REPS, sizeof(double), compare_double);
+  return times[REPS / 2];
+}
+
+/*
+ measure_row: mide la misma consulta en "unico" y en "segmentos" y escribe la fila
+ Devuelve 0 si fue bien, -1 si alguna ejecucion fallo.
+ */
+int measure_row(const char *label, const char *option, const char *arg) {
+  double single;
+  double segmented;
+
+  if (chdir("unico") < 0) {
+    return -1;
+  }
+  single = measure(option, arg);
+  if (chdir("../segmentos") < 0) {
+    return -1;
+  }
+  segmented = measure(option, arg);
+  if (chdir("..") < 0 || single < 0 || segmented < 0) {
+    return -1;
+  }
+  printf("%-20s %14.0f %14.0f\n", label, single, segmented);
+  return 0;
+}
+
+/*
+ measure_lookups: mide -b al principio, a la mitad y al final, un rango de mil lineas y -t 100
+ Devuelve 0 si fue bien, -1 si alguna ejecucion fallo.
+ */
+int measure_lookups(long lines) {
+  char label[64];
+  char arg[64];
+  long targets[3];
+  int i;
+
+  printf("%-20s %14s %14s\n", "consulta (mediana)", "unico us", "segmentos us");
+  targets[0] = 1;
+  targets[1] = lines / 2 > 0 ? lines / 2 : 1;
+  targets[2] = lines;
+  for (i = 0; i < 3; i++) {
+    snprintf(label, sizeof(label), "-b %ld", targets[i]);
+    snprintf(arg, sizeof(arg), "%ld", targets[i]);
+    if (measure_row(label, "-b", arg) < 0) {
+      return -1;
+    }
+  }
+  snprintf(arg, sizeof(arg), "%ld:%ld", targets[1], targets[1] + 999);
+  if (measure_row("-b (1000 lineas)", "-b", arg) < 0) {
+    return -1;
+  }
+  return measure_row("-t 100", "-t", "100");
+}
+
+/*
+ run_in: ejecuta ./mycalc con args en el directorio dir
+ Devuelve los microsegundos que ha tardado, o -1 si fallo.
+ */
+double run_in(const char *dir, char *args[]) {
+  double elapsed;
+
+  if (chdir(dir) < 0) {
+    perror(dir);
+    return -1;
+  }
+  elapsed = run_mycalc(args, 0);
+  if (chdir("..") < 0) {
+    return -1;
+  }
+  return elapsed;
+}
+
+/*
+ dir_size: lo que ocupan los ficheros de dir cuyo nombre empieza por prefix y acaba en suffix
+ Con drop = 1 los borra en lugar de sumarlos.
+ */
+long long dir_size(const char *dir, const char *prefix, const char *suffix, int drop) {
+  char path[PATH_MAX];
+  struct dirent *entry;
+  struct stat st;
+  long long total;
+  size_t len;
+  DIR *d;
+
+  total = 0;
+  d = opendir(dir);
+  if (d == NULL) {
+    return 0;
+  }
+  while ((entry = readdir(d)) != NULL) {
+    len = strlen(entry->d_name);
+    if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0 || len < strlen(suffix) ||
+        strcmp(entry->d_name + len - strlen(suffix), suffix) != 0 || entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (drop) {
+      unlink(path);
+    } else if (stat(path, &st) == 0) {
+      total += (long long)st.st_size;
+    }
+  }
+  closedir(d);
+  return total;
+}
+
+/*
+ cleanup_work_dir: borra todo lo generado y el directorio temporal
+ */
+void cleanup_work_dir(void) {
+  if (chdir(work_dir) == 0) {
+    dir_size("unico", "", "", 1);
+    dir_size("segmentos", "", "", 1);
+    rmdir("unico");
+    rmdir("segmentos");
+    unlink("ops.txt");
+  }
+  if (chdir("/") == 0) {
+    rmdir(work_dir);
+  }
+  free(output);
+}
+
+int main(int argc, char *argv[]) {
+  char segment_option[64];
+  char arg[64];
+  char *args[5];
+  double single;
+  double segmented;
+  long long before;
+  long long after;
+  char *end;
+  long lines;
+  long segment_lines;
+
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "Uso: ./bench/calcseg <mycalc> <lineas> [lineas por segmento]\n");
+    return -1;
+  }
+  lines = strtol(argv[2], &end, 10);
+  if (argv[2][0] == '\0' || *end != '\0' || lines < 2 || lines > MAX_LINES) {
+    fprintf(stderr, "Error: lineas debe estar entre 2 y %ld\n", MAX_LINES);
+    return -1;
+  }
+  segment_lines = DEFAULT_SEGMENT_LINES;
+  if (argc == 4) {
+    segment_lines = strtol(argv[3], &end, 10);
+    if (argv[3][0] == '\0' || *end != '\0' || segment_lines < 1 || segment_lines > INT_MAX) {
+      fprintf(stderr, "Error: las lineas por segmento deben estar entre 1 y %d\n", INT_MAX);
+      return -1;
+    }
+  }
+  if (realpath(argv[1], mycalc_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0 || mkdir("unico", 0755) < 0 ||
+      mkdir("segmentos", 0755) < 0) {
+    perror("mkdtemp");
+    cleanup_work_dir();
+    return -1;
+  }
+  if (write_ops(lines) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  /* el mismo fichero de operaciones con y sin segmentos */
+  snprintf(segment_option, sizeof(segment_option), "--segment-lines=%ld", segment_lines);
+  args[1] = "-f";
+  args[2] = "../ops.txt";
+  args[3] = NULL;
+  single = run_in("unico", args);
+  args[1] = segment_option;
+  args[2] = "-f";
+  args[3] = "../ops.txt";
+  args[4] = NULL;
+  segmented = run_in("segmentos", args);
+  if (single < 0 || segmented < 0 || chdir("segmentos") < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("log: %ld lineas  segmentos de %ld lineas\n", lines, segment_lines);
+  printf("-f: %.0f us en un solo fichero, %.0f us con segmentos\n", single, segmented);
+  if (check_segments(lines, segment_lines) < 0 || chdir("..") < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("segmentos cerrados: %ld (+ mycalc.log), -b, rangos y -t comprobados\n", segments);
+
+  /* primera consulta sin indices: en "segmentos" solo se rehace el de un segmento */
+  dir_size("unico", "mycalc.log", ".idx", 1);
+  dir_size("segmentos", "mycalc.log", ".idx", 1);
+  snprintf(arg, sizeof(arg), "%ld", lines / 2);
+  args[1] = "-b";
+  args[2] = arg;
+  args[3] = NULL;
+  single = run_in("unico", args);
+  segmented = run_in("segmentos", args);
+  if (single < 0 || segmented < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("primera -b %ld sin indices: %.0f us en un solo fichero, %.0f us con segmentos\n", lines / 2, single,
+         segmented);
+  if (measure_lookups(lines) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  /* los segmentos cerrados comprimidos: lo que ocupan y las mismas comprobaciones y consultas */
+  before = dir_size("segmentos", "mycalc.log.", "", 0) - dir_size("segmentos", "mycalc.log.", ".idx", 0) -
+           dir_size("segmentos", "mycalc.log.", ".manifest", 0);
+  args[1] = "--compress";
+  args[2] = NULL;
+  segmented = run_in("segmentos", args);
+  if (segmented < 0 || chdir("segmentos") < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  after = dir_size(".", "mycalc.log.", ".lz", 0);
+  printf("--compress: %.0f us, segmentos cerrados: %lld -> %lld bytes\n", segmented, before, after);
+  if (check_segments(lines, segment_lines) < 0 || chdir("..") < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+  printf("-b, rangos y -t comprobados con los segmentos comprimidos\n");
+  if (measure_lookups(lines) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  cleanup_work_dir();
+  return 0;
+}
@@ -0,0 +1,321 @@
+/*
+calcsimd.c - Compara y mide los kernels por columnas del modo por lotes de mycalc
+
+Genera un fichero de operaciones aleatorias (siempre las mismas para la
+misma semilla) con muchos casos limite: INT_MIN, INT_MAX, productos que
+rozan el desbordamiento, divisiones por cero, operadores y numeros
+invalidos y lineas en blanco. Mientras las genera calcula por su cuenta,
+con enteros de 64 bits, la salida y los errores que deberia dar mycalc.
+
+Despues ejecuta ./mycalc -f con cada kernel (MYCALC_SIMD=scalar, sse4 y
+avx2) y comprueba que la salida, los errores y mycalc.log son exactamente
+los esperados, y muestra cuantas operaciones por segundo calcula cada uno.
+Si la CPU no tiene un kernel, mycalc usa el escalar y la fila sale igual.
+
+Modo de uso:
+./bench/calcsimd <mycalc> <operaciones> [semilla]
+*/
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* maximo de operaciones */
+#define MAX_OPS 100000000L
+/* tamano de los bloques en que se comparan los ficheros */
+#define COMPARE_BUF 65536
+
+/* kernels que se prueban, en el orden de la tabla */
+const char *kernels[] = {"scalar", "sse4", "avx2"};
+
+/* valores que mas fallos suelen destapar */
+const long edge_values[] = {INT_MIN, INT_MIN + 1, -46341, -46340, -65536, -1, 0,
+                            1,       2,           46340,  46341,  65535,  65536, INT_MAX - 1, INT_MAX};
+
+/* ruta absoluta de mycalc */
+char mycalc_path[PATH_MAX];
+/* directorio temporal donde se ejecuta todo */
+char work_dir[] = "/tmp/mycalc-simd-XXXXXX";
+/* estado del generador de numeros aleatorios */
+unsigned long long rng_state;
+
+/*
+ now_us: reloj monotono en microsegundos
+ */
+double now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/*
+ next_random: siguiente numero del generador (xorshift64*)
+ */
+unsigned long long next_random(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ random_operand: un operando, a veces limite, a veces cualquiera y a veces pequeno
+ */
+long random_operand(void) {
+  unsigned long long r;
+
+  r = next_random() % 10;
+  if (r < 3) {
+    return edge_values[next_random() % (sizeof(edge_values) / sizeof(edge_values[0]))];
+  }
+  if (r < 6) {
+    return (long)(int)(unsigned int)next_random();
+  }
+  if (r < 9) {
+    return (long)(next_random() % 100001) - 50000;
+  }
+  return (long)(next_random() % 201) - 100;
+}
+
+/*
+ write_inputs: crea ops.txt y lo que deberia salir por stdout (expected.out) y stderr (expected.err)
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_inputs(long ops) {
+  static const char operators[5] = {'+', '-', 'x', '*', '/'};
+  FILE *in;
+  FILE *out;
+  FILE *err;
+  long long value;
+  long a;
+  long b;
+  long i;
+  char op;
+  unsigned long long kind;
+
+  in = fopen("ops.txt", "w");
+  out = fopen("expected.out", "w");
+  err = fopen("expected.err", "w");
+  if (in == NULL || out == NULL || err == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  for (i = 1; i <= ops; i++) {
+    kind = next_random() % 200;
+    if (kind == 0) {
+      fprintf(in, "\n");
+    } else if (kind == 1) {
+      fprintf(in, "%ld %% %ld\n", random_operand(), random_operand());
+      fprintf(err, "Error: linea %ld: operador invalido\n", i);
+    } else if (kind == 2) {
+      fprintf(in, "12a + 3\n");
+      fprintf(err, "Error: linea %ld: numeros invalidos\n", i);
+    } else if (kind == 3) {
+      fprintf(in, "1 + 2 + 3\n");
+      fprintf(err, "Error: linea %ld: se esperaba <num1> <op> <num2>\n", i);
+    } else if (kind == 4) {
+      /* los numeros se copian tal cual vienen */
+      fprintf(in, "  007\t+  +5 \r\n");
+      fprintf(out, "Operación: 007 + +5 = 12\n");
+    } else {
+      a = random_operand();
+      b = kind < 10 ? 0 : random_operand();
+      op = operators[next_random() % 5];
+      fprintf(in, "%ld %c %ld\n", a, op, b);
+      if (op == '+') {
+        value = (long long)a + b;
+      } else if (op == '-') {
+        value = (long long)a - b;
+      } else if (op == '/') {
+        if (b == 0) {
+          fprintf(err, "Error: linea %ld: Division por cero\n", i);
+          continue;
+        }
+        value = a == INT_MIN && b == -1 ? (long long)INT_MAX + 1 : (long long)(a / b);
+      } else {
+        value = (long long)a * b;
+      }
+      if (value < INT_MIN || value > INT_MAX) {
+        fprintf(err, "Error: linea %ld: overflow en operacion\n", i);
+      } else {
+        fprintf(out, "Operación: %ld %c %ld = %lld\n", a, op, b, value);
+      }
+    }
+  }
+  if (fclose(in) != 0 || fclose(out) != 0 || fclose(err) != 0) {
+    perror("fclose");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ run_kernel: ejecuta ./mycalc -f ops.txt con MYCALC_SIMD=kernel
+ La salida va a kernel.out y kernel.err y el log se empieza de cero.
+ Devuelve los microsegundos que ha tardado, o -1 si no se pudo ejecutar.
+ */
+double run_kernel(const char *kernel) {
+  char out_name[64];
+  char err_name[64];
+  double start;
+  pid_t pid;
+  int status;
+  int out_fd;
+  int err_fd;
+
+  unlink("mycalc.log");
+  unlink("mycalc.log.idx");
+  snprintf(out_name, sizeof(out_name), "%s.out", kernel);
+  snprintf(err_name, sizeof(err_name), "%s.err", kernel);
+  start = now_us();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    out_fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    err_fd = open(err_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0 || err_fd < 0) {
+      _exit(127);
+    }
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(err_fd, STDERR_FILENO);
+    setenv("MYCALC_SIMD", kernel, 1);
+    execl(mycalc_path, mycalc_path, "-f", "ops.txt", (char *)NULL);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    fprintf(stderr, "Error: no se pudo ejecutar mycalc\n");
+    return -1;
+  }
+  return now_us() - start;
+}
+
+/*
+ same_file: compara dos ficheros byte a byte
+ Devuelve 1 si son iguales, 0 si no (o si no se pueden leer).
+ */
+int same_file(const char *path1, const char *path2) {
+  char buf1[COMPARE_BUF];
+  char buf2[COMPARE_BUF];
+  size_t n1;
+  size_t n2;
+  FILE *f1;
+  FILE *f2;
+  int same;
+
+  f1 = fopen(path1, "r");
+  f2 = fopen(path2, "r");
+  same = f1 != NULL && f2 != NULL;
+  while (same) {
+    n1 = fread(buf1, 1, sizeof(buf1), f1);
+    n2 = fread(buf2, 1, sizeof(buf2), f2);
+    if (n1 != n2 || memcmp(buf1, buf2, n1) != 0) {
+      same = 0;
+    }
+    if (n1 == 0) {
+      break;
+    }
+  }
+  if (f1 != NULL) {
+    fclose(f1);
+  }
+  if (f2 != NULL) {
+    fclose(f2);
+  }
+  return same;
+}
+
+/*
+ cleanup_work_dir: borra lo generado y el directorio temporal
+ */
+void cleanup_work_dir(void) {
+  char name[64];
+  size_t i;
+
+  unlink("ops.txt");
+  unlink("expected.out");
+  unlink("expected.err");
+  unlink("mycalc.log");
+  unlink("mycalc.log.idx");
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    snprintf(name, sizeof(name), "%s.out", kernels[i]);
+    unlink(name);
+    snprintf(name, sizeof(name), "%s.err", kernels[i]);
+    unlink(name);
+  }
+  if (chdir("/") == 0) {
+    rmdir(work_dir);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char out_name[64];
+  char err_name[64];
+  double elapsed;
+  char *end;
+  long ops;
+  int failed;
+  int same;
+  size_t i;
+
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "Uso: ./bench/calcsimd <mycalc> <operaciones> [semilla]\n");
+    return -1;
+  }
+  ops = strtol(argv[2], &end, 10);
+  if (argv[2][0] == '\0' || *end != '\0' || ops < 1 || ops > MAX_OPS) {
+    fprintf(stderr, "Error: operaciones debe estar entre 1 y %ld\n", MAX_OPS);
+    return -1;
+  }
+  rng_state = 88172645463325252ULL;
+  if (argc == 4) {
+    rng_state = strtoull(argv[3], &end, 10);
+    if (argv[3][0] == '\0' || *end != '\0' || rng_state == 0) {
+      fprintf(stderr, "Error: la semilla debe ser un numero distinto de 0\n");
+      return -1;
+    }
+  }
+  if (realpath(argv[1], mycalc_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0) {
+    perror("mkdtemp");
+    return -1;
+  }
+  if (write_inputs(ops) < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  printf("operaciones: %ld\n", ops);
+  printf("%-8s %12s %14s %10s\n", "kernel", "us", "operac./s", "resultado");
+  failed = 0;
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    elapsed = run_kernel(kernels[i]);
+    if (elapsed < 0) {
+      cleanup_work_dir();
+      return -1;
+    }
+    snprintf(out_name, sizeof(out_name), "%s.out", kernels[i]);
+    snprintf(err_name, sizeof(err_name), "%s.err", kernels[i]);
+    /* el log lleva lo mismo que la salida */
+    same = same_file(out_name, "expected.out") && same_file(err_name, "expected.err") &&
+           same_file("mycalc.log", "expected.out");
+    printf("%-8s %12.0f %14.0f %10s\n", kernels[i], elapsed, (double)ops / (elapsed / 1e6),
+           same ? "igual" : "DISTINTO");
+    failed |= !same;
+  }
+
+  cleanup_work_dir();
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,341 @@
+/*
+calcwriters.c - Comprueba que muchos mycalc escribiendo a la vez no cortan lineas del log
+
+Lanza <escritores> procesos a la vez (64 por defecto) sobre el mismo
+mycalc.log, en dos rondas:
+ calculadora : cada escritor ejecuta ./mycalc W + i para i = 0 .. <operaciones>-1,
+               un proceso de mycalc por operacion
+ lotes       : cada escritor ejecuta ./mycalc -f con un fichero de
+               10 * <operaciones> operaciones 1000+W + i, que van al log
+               en escrituras grandes
+
+Despues lee mycalc.log y comprueba que cada linea es una operacion entera,
+bien escrita y bien calculada (una linea cortada o mezclada con otra no lo
+es) y que cada operacion de cada escritor esta exactamente una vez. Si
+alguna linea esta rota, falta o sobra, termina con error: es lo que usa
+make check-mycalc.
+
+Modo de uso:
+./bench/calcwriters <mycalc> [escritores] [operaciones] [none|batch|always]
+
+El ultimo argumento se pasa a mycalc como --sync= (por defecto none). Todo
+se ejecuta en un directorio temporal, asi el mycalc.log del usuario no cambia.
+*/
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* escritores y operaciones por escritor por defecto */
+#define DEFAULT_WRITERS 64
+#define DEFAULT_OPS 100
+/* maximos de los argumentos */
+#define MAX_WRITERS 1000
+#define MAX_OPS 100000
+/* el modo por lotes hace BATCH_FACTOR veces mas operaciones por escritor */
+#define BATCH_FACTOR 10
+/* el primer operando de la ronda por lotes empieza aqui, para no confundirla con la otra */
+#define BATCH_BASE 1000
+/* longitud maxima de una linea del log */
+#define LINE_MAX_LEN 512
+
+extern char **environ;
+
+/* ruta absoluta de mycalc */
+char mycalc_path[PATH_MAX];
+/* directorio temporal donde se crea el log */
+char work_dir[] = "/tmp/mycalc-writers-XXXXXX";
+/* opcion --sync= que se pasa a mycalc */
+char sync_option[32] = "--sync=none";
+
+/*
+ now_ms: reloj monotono en milisegundos
+ */
+double now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/*
+ run_mycalc: ejecuta mycalc con args, con la salida normal descartada, y espera a que termine
+ Devuelve 0 si termino bien, -1 si no.
+ */
+int run_mycalc(char *const args[]) {
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status;
+  int error;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  error = posix_spawn(&pid, mycalc_path, &actions, NULL, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    fprintf(stderr, "Error: no se pudo lanzar mycalc: %s\n", strerror(error));
+    return -1;
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ writer_calc: escritor de la ronda calculadora, un mycalc por operacion
+ Devuelve 0 si todas fueron bien, -1 si no.
+ */
+int writer_calc(long writer, long ops) {
+  char num1[24];
+  char num2[24];
+  char *args[6];
+  long i;
+
+  args[0] = mycalc_path;
+  args[1] = sync_option;
+  args[2] = num1;
+  args[3] = "+";
+  args[4] = num2;
+  args[5] = NULL;
+  snprintf(num1, sizeof(num1), "%ld", writer);
+  for (i = 0; i < ops; i++) {
+    snprintf(num2, sizeof(num2), "%ld", i);
+    if (run_mycalc(args) < 0) {
+      fprintf(stderr, "Error: mycalc %s + %s fallo\n", num1, num2);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ writer_batch: escritor de la ronda por lotes, un mycalc -f con todas sus operaciones
+ Devuelve 0 si fue bien, -1 si no.
+ */
+int writer_batch(long writer, long ops) {
+  char path[64];
+  char *args[5];
+  FILE *file;
+  long i;
+
+  snprintf(path, sizeof(path), "ops%ld.txt", writer);
+  file = fopen(path, "w");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  for (i = 0; i < ops; i++) {
+    fprintf(file, "%ld + %ld\n", BATCH_BASE + writer, i);
+  }
+  if (fclose(file) != 0) {
+    perror(path);
+    return -1;
+  }
+  args[0] = mycalc_path;
+  args[1] = sync_option;
+  args[2] = "-f";
+  args[3] = path;
+  args[4] = NULL;
+  if (run_mycalc(args) < 0) {
+    fprintf(stderr, "Error: mycalc -f %s fallo\n", path);
+    unlink(path);
+    return -1;
+  }
+  unlink(path);
+  return 0;
+}
+
+/*
+ run_round: lanza writers procesos a la vez, cada uno con ops operaciones
+ batch elige la ronda (0 = calculadora, 1 = lotes).
+ Devuelve 0 si todos terminaron bien, -1 si no.
+ */
+int run_round(const char *label, int batch, long writers, long ops) {
+  double start;
+  pid_t pid;
+  long started;
+  long w;
+  int status;
+  int failed;
+
+  start = now_ms();
+  failed = 0;
+  started = 0;
+  for (w = 0; w < writers; w++) {
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      failed = 1;
+      break;
+    }
+    if (pid == 0) {
+      _exit((batch ? writer_batch(w, ops) : writer_calc(w, ops)) < 0 ? 1 : 0);
+    }
+    started++;
+  }
+  for (w = 0; w < started; w++) {
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failed = 1;
+    }
+  }
+  printf("%-12s %10ld %12ld %10.0f\n", label, writers, writers * ops, now_ms() - start);
+  return failed ? -1 : 0;
+}
+
+/*
+ check_log: comprueba que mycalc.log tiene cada operacion de las dos rondas, entera y una sola vez
+
+ Cada linea tiene que ser exactamente "Operación: a + b = a+b\n" (la
+ volvemos a escribir y la comparamos, asi un trozo de otra linea no pasa) y
+ (a, b) tiene que ser una operacion de algun escritor que no hayamos visto
+ ya.
+ Devuelve 0 si todo esta bien, -1 si no.
+ */
+int check_log(long writers, long ops) {
+  char line[LINE_MAX_LEN];
+  char expected[LINE_MAX_LEN];
+  unsigned char *seen;
+  long calc_ops;
+  long batch_ops;
+  long lines;
+  long bad;
+  long missing;
+  long slot;
+  long a;
+  long b;
+  long i;
+  FILE *log;
+
+  calc_ops = writers * ops;
+  batch_ops = writers * ops * BATCH_FACTOR;
+  seen = calloc((size_t)(calc_ops + batch_ops), 1);
+  if (seen == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  log = fopen("mycalc.log", "r");
+  if (log == NULL) {
+    perror("mycalc.log");
+    free(seen);
+    return -1;
+  }
+  lines = 0;
+  bad = 0;
+  while (fgets(line, sizeof(line), log) != NULL) {
+    lines++;
+    slot = -1;
+    if (sscanf(line, "Operación: %ld + %ld", &a, &b) == 2 && b >= 0) {
+      snprintf(expected, sizeof(expected), "Operación: %ld + %ld = %ld\n", a, b, a + b);
+      if (strcmp(line, expected) == 0) {
+        if (a >= 0 && a < writers && b < ops) {
+          slot = a * ops + b;
+        } else if (a >= BATCH_BASE && a < BATCH_BASE + writers && b < ops * BATCH_FACTOR) {
+          slot = calc_ops + (a - BATCH_BASE) * ops * BATCH_FACTOR + b;
+        }
+      }
+    }
+    if (slot < 0 || seen[slot]) {
+      if (bad == 0) {
+        fprintf(stderr, "Error: linea %ld rota o repetida: %s", lines, line);
+      }
+      bad++;
+      continue;
+    }
+    seen[slot] = 1;
+  }
+  fclose(log);
+  missing = 0;
+  for (i = 0; i < calc_ops + batch_ops; i++) {
+    missing += !seen[i];
+  }
+  free(seen);
+  printf("mycalc.log: %ld lineas (%ld esperadas), %ld rotas o repetidas, %ld operaciones sin linea\n", lines,
+         calc_ops + batch_ops, bad, missing);
+  return bad == 0 && missing == 0 ? 0 : -1;
+}
+
+/*
+ cleanup_work_dir: borra el log, su indice y el directorio temporal
+ */
+void cleanup_work_dir(void) {
+  unlink("mycalc.log");
+  unlink("mycalc.log.idx");
+  if (chdir("/") == 0) {
+    rmdir(work_dir);
+  }
+}
+
+/*
+ parse_arg: lee un argumento numerico entre 1 y max
+ Devuelve 0 si es valido, -1 si no.
+ */
+int parse_arg(const char *text, long max, long *out) {
+  char *end;
+  long value;
+
+  value = strtol(text, &end, 10);
+  if (text[0] == '\0' || *end != '\0' || value < 1 || value > max) {
+    return -1;
+  }
+  *out = value;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long writers;
+  long ops;
+  int status;
+
+  if (argc < 2 || argc > 5) {
+    fprintf(stderr, "Uso: ./bench/calcwriters <mycalc> [escritores] [operaciones] [none|batch|always]\n");
+    return -1;
+  }
+  writers = DEFAULT_WRITERS;
+  ops = DEFAULT_OPS;
+  if ((argc > 2 && parse_arg(argv[2], MAX_WRITERS, &writers) < 0) ||
+      (argc > 3 && parse_arg(argv[3], MAX_OPS, &ops) < 0)) {
+    fprintf(stderr, "Error: escritores (hasta %d) y operaciones (hasta %d) tienen que ser numeros positivos\n",
+            MAX_WRITERS, MAX_OPS);
+    return -1;
+  }
+  if (argc == 5) {
+    if (strcmp(argv[4], "none") != 0 && strcmp(argv[4], "batch") != 0 && strcmp(argv[4], "always") != 0) {
+      fprintf(stderr, "Error: la politica de --sync debe ser none, batch o always\n");
+      return -1;
+    }
+    snprintf(sync_option, sizeof(sync_option), "--sync=%s", argv[4]);
+  }
+  if (realpath(argv[1], mycalc_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0) {
+    perror("mkdtemp");
+    return -1;
+  }
+
+  fflush(stdout); /* los hijos heredan el buffer de stdout */
+  printf("%s\n", sync_option);
+  printf("%-12s %10s %12s %10s\n", "ronda", "escritores", "operaciones", "ms");
+  fflush(stdout);
+  status = run_round("calculadora", 0, writers, ops);
+  fflush(stdout);
+  if (status == 0) {
+    status = run_round("lotes (-f)", 1, writers, ops * BATCH_FACTOR);
+  }
+  if (status == 0) {
+    status = check_log(writers, ops);
+  }
+  if (status == 0) {
+    printf("ninguna linea rota: todas las operaciones estan una vez y enteras\n");
+  }
+  cleanup_work_dir();
+  return status;
+}
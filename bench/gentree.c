@@ -0,0 +1,291 @@
+/*
+gentree.c - Generador de arboles de prueba para medir mydu
+
+Crea un arbol de directorios sintetico y siempre igual para los mismos
+parametros, para que las medidas de distintas versiones de mydu sean
+comparables. Conviene crearlo en un tmpfs (/dev/shm) para medir mydu y no
+el disco.
+
+Modo de uso:
+./bench/gentree <directorio> [--fanout N] [--depth N] [--files N] [--size B]
+                [--links N] [--sparse N] [--name-len N]
+
+ --fanout N   : subdirectorios de cada directorio (por defecto 4)
+ --depth N    : niveles por debajo de la raiz (por defecto 4)
+ --files N    : ficheros normales en cada directorio (por defecto 16)
+ --size B     : bytes de cada fichero normal (por defecto 4096)
+ --links N    : enlaces duros en cada directorio a ficheros de su padre (por defecto 0)
+ --sparse N   : ficheros dispersos de 1 MB sin bloques en cada directorio (por defecto 0)
+ --name-len N : longitud de los nombres, rellenados con 'x' (por defecto los mas cortos)
+
+El directorio no debe existir: lo crea el programa.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* longitud maxima de un nombre de fichero en Linux */
+#define NAME_MAX_LEN 255
+/* tamano de los ficheros dispersos */
+#define SPARSE_SIZE (1024 * 1024)
+
+/*
+ TreeParams: forma del arbol que se genera
+ */
+typedef struct {
+  long fanout;
+  long depth;
+  long files;
+  long size;
+  long links;
+  long sparse;
+  long name_len;
+} TreeParams;
+
+/*
+ TreeCount: lo que se ha creado, para mostrarlo al terminar
+ */
+typedef struct {
+  long dirs;
+  long files;
+  long links;
+  long sparse;
+  long long bytes;
+} TreeCount;
+
+/* contenido de cada fichero normal (siempre el mismo para que el arbol sea reproducible) */
+char *file_data;
+
+/*
+ make_name: escribe en name el nombre prefix + index, rellenado hasta name_len
+ */
+void make_name(char *name, const char *prefix, long index, long name_len) {
+  int len;
+
+  len = snprintf(name, NAME_MAX_LEN + 1, "%s%ld", prefix, index);
+  while (len < name_len && len < NAME_MAX_LEN) {
+    name[len] = 'x';
+    len++;
+  }
+  name[len] = '\0';
+}
+
+/*
+ write_file: crea en dirfd el fichero name con size bytes de file_data
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_file(int dirfd, const char *name, long size) {
+  ssize_t written;
+  size_t done;
+  int fd;
+
+  fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  done = 0;
+  while (done < (size_t)size) {
+    written = write(fd, file_data + done, (size_t)size - done);
+    if (written <= 0) {
+      close(fd);
+      return -1;
+    }
+    done += (size_t)written;
+  }
+  return close(fd);
+}
+
+/*
+ make_sparse: crea en dirfd un fichero de SPARSE_SIZE bytes sin escribir ninguno
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int make_sparse(int dirfd, const char *name) {
+  int fd;
+
+  fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, SPARSE_SIZE) < 0) {
+    close(fd);
+    return -1;
+  }
+  return close(fd);
+}
+
+/*
+ fill_dir: rellena el directorio dirfd y crea sus subdirectorios
+
+ parentfd es el directorio padre (o -1 en la raiz), del que salen los
+ enlaces duros, y level la profundidad de dirfd.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int fill_dir(int dirfd, int parentfd, long level, const TreeParams *params, TreeCount *count) {
+  char name[NAME_MAX_LEN + 1];
+  char target[NAME_MAX_LEN + 1];
+  long i;
+  int childfd;
+
+  count->dirs++;
+  for (i = 0; i < params->files; i++) {
+    make_name(name, "f", i, params->name_len);
+    if (write_file(dirfd, name, params->size) < 0) {
+      perror(name);
+      return -1;
+    }
+    count->files++;
+    count->bytes += params->size;
+  }
+  for (i = 0; i < params->sparse; i++) {
+    make_name(name, "s", i, params->name_len);
+    if (make_sparse(dirfd, name) < 0) {
+      perror(name);
+      return -1;
+    }
+    count->sparse++;
+  }
+  /* los enlaces apuntan a los ficheros del padre, asi mydu los encuentra en dos directorios */
+  for (i = 0; parentfd >= 0 && i < params->links && i < params->files; i++) {
+    make_name(target, "f", i, params->name_len);
+    make_name(name, "l", i, params->name_len);
+    if (linkat(parentfd, target, dirfd, name, 0) < 0) {
+      perror(name);
+      return -1;
+    }
+    count->links++;
+  }
+
+  if (level == params->depth) {
+    return 0;
+  }
+  for (i = 0; i < params->fanout; i++) {
+    make_name(name, "d", i, params->name_len);
+    if (mkdirat(dirfd, name, 0755) < 0) {
+      perror(name);
+      return -1;
+    }
+    childfd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (childfd < 0) {
+      perror(name);
+      return -1;
+    }
+    if (fill_dir(childfd, dirfd, level + 1, params, count) < 0) {
+      close(childfd);
+      return -1;
+    }
+    close(childfd);
+  }
+  return 0;
+}
+
+/*
+ parse_param: lee el valor de una opcion numerica (entre 0 y max)
+ Devuelve 0 si es valido, -1 si no.
+ */
+int parse_param(const char *text, long max, long *out) {
+  char *end;
+  long value;
+
+  value = strtol(text, &end, 10);
+  if (text[0] == '\0' || *end != '\0' || value < 0 || value > max) {
+    return -1;
+  }
+  *out = value;
+  return 0;
+}
+
+/*
+ print_usage: muestra como se usa el programa
+ */
+void print_usage(void) {
+  fprintf(stderr, "Uso: ./bench/gentree <directorio> [--fanout N] [--depth N] [--files N] [--size B]\n");
+  fprintf(stderr, "                     [--links N] [--sparse N] [--name-len N]\n");
+}
+
+int main(int argc, char *argv[]) {
+  TreeParams params;
+  TreeCount count;
+  long *value;
+  long max;
+  int rootfd;
+  int i;
+
+  if (argc < 2) {
+    print_usage();
+    return -1;
+  }
+  params.fanout = 4;
+  params.depth = 4;
+  params.files = 16;
+  params.size = 4096;
+  params.links = 0;
+  params.sparse = 0;
+  params.name_len = 0;
+  for (i = 2; i < argc; i++) {
+    max = 1000000;
+    if (strcmp(argv[i], "--fanout") == 0) {
+      value = &params.fanout;
+    } else if (strcmp(argv[i], "--depth") == 0) {
+      value = &params.depth;
+      max = 64;
+    } else if (strcmp(argv[i], "--files") == 0) {
+      value = &params.files;
+    } else if (strcmp(argv[i], "--size") == 0) {
+      value = &params.size;
+      max = 64 * 1024 * 1024;
+    } else if (strcmp(argv[i], "--links") == 0) {
+      value = &params.links;
+    } else if (strcmp(argv[i], "--sparse") == 0) {
+      value = &params.sparse;
+    } else if (strcmp(argv[i], "--name-len") == 0) {
+      value = &params.name_len;
+      max = NAME_MAX_LEN;
+    } else {
+      print_usage();
+      return -1;
+    }
+    if (i + 1 >= argc || parse_param(argv[i + 1], max, value) < 0) {
+      fprintf(stderr, "Error: valor invalido para %s (0-%ld)\n", argv[i], max);
+      return -1;
+    }
+    i++;
+  }
+
+  file_data = malloc(params.size > 0 ? (size_t)params.size : 1);
+  if (file_data == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  for (i = 0; i < params.size; i++) {
+    file_data[i] = (char)('a' + i % 26);
+  }
+
+  if (mkdir(argv[1], 0755) < 0) {
+    fprintf(stderr, "Error: no se pudo crear %s: %s\n", argv[1], strerror(errno));
+    free(file_data);
+    return -1;
+  }
+  rootfd = open(argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (rootfd < 0) {
+    perror(argv[1]);
+    free(file_data);
+    return -1;
+  }
+  memset(&count, 0, sizeof(count));
+  if (fill_dir(rootfd, -1, 0, &params, &count) < 0) {
+    close(rootfd);
+    free(file_data);
+    return -1;
+  }
+  close(rootfd);
+  free(file_data);
+
+  printf("arbol %s: %ld directorios, %ld ficheros, %ld enlaces, %ld dispersos, %lld bytes\n", argv[1], count.dirs,
+         count.files, count.links, count.sparse, count.bytes);
+  return 0;
+}
@@ -0,0 +1,535 @@
+/*
+harness.c - Mide mydu sobre un arbol y lo compara con du -s
+
+Ejecuta cada variante de mydu (y du -s como referencia) varias veces sobre
+el mismo arbol y muestra una tabla con el tiempo real (mediana, minimo y
+maximo), las entradas por segundo, las llamadas al sistema principales y la
+memoria maxima (RSS) de cada una.
+
+Modo de uso:
+./bench/harness <mydu> <directorio> [repeticiones]
+
+Antes de medir se hace una pasada sin contar, para que todas las variantes
+encuentren la cache de directorios del kernel igual de caliente (y para que
+mydu -i tenga ya su cache; los directorios con enlaces duros no entran en
+ella, asi que con --links en gentree -i no ahorra nada). Los programas se
+ejecutan en un directorio temporal, asi el mydu.bin que escribe mydu no
+ensucia el del usuario.
+
+Las llamadas al sistema se cuentan desde fuera, con ptrace, en una
+ejecucion extra de cada variante (du incluido): todas las que hace el
+programa y sus hilos desde el execve, sea la que sea (openat, close, mmap,
+io_uring_enter...). Las operaciones que -u mete en la cola de io_uring no son
+llamadas: solo cuenta el io_uring_enter que las envia. Como ptrace frena
+mucho al programa, esa ejecucion no entra en los tiempos. Si el sistema no
+deja usar ptrace la columna sale con "-". Las entradas salen de otra
+ejecucion con --stats=json.
+
+Antes de medir nada comprueba que los motores de recorrido dan la misma
+salida byte a byte: mydu, mydu -u (io_uring) y mydu -u -j 4 (y -j 4) sobre
+el mismo arbol. Si alguno no coincide con mydu, termina con error.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* repeticiones por defecto de cada variante */
+#define DEFAULT_REPS 5
+/* maximo de repeticiones */
+#define MAX_REPS 100
+/* maximo de argumentos de una variante */
+#define MAX_ARGS 8
+/* tamano del buffer para la salida de --stats=json */
+#define STATS_BUF 8192
+/* tamano de cada trozo que se compara de dos salidas */
+#define COMPARE_BUF 65536
+
+/*
+ Variant: una forma de ejecutar el programa que se mide
+ */
+typedef struct {
+  const char *label;
+  int is_du;
+  int uses_cache;
+  const char *args[MAX_ARGS];
+} Variant;
+
+/*
+ Measure: resultados de una variante
+ */
+typedef struct {
+  double wall_ms[MAX_REPS];
+  long max_rss_kb;
+  unsigned long long entries;
+  unsigned long long syscalls;
+  int has_syscalls;
+} Measure;
+
+/* variantes que se miden, en el orden en que salen en la tabla */
+const Variant variants[] = {
+    {"mydu", 0, 0, {NULL}},
+    {"mydu -j 4", 0, 0, {"-j", "4", NULL}},
+    {"mydu -u", 0, 0, {"-u", NULL}},
+    {"mydu -l", 0, 0, {"-l", NULL}},
+    {"mydu -i (cache)", 0, 1, {"-i", NULL}},
+    {"du -s", 1, 0, {NULL}},
+};
+
+/* variantes que tienen que dar exactamente la misma salida que la primera */
+const Variant same_output[] = {
+    {"mydu", 0, 0, {NULL}},
+    {"mydu -u", 0, 0, {"-u", NULL}},
+    {"mydu -u -j 4", 0, 0, {"-u", "-j", "4", NULL}},
+    {"mydu -j 4", 0, 0, {"-j", "4", NULL}},
+};
+
+/* ruta absoluta de mydu y del arbol */
+char mydu_path[PATH_MAX];
+char tree_path[PATH_MAX];
+/* directorio temporal en el que se ejecutan los programas */
+char work_dir[] = "/tmp/mydu-bench-XXXXXX";
+/* segundo en que empezo el harness (el arbol es anterior) */
+time_t start_time;
+
+/*
+ now_ms: reloj monotono en milisegundos
+ */
+double now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+/*
+ build_argv: escribe en argv la linea de ordenes de la variante v (con --stats=json si stats)
+ */
+void build_argv(const Variant *v, int stats, const char **argv) {
+  int argc;
+  int i;
+
+  argc = 0;
+  if (v->is_du) {
+    argv[argc++] = "du";
+    argv[argc++] = "-s";
+  } else {
+    argv[argc++] = mydu_path;
+    for (i = 0; v->args[i] != NULL; i++) {
+      argv[argc++] = v->args[i];
+    }
+    if (stats) {
+      argv[argc++] = "--stats=json";
+    }
+  }
+  argv[argc++] = tree_path;
+  argv[argc] = NULL;
+}
+
+/*
+ run_variant: ejecuta una vez la variante v
+
+ La salida normal va a out_fd, o se descarta si es -1. Si stats_fd no es
+ -1 se pasa --stats=json y la salida de error se envia a ese descriptor;
+ si no, tambien se descarta.
+ Guarda en wall_ms el tiempo real y en rss_kb la memoria maxima del hijo.
+ Devuelve 0 si el programa termino bien, -1 si no.
+ */
+int run_variant(const Variant *v, int out_fd, int stats_fd, double *wall_ms, long *rss_kb) {
+  const char *argv[MAX_ARGS + 4];
+  struct rusage usage;
+  double start;
+  pid_t pid;
+  int status;
+  int devnull;
+
+  build_argv(v, stats_fd >= 0, argv);
+
+  /* el historial crece con cada ejecucion: se empieza siempre sin el */
+  unlinkat(AT_FDCWD, "mydu.bin", 0);
+
+  start = now_ms();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+      _exit(127);
+    }
+    dup2(out_fd >= 0 ? out_fd : devnull, STDOUT_FILENO);
+    dup2(stats_fd >= 0 ? stats_fd : devnull, STDERR_FILENO);
+    execvp(argv[0], (char *const *)argv);
+    _exit(127);
+  }
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    return -1;
+  }
+  *wall_ms = now_ms() - start;
+  *rss_kb = usage.ru_maxrss;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Error: %s termino con error\n", v->label);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ json_number: busca "key": en text y devuelve su valor (0 si no esta)
+ */
+unsigned long long json_number(const char *text, const char *key) {
+  char pattern[64];
+  const char *p;
+
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  p = strstr(text, pattern);
+  if (p == NULL) {
+    return 0;
+  }
+  return strtoull(p + strlen(pattern), NULL, 10);
+}
+
+/*
+ count_syscalls: ejecuta la variante bajo ptrace y cuenta sus llamadas al sistema
+
+ El hijo se para antes del execve; seguimos tambien a sus hilos y procesos
+ hijos (TRACECLONE, TRACEFORK, TRACEVFORK) y contamos cada entrada en una
+ llamada (PTRACE_GET_SYSCALL_INFO) a partir del execve, asi no entra lo que
+ hace el hijo para prepararse.
+ Devuelve 0 si fue bien, 1 si el sistema no deja usar ptrace, -1 si el
+ programa termino con error.
+ */
+int count_syscalls(const Variant *v, unsigned long long *calls) {
+  const char *argv[MAX_ARGS + 4];
+  struct __ptrace_syscall_info info;
+  pid_t child;
+  pid_t pid;
+  int child_status;
+  int status;
+  int counting;
+  int signal_number;
+  int devnull;
+
+  build_argv(v, 0, argv);
+  unlinkat(AT_FDCWD, "mydu.bin", 0);
+  child = fork();
+  if (child < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (child == 0) {
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0 || ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+      _exit(127);
+    }
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    raise(SIGSTOP);
+    execvp(argv[0], (char *const *)argv);
+    _exit(127);
+  }
+  if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status)) {
+    return 1; /* no llego a pararse: ptrace no esta permitido */
+  }
+  if (ptrace(PTRACE_SETOPTIONS, child, NULL,
+             (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK |
+                            PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)) < 0) {
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+    return 1;
+  }
+  *calls = 0;
+  counting = 0;
+  child_status = -1;
+  pid = child;
+  signal_number = 0;
+  while (1) {
+    ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)signal_number);
+    pid = waitpid(-1, &status, __WALL);
+    if (pid < 0) {
+      break; /* ECHILD: han terminado todos */
+    }
+    signal_number = 0;
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (pid == child) {
+        child_status = status;
+      }
+      continue;
+    }
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      if (counting && ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *)sizeof(info), &info) > 0 &&
+          info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+        (*calls)++;
+      }
+    } else if (WSTOPSIG(status) == SIGTRAP) {
+      if (status >> 16 == PTRACE_EVENT_EXEC) {
+        counting = 1;
+      }
+    } else if (WSTOPSIG(status) != SIGSTOP) {
+      signal_number = WSTOPSIG(status); /* una senal de verdad: se la pasamos */
+    }
+  }
+  if (child_status < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+    fprintf(stderr, "Error: %s termino con error bajo ptrace\n", v->label);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ read_stats: ejecuta la variante con --stats=json y anota las entradas que ha visto
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int read_stats(const Variant *v, Measure *m) {
+  char buf[STATS_BUF];
+  size_t used;
+  ssize_t n;
+  double wall;
+  long rss;
+  FILE *tmp;
+  int fd;
+
+  tmp = tmpfile();
+  if (tmp == NULL) {
+    perror("tmpfile");
+    return -1;
+  }
+  fd = fileno(tmp);
+  if (run_variant(v, -1, fd, &wall, &rss) < 0) {
+    fclose(tmp);
+    return -1;
+  }
+  lseek(fd, 0, SEEK_SET);
+  used = 0;
+  while (used < sizeof(buf) - 1 && (n = read(fd, buf + used, sizeof(buf) - 1 - used)) > 0) {
+    used += (size_t)n;
+  }
+  buf[used] = '\0';
+  fclose(tmp);
+
+  m->entries = json_number(buf, "dirs") + json_number(buf, "files");
+  return 0;
+}
+
+/*
+ compare_double: orden para qsort de los tiempos
+ */
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ measure_variant: pasada de calentamiento y reps ejecuciones medidas
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int measure_variant(const Variant *v, int reps, Measure *m) {
+  double wall;
+  long rss;
+  int status;
+  int i;
+
+  m->max_rss_kb = 0;
+  m->has_syscalls = 0;
+  /* mydu -i no se fia de directorios cambiados en el mismo segundo en que se
+     escribio la cache: si el arbol es de este segundo esperamos al siguiente */
+  while (v->uses_cache && time(NULL) <= start_time) {
+    usleep(10000);
+  }
+  if (run_variant(v, -1, -1, &wall, &rss) < 0) {
+    return -1;
+  }
+  for (i = 0; i < reps; i++) {
+    if (run_variant(v, -1, -1, &m->wall_ms[i], &rss) < 0) {
+      return -1;
+    }
+    if (rss > m->max_rss_kb) {
+      m->max_rss_kb = rss;
+    }
+  }
+  qsort(m->wall_ms, (size_t)reps, sizeof(double), compare_double);
+  if (!v->is_du && read_stats(v, m) < 0) {
+    return -1;
+  }
+  status = count_syscalls(v, &m->syscalls);
+  if (status < 0) {
+    return -1;
+  }
+  m->has_syscalls = status == 0;
+  return 0;
+}
+
+/*
+ same_file: dice si los ficheros abiertos en a y b tienen el mismo contenido
+ */
+int same_file(int a, int b) {
+  char buf_a[COMPARE_BUF];
+  char buf_b[COMPARE_BUF];
+  off_t offset;
+  ssize_t n;
+
+  if (lseek(a, 0, SEEK_END) != lseek(b, 0, SEEK_END)) {
+    return 0;
+  }
+  offset = 0;
+  while ((n = pread(a, buf_a, sizeof(buf_a), offset)) > 0) {
+    if (pread(b, buf_b, (size_t)n, offset) != n || memcmp(buf_a, buf_b, (size_t)n) != 0) {
+      return 0;
+    }
+    offset += n;
+  }
+  return n == 0;
+}
+
+/*
+ check_outputs: comprueba que las variantes de same_output dan la misma salida que mydu
+ Devuelve 0 si todas coinciden, -1 si no (o si alguna no se pudo ejecutar).
+ */
+int check_outputs(void) {
+  FILE *reference;
+  FILE *out;
+  double wall;
+  long rss;
+  size_t i;
+  int status;
+
+  reference = tmpfile();
+  if (reference == NULL) {
+    perror("tmpfile");
+    return -1;
+  }
+  if (run_variant(&same_output[0], fileno(reference), -1, &wall, &rss) < 0) {
+    fclose(reference);
+    return -1;
+  }
+  status = 0;
+  for (i = 1; i < sizeof(same_output) / sizeof(same_output[0]) && status == 0; i++) {
+    out = tmpfile();
+    if (out == NULL) {
+      perror("tmpfile");
+      status = -1;
+      break;
+    }
+    if (run_variant(&same_output[i], fileno(out), -1, &wall, &rss) < 0) {
+      status = -1;
+    } else if (!same_file(fileno(reference), fileno(out))) {
+      fprintf(stderr, "Error: la salida de %s no es igual que la de %s\n", same_output[i].label,
+              same_output[0].label);
+      status = -1;
+    }
+    fclose(out);
+  }
+  fclose(reference);
+  return status;
+}
+
+/*
+ print_row: escribe la fila de una variante en la tabla
+ */
+void print_row(const Variant *v, const Measure *m, int reps, unsigned long long entries) {
+  double median;
+  char calls[32];
+
+  if (reps % 2 == 1) {
+    median = m->wall_ms[reps / 2];
+  } else {
+    median = (m->wall_ms[reps / 2 - 1] + m->wall_ms[reps / 2]) / 2.0;
+  }
+  if (m->has_syscalls) {
+    snprintf(calls, sizeof(calls), "%llu", m->syscalls);
+  } else {
+    snprintf(calls, sizeof(calls), "-");
+  }
+  printf("%-18s %10.2f %10.2f %10.2f %12.0f %10s %10ld\n", v->label, median, m->wall_ms[0], m->wall_ms[reps - 1],
+         median > 0 ? (double)entries / (median / 1000.0) : 0.0, calls, m->max_rss_kb);
+}
+
+/*
+ cleanup_work_dir: borra lo que han dejado los programas y el directorio temporal
+ */
+void cleanup_work_dir(void) {
+  unlinkat(AT_FDCWD, "mydu.bin", 0);
+  unlinkat(AT_FDCWD, "mydu.cache", 0);
+  if (chdir("/") == 0) {
+    rmdir(work_dir);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Measure *results;
+  unsigned long long entries;
+  size_t nvariants;
+  char *end;
+  long reps;
+  size_t i;
+
+  start_time = time(NULL);
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "Uso: ./bench/harness <mydu> <directorio> [repeticiones]\n");
+    return -1;
+  }
+  reps = DEFAULT_REPS;
+  if (argc == 4) {
+    reps = strtol(argv[3], &end, 10);
+    if (argv[3][0] == '\0' || *end != '\0' || reps < 1 || reps > MAX_REPS) {
+      fprintf(stderr, "Error: repeticiones debe estar entre 1 y %d\n", MAX_REPS);
+      return -1;
+    }
+  }
+  if (realpath(argv[1], mydu_path) == NULL || realpath(argv[2], tree_path) == NULL) {
+    fprintf(stderr, "Error: %s\n", strerror(errno));
+    return -1;
+  }
+  if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0) {
+    perror("mkdtemp");
+    return -1;
+  }
+
+  if (check_outputs() < 0) {
+    cleanup_work_dir();
+    return -1;
+  }
+
+  nvariants = sizeof(variants) / sizeof(variants[0]);
+  results = calloc(nvariants, sizeof(Measure));
+  if (results == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    cleanup_work_dir();
+    return -1;
+  }
+  for (i = 0; i < nvariants; i++) {
+    if (measure_variant(&variants[i], (int)reps, &results[i]) < 0) {
+      free(results);
+      cleanup_work_dir();
+      return -1;
+    }
+  }
+
+  /* du no dice cuantas entradas ha visto: se usan las que cuenta mydu */
+  entries = results[0].entries;
+  printf("arbol: %s  entradas: %llu  repeticiones: %ld\n", tree_path, entries, reps);
+  printf("mydu, -u, -u -j 4 y -j 4 dan la misma salida byte a byte\n");
+  printf("%-18s %10s %10s %10s %12s %10s %10s\n", "variante", "mediana ms", "min ms", "max ms", "entradas/s",
+         "llamadas", "RSS KB");
+  for (i = 0; i < nvariants; i++) {
+    print_row(&variants[i], &results[i], (int)reps, entries);
+  }
+
+  free(results);
+  cleanup_work_dir();
+  return 0;
+}
@@ -0,0 +1,511 @@
+/*
+histbench.c - Mide las consultas de mydu -b sobre un historial grande
+
+Crea en <directorio> un mydu.bin v2 con <entradas> entradas repartidas en
+<ejecuciones> ejecuciones (por defecto 10 millones en 10), escrito con el
+mismo formato que mydu: cabecera del fichero, y por cada ejecucion su
+cabecera, las entradas con codificacion frontal y el pie. Las rutas son
+"bench/tNNNN/mNN/lNN", asi que cada una comparte casi todo con la anterior
+como en un recorrido de verdad, y el tamano de cada ruta cambia de una
+ejecucion a otra.
+
+Despues mide cuanto tarda mydu en:
+ -b                  todo el historial
+ -b --path P         la evolucion de una ruta en todas las ejecuciones
+ -b --last --top 10  los 10 mayores de la ultima ejecucion
+
+y comprueba la salida de cada consulta con lo que se genero: el numero de
+lineas de -b, el tamano de P en cada ejecucion y el mayor de la ultima. Si
+algo no cuadra el programa termina con error.
+
+Modo de uso:
+./bench/histbench <mydu> <directorio> [entradas] [ejecuciones] [repeticiones]
+
+El directorio no debe existir: lo crea el programa y lo borra al terminar.
+*/
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* entradas, ejecuciones y repeticiones por defecto */
+#define DEFAULT_RECORDS 10000000L
+#define DEFAULT_RUNS 10
+#define DEFAULT_REPS 5
+/* maximos de los argumentos */
+#define MAX_RECORDS 1000000000L
+#define MAX_RUNS 100000L
+#define MAX_REPS 1000
+/* entradas que muestra --top */
+#define TOP_COUNT "10"
+/* formato v2 de mydu.bin (ver FORMATO v2 en mydu.c) */
+#define HISTORY_MAGIC "MYDUBIN"
+#define HISTORY_VERSION 2
+#define FILE_HEADER_SIZE 16
+#define RUN_MAGIC 0x4E55524DU
+#define RUN_END_MAGIC 0x444E454DU
+#define RUN_HEADER_SIZE 36
+#define RUN_FOOTER_SIZE 24
+#define RUN_COUNT_OFFSET 16
+#define RUN_BYTES_OFFSET 24
+#define VARINT_MAX_LEN 10
+/* raiz de todas las ejecuciones */
+#define ROOT "bench"
+/* fecha de la primera ejecucion; cada una es un dia despues de la anterior */
+#define FIRST_RUN_TIME 1700000000L
+#define RUN_INTERVAL 86400L
+/* maximo de argumentos de una consulta */
+#define MAX_ARGS 8
+
+/* ruta absoluta de mydu */
+char mydu_path[PATH_MAX];
+
+/*
+ now_us: reloj monotono en microsegundos
+ */
+double now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+/*
+ put_u32, put_u64: enteros en little endian, como los escribe mydu
+ */
+void put_u32(unsigned char *p, uint32_t value) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+void put_u64(unsigned char *p, uint64_t value) {
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+/*
+ put_varint: escribe value con 7 bits por byte y devuelve cuantos bytes usa
+ */
+size_t put_varint(unsigned char *p, uint64_t value) {
+  size_t n;
+
+  n = 0;
+  while (value >= 0x80) {
+    p[n] = (unsigned char)(value | 0x80);
+    value >>= 7;
+    n++;
+  }
+  p[n] = (unsigned char)value;
+  return n + 1;
+}
+
+/*
+ record_path: ruta de la entrada i (igual en todas las ejecuciones)
+ Devuelve la longitud de la ruta.
+ */
+size_t record_path(long i, char *path, size_t size) {
+  return (size_t)snprintf(path, size, "%s/t%04ld/m%02ld/l%02ld", ROOT, i / 10000, i / 100 % 100, i % 100);
+}
+
+/*
+ record_size: tamano en KB de la entrada i en la ejecucion run
+ */
+long record_size(long i, long run) {
+  return (i * 7919) % 1000003 + 1 + run * (i % 7);
+}
+
+/*
+ write_history: crea mydu.bin con runs ejecuciones de per_run entradas
+ En *top_size deja el mayor tamano de la ultima ejecucion.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_history(long per_run, long runs, long *top_size) {
+  unsigned char header[RUN_HEADER_SIZE];
+  unsigned char head[3 * VARINT_MAX_LEN];
+  char prev[64];
+  char path[64];
+  FILE *file;
+  long run_start;
+  long records_start;
+  long records_end;
+  long run;
+  long size;
+  long i;
+  size_t head_len;
+  size_t prev_len;
+  size_t len;
+  size_t shared;
+
+  file = fopen("mydu.bin", "wb");
+  if (file == NULL) {
+    perror("mydu.bin");
+    return -1;
+  }
+  memset(header, 0, FILE_HEADER_SIZE);
+  memcpy(header, HISTORY_MAGIC, sizeof(HISTORY_MAGIC));
+  put_u32(header + 8, HISTORY_VERSION);
+  fwrite(header, 1, FILE_HEADER_SIZE, file);
+
+  *top_size = 0;
+  for (run = 0; run < runs; run++) {
+    /* el numero de entradas se conoce ya; los bytes se rellenan al final de la ejecucion */
+    run_start = ftell(file);
+    memset(header, 0, sizeof(header));
+    put_u32(header, RUN_MAGIC);
+    put_u64(header + 8, (uint64_t)(FIRST_RUN_TIME + run * RUN_INTERVAL));
+    put_u64(header + RUN_COUNT_OFFSET, (uint64_t)per_run);
+    put_u32(header + 32, (uint32_t)strlen(ROOT));
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(ROOT, 1, strlen(ROOT), file);
+    records_start = ftell(file);
+
+    prev_len = 0;
+    for (i = 0; i < per_run; i++) {
+      len = record_path(i, path, sizeof(path));
+      shared = 0;
+      while (shared < prev_len && shared < len && prev[shared] == path[shared]) {
+        shared++;
+      }
+      size = record_size(i, run);
+      if (run == runs - 1 && size > *top_size) {
+        *top_size = size;
+      }
+      head_len = put_varint(head, (uint64_t)size);
+      head_len += put_varint(head + head_len, shared);
+      head_len += put_varint(head + head_len, len - shared);
+      fwrite(head, 1, head_len, file);
+      fwrite(path + shared, 1, len - shared, file);
+      memcpy(prev, path, len);
+      prev_len = len;
+    }
+
+    records_end = ftell(file);
+    memset(header, 0, RUN_FOOTER_SIZE);
+    put_u32(header, RUN_END_MAGIC);
+    put_u64(header + 8, (uint64_t)per_run);
+    put_u64(header + 16, (uint64_t)(records_end - run_start));
+    fwrite(header, 1, RUN_FOOTER_SIZE, file);
+    put_u64(header, (uint64_t)(records_end - records_start));
+    if (fseek(file, run_start + RUN_BYTES_OFFSET, SEEK_SET) < 0 || fwrite(header, 1, 8, file) != 8 ||
+        fseek(file, 0, SEEK_END) < 0) {
+      perror("mydu.bin");
+      fclose(file);
+      return -1;
+    }
+  }
+  if (ferror(file) || fclose(file) != 0) {
+    perror("mydu.bin");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ run_query: ejecuta mydu con args y la salida en out_path (o descartada si es NULL)
+ Devuelve los microsegundos que ha tardado, o -1 si fallo.
+ */
+double run_query(const char *const *args, const char *out_path) {
+  const char *argv[MAX_ARGS + 2];
+  double start;
+  pid_t pid;
+  int status;
+  int fd;
+  int i;
+
+  argv[0] = mydu_path;
+  for (i = 0; args[i] != NULL; i++) {
+    argv[i + 1] = args[i];
+  }
+  argv[i + 1] = NULL;
+
+  start = now_us();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    fd = out_path != NULL ? open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+      _exit(127);
+    }
+    dup2(fd, STDOUT_FILENO);
+    execv(mydu_path, (char *const *)argv);
+    _exit(127);
+  }
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Error: mydu");
+    for (i = 0; args[i] != NULL; i++) {
+      fprintf(stderr, " %s", args[i]);
+    }
+    fprintf(stderr, " fallo\n");
+    return -1;
+  }
+  return now_us() - start;
+}
+
+/*
+ compare_double: orden para qsort de los tiempos
+ */
+int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ measure: ejecuta reps veces mydu con args y escribe la fila de la tabla
+ Devuelve 0 si fue bien, -1 si alguna ejecucion fallo.
+ */
+int measure(const char *label, const char *const *args, long reps) {
+  double times[MAX_REPS];
+  long i;
+
+  for (i = 0; i < reps; i++) {
+    times[i] = run_query(args, NULL);
+    if (times[i] < 0) {
+      return -1;
+    }
+  }
+  qsort(times, (size_t)reps, sizeof(double), compare_double);
+  printf("%-26s %12.0f %12.0f %12.0f\n", label, times[reps / 2] / 1e3, times[0] / 1e3, times[reps - 1] / 1e3);
+  return 0;
+}
+
+/*
+ count_lines: cuenta las lineas de un fichero
+ Devuelve el numero de lineas, o -1 si no se pudo leer.
+ */
+long count_lines(const char *path) {
+  char buf[65536];
+  size_t n;
+  size_t i;
+  FILE *file;
+  long lines;
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+  lines = 0;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+    for (i = 0; i < n; i++) {
+      lines += buf[i] == '\n';
+    }
+  }
+  fclose(file);
+  return lines;
+}
+
+/*
+ check_full: comprueba que -b muestra la cabecera y todas las entradas
+ Devuelve 0 si cuadra, -1 si no.
+ */
+int check_full(long per_run, long runs) {
+  static const char *const args[] = {"-b", NULL};
+  long lines;
+
+  if (run_query(args, "salida.txt") < 0) {
+    return -1;
+  }
+  lines = count_lines("salida.txt");
+  if (lines != 1 + per_run * runs) {
+    fprintf(stderr, "Error: -b muestra %ld lineas y tenian que ser %ld\n", lines, 1 + per_run * runs);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ check_path: comprueba que --path muestra el tamano de la ruta i en cada ejecucion
+ Devuelve 0 si cuadra, -1 si no.
+ */
+int check_path(const char *path, long i, long runs) {
+  const char *args[] = {"-b", "--path", NULL, NULL};
+  char line[256];
+  FILE *file;
+  char *tab;
+  long run;
+  int status;
+
+  args[2] = path;
+  if (run_query(args, "salida.txt") < 0) {
+    return -1;
+  }
+  file = fopen("salida.txt", "r");
+  if (file == NULL) {
+    perror("salida.txt");
+    return -1;
+  }
+  status = 0;
+  run = 0;
+  /* la primera linea es la cabecera "--- Contenido del archivo binario ---" */
+  if (fgets(line, sizeof(line), file) == NULL) {
+    status = -1;
+  }
+  while (status == 0 && fgets(line, sizeof(line), file) != NULL) {
+    tab = strrchr(line, '\t');
+    if (run >= runs || tab == NULL || strtol(tab + 1, NULL, 10) != record_size(i, run)) {
+      status = -1;
+      break;
+    }
+    run++;
+  }
+  fclose(file);
+  if (status < 0 || run != runs) {
+    fprintf(stderr, "Error: --path %s no da el tamano de cada ejecucion\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ check_top: comprueba que --last --top muestra primero el mayor de la ultima ejecucion
+ Devuelve 0 si cuadra, -1 si no.
+ */
+int check_top(long top_size) {
+  static const char *const args[] = {"-b", "--last", "--top", TOP_COUNT, NULL};
+  char line[256];
+  FILE *file;
+  int found;
+
+  if (run_query(args, "salida.txt") < 0) {
+    return -1;
+  }
+  file = fopen("salida.txt", "r");
+  if (file == NULL) {
+    perror("salida.txt");
+    return -1;
+  }
+  found = fgets(line, sizeof(line), file) != NULL && fgets(line, sizeof(line), file) != NULL &&
+          strtol(line, NULL, 10) == top_size;
+  fclose(file);
+  if (!found) {
+    fprintf(stderr, "Error: --last --top %s no empieza por el mayor (%ld KB)\n", TOP_COUNT, top_size);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ file_size: tamano de un fichero en bytes (0 si no existe)
+ */
+long long file_size(const char *path) {
+  struct stat st;
+
+  if (stat(path, &st) < 0) {
+    return 0;
+  }
+  return (long long)st.st_size;
+}
+
+/*
+ cleanup: borra los ficheros y el directorio de trabajo
+ */
+void cleanup(const char *base) {
+  unlink("mydu.bin");
+  unlink("salida.txt");
+  if (chdir("/") == 0) {
+    rmdir(base);
+  }
+}
+
+/*
+ parse_arg: lee un argumento numerico entre 1 y max
+ Devuelve 0 si es valido, -1 si no.
+ */
+int parse_arg(const char *text, long max, long *out) {
+  char *end;
+  long value;
+
+  value = strtol(text, &end, 10);
+  if (text[0] == '\0' || *end != '\0' || value < 1 || value > max) {
+    return -1;
+  }
+  *out = value;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *const full_args[] = {"-b", NULL};
+  static const char *const top_args[] = {"-b", "--last", "--top", TOP_COUNT, NULL};
+  const char *path_args[] = {"-b", "--path", NULL, NULL};
+  char base[PATH_MAX];
+  char path[64];
+  double start;
+  long records;
+  long runs;
+  long reps;
+  long per_run;
+  long top_size;
+  int status;
+
+  if (argc < 3 || argc > 6) {
+    fprintf(stderr, "Uso: ./bench/histbench <mydu> <directorio> [entradas] [ejecuciones] [repeticiones]\n");
+    return -1;
+  }
+  records = DEFAULT_RECORDS;
+  runs = DEFAULT_RUNS;
+  reps = DEFAULT_REPS;
+  if ((argc > 3 && parse_arg(argv[3], MAX_RECORDS, &records) < 0) ||
+      (argc > 4 && parse_arg(argv[4], MAX_RUNS, &runs) < 0) ||
+      (argc > 5 && parse_arg(argv[5], MAX_REPS, &reps) < 0)) {
+    fprintf(stderr, "Error: entradas (hasta %ld), ejecuciones (hasta %ld) y repeticiones (hasta %d) "
+                    "tienen que ser numeros positivos\n", MAX_RECORDS, MAX_RUNS, MAX_REPS);
+    return -1;
+  }
+  if (records < runs) {
+    fprintf(stderr, "Error: tiene que haber al menos una entrada por ejecucion\n");
+    return -1;
+  }
+  per_run = records / runs;
+  if (realpath(argv[1], mydu_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdir(argv[2], 0755) < 0 || realpath(argv[2], base) == NULL || chdir(base) < 0) {
+    perror(argv[2]);
+    return -1;
+  }
+
+  start = now_us();
+  if (write_history(per_run, runs, &top_size) < 0) {
+    cleanup(base);
+    return -1;
+  }
+  printf("mydu.bin: %ld ejecuciones de %ld entradas, %lld bytes (generado en %.0f ms)\n", runs, per_run,
+         file_size("mydu.bin"), (now_us() - start) / 1e3);
+
+  /* una ruta de la mitad de la ejecucion, para que --path no la encuentre enseguida */
+  record_path(per_run / 2, path, sizeof(path));
+  path_args[2] = path;
+  status = 0;
+  if (check_full(per_run, runs) < 0 || check_path(path, per_run / 2, runs) < 0 || check_top(top_size) < 0) {
+    status = -1;
+  } else {
+    printf("-b, --path y --last --top dan lo que se genero\n");
+    printf("%-26s %12s %12s %12s\n", "consulta", "mediana ms", "min ms", "max ms");
+    if (measure("-b", full_args, reps) < 0 || measure("-b --path", path_args, reps) < 0 ||
+        measure("-b --last --top " TOP_COUNT, top_args, reps) < 0) {
+      status = -1;
+    }
+  }
+
+  cleanup(base);
+  return status;
+}
@@ -0,0 +1,431 @@
+/*
+numbench.c - Comprueba y mide numtext.c frente a las implementaciones anteriores
+
+Compara parse_int con el to_int anterior de mycalc (strtol y limites de
+int), format_int con el int_to_text anterior y format_long con printf("%ld")
+(lo que usaba mydu):
+
+ - parse_int con todas las cadenas de hasta 6 caracteres de un alfabeto con
+   cifras, signos, espacios y letras, con todos los enteros alrededor de 0,
+   de INT_MIN, de INT_MAX y de cada potencia de 10 (tambien con ceros a la
+   izquierda), y con cadenas aleatorias de hasta 14 caracteres.
+ - format_int y format_long con los mismos valores limite y aleatorios de
+   todos los tamanos, y comprobando que parse_int lee lo que escribe
+   format_int.
+ - con --exhaustive, ademas, todos los int (unos minutos).
+
+Despues mide cuantos nanosegundos tarda cada version por numero.
+
+Modo de uso:
+./bench/numbench <numeros> [--exhaustive]
+*/
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../numtext.h"
+
+/* maximo de numeros aleatorios */
+#define MAX_COUNT 100000000L
+/* longitud maxima de las cadenas aleatorias */
+#define RANDOM_TEXT_MAX 14
+/* longitud de las cadenas que se prueban todas */
+#define SHORT_TEXT_MAX 6
+/* tamano de cada texto de la tabla de la medida */
+#define TEXT_SIZE 24
+
+/* caracteres de las cadenas que se prueban todas */
+const char short_alphabet[] = "019+- \ta";
+/* caracteres de las cadenas aleatorias (con '/' y ':', justo antes y despues de las cifras) */
+const char random_alphabet[] = "0123456789000-+ /:\x7f\xb0";
+
+/* estado del generador de numeros aleatorios */
+unsigned long long rng_state = 88172645463325252ULL;
+/* fallos encontrados */
+long failures;
+
+/*
+ now_ns: reloj monotono en nanosegundos
+ */
+double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ next_random: siguiente numero del generador (xorshift64*)
+ */
+unsigned long long next_random(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ random_long: un long con un numero de cifras aleatorio (si no, casi todos tendrian 19)
+ */
+long random_long(void) {
+  unsigned long long value;
+  int bits;
+
+  bits = (int)(next_random() % 64);
+  value = next_random() >> (63 - bits);
+  return (long)value;
+}
+
+/*
+ reference_to_int: el to_int anterior de mycalc (cifras cortas a mano y el resto con strtol)
+ */
+int reference_to_int(const char *text, int *out) {
+  char *end;
+  long value;
+  int first;
+  int i;
+
+  first = (text[0] == '-' || text[0] == '+') ? 1 : 0;
+  value = 0;
+  for (i = first; text[i] >= '0' && text[i] <= '9' && i - first < 9; i++) {
+    value = value * 10 + (text[i] - '0');
+  }
+  if (text[i] == '\0' && i > first) {
+    *out = (int)(text[0] == '-' ? -value : value);
+    return 0;
+  }
+  value = strtol(text, &end, 10);
+  if (text[0] == '\0' || *end != '\0' || value < INT_MIN || value > INT_MAX) {
+    return -1;
+  }
+  *out = (int)value;
+  return 0;
+}
+
+/*
+ reference_int_to_text: el int_to_text anterior de mycalc (una division por cifra)
+ */
+int reference_int_to_text(int value, char *out) {
+  unsigned long n;
+  char tmp[20];
+  int i;
+  int j;
+
+  if (value == 0) {
+    out[0] = '0';
+    return 1;
+  }
+  i = 0;
+  j = 0;
+  if (value < 0) {
+    out[j++] = '-';
+    n = (unsigned long)(-(value + 1)) + 1;
+  } else {
+    n = (unsigned long)value;
+  }
+  while (n > 0) {
+    tmp[i++] = (char)('0' + (n % 10));
+    n = n / 10;
+  }
+  while (i > 0) {
+    out[j++] = tmp[--i];
+  }
+  return j;
+}
+
+/*
+ check_parse: compara parse_int con reference_to_int para un texto
+ */
+void check_parse(const char *text) {
+  int expected_value;
+  int value;
+  int expected;
+  int got;
+
+  expected_value = 0;
+  value = 0;
+  expected = reference_to_int(text, &expected_value);
+  got = parse_int(text, strlen(text), &value);
+  if (got != expected || (got == 0 && value != expected_value)) {
+    if (failures < 10) {
+      fprintf(stderr, "Error: parse_int(\"%s\") = %d (%d), se esperaba %d (%d)\n", text, got, value, expected,
+              expected_value);
+    }
+    failures++;
+  }
+}
+
+/*
+ check_int: compara format_int con reference_int_to_text y vuelve a leer el resultado
+ Tambien lo lee con ceros a la izquierda y con un caracter de mas detras.
+ */
+void check_int(int value) {
+  char expected[TEXT_SIZE];
+  char text[TEXT_SIZE];
+  int expected_len;
+  int len;
+
+  expected_len = reference_int_to_text(value, expected);
+  len = format_int(value, text);
+  if (len != expected_len || len > NUMTEXT_INT_MAX || memcmp(text, expected, (size_t)len) != 0) {
+    if (failures < 10) {
+      fprintf(stderr, "Error: format_int(%d) = \"%.*s\"\n", value, len, text);
+    }
+    failures++;
+    return;
+  }
+  text[len] = '\0';
+  check_parse(text);
+  snprintf(text, sizeof(text), "%+012d", value);
+  check_parse(text);
+  snprintf(text, sizeof(text), "%d1", value);
+  check_parse(text);
+}
+
+/*
+ check_long: compara format_long con printf("%ld")
+ */
+void check_long(long value) {
+  char expected[TEXT_SIZE];
+  char text[TEXT_SIZE];
+  int expected_len;
+  int len;
+
+  expected_len = snprintf(expected, sizeof(expected), "%ld", value);
+  len = format_long(value, text);
+  if (len != expected_len || len > NUMTEXT_LONG_MAX || memcmp(text, expected, (size_t)len) != 0) {
+    if (failures < 10) {
+      fprintf(stderr, "Error: format_long(%ld) = \"%.*s\"\n", value, len, text);
+    }
+    failures++;
+  }
+}
+
+/*
+ check_short_texts: todas las cadenas de hasta SHORT_TEXT_MAX caracteres de short_alphabet
+ */
+void check_short_texts(void) {
+  char text[SHORT_TEXT_MAX + 1];
+  size_t alphabet;
+  long combinations;
+  long code;
+  long i;
+  int len;
+  int k;
+
+  alphabet = strlen(short_alphabet);
+  combinations = 1;
+  for (len = 0; len <= SHORT_TEXT_MAX; len++) {
+    for (i = 0; i < combinations; i++) {
+      code = i;
+      for (k = 0; k < len; k++) {
+        text[k] = short_alphabet[code % (long)alphabet];
+        code /= (long)alphabet;
+      }
+      text[len] = '\0';
+      check_parse(text);
+    }
+    combinations *= (long)alphabet;
+  }
+}
+
+/*
+ check_edges: enteros alrededor de 0, de los limites y de las potencias de 10
+ */
+void check_edges(void) {
+  long power;
+  long i;
+  long d;
+
+  for (i = -1000000; i <= 1000000; i++) {
+    check_int((int)i);
+  }
+  for (i = 0; i < 100000; i++) {
+    check_int(INT_MIN + (int)i);
+    check_int(INT_MAX - (int)i);
+  }
+  for (power = 1; power <= 1000000000L; power *= 10) {
+    for (d = -100; d <= 100; d++) {
+      check_int((int)(power + d));
+      check_int((int)(-power + d));
+    }
+  }
+  for (power = 1; power <= 1000000000000000000L; power *= 10) {
+    for (d = -2; d <= 2; d++) {
+      check_long(power + d);
+      check_long(-power + d);
+    }
+  }
+  for (i = 0; i < 1000; i++) {
+    check_long(LONG_MIN + i);
+    check_long(LONG_MAX - i);
+  }
+  check_parse("2147483648");
+  check_parse("-2147483649");
+  check_parse("9223372036854775807");
+  check_parse("9223372036854775808");
+  check_parse("-99999999999999999999999");
+  check_parse("000000000000000000000000000002147483647");
+  check_parse("  -000000000000000000000000000002147483648");
+}
+
+/*
+ check_random: count numeros y textos aleatorios
+ */
+void check_random(long count) {
+  char text[RANDOM_TEXT_MAX + 1];
+  size_t alphabet;
+  long i;
+  int len;
+  int k;
+
+  alphabet = strlen(random_alphabet);
+  for (i = 0; i < count; i++) {
+    check_int((int)(random_long() & 0xFFFFFFFF));
+    check_long(random_long());
+    check_long(~random_long());
+    len = (int)(next_random() % (RANDOM_TEXT_MAX + 1));
+    for (k = 0; k < len; k++) {
+      text[k] = random_alphabet[next_random() % alphabet];
+    }
+    text[len] = '\0';
+    check_parse(text);
+  }
+}
+
+/*
+ check_exhaustive: todos los int
+ Para que tarde minutos y no horas solo se compara format_int con
+ reference_int_to_text y se vuelve a leer lo escrito con parse_int.
+ */
+void check_exhaustive(void) {
+  char expected[TEXT_SIZE];
+  char text[TEXT_SIZE];
+  long long i;
+  int value;
+  int len;
+
+  for (i = INT_MIN; i <= INT_MAX; i++) {
+    len = format_int((int)i, text);
+    if (len != reference_int_to_text((int)i, expected) || memcmp(text, expected, (size_t)len) != 0 ||
+        parse_int(text, (size_t)len, &value) != 0 || value != (int)i) {
+      if (failures < 10) {
+        fprintf(stderr, "Error: %lld no se escribe o no se vuelve a leer bien\n", i);
+      }
+      failures++;
+    }
+  }
+}
+
+/*
+ measure: ns por numero de cada version, leyendo y escribiendo count numeros
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int measure(long count) {
+  char out[TEXT_SIZE];
+  char *texts;
+  size_t *lens;
+  long *values;
+  unsigned long long sink;
+  double start;
+  double times[6];
+  long i;
+  int value;
+
+  texts = malloc((size_t)count * TEXT_SIZE);
+  lens = malloc((size_t)count * sizeof(size_t));
+  values = malloc((size_t)count * sizeof(long));
+  if (texts == NULL || lens == NULL || values == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    free(texts);
+    free(lens);
+    free(values);
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    values[i] = random_long();
+    value = (int)(values[i] & 0xFFFFFFFF);
+    lens[i] = (size_t)snprintf(texts + i * TEXT_SIZE, TEXT_SIZE, "%d", value);
+  }
+
+  sink = 0;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    reference_to_int(texts + i * TEXT_SIZE, &value);
+    sink += (unsigned)value;
+  }
+  times[0] = now_ns() - start;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    parse_int(texts + i * TEXT_SIZE, lens[i], &value);
+    sink += (unsigned)value;
+  }
+  times[1] = now_ns() - start;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    sink += (unsigned)reference_int_to_text((int)(values[i] & 0xFFFFFFFF), out) + (unsigned char)out[0];
+  }
+  times[2] = now_ns() - start;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    sink += (unsigned)format_int((int)(values[i] & 0xFFFFFFFF), out) + (unsigned char)out[0];
+  }
+  times[3] = now_ns() - start;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    sink += (unsigned)snprintf(out, sizeof(out), "%ld", values[i]) + (unsigned char)out[0];
+  }
+  times[4] = now_ns() - start;
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    sink += (unsigned)format_long(values[i], out) + (unsigned char)out[0];
+  }
+  times[5] = now_ns() - start;
+
+  printf("%-28s %12s %12s\n", "conversion", "ns/numero", "anterior/nuevo");
+  printf("%-28s %12.2f\n", "to_int (strtol)", times[0] / (double)count);
+  printf("%-28s %12.2f %12.2f\n", "parse_int", times[1] / (double)count, times[0] / times[1]);
+  printf("%-28s %12.2f\n", "int_to_text", times[2] / (double)count);
+  printf("%-28s %12.2f %12.2f\n", "format_int", times[3] / (double)count, times[2] / times[3]);
+  printf("%-28s %12.2f\n", "snprintf(\"%ld\")", times[4] / (double)count);
+  printf("%-28s %12.2f %12.2f\n", "format_long", times[5] / (double)count, times[4] / times[5]);
+  printf("(suma de control: %llu)\n", sink);
+
+  free(texts);
+  free(lens);
+  free(values);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char *end;
+  long count;
+  int exhaustive;
+
+  exhaustive = argc == 3 && strcmp(argv[2], "--exhaustive") == 0;
+  if (argc < 2 || argc > 3 || (argc == 3 && !exhaustive)) {
+    fprintf(stderr, "Uso: ./bench/numbench <numeros> [--exhaustive]\n");
+    return -1;
+  }
+  count = strtol(argv[1], &end, 10);
+  if (argv[1][0] == '\0' || *end != '\0' || count < 1 || count > MAX_COUNT) {
+    fprintf(stderr, "Error: numeros debe estar entre 1 y %ld\n", MAX_COUNT);
+    return -1;
+  }
+
+  check_short_texts();
+  check_edges();
+  check_random(count);
+  if (exhaustive) {
+    check_exhaustive();
+  }
+  printf("comprobaciones: %s (%ld fallos)\n", failures == 0 ? "iguales" : "DISTINTAS", failures);
+
+  if (measure(count) < 0) {
+    return -1;
+  }
+  return failures == 0 ? 0 : -1;
+}
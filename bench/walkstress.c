@@ -0,0 +1,438 @@
+/*
+walkstress.c - Prueba de estres del recorrido de mydu con arboles profundos y anchos
+
+Crea en <directorio> (mejor en un tmpfs) tres arboles:
+ profundo : una cadena de <niveles> directorios, uno dentro de otro (con los
+            3000 de por defecto la ruta del ultimo pasa de PATH_MAX)
+ ancho    : un directorio con <anchura> subdirectorios, cada uno con un fichero
+ peine    : una cadena de <niveles>/10 directorios con 10 subdirectorios
+            vacios en cada nivel
+
+Ejecuta mydu, mydu -j 4 y mydu -u sobre cada arbol, primero sin tocar el
+limite de ficheros abiertos y despues con RLIMIT_NOFILE bajado a <limite>
+(por defecto 32, menos que los WALK_OPEN_DIRS directorios que el recorrido
+secuencial tendria abiertos si no mirase el limite). De cada ejecucion
+apunta el tiempo, la memoria maxima (RSS, de wait4) y el maximo de
+descriptores abiertos a la vez, que se saca mirando /proc/<pid>/fd
+mientras el programa corre (es un muestreo: un pico muy corto se puede
+escapar). Todas las ejecuciones tienen que terminar bien y dar el mismo
+total que mydu sin limite; si no, el programa termina con error.
+
+Modo de uso:
+./bench/walkstress <mydu> <directorio> [niveles] [anchura] [limite]
+
+El directorio no debe existir: lo crea el programa y lo borra al terminar.
+*/
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* niveles del arbol profundo por defecto */
+#define DEFAULT_LEVELS 3000
+/* subdirectorios del arbol ancho por defecto */
+#define DEFAULT_WIDTH 20000
+/* limite de ficheros abiertos por defecto en las ejecuciones limitadas */
+#define DEFAULT_FD_LIMIT 32
+/* el peine tiene un nivel por cada COMB_STEP del profundo, con COMB_TEETH subdirectorios */
+#define COMB_STEP 10
+#define COMB_TEETH 10
+/* bytes del fichero de cada subdirectorio del arbol ancho */
+#define FILE_SIZE 4096
+/* cada cuanto se miran los descriptores del programa (microsegundos) */
+#define SAMPLE_US 200
+/* maximo de argumentos de una variante */
+#define MAX_ARGS 8
+/* bytes del final de la salida donde buscamos la linea del total */
+#define TAIL_SIZE 4096
+
+/*
+ Variant: una forma de ejecutar mydu
+ */
+typedef struct {
+  const char *label;
+  const char *args[MAX_ARGS];
+} Variant;
+
+/*
+ RunResult: lo que se mide de una ejecucion
+ */
+typedef struct {
+  double wall_ms;
+  long max_rss_kb;
+  int max_fds;
+  char total[TAIL_SIZE];
+} RunResult;
+
+/* variantes que se ejecutan, en el orden en que salen en la tabla */
+const Variant variants[] = {
+    {"mydu", {NULL}},
+    {"mydu -j 4", {"-j", "4", NULL}},
+    {"mydu -u", {"-u", NULL}},
+};
+
+/* arboles que se crean, en el orden en que salen en la tabla */
+const char *trees[] = {"profundo", "ancho", "peine"};
+
+/* ruta absoluta de mydu */
+char mydu_path[PATH_MAX];
+/* contenido del fichero de cada subdirectorio del arbol ancho */
+char file_data[FILE_SIZE];
+
+/*
+ now_ms: reloj monotono en milisegundos
+ */
+double now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+/*
+ make_chain: crea en path una cadena de levels directorios "d", cada uno con teeth subdirectorios vacios
+ Se baja con openat desde el nivel anterior, asi que la ruta puede pasar de PATH_MAX.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int make_chain(const char *path, long levels, long teeth) {
+  char name[32];
+  long level;
+  long i;
+  int fd;
+  int childfd;
+
+  if (mkdir(path, 0755) < 0) {
+    perror(path);
+    return -1;
+  }
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  for (level = 0; fd >= 0 && level < levels; level++) {
+    for (i = 0; i < teeth; i++) {
+      snprintf(name, sizeof(name), "h%ld", i);
+      if (mkdirat(fd, name, 0755) < 0) {
+        close(fd);
+        fd = -1;
+        break;
+      }
+    }
+    if (fd < 0 || mkdirat(fd, "d", 0755) < 0) {
+      break;
+    }
+    childfd = openat(fd, "d", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(fd);
+    fd = childfd;
+  }
+  if (fd < 0 || level < levels) {
+    fprintf(stderr, "Error: no se pudo crear el nivel %ld de %s: %s\n", level, path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/*
+ make_wide: crea en path width subdirectorios, cada uno con un fichero de FILE_SIZE bytes
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int make_wide(const char *path, long width) {
+  char name[32];
+  long i;
+  int fd;
+  int childfd;
+  int filefd;
+  int ok;
+
+  if (mkdir(path, 0755) < 0) {
+    perror(path);
+    return -1;
+  }
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  ok = 1;
+  for (i = 0; ok && i < width; i++) {
+    snprintf(name, sizeof(name), "d%ld", i);
+    ok = 0;
+    if (mkdirat(fd, name, 0755) == 0) {
+      childfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (childfd >= 0) {
+        filefd = openat(childfd, "f", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (filefd >= 0) {
+          ok = write(filefd, file_data, FILE_SIZE) == FILE_SIZE;
+          close(filefd);
+        }
+        close(childfd);
+      }
+    }
+  }
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, "Error: no se pudo crear %s/%s: %s\n", path, name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ count_fds: cuantos descriptores tiene abiertos ahora el proceso pid (-1 si ya no se puede ver)
+ */
+int count_fds(pid_t pid) {
+  char path[64];
+  struct dirent *entry;
+  DIR *dir;
+  int count;
+
+  snprintf(path, sizeof(path), "/proc/%ld/fd", (long)pid);
+  dir = opendir(path);
+  if (dir == NULL) {
+    return -1;
+  }
+  count = 0;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      count++;
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+/*
+ read_total: deja en total la ultima linea de la salida de mydu (la del arbol entero)
+ */
+void read_total(int fd, char *total) {
+  char buf[TAIL_SIZE];
+  off_t size;
+  off_t start;
+  ssize_t n;
+  char *line;
+
+  total[0] = '\0';
+  size = lseek(fd, 0, SEEK_END);
+  if (size <= 0) {
+    return;
+  }
+  start = size > TAIL_SIZE - 1 ? size - (TAIL_SIZE - 1) : 0;
+  n = pread(fd, buf, (size_t)(size - start), start);
+  if (n <= 0) {
+    return;
+  }
+  if (buf[n - 1] == '\n') {
+    n--;
+  }
+  buf[n] = '\0';
+  line = strrchr(buf, '\n');
+  strcpy(total, line != NULL ? line + 1 : buf);
+}
+
+/*
+ run_mydu: ejecuta la variante v sobre tree con RLIMIT_NOFILE = fd_limit (0 es sin tocarlo)
+
+ La salida se guarda en un fichero temporal para sacar el total; los
+ errores salen por la salida de error de siempre. Mientras corre miramos
+ cada SAMPLE_US cuantos descriptores tiene abiertos.
+ Devuelve 0 si mydu termino bien, -1 si no.
+ */
+int run_mydu(const Variant *v, const char *tree, long fd_limit, RunResult *result) {
+  const char *argv[MAX_ARGS + 3];
+  struct rusage usage;
+  struct rlimit limit;
+  FILE *out;
+  double start;
+  pid_t pid;
+  pid_t done;
+  int status;
+  int fds;
+  int argc;
+  int i;
+
+  argc = 0;
+  argv[argc++] = mydu_path;
+  for (i = 0; v->args[i] != NULL; i++) {
+    argv[argc++] = v->args[i];
+  }
+  argv[argc++] = tree;
+  argv[argc] = NULL;
+
+  out = tmpfile();
+  if (out == NULL) {
+    perror("tmpfile");
+    return -1;
+  }
+  /* el historial crece con cada ejecucion: se empieza siempre sin el */
+  unlinkat(AT_FDCWD, "mydu.bin", 0);
+
+  start = now_ms();
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    fclose(out);
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(fileno(out), STDOUT_FILENO);
+    if (fd_limit > 0) {
+      getrlimit(RLIMIT_NOFILE, &limit);
+      limit.rlim_cur = (rlim_t)fd_limit;
+      if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        _exit(127);
+      }
+    }
+    execv(argv[0], (char *const *)argv);
+    _exit(127);
+  }
+
+  result->max_fds = 0;
+  while ((done = wait4(pid, &status, WNOHANG, &usage)) == 0) {
+    fds = count_fds(pid);
+    if (fds > result->max_fds) {
+      result->max_fds = fds;
+    }
+    usleep(SAMPLE_US);
+  }
+  result->wall_ms = now_ms() - start;
+  if (done < 0) {
+    perror("wait4");
+    fclose(out);
+    return -1;
+  }
+  result->max_rss_kb = usage.ru_maxrss;
+  read_total(fileno(out), result->total);
+  fclose(out);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Error: %s %s termino con error\n", v->label, tree);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ remove_tree: borra el directorio de la prueba con rm -rf (que no se pierde en los arboles profundos)
+ */
+void remove_tree(const char *path) {
+  pid_t pid;
+  int status;
+
+  pid = fork();
+  if (pid == 0) {
+    execlp("rm", "rm", "-rf", path, (char *)NULL);
+    _exit(127);
+  }
+  if (pid > 0) {
+    waitpid(pid, &status, 0);
+  }
+}
+
+/*
+ parse_arg: lee un argumento numerico entre 1 y max
+ Devuelve 0 si es valido, -1 si no.
+ */
+int parse_arg(const char *text, long max, long *out) {
+  char *end;
+  long value;
+
+  value = strtol(text, &end, 10);
+  if (text[0] == '\0' || *end != '\0' || value < 1 || value > max) {
+    return -1;
+  }
+  *out = value;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char base[PATH_MAX];
+  char reference[TAIL_SIZE];
+  RunResult result;
+  size_t t;
+  size_t i;
+  long levels;
+  long width;
+  long fd_limit;
+  long limit;
+  int pass;
+  int status;
+
+  if (argc < 3 || argc > 6) {
+    fprintf(stderr, "Uso: ./bench/walkstress <mydu> <directorio> [niveles] [anchura] [limite]\n");
+    return -1;
+  }
+  levels = DEFAULT_LEVELS;
+  width = DEFAULT_WIDTH;
+  fd_limit = DEFAULT_FD_LIMIT;
+  if ((argc > 3 && parse_arg(argv[3], 1000000, &levels) < 0) ||
+      (argc > 4 && parse_arg(argv[4], 10000000, &width) < 0) ||
+      (argc > 5 && parse_arg(argv[5], 1000000, &fd_limit) < 0)) {
+    fprintf(stderr, "Error: niveles, anchura y limite tienen que ser numeros positivos\n");
+    return -1;
+  }
+  if (realpath(argv[1], mydu_path) == NULL) {
+    perror(argv[1]);
+    return -1;
+  }
+  if (mkdir(argv[2], 0755) < 0 || realpath(argv[2], base) == NULL || chdir(base) < 0) {
+    perror(argv[2]);
+    return -1;
+  }
+  memset(file_data, 'x', sizeof(file_data));
+  if (make_chain("profundo", levels, 0) < 0 || make_wide("ancho", width) < 0 ||
+      make_chain("peine", levels / COMB_STEP, COMB_TEETH) < 0) {
+    if (chdir("/") == 0) {
+      remove_tree(base);
+    }
+    return -1;
+  }
+
+  printf("profundo: %ld niveles  ancho: %ld subdirectorios  peine: %ld niveles de %d\n", levels, width,
+         levels / COMB_STEP, COMB_TEETH);
+  printf("%-9s %-10s %8s %10s %10s %8s\n", "arbol", "variante", "limite", "ms", "RSS KB", "max fds");
+  status = 0;
+  for (t = 0; t < sizeof(trees) / sizeof(trees[0]) && status == 0; t++) {
+    reference[0] = '\0';
+    for (pass = 0; pass < 2 && status == 0; pass++) {
+      limit = pass == 0 ? 0 : fd_limit;
+      for (i = 0; i < sizeof(variants) / sizeof(variants[0]) && status == 0; i++) {
+        if (run_mydu(&variants[i], trees[t], limit, &result) < 0) {
+          status = -1;
+          break;
+        }
+        if (reference[0] == '\0') {
+          strcpy(reference, result.total);
+        } else if (strcmp(reference, result.total) != 0) {
+          fprintf(stderr, "Error: %s %s da \"%s\" y mydu sin limite \"%s\"\n", variants[i].label, trees[t],
+                  result.total, reference);
+          status = -1;
+          break;
+        }
+        if (limit > 0) {
+          printf("%-9s %-10s %8ld %10.1f %10ld %8d\n", trees[t], variants[i].label, limit, result.wall_ms,
+                 result.max_rss_kb, result.max_fds);
+        } else {
+          printf("%-9s %-10s %8s %10.1f %10ld %8d\n", trees[t], variants[i].label, "-", result.wall_ms,
+                 result.max_rss_kb, result.max_fds);
+        }
+      }
+    }
+  }
+  if (status == 0) {
+    printf("todas las ejecuciones terminan bien y dan el mismo total\n");
+  }
+
+  if (chdir("/") == 0) {
+    remove_tree(base);
+  }
+  return status;
+}
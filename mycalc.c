@@ -1,392 +1,4637 @@
-/*
-mycalc.c - Calculadora con historial de operaciones
-
-Este programa funciona como una calculadora simple desde la terminal.
-No se han utilizaso librearia stdio.h, sino directamente con llamadas al sistema 
-
-Modos de uso:
-  -Calculadora: ./mycalc <num1> <op> <num2>
-  -Historial: ./mycalc -b <num_operacion>
-*/
-
-#include <fcntl.h>
-#include <limits.h>
-#include <stdlib.h>
-#include <unistd.h>
-
-/*
-to_int: convierte un texto como "123" a un entero 123. Si el texto no es un numero valido, devuelve -1.
-Hemos utilizado strtol para verificar que es un numero valido.
-*/
-int to_int(const char *text, int *out) {
-  char *end; /*apunta al primer caracter que no es un digito */
-  long value; /*strtol devuelve un long y luego lo convertimos a int*/
-
-  value = strtol(text, &end, 10); /*convertimos en base 10*/
-  /*si el texto esta vacio, no hay que convertir nada*/
-  if (text[0] == '\0') {
-    return -1;
-  }
-  /*si 'end' no llega al final, habia algo que no era nuemero (ej:"5abc34")*/
-  if (*end != '\0') {
-    return -1;
-  }
-  /*int tiene limintes si son nuemeros muy grandes*/ 
-  if (value < INT_MIN || value > INT_MAX) {
-    return -1;
-  }
-
-  *out = (int)value;
-  return 0;
-}
-
-/*
-print_usage: muestra como se usa el programa cuando el ussuario lo llama mal.
-Escribimos siempre en fd=2, que es stderr (la salida de error estandar).
-*/
-void print_usage(void) {
-  if (write(2, "Uso: ./mycalc <num1> <op> <num2>\n", 33) < 0) return;
-  if (write(2, "Uso: ./mycalc -b <num_operacion>\n", 33) < 0) return;
-}
-
-/*
-print_error: escribe un mensaje de error por stderr
-*/
-void print_error(const char *msg, int len) {
-  if (write(2, msg, (size_t)len) < 0) return;
-}
-
-/*
-str_len: calcula cuantos bytes tiene un texto
-Recorremos hasta encontrar el caracter nulo '\0' que marca el final y contamos los caracteres
-*/
-int str_len(const char *text) {
-  int i;
-  i = 0;
-  while (text[i] != '\0') {
-    i++;
-  }
-  return i;
-}
-
-/*
-int_to_text:convierte un numero entero a su representacion en texto.
-
-La idea es dividir el numero por 10 sucesivamente para obtener cada digito, y guardarlos en un buffer temporal.
-Luego los copiamos al buffer de salida en el orden correcto. 
-
-*/
-int int_to_text(int value, char *out) {
-  int i;
-  int j;
-  unsigned long n;
-  char tmp[20]; /*buffer temporal para almacenar los digitos*/
-  /*caso especial: 0*/
-  if (value == 0) {
-    out[0] = '0';
-    return 1;
-  }
-
-  i = 0;
-  j = 0;
-  if (value < 0) {
-    out[j] = '-'; /*escribimos el signo negativo*/
-    j++;
-    /*evitamos problemas con INT_MIN*/
-    n = (unsigned long)(-(value + 1)) + 1;
-  } else {
-    n = (unsigned long)value;
-  }
-/*extraemos digitos de derecha a izquierda y lo guardamos en tmp*/
-  while (n > 0) {
-    tmp[i] = (char)('0' + (n % 10)); /*convertimos el digito a su caracter ASCII*/
-    i++;
-    n = n / 10;
-  }
-/*copiamos los digitos en el orden corrrecto*/
-  while (i > 0) {
-    i--;
-    out[j] = tmp[i];
-    j++;
-  }
-
-  return j;
-}
-
-/*
-write_checked: escribe un texto en un fd asegurandose de que se escriba todo. Si hay un error, devuelve -1.
-El problema es que la llamada a write puede escribir menos bytes de los que le pedimos, quedando el texto cortado.
-Para solucionarlo, hacemos un bucle que sigue llamando a write hasta que se haya escrito todo el texto.
-*/
-int write_checked(int fd, const char *text, int len) {
-  int total;
-  ssize_t written;
-
-  total = 0;
-  while (total < len) {
-    /*escribimos donde nos qudamos la anterior vez*/
-    written = write(fd, text + total, (size_t)(len - total));
-    if (written <= 0) {
-      return -1;
-    }
-    total += (int)written;
-  }
-  return 0;
-}
-
-/*
-write_operation: construye y escribe la operación completa
-Escribe en el formato: "Operación: num1 op num2 = result\n"
-Se utiliza dos veces: una para escribir en la salida estandar y otra para escribir en el log.
-*/
-int write_operation(int fd, const char *num1, const char *op, const char *num2, const char *result_text) {
-  if (write_checked(fd, "Operación: ", str_len("Operación: ")) < 0 ||
-      write_checked(fd, num1, str_len(num1)) < 0 ||
-      write_checked(fd, " ", 1) < 0 ||
-      write_checked(fd, op, str_len(op)) < 0 ||
-      write_checked(fd, " ", 1) < 0 ||
-      write_checked(fd, num2, str_len(num2)) < 0 ||
-      write_checked(fd, " = ", 3) < 0 ||
-      write_checked(fd, result_text, str_len(result_text)) < 0 ||
-      write_checked(fd, "\n", 1) < 0) {
-    return -1;
-  }
-  return 0;
-}
-
-/*
-write_history_line: escribe una linea del historial con su numero.
-Escribe en el formato: "Linea N: contenido de la linea\n"
-Convertimos el numero de linea a texto con int_to_text y luego escribimos todo el mensaje utilizando write_checked.
-*/
-int write_history_line(int line_number, const char *line_text, int line_len) {
-  char line_number_text[20];
-  int line_number_len;
-
-  line_number_len = int_to_text(line_number, line_number_text);
-  line_number_text[line_number_len] = '\0';
-
-  if (write_checked(1, "Linea ", 6) < 0 ||
-      write_checked(1, line_number_text, line_number_len) < 0 ||
-      write_checked(1, ": ", 2) < 0) {
-    return -1;
-  }
-
-  if (write_checked(1, line_text, line_len) < 0) {
-    return -1;
-  }
-  return 0;
-}
-
-/*
-is_history_mode: verifica si el programa se ha llamado en modo historial.
-El argumento tiene que ser exactamente "-b" para que se considere modo historial. Si es así, devuelve 1, sino devuelve 0.
-*/
-int is_history_mode(const char *text) {
-  if (text[0] == '-' && text[1] == 'b' && text[2] == '\0') {
-    return 1;
-  }
-  return 0;
-}
-
-/*
-compute_result: realiza la operación entre dos numeros y devuelve el resultado.
-
-Usamomos long para el resultado intermedio para detectar posibles overflow.
-
-Aceptamos tanto '*' como 'x' para la multiplicacion, aunque la practica pide 'x', es comodo tener los dos.
-
-Codigos de retorno:
-  0: operacion exitosa, el resultado se guarda en *out
-  -1: operador invalido
-  -2: division por cero
-  -3: overflow en la operacion
-*/
-int compute_result(int a, int b, char op, int *out) {
-  long tmp;
-
-  if (op == '+') {
-    tmp = (long)a + (long)b;
-  } else if (op == '-') {
-    tmp = (long)a - (long)b;
-  } else if (op == '*' || op == 'x') {
-    tmp = (long)a * (long)b;
-  } else if (op == '/') {
-    if (b == 0) {
-      return -2; /*No se puede dividir entre cero*/
-    }
-    if (a == INT_MIN && b == -1) {
-      return -3; /* caso que desbordaria*/
-    }
-    tmp = a / b;
-  } else {
-    return -1; /*operador invalido*/
-  }
-/*verificamos que el resultado no desborde los limites de int*/
-  if (tmp < INT_MIN || tmp > INT_MAX) {
-    return -3;
-  }
-
-  *out = (int)tmp;
-  return 0;
-}
-
-/*
-main: punto de entrada y logica principal del programa.
-
-Lo primero es mirar los argumentos para ver el modo que estamos.
-Si el el primer argumento es '-b' y hay 3 argumentos, estamos en modo historial.
-Si hay 4 argumentos, estamos en modo calculadora.
-Cualquier otra combinacion de argumentos es invalida y mostramos el mensaje de uso.
-*/
-int main(int argc, char *argv[]) {
-  int a;
-  int b;
-  int result;
-  int line_number;
-  int current_line;
-  int fd;
-  char op;
-  char result_text[20];
-  char line_buffer[512];    /*acumulamos la linea que estamos buscando*/
-  char read_buffer[128];    /*Leemos el fichero en bloque de 128 bytes*/
-  int pos;
-  int result_len;
-  int calc_status;
-  int line_too_long;
-  ssize_t nread;
-  int i;
-
-  /*MODO HISTOSIAL: ./ mycalc -b <numero_de_linea> */
-  if (argc == 3 && is_history_mode(argv[1]) == 1) {
-    /*el numero de linea tiene que ser un entero positivo*/
-    if (to_int(argv[2], &line_number) != 0 || line_number <= 0) {
-      print_error("Error: numero de operacion invalido\n", 36);
-      return -1;
-    }
-    /*abrimos el log solo para leer*/
-    fd = open("mycalc.log", O_RDONLY);
-    if (fd < 0) {
-      print_error("Error: no se pudo abrir mycalc.log\n", 35);
-      return -1;
-    }
-
-    current_line = 1; 
-    pos = 0;
-    line_too_long = 0;
-    /*leemos el fichero en bloques de 128 bytes hasta encontrar la linea que queremos o llegar al final del fichero*/
-    while (1) {
-      nread = read(fd, read_buffer, sizeof(read_buffer));
-      if (nread < 0) {
-        close(fd);
-        return -1;
-      }
-      if (nread == 0) {
-        break; /*llegamos al final del fichero*/
-      }
-
-      for (i = 0; i < nread; i++) {
-        /*si es la linea buscada, acumulamos el carecter */
-        if (current_line == line_number && pos < 511) {
-          line_buffer[pos] = read_buffer[i];
-          pos++;
-        } else if (current_line == line_number && read_buffer[i] != '\n') {
-          line_too_long = 1;
-        }
-        /*cuando encontramos '\n' hemos teminado la linea actual*/
-        if (read_buffer[i] == '\n') {
-          if (current_line == line_number) {
-            close(fd);
-            if (line_too_long == 1) {
-              print_error("Error: linea de historial demasiado larga\n", 40);
-              return -1;
-            }
-            if (write_history_line(line_number, line_buffer, pos) < 0) {
-              return -1;
-            }
-            return 0;
-          }
-          /*no era la linea buscada, avanzamos a la siguiente*/
-          current_line++;
-          pos = 0;
-        }
-      }
-    }
-    /*llegamos al final del fichero sin encontrar la linea buscada.*/
-    if (current_line == line_number && pos > 0) {
-      close(fd);
-      if (line_too_long == 1) {
-        print_error("Error: linea de historial demasiado larga\n", 40);
-        return -1;
-      }
-      if (write_history_line(line_number, line_buffer, pos) < 0 ||
-          write_checked(1, "\n", 1) < 0) {
-        return -1;
-      }
-      return 0;
-    }
-    /*si llegamos aqui, la linea pedido no existe en el fichero*/
-    close(fd);
-    print_error("Error: El numero de linea no es valido\n", 39);
-    return -1;
-  }
-
-  /*MODO CALCULADORA: ./mycalc <num1> <op> <num2>*/
-
-  if (argc != 4) {
-    print_usage();
-    return -1;
-  }
-  /*convertimos los argumentos de texto a entero*/
-  if (to_int(argv[1], &a) != 0 || to_int(argv[3], &b) != 0) {
-    print_error("Error: numeros invalidos\n", 25);
-    return -1;
-  }
-  /* el operador tiene que ser exactamente un caracter, no mas */
-  if (argv[2][1] != '\0') {
-    print_error("Error: operador invalido\n", 25);
-    return -1;
-  }
-
-  op = argv[2][0];
-  /* calculamos y gestionamos cada tipo de error posible */
-  calc_status = compute_result(a, b, op, &result);
-  if (calc_status == -1) {
-    print_error("Error: operador invalido\n", 25);
-    return -1;
-  }
-  if (calc_status == -2) {
-    print_error("Error: Division por cero\n", 25);
-    return -1;
-  }
-  if (calc_status == -3) {
-    print_error("Error: overflow en operacion\n", str_len("Error: overflow en operacion\n"));
-    return -1;
-  }
-  
-  /*
-  abrimos el log para añadir la operación al final
-  usamos O_APPEND para no borrar el contenido existente. O_CREAT para crear el archivo si no existe 
-  */
-  fd = open("mycalc.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
-  if (fd < 0) {
-    print_error("Error: no se pudo abrir mycalc.log\n", 35);
-    return -1;
-  }
-
-  result_len = int_to_text(result, result_text);
-  result_text[result_len] = '\0';
-  /* primero mostramos la operacion por pantalla (fd=1 es stdout) */
-  if (write_operation(1, argv[1], argv[2], argv[3], result_text) < 0) {
-    close(fd);
-    return -1;
-  }
-  /* luego guardamos exactamente la misma linea en el fichero de log */
-  if (write_operation(fd, argv[1], argv[2], argv[3], result_text) < 0) {
-    close(fd);
-    return -1;
-  }
-
-  close(fd);
-  return 0;
-}
+/*
+mycalc.c - Calculadora con historial de operaciones
+
+Este programa funciona como una calculadora simple desde la terminal.
+No se han utilizaso librearia stdio.h, sino directamente con llamadas al sistema 
+
+Modos de uso:
+  -Calculadora: ./mycalc <num1> <op> <num2>
+  -Historial: ./mycalc -b <num_operacion>
+  -Rango del historial: ./mycalc -b <primera>:<ultima>
+  -Ultimas operaciones: ./mycalc -t <N>
+  -Por lotes: ./mycalc -f <fichero> o ./mycalc - (lee "num1 op num2" por lineas de stdin)
+  -Servidor: ./mycalc -s <socket> (atiende lineas "num1 op num2" por un socket Unix)
+  -Cliente: ./mycalc -c <socket> <num1> <op> <num2>
+  -Conversion: ./mycalc --convert (pasa mycalc.log al log binario mycalc.log.bin)
+  -Expresion: ./mycalc -e "<expresion>" [<fichero> | -] (una expresion con
+   precedencia, parentesis y variables; con fichero o stdin, la primera linea
+   nombra las columnas y se calcula una vez por cada fila de valores)
+  -Compresion: ./mycalc --compress (comprime los segmentos cerrados de mycalc.log)
+  Delante de cualquiera: --sync=none|batch|always (fdatasync del log nunca,
+  una vez por cada escritura en grupo o por cada operacion), --binlog (usar
+  mycalc.log.bin, con un registro de 16 bytes por operacion, en lugar de mycalc.log)
+  y --segment-size=<bytes> o --segment-lines=<N> (al llegar a ese tamano o a ese
+  numero de lineas, mycalc.log pasa a ser un segmento cerrado y se empieza otro)
+
+El servidor evita crear un proceso por operacion: cada cliente manda una
+linea por operacion y recibe la misma linea que escribiria el modo
+calculadora ("Operación: ..." o "Error: ...").
+
+Junto a mycalc.log mantenemos mycalc.log.idx, un indice con donde termina
+cada linea del log, para que el modo historial lea solo la linea pedida.
+Su cabecera dice de que log es (dispositivo, inodo y primera linea), asi que
+un indice que se quedo de otro log se rehace en lugar de usarse.
+Los segmentos cerrados se apuntan en mycalc.log.manifest, y -b N solo abre
+el segmento que tiene la linea N (ver SEGMENTOS DEL LOG).
+*/
+
+/*memrchr y accept4 son extensiones de GNU*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numtext.h"
+
+/*los kernels SIMD del modo por lotes solo existen en x86 con gcc o clang*/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COLUMN_SIMD
+#include <immintrin.h>
+#endif
+
+/*fichero del indice: una cabecera y una entrada de INDEX_ENTRY_SIZE bytes por linea del log*/
+#define INDEX_FILE "mycalc.log.idx"
+#define INDEX_ENTRY_SIZE 8
+/*cabecera del indice: INDEX_MAGIC, dispositivo, inodo y resumen de la primera linea del log*/
+#define INDEX_MAGIC "MCALCIDX"
+#define INDEX_HEADER_SIZE 32
+/*tamano de los bloques en que leemos el log al completar el indice*/
+#define INDEX_READ_SIZE (64 * 1024)
+/*entradas del indice que acumulamos antes de escribirlas*/
+#define INDEX_BATCH 1024
+/*bytes que puede tener como mucho una linea del historial (sin contar su '\n')*/
+#define HISTORY_LINE_MAX 511
+/*buffer de salida de los rangos del historial*/
+#define HISTORY_OUT_SIZE (64 * 1024)
+/*buffers del modo por lotes: entrada, operaciones calculadas y errores*/
+#define BATCH_IN_SIZE (1024 * 1024)
+#define BATCH_OUT_SIZE (1024 * 1024)
+#define BATCH_ERR_SIZE (64 * 1024)
+/*longitud maxima de una linea de la entrada del modo por lotes y de la linea "Operación: ..." que sale*/
+#define BATCH_LINE_MAX 256
+#define OPERATION_TEXT_MAX (BATCH_LINE_MAX + 64)
+/*modo servidor: conexiones pendientes de aceptar, eventos por llamada a epoll_wait,
+buffer de entrada de cada cliente y respuestas sin recoger a partir de las que dejamos de leerle*/
+#define SERVER_BACKLOG 128
+#define SERVER_EVENTS 256
+#define SERVER_IN_SIZE 4096
+#define SERVER_OUT_MAX (64 * 1024)
+/*--sync=: cuando hacemos fdatasync del log (nunca, una vez por cada escritura en grupo o por cada linea)*/
+#define SYNC_NONE 0
+#define SYNC_BATCH 1
+#define SYNC_ALWAYS 2
+/*log binario (--binlog): un registro de BINLOG_RECORD_SIZE bytes por operacion,
+la operacion N empieza en el byte (N-1)*BINLOG_RECORD_SIZE*/
+#define BINLOG_FILE "mycalc.log.bin"
+#define BINLOG_RECORD_SIZE 16
+/*operadores, en el orden de su codigo en el registro*/
+#define BINLOG_OPS "+-x/*"
+/*las marcas de tiempo son segundos desde el 1 de enero de 2024 en 29 bits (llegan hasta 2041)*/
+#define BINLOG_EPOCH 1704067200
+#define BINLOG_STAMP_MASK 0x1fffffffu
+/*longitud maxima de la linea "Operación: ..." de un registro y registros que leemos de una vez*/
+#define BINLOG_TEXT_MAX 64
+#define BINLOG_READ_RECORDS 4096
+/*modo por lotes por columnas: lineas que juntamos antes de calcularlas y grupos
+(uno por operador, en el orden de COLUMN_OPS)*/
+#define COLUMN_LANES 4096
+#define COLUMN_GROUPS 4
+#define COLUMN_OPS "+-x/"
+/*expresiones (-e): registros e instrucciones de un programa, variables, longitud de
+sus nombres, parentesis anidados, columnas de la entrada y filas que calculamos de una vez*/
+#define EXPR_REGS 256
+#define EXPR_VARS 64
+#define EXPR_NAME_MAX 32
+#define EXPR_DEPTH 64
+#define EXPR_COLUMNS 256
+#define EXPR_ROWS 1024
+/*segmentos del log de texto: el manifiesto tiene un registro de SEGMENT_RECORD_SIZE bytes por
+segmento cerrado (mycalc.log.<k>), y SEGMENT_COMPRESSED en sus flags si esta comprimido (mycalc.log.<k>.lz)*/
+#define SEGMENT_MANIFEST "mycalc.log.manifest"
+#define SEGMENT_RECORD_SIZE 32
+#define SEGMENT_COMPRESSED 1
+#define SEGMENT_PATH_MAX 64
+/*segmentos comprimidos: bloques de como mucho LZ_BLOCK bytes del log con una cabecera de
+LZ_HEADER_SIZE bytes, repeticiones de al menos LZ_MIN_MATCH bytes, tabla hash de 2^LZ_HASH_BITS
+posiciones y lo mas que puede ocupar un bloque comprimido*/
+#define LZ_BLOCK 65536
+#define LZ_HEADER_SIZE 12
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_BOUND (LZ_BLOCK + LZ_BLOCK / 32 + 16)
+
+/*
+print_usage: muestra como se usa el programa cuando el ussuario lo llama mal.
+Escribimos siempre en fd=2, que es stderr (la salida de error estandar).
+*/
+void print_usage(void) {
+  if (write(2, "Uso: ./mycalc <num1> <op> <num2>\n", 33) < 0) return;
+  if (write(2, "Uso: ./mycalc -b <num_operacion>\n", 33) < 0) return;
+  if (write(2, "Uso: ./mycalc -b <primera>:<ultima>\n", 36) < 0) return;
+  if (write(2, "Uso: ./mycalc -t <N>\n", 21) < 0) return;
+  if (write(2, "Uso: ./mycalc -f <fichero> | -\n", 31) < 0) return;
+  if (write(2, "Uso: ./mycalc -s <socket>\n", 26) < 0) return;
+  if (write(2, "Uso: ./mycalc -c <socket> <num1> <op> <num2>\n", 45) < 0) return;
+  if (write(2, "Uso: ./mycalc --convert\n", 24) < 0) return;
+  if (write(2, "Uso: ./mycalc -e <expresion> [<fichero> | -]\n", 45) < 0) return;
+  if (write(2, "Uso: ./mycalc --compress\n", 25) < 0) return;
+  if (write(2, "(delante de cualquier modo: --sync=none|batch|always y --binlog)\n", 65) < 0) return;
+  if (write(2, "(y para rotar mycalc.log: --segment-size=<bytes> y --segment-lines=<N>)\n", 72) < 0) return;
+}
+
+/*
+print_error: escribe un mensaje de error por stderr
+*/
+void print_error(const char *msg, int len) {
+  if (write(2, msg, (size_t)len) < 0) return;
+}
+
+/*
+str_len: calcula cuantos bytes tiene un texto
+Recorremos hasta encontrar el caracter nulo '\0' que marca el final y contamos los caracteres
+*/
+int str_len(const char *text) {
+  int i;
+  i = 0;
+  while (text[i] != '\0') {
+    i++;
+  }
+  return i;
+}
+
+/*
+to_int: convierte un texto como "123" a un entero 123. Si el texto no es un numero valido, devuelve -1.
+Antes usabamos strtol; ahora lo hace parse_int (numtext.c), que comprueba lo mismo
+(texto vacio, algo que no es numero detras como en "5abc34", limites de int) pero
+lee ocho cifras de golpe.
+*/
+int to_int(const char *text, int *out) {
+  return parse_int(text, (size_t)str_len(text), out);
+}
+
+/*
+write_checked: escribe un texto en un fd asegurandose de que se escriba todo. Si hay un error, devuelve -1.
+El problema es que la llamada a write puede escribir menos bytes de los que le pedimos, quedando el texto cortado.
+Para solucionarlo, hacemos un bucle que sigue llamando a write hasta que se haya escrito todo el texto.
+*/
+int write_checked(int fd, const char *text, int len) {
+  int total;
+  ssize_t written;
+
+  total = 0;
+  while (total < len) {
+    /*escribimos donde nos qudamos la anterior vez*/
+    written = write(fd, text + total, (size_t)(len - total));
+    if (written <= 0) {
+      return -1;
+    }
+    total += (int)written;
+  }
+  return 0;
+}
+
+/*
+writev_checked: como write_checked pero con el texto repartido en n trozos
+Si writev escribe solo una parte, seguimos desde el trozo donde se quedo.
+*/
+int writev_checked(int fd, struct iovec *parts, int n) {
+  ssize_t written;
+  size_t done;
+
+  while (n > 0) {
+    written = writev(fd, parts, n);
+    if (written <= 0) {
+      return -1;
+    }
+    done = (size_t)written;
+    while (n > 0 && done >= parts[0].iov_len) {
+      done -= parts[0].iov_len;
+      parts++;
+      n--;
+    }
+    if (n > 0) {
+      parts[0].iov_base = (char *)parts[0].iov_base + done;
+      parts[0].iov_len -= done;
+    }
+  }
+  return 0;
+}
+
+/*
+write_operation: construye y escribe la operación completa
+Escribe en el formato: "Operación: num1 op num2 = result\n"
+Se utiliza dos veces: una para escribir en la salida estandar y otra para escribir en el log.
+La linea sale en un solo writev y no trozo a trozo: con O_APPEND el kernel la
+añade entera al log de una vez, asi que otro mycalc que escriba a la vez no
+puede meter su linea en medio de la nuestra.
+*/
+int write_operation(int fd, const char *num1, const char *op, const char *num2, const char *result_text) {
+  struct iovec parts[9];
+
+  parts[0].iov_base = "Operación: ";
+  parts[0].iov_len = 12; /*la o con tilde son dos bytes*/
+  parts[1].iov_base = (char *)num1;
+  parts[1].iov_len = (size_t)str_len(num1);
+  parts[2].iov_base = " ";
+  parts[2].iov_len = 1;
+  parts[3].iov_base = (char *)op;
+  parts[3].iov_len = (size_t)str_len(op);
+  parts[4].iov_base = " ";
+  parts[4].iov_len = 1;
+  parts[5].iov_base = (char *)num2;
+  parts[5].iov_len = (size_t)str_len(num2);
+  parts[6].iov_base = " = ";
+  parts[6].iov_len = 3;
+  parts[7].iov_base = (char *)result_text;
+  parts[7].iov_len = (size_t)str_len(result_text);
+  parts[8].iov_base = "\n";
+  parts[8].iov_len = 1;
+  return writev_checked(fd, parts, 9);
+}
+
+/*
+write_history_line: escribe una linea del historial con su numero.
+Escribe en el formato: "Linea N: contenido de la linea\n"
+Convertimos el numero de linea a texto con int_to_text y luego escribimos todo el mensaje utilizando write_checked.
+*/
+int write_history_line(int line_number, const char *line_text, int line_len) {
+  char line_number_text[20];
+  int line_number_len;
+
+  line_number_len = format_int(line_number, line_number_text);
+  line_number_text[line_number_len] = '\0';
+
+  if (write_checked(1, "Linea ", 6) < 0 ||
+      write_checked(1, line_number_text, line_number_len) < 0 ||
+      write_checked(1, ": ", 2) < 0) {
+    return -1;
+  }
+
+  if (write_checked(1, line_text, line_len) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+put_u64 / get_u64: guardan y leen un entero de 8 bytes en little endian
+Asi el indice es igual en cualquier maquina.
+*/
+void put_u64(unsigned char *p, uint64_t value) {
+  int i;
+  for (i = 0; i < 8; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+uint64_t get_u64(const unsigned char *p) {
+  uint64_t value;
+  int i;
+  value = 0;
+  for (i = 7; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+/*
+pread_full: lee exactamente len bytes de fd desde offset
+Devuelve 0 si los ha leido todos, -1 si hubo un error o el fichero es mas corto.
+*/
+int pread_full(int fd, void *buf, size_t len, off_t offset) {
+  size_t done;
+  ssize_t nread;
+
+  done = 0;
+  while (done < len) {
+    nread = pread(fd, (char *)buf + done, len - done, offset + (off_t)done);
+    if (nread <= 0) {
+      return -1;
+    }
+    done += (size_t)nread;
+  }
+  return 0;
+}
+
+/*
+index_header: prepara en header la cabecera del indice del log log_fd
+
+La cabecera dice de que log es el indice: el dispositivo y el inodo del log
+y un resumen (FNV-1a) de su primera linea, o de sus primeros
+HISTORY_LINE_MAX + 1 bytes si es mas larga. Asi un indice que se quedo de
+un log borrado no se usa con uno nuevo aunque el inodo se reutilice y sus
+lineas terminen en los mismos sitios.
+Devuelve 1 si la ha preparado, 0 si el log aun no tiene una linea completa y -1 si hubo algun error.
+*/
+int index_header(int log_fd, unsigned char *header) {
+  char first[HISTORY_LINE_MAX + 1];
+  struct stat st;
+  const char *nl;
+  uint64_t hash;
+  ssize_t nread;
+  size_t len;
+  size_t i;
+
+  if (fstat(log_fd, &st) < 0) {
+    return -1;
+  }
+  nread = pread(log_fd, first, sizeof(first), 0);
+  if (nread < 0) {
+    return -1;
+  }
+  nl = memchr(first, '\n', (size_t)nread);
+  if (nl == NULL && (size_t)nread < sizeof(first)) {
+    return 0;
+  }
+  len = nl != NULL ? (size_t)(nl - first) + 1 : sizeof(first);
+  hash = UINT64_C(14695981039346656037);
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)first[i]) * UINT64_C(1099511628211);
+  }
+  memcpy(header, INDEX_MAGIC, 8);
+  put_u64(header + 8, (uint64_t)st.st_dev);
+  put_u64(header + 16, (uint64_t)st.st_ino);
+  put_u64(header + 24, hash);
+  return 1;
+}
+
+/*
+index_matches: dice si la cabecera del indice idx_fd es la del log log_fd
+*/
+int index_matches(int idx_fd, int log_fd) {
+  unsigned char stored[INDEX_HEADER_SIZE];
+  unsigned char expected[INDEX_HEADER_SIZE];
+
+  return pread_full(idx_fd, stored, INDEX_HEADER_SIZE, 0) == 0 && index_header(log_fd, expected) == 1 &&
+         memcmp(stored, expected, INDEX_HEADER_SIZE) == 0;
+}
+
+/*
+index_in_sync: dice si el indice idx_fd del log log_fd llega justo hasta su byte log_end
+Si es asi se le pueden anadir al final (con index_write) las lineas que se
+escriban desde ahi.
+*/
+int index_in_sync(int idx_fd, int log_fd, uint64_t log_end) {
+  unsigned char entry[INDEX_ENTRY_SIZE];
+  struct stat st;
+
+  if (fstat(idx_fd, &st) < 0) {
+    return 0;
+  }
+  if (st.st_size == 0) {
+    return log_end == 0;
+  }
+  if (log_end == 0 || st.st_size < INDEX_HEADER_SIZE + INDEX_ENTRY_SIZE ||
+      (st.st_size - INDEX_HEADER_SIZE) % INDEX_ENTRY_SIZE != 0 ||
+      pread_full(idx_fd, entry, INDEX_ENTRY_SIZE, st.st_size - INDEX_ENTRY_SIZE) < 0) {
+    return 0;
+  }
+  return get_u64(entry) == log_end && index_matches(idx_fd, log_fd);
+}
+
+/*
+index_write: anade al indice idx_fd las entradas entries (len bytes)
+Si el indice esta vacio escribe antes su cabecera, que sale del log log_fd
+(donde ya estan las lineas). Se llama con el indice bloqueado y despues de
+comprobar index_in_sync.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int index_write(int idx_fd, int log_fd, const unsigned char *entries, size_t len) {
+  unsigned char header[INDEX_HEADER_SIZE];
+  struct stat st;
+
+  if (fstat(idx_fd, &st) < 0) {
+    return -1;
+  }
+  if (st.st_size == 0 &&
+      (index_header(log_fd, header) != 1 || write_checked(idx_fd, (const char *)header, INDEX_HEADER_SIZE) < 0)) {
+    return -1;
+  }
+  return write_checked(idx_fd, (const char *)entries, (int)len);
+}
+
+/*
+index_append: apunta en el indice la linea que acabamos de escribir en el log
+
+log_fd es el log abierto con O_RDWR | O_APPEND, ya con la linea escrita, y line_len
+su longitud. Solo la apuntamos si el indice llega justo hasta donde empieza
+la linea: si le faltan lineas (por ejemplo porque no existia) no tocamos
+nada y ya lo completara el modo historial. Un fallo aqui no estropea la
+operacion, asi que no devolvemos error.
+*/
+void index_append(int log_fd, int line_len) {
+  unsigned char entry[INDEX_ENTRY_SIZE];
+  off_t end;
+  int fd;
+
+  end = lseek(log_fd, 0, SEEK_CUR);
+  if (end < line_len) {
+    return;
+  }
+  fd = open(INDEX_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    return;
+  }
+  /*con el indice bloqueado nadie mas lo puede completar entre la comprobacion y nuestra entrada*/
+  if (flock(fd, LOCK_EX) == 0 && index_in_sync(fd, log_fd, (uint64_t)(end - line_len))) {
+    put_u64(entry, (uint64_t)end);
+    /*si falla nos quedamos sin la entrada y el modo historial la repondra*/
+    index_write(fd, log_fd, entry, INDEX_ENTRY_SIZE);
+  }
+  close(fd);
+}
+
+/*
+index_sync: pone al dia el indice con lo que tenga el log
+
+La entrada k del indice es donde termina la linea k+1 (justo despues de su
+'\n'), que es donde empieza la siguiente. Si la cabecera no es la de este
+log (index_header) o la ultima entrada no cae justo despues de un '\n' del
+log (el log se ha borrado o reescrito) rehacemos el indice desde el
+principio; si solo le faltan las ultimas lineas, leemos el log desde la
+ultima que tiene. Asi el log entero solo se lee una vez.
+Una ultima linea sin '\n' no entra en el indice.
+En *last_end deja donde termina la ultima linea del indice.
+Como puede truncar el indice, se llama con el bloqueado (flock).
+Devuelve cuantas lineas tiene el indice, o -1 si hubo algun error.
+*/
+long index_sync(int log_fd, off_t log_size, int idx_fd, uint64_t *last_end) {
+  unsigned char entry[INDEX_ENTRY_SIZE];
+  unsigned char batch[INDEX_BATCH * INDEX_ENTRY_SIZE];
+  unsigned char header[INDEX_HEADER_SIZE];
+  char read_buffer[INDEX_READ_SIZE];
+  struct stat st;
+  const char *p;
+  const char *nl;
+  uint64_t last;
+  off_t keep;
+  off_t pos;
+  ssize_t nread;
+  long count;
+  int pending;
+  int status;
+  char c;
+
+  if (fstat(idx_fd, &st) < 0) {
+    return -1;
+  }
+  count = 0;
+  last = 0;
+  if (st.st_size >= INDEX_HEADER_SIZE + INDEX_ENTRY_SIZE && index_matches(idx_fd, log_fd)) {
+    count = (long)((st.st_size - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE);
+    if (pread_full(idx_fd, entry, INDEX_ENTRY_SIZE, INDEX_HEADER_SIZE + (off_t)(count - 1) * INDEX_ENTRY_SIZE) < 0) {
+      return -1;
+    }
+    last = get_u64(entry);
+    if (last == 0 || last > (uint64_t)log_size || pread_full(log_fd, &c, 1, (off_t)last - 1) < 0 || c != '\n') {
+      count = 0;
+      last = 0;
+    }
+  }
+  /*quitamos una entrada a medias o todo el indice si no vale*/
+  keep = count > 0 ? INDEX_HEADER_SIZE + (off_t)count * INDEX_ENTRY_SIZE : 0;
+  if (keep != st.st_size && ftruncate(idx_fd, keep) < 0) {
+    return -1;
+  }
+  /*un indice nuevo empieza por la cabecera; sin ninguna linea completa se queda vacio*/
+  if (count == 0) {
+    status = index_header(log_fd, header);
+    if (status < 0 || (status == 1 && write_checked(idx_fd, (const char *)header, INDEX_HEADER_SIZE) < 0)) {
+      return -1;
+    }
+    if (status == 0) {
+      *last_end = 0;
+      return 0;
+    }
+  }
+
+  /*anadimos las lineas que le faltan, en bloques*/
+  pos = (off_t)last;
+  pending = 0;
+  while (pos < log_size) {
+    nread = pread(log_fd, read_buffer, sizeof(read_buffer), pos);
+    if (nread < 0) {
+      return -1;
+    }
+    if (nread == 0) {
+      break;
+    }
+    p = read_buffer;
+    while ((nl = memchr(p, '\n', (size_t)(read_buffer + nread - p))) != NULL) {
+      last = (uint64_t)pos + (uint64_t)(nl - read_buffer) + 1;
+      put_u64(batch + pending * INDEX_ENTRY_SIZE, last);
+      pending++;
+      count++;
+      if (pending == INDEX_BATCH) {
+        if (write_checked(idx_fd, (const char *)batch, pending * INDEX_ENTRY_SIZE) < 0) {
+          return -1;
+        }
+        pending = 0;
+      }
+      p = nl + 1;
+    }
+    pos += nread;
+  }
+  if (pending > 0 && write_checked(idx_fd, (const char *)batch, pending * INDEX_ENTRY_SIZE) < 0) {
+    return -1;
+  }
+  *last_end = last;
+  return count;
+}
+
+/*
+print_line: escribe la linea del log que va de start a end
+Si no termina en '\n' (ultima linea del log) lo anadimos al escribirla.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int print_line(int fd, int line_number, off_t start, off_t end, int has_newline) {
+  char line_buffer[HISTORY_LINE_MAX + 1];
+
+  if (end - start - has_newline > HISTORY_LINE_MAX) {
+    print_error("Error: linea de historial demasiado larga\n", 42);
+    return -1;
+  }
+  if (pread_full(fd, line_buffer, (size_t)(end - start), start) < 0 ||
+      write_history_line(line_number, line_buffer, (int)(end - start)) < 0) {
+    return -1;
+  }
+  if (has_newline == 0 && write_checked(1, "\n", 1) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+print_line_scan: busca la linea leyendo el log desde el principio
+
+Es la forma de siempre, que solo usamos si no se puede usar el indice
+(por ejemplo si no podemos escribir mycalc.log.idx). line_number es la
+linea dentro de este fichero y sale numerada como base + line_number (base
+es cuantas lineas hay en los segmentos anteriores, ver SEGMENTOS).
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int print_line_scan(int fd, int line_number, int base) {
+  char line_buffer[512];    /*acumulamos la linea que estamos buscando*/
+  char read_buffer[128];    /*Leemos el fichero en bloque de 128 bytes*/
+  int current_line;
+  int pos;
+  int line_too_long;
+  ssize_t nread;
+  int i;
+
+  current_line = 1;
+  pos = 0;
+  line_too_long = 0;
+  /*leemos el fichero en bloques de 128 bytes hasta encontrar la linea que queremos o llegar al final del fichero*/
+  while (1) {
+    nread = read(fd, read_buffer, sizeof(read_buffer));
+    if (nread < 0) {
+      return -1;
+    }
+    if (nread == 0) {
+      break; /*llegamos al final del fichero*/
+    }
+
+    for (i = 0; i < nread; i++) {
+      /*si es la linea buscada, acumulamos el carecter */
+      if (current_line == line_number && pos < 511) {
+        line_buffer[pos] = read_buffer[i];
+        pos++;
+      } else if (current_line == line_number && read_buffer[i] != '\n') {
+        line_too_long = 1;
+      }
+      /*cuando encontramos '\n' hemos teminado la linea actual*/
+      if (read_buffer[i] == '\n') {
+        if (current_line == line_number) {
+          if (line_too_long == 1) {
+            print_error("Error: linea de historial demasiado larga\n", 42);
+            return -1;
+          }
+          return write_history_line(base + line_number, line_buffer, pos);
+        }
+        /*no era la linea buscada, avanzamos a la siguiente*/
+        current_line++;
+        pos = 0;
+      }
+    }
+  }
+  /*llegamos al final del fichero sin encontrar la linea buscada.*/
+  if (current_line == line_number && pos > 0) {
+    if (line_too_long == 1) {
+      print_error("Error: linea de historial demasiado larga\n", 42);
+      return -1;
+    }
+    if (write_history_line(base + line_number, line_buffer, pos) < 0 ||
+        write_checked(1, "\n", 1) < 0) {
+      return -1;
+    }
+    return 0;
+  }
+  /*si llegamos aqui, la linea pedido no existe en el fichero*/
+  print_error("Error: El numero de linea no es valido\n", 39);
+  return -1;
+}
+
+/*
+print_line_indexed: busca la linea con el indice y la lee directamente
+
+Con el indice al dia, la linea N va de la entrada N-1 (o 0 si N es 1) a la
+entrada N, asi que basta un pread del indice y otro del log, tenga el log
+las lineas que tenga. Como en print_line_scan, sale numerada como base + line_number.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int print_line_indexed(int fd, int idx_fd, int line_number, int base) {
+  unsigned char entries[2 * INDEX_ENTRY_SIZE];
+  struct stat st;
+  uint64_t last;
+  off_t start;
+  off_t end;
+  long count;
+
+  if (fstat(fd, &st) < 0) {
+    return -1;
+  }
+  flock(idx_fd, LOCK_EX);
+  count = index_sync(fd, st.st_size, idx_fd, &last);
+  flock(idx_fd, LOCK_UN);
+  if (count < 0) {
+    return print_line_scan(fd, line_number, base);
+  }
+  if (line_number <= count) {
+    if (line_number == 1) {
+      if (pread_full(idx_fd, entries + INDEX_ENTRY_SIZE, INDEX_ENTRY_SIZE, INDEX_HEADER_SIZE) < 0) {
+        return -1;
+      }
+      start = 0;
+    } else {
+      if (pread_full(idx_fd, entries, 2 * INDEX_ENTRY_SIZE,
+                     INDEX_HEADER_SIZE + (off_t)(line_number - 2) * INDEX_ENTRY_SIZE) < 0) {
+        return -1;
+      }
+      start = (off_t)get_u64(entries);
+    }
+    end = (off_t)get_u64(entries + INDEX_ENTRY_SIZE);
+    return print_line(fd, base + line_number, start, end, 1);
+  }
+  /*la ultima linea del log, si no termina en '\n', no esta en el indice*/
+  if (line_number == count + 1 && (off_t)last < st.st_size) {
+    return print_line(fd, base + line_number, (off_t)last, st.st_size, 0);
+  }
+  print_error("Error: El numero de linea no es valido\n", 39);
+  return -1;
+}
+
+/*
+parse_range: lee un rango de lineas "primera:ultima" (las dos incluidas)
+Devuelve 1 si es un rango valido, 0 si el texto no es un rango y -1 si es un rango mal escrito.
+*/
+int parse_range(const char *text, int *first, int *last) {
+  char part[16];
+  int i;
+
+  i = 0;
+  while (text[i] != '\0' && text[i] != ':') {
+    i++;
+  }
+  if (text[i] == '\0') {
+    return 0; /*no hay ':', es una sola linea*/
+  }
+  if (i == 0 || i >= (int)sizeof(part)) {
+    return -1;
+  }
+  memcpy(part, text, (size_t)i);
+  part[i] = '\0';
+  if (to_int(part, first) != 0 || to_int(text + i + 1, last) != 0 || *first <= 0 || *last < *first) {
+    return -1;
+  }
+  return 1;
+}
+
+/*
+count_lines: cuenta las lineas del log mapeado (la ultima puede no tener '\n')
+Solo hace falta si no podemos usar el indice.
+*/
+long count_lines(const char *map, size_t size) {
+  const char *p;
+  const char *nl;
+  long count;
+
+  count = 0;
+  p = map;
+  while (p < map + size && (nl = memchr(p, '\n', (size_t)(map + size - p))) != NULL) {
+    count++;
+    p = nl + 1;
+  }
+  if (p < map + size) {
+    count++;
+  }
+  return count;
+}
+
+/*
+print_lines: escribe nlines lineas del log mapeado empezando en el byte pos
+
+Cada linea sale con el formato de siempre, "Linea N: contenido\n", pero en
+lugar de hacer cuatro write por linea las juntamos en un buffer de
+HISTORY_OUT_SIZE bytes y lo escribimos al llenarse. Los finales de linea
+los buscamos con memchr, que mira muchos bytes a la vez. Una linea de mas
+de HISTORY_LINE_MAX bytes es un error, igual que con -b N (print_line):
+escribimos las anteriores y paramos ahi.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int print_lines(const char *map, size_t size, size_t pos, int line_number, long nlines) {
+  char out[HISTORY_OUT_SIZE];
+  char number_text[20];
+  const char *nl;
+  size_t end;
+  size_t len;
+  size_t used;
+  size_t needed;
+  int number_len;
+
+  used = 0;
+  while (nlines > 0 && pos < size) {
+    nl = memchr(map + pos, '\n', size - pos);
+    end = nl != NULL ? (size_t)(nl - map) : size;
+    len = end - pos;
+    if (len > HISTORY_LINE_MAX) {
+      if (used > 0 && write_checked(1, out, (int)used) < 0) {
+        return -1;
+      }
+      print_error("Error: linea de historial demasiado larga\n", 42);
+      return -1;
+    }
+    number_len = format_int(line_number, number_text);
+    /*con HISTORY_LINE_MAX bytes como mucho, una linea siempre cabe en out*/
+    needed = 6 + (size_t)number_len + 2 + len + 1;
+    if (used + needed > sizeof(out)) {
+      if (write_checked(1, out, (int)used) < 0) {
+        return -1;
+      }
+      used = 0;
+    }
+    memcpy(out + used, "Linea ", 6);
+    memcpy(out + used + 6, number_text, (size_t)number_len);
+    memcpy(out + used + 6 + number_len, ": ", 2);
+    memcpy(out + used + 8 + number_len, map + pos, len);
+    out[used + needed - 1] = '\n';
+    used += needed;
+    pos = end + 1;
+    line_number++;
+    nlines--;
+  }
+  if (used > 0 && write_checked(1, out, (int)used) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+text_lines: escribe un rango de lineas de un log de texto o las ultimas tail
+
+fd es mycalc.log (o un segmento cerrado) e idx_path su indice. Mapeamos el
+fichero en lugar de leerlo a trozos. Con un rango (tail = 0)
+el indice nos dice donde empieza la primera linea sin recorrer las
+anteriores; con tail > 0 buscamos hacia atras desde el final del fichero con
+memrchr, asi solo se toca el final del log. En los dos casos el indice nos
+da tambien cuantas lineas hay, para numerarlas. Si no se puede usar el
+indice contamos las lineas recorriendo el log. first y last son lineas
+dentro de este fichero y salen numeradas a partir de base + first.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int text_lines(int fd, const char *idx_path, int base, int first, int last, int tail) {
+  unsigned char entry[INDEX_ENTRY_SIZE];
+  struct stat st;
+  const char *map;
+  const char *nl;
+  uint64_t last_end;
+  size_t size;
+  size_t start;
+  size_t pos;
+  long count;
+  long total;
+  long found;
+  int idx_fd;
+  int status;
+
+  if (fstat(fd, &st) < 0) {
+    return -1;
+  }
+  size = (size_t)st.st_size;
+  map = NULL;
+  if (size > 0) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      print_error("Error: no se pudo leer mycalc.log\n", 34);
+      return -1;
+    }
+  }
+
+  /*cuantas lineas hay: del indice si podemos, si no contandolas*/
+  count = -1;
+  last_end = 0;
+  idx_fd = open(idx_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (idx_fd >= 0) {
+    flock(idx_fd, LOCK_EX);
+    count = index_sync(fd, st.st_size, idx_fd, &last_end);
+    flock(idx_fd, LOCK_UN);
+  }
+  if (count >= 0) {
+    total = count + (last_end < (uint64_t)size ? 1 : 0);
+  } else {
+    total = count_lines(map, size);
+  }
+
+  status = 0;
+  if (tail > 0) {
+    /*la ultima linea termina en el ultimo '\n' (o en el final si no lo tiene)*/
+    pos = size > 0 && map[size - 1] == '\n' ? size - 1 : size;
+    start = size;
+    found = 0;
+    while (found < tail && start > 0) {
+      nl = memrchr(map, '\n', pos);
+      start = nl != NULL ? (size_t)(nl - map) + 1 : 0;
+      pos = nl != NULL ? (size_t)(nl - map) : 0;
+      found++;
+    }
+    first = (int)(total - found + 1);
+  } else if (first > total) {
+    print_error("Error: El numero de linea no es valido\n", 39);
+    status = -1;
+  } else {
+    if (last > total) {
+      last = (int)total;
+    }
+    found = last - first + 1;
+    start = 0;
+    if (first > 1 && count >= 0) {
+      /*la linea first empieza donde termina la anterior*/
+      if (pread_full(idx_fd, entry, INDEX_ENTRY_SIZE, INDEX_HEADER_SIZE + (off_t)(first - 2) * INDEX_ENTRY_SIZE) < 0) {
+        status = -1;
+      } else {
+        start = (size_t)get_u64(entry);
+      }
+    } else if (first > 1) {
+      /*sin indice saltamos las first-1 lineas anteriores*/
+      for (pos = 1; pos < (size_t)first; pos++) {
+        nl = memchr(map + start, '\n', size - start);
+        start = (size_t)(nl - map) + 1;
+      }
+    }
+  }
+  if (status == 0) {
+    status = print_lines(map, size, start, base + first, found);
+  }
+
+  if (idx_fd >= 0) {
+    close(idx_fd);
+  }
+  if (map != NULL) {
+    munmap((void *)map, size);
+  }
+  return status;
+}
+
+/*
+is_history_mode: verifica si el programa se ha llamado en modo historial.
+El argumento tiene que ser exactamente "-b" para que se considere modo historial. Si es así, devuelve 1, sino devuelve 0.
+*/
+int is_history_mode(const char *text) {
+  if (text[0] == '-' && text[1] == 'b' && text[2] == '\0') {
+    return 1;
+  }
+  return 0;
+}
+
+/*
+is_tail_mode: igual que is_history_mode pero para "-t" (ultimas operaciones)
+*/
+int is_tail_mode(const char *text) {
+  if (text[0] == '-' && text[1] == 't' && text[2] == '\0') {
+    return 1;
+  }
+  return 0;
+}
+
+/*
+put_u32 / get_u32: como put_u64 y get_u64 pero con enteros de 4 bytes
+(los campos de los registros del log binario)
+*/
+void put_u32(unsigned char *p, uint32_t value) {
+  int i;
+  for (i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+uint32_t get_u32(const unsigned char *p) {
+  uint32_t value;
+  int i;
+
+  value = 0;
+  for (i = 3; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+/*
+binlog_stamp: marca de tiempo de un registro para el instante now
+Son segundos desde BINLOG_EPOCH; si no caben en 29 bits se quedan en el maximo.
+*/
+uint32_t binlog_stamp(time_t now) {
+  if (now <= BINLOG_EPOCH) {
+    return 0;
+  }
+  if ((uint64_t)(now - BINLOG_EPOCH) > BINLOG_STAMP_MASK) {
+    return BINLOG_STAMP_MASK;
+  }
+  return (uint32_t)(now - BINLOG_EPOCH);
+}
+
+/*
+binlog_encode: escribe en record el registro de la operacion a op b = result
+
+Un registro son BINLOG_RECORD_SIZE bytes en little endian: num1, num2 y el
+resultado como enteros de 4 bytes y un cuarto entero con el operador en
+los 3 bits altos (su posicion en BINLOG_OPS) y la marca de tiempo en el
+resto.
+Devuelve 0 si fue bien, -1 si el operador no es uno de BINLOG_OPS.
+*/
+int binlog_encode(unsigned char *record, int a, char op, int b, int result, uint32_t stamp) {
+  uint32_t opcode;
+
+  opcode = 0;
+  while (BINLOG_OPS[opcode] != '\0' && BINLOG_OPS[opcode] != op) {
+    opcode++;
+  }
+  if (BINLOG_OPS[opcode] == '\0') {
+    return -1;
+  }
+  put_u32(record, (uint32_t)a);
+  put_u32(record + 4, (uint32_t)b);
+  put_u32(record + 8, (uint32_t)result);
+  put_u32(record + 12, opcode << 29 | stamp);
+  return 0;
+}
+
+/*
+binlog_render: escribe en out la linea "Operación: ..." de un registro
+Es la misma linea que habria escrito el modo calculadora, con los numeros
+escritos de la forma normal (sin ceros ni '+' delante). out tiene que tener
+sitio para BINLOG_TEXT_MAX bytes.
+Devuelve los bytes escritos, o -1 si el registro no es valido.
+*/
+int binlog_render(const unsigned char *record, char *out) {
+  uint32_t opcode;
+  int len;
+
+  opcode = get_u32(record + 12) >> 29;
+  if (opcode >= sizeof(BINLOG_OPS) - 1) {
+    return -1;
+  }
+  memcpy(out, "Operación: ", 12);
+  len = 12;
+  len += format_int((int)get_u32(record), out + len);
+  out[len] = ' ';
+  out[len + 1] = BINLOG_OPS[opcode];
+  out[len + 2] = ' ';
+  len += 3;
+  len += format_int((int)get_u32(record + 4), out + len);
+  memcpy(out + len, " = ", 3);
+  len += 3;
+  len += format_int((int)get_u32(record + 8), out + len);
+  out[len] = '\n';
+  return len + 1;
+}
+
+/*
+binlog_lines: escribe un rango de operaciones del log binario o las ultimas tail
+
+Como todos los registros miden lo mismo, la operacion N esta en el byte
+(N-1)*BINLOG_RECORD_SIZE: no hace falta indice ni recorrer nada, y -b N es
+un solo pread. Los rangos se leen de BINLOG_READ_RECORDS en
+BINLOG_READ_RECORDS registros. Si el fichero acaba en un registro a medias
+(se corto una escritura) no lo contamos.
+Las lineas salen igual que con el log de texto: "Linea N: Operación: ...".
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int binlog_lines(int first, int last, int tail) {
+  unsigned char records[BINLOG_READ_RECORDS * BINLOG_RECORD_SIZE];
+  char out[HISTORY_OUT_SIZE];
+  struct stat st;
+  size_t used;
+  long total;
+  long count;
+  long chunk;
+  long i;
+  int len;
+  int fd;
+
+  fd = open(BINLOG_FILE, O_RDONLY);
+  if (fd < 0) {
+    print_error("Error: no se pudo abrir mycalc.log.bin\n", 39);
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  total = (long)(st.st_size / BINLOG_RECORD_SIZE);
+  if (tail > 0) {
+    count = tail < total ? tail : total;
+    first = (int)(total - count + 1);
+  } else if (first > total) {
+    print_error("Error: El numero de linea no es valido\n", 39);
+    close(fd);
+    return -1;
+  } else {
+    count = (last < total ? last : total) - first + 1;
+  }
+
+  used = 0;
+  while (count > 0) {
+    chunk = count < BINLOG_READ_RECORDS ? count : BINLOG_READ_RECORDS;
+    if (pread_full(fd, records, (size_t)chunk * BINLOG_RECORD_SIZE, (off_t)(first - 1) * BINLOG_RECORD_SIZE) < 0) {
+      print_error("Error: no se pudo leer mycalc.log.bin\n", 38);
+      close(fd);
+      return -1;
+    }
+    for (i = 0; i < chunk; i++) {
+      if (used + 6 + 20 + 2 + BINLOG_TEXT_MAX > sizeof(out)) {
+        if (write_checked(1, out, (int)used) < 0) {
+          close(fd);
+          return -1;
+        }
+        used = 0;
+      }
+      memcpy(out + used, "Linea ", 6);
+      used += 6;
+      used += (size_t)format_int(first, out + used);
+      memcpy(out + used, ": ", 2);
+      used += 2;
+      len = binlog_render(records + i * BINLOG_RECORD_SIZE, out + used);
+      if (len < 0) {
+        print_error("Error: registro invalido en mycalc.log.bin\n", 43);
+        close(fd);
+        return -1;
+      }
+      used += (size_t)len;
+      first++;
+    }
+    count -= chunk;
+  }
+  close(fd);
+  if (used > 0 && write_checked(1, out, (int)used) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+binlog_open: abre el log binario para añadir registros
+
+Si acaba en un registro a medias (se corto una escritura) lo quitamos,
+para que los siguientes sigan cayendo en multiplos de BINLOG_RECORD_SIZE.
+Devuelve el descriptor, o -1 si no se pudo abrir.
+*/
+int binlog_open(void) {
+  struct stat st;
+  int fd;
+
+  fd = open(BINLOG_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    print_error("Error: no se pudo abrir mycalc.log.bin\n", 39);
+    return -1;
+  }
+  if (fstat(fd, &st) == 0 && st.st_size % BINLOG_RECORD_SIZE != 0) {
+    if (ftruncate(fd, st.st_size - st.st_size % BINLOG_RECORD_SIZE) < 0) {
+      print_error("Error: no se pudo reparar mycalc.log.bin\n", 41);
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/*
+SEGMENTOS DEL LOG
+
+Con --segment-size=<bytes> o --segment-lines=<N>, cuando mycalc.log llega
+a ese tamano o a ese numero de lineas pasa a ser un segmento cerrado y se
+empieza un mycalc.log nuevo. El segmento k se llama mycalc.log.<k> (con
+su propio indice, mycalc.log.<k>.idx) y ya no cambia. En
+mycalc.log.manifest hay un registro de SEGMENT_RECORD_SIZE bytes por
+segmento cerrado, en little endian: el numero de su primera linea, cuantas
+lineas tiene, cuantos bytes ocupa sin comprimir y sus flags.
+
+Asi -b N busca en el manifiesto (busqueda binaria, con un pread por
+paso) el segmento de la linea N y solo abre ese: lo que cuesta no depende
+de lo grande que sea el historial, y si hay que rehacer un indice solo se
+lee un segmento. mycalc.log es siempre el ultimo segmento y empieza
+justo despues del ultimo registro. Un log de antes de los segmentos (sin
+manifiesto) es el segmento 0 y empieza en la linea 1, y asi sigue hasta
+que alguien lo rota con alguna de las dos opciones.
+
+./mycalc --compress comprime los segmentos cerrados que aun no lo estan a
+mycalc.log.<k>.lz (ver lz_compress), en bloques que se descomprimen de uno
+en uno al leerlos.
+
+Los que escriben en mycalc.log lo bloquean (flock) mientras escriben, en
+compartido si no rotan y en exclusivo con --segment-*, y el modo historial
+en compartido mientras lee; rotar un segmento o cambiarlo por su version
+comprimida se hace con mycalc.log bloqueado en exclusivo.
+El log binario no se parte en segmentos: ya encuentra cualquier operacion
+con un solo pread.
+*/
+
+/*
+SegmentLimits: cuando pasa mycalc.log a ser un segmento cerrado (0 es sin limite)
+*/
+typedef struct {
+  uint64_t max_bytes;  /*--segment-size=*/
+  long max_lines;      /*--segment-lines=*/
+} SegmentLimits;
+
+/*
+Segment: el registro de un segmento cerrado en el manifiesto
+*/
+typedef struct {
+  long first_line;  /*numero de su primera linea en todo el historial*/
+  long lines;
+  uint64_t bytes;   /*lo que ocupa sin comprimir*/
+  uint64_t flags;   /*SEGMENT_COMPRESSED*/
+} Segment;
+
+/*
+segment_path: escribe en out el nombre del segmento k, "mycalc.log.<k>" seguido de suffix
+out tiene que tener sitio para SEGMENT_PATH_MAX bytes.
+*/
+void segment_path(char *out, long k, const char *suffix) {
+  int len;
+
+  memcpy(out, "mycalc.log.", 11);
+  len = 11 + format_long(k, out + 11);
+  memcpy(out + len, suffix, (size_t)str_len(suffix) + 1);
+}
+
+/*
+manifest_segments: cuantos segmentos cerrados tiene el manifiesto fd (0 si fd es -1)
+Un registro a medias (se corto su escritura) no cuenta.
+*/
+long manifest_segments(int fd) {
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    return 0;
+  }
+  return (long)(st.st_size / SEGMENT_RECORD_SIZE);
+}
+
+/*
+manifest_read: lee el registro del segmento k
+Devuelve 0 si fue bien, -1 si no se pudo leer.
+*/
+int manifest_read(int fd, long k, Segment *segment) {
+  unsigned char record[SEGMENT_RECORD_SIZE];
+
+  if (pread_full(fd, record, SEGMENT_RECORD_SIZE, (off_t)k * SEGMENT_RECORD_SIZE) < 0) {
+    return -1;
+  }
+  segment->first_line = (long)get_u64(record);
+  segment->lines = (long)get_u64(record + 8);
+  segment->bytes = get_u64(record + 16);
+  segment->flags = get_u64(record + 24);
+  return 0;
+}
+
+/*
+manifest_write: escribe el registro del segmento k y espera a que llegue al disco
+Devuelve 0 si fue bien, -1 si no se pudo escribir.
+*/
+int manifest_write(int fd, long k, const Segment *segment) {
+  unsigned char record[SEGMENT_RECORD_SIZE];
+
+  put_u64(record, (uint64_t)segment->first_line);
+  put_u64(record + 8, (uint64_t)segment->lines);
+  put_u64(record + 16, segment->bytes);
+  put_u64(record + 24, segment->flags);
+  if (pwrite(fd, record, SEGMENT_RECORD_SIZE, (off_t)k * SEGMENT_RECORD_SIZE) != SEGMENT_RECORD_SIZE ||
+      fdatasync(fd) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+manifest_next_line: numero de la primera linea despues de los segmentos cerrados
+(la primera de mycalc.log). Sin segmentos es la 1.
+Devuelve -1 si no se pudo leer el manifiesto.
+*/
+long manifest_next_line(int fd, long segments) {
+  Segment last;
+
+  if (segments == 0) {
+    return 1;
+  }
+  if (manifest_read(fd, segments - 1, &last) < 0) {
+    return -1;
+  }
+  return last.first_line + last.lines;
+}
+
+/*
+manifest_find: busca el segmento cerrado que tiene la linea line
+Es el ultimo cuya primera linea no pasa de line: busqueda binaria sobre
+los registros, que estan ordenados. Deja su registro en *segment.
+Devuelve su numero, o -1 si no se pudo leer el manifiesto.
+*/
+long manifest_find(int fd, long segments, long line, Segment *segment) {
+  long low;
+  long high;
+  long mid;
+
+  low = 0;
+  high = segments - 1;
+  while (low < high) {
+    mid = low + (high - low + 1) / 2;
+    if (manifest_read(fd, mid, segment) < 0) {
+      return -1;
+    }
+    if (segment->first_line <= line) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  if (manifest_read(fd, low, segment) < 0) {
+    return -1;
+  }
+  return low;
+}
+
+/*
+text_line_count: cuenta las lineas de un log de texto (fd, que se pueda leer) con su indice idx_path
+El indice se completa si le faltan lineas; si no se puede usar, las
+contamos recorriendo el fichero.
+Devuelve cuantas lineas tiene, o -1 si no se pudo leer.
+*/
+long text_line_count(int fd, const char *idx_path) {
+  struct stat st;
+  const char *map;
+  uint64_t last_end;
+  long count;
+  int idx_fd;
+
+  if (fstat(fd, &st) < 0) {
+    return -1;
+  }
+  count = -1;
+  last_end = 0;
+  idx_fd = open(idx_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (idx_fd >= 0) {
+    flock(idx_fd, LOCK_EX);
+    count = index_sync(fd, st.st_size, idx_fd, &last_end);
+    close(idx_fd); /*al cerrarlo se suelta el bloqueo*/
+  }
+  if (count >= 0) {
+    return count + (last_end < (uint64_t)st.st_size ? 1 : 0);
+  }
+  if (st.st_size == 0) {
+    return 0;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  count = count_lines(map, (size_t)st.st_size);
+  munmap((void *)map, (size_t)st.st_size);
+  return count;
+}
+
+/*
+log_current: dice si fd sigue siendo el mycalc.log de ahora, y deja en *st como esta
+Otro proceso puede haberlo pasado a segmento cerrado entre nuestro open y el flock.
+*/
+int log_current(int fd, struct stat *st) {
+  struct stat path_st;
+
+  return fstat(fd, st) == 0 && stat("mycalc.log", &path_st) == 0 && st->st_dev == path_st.st_dev &&
+         st->st_ino == path_st.st_ino;
+}
+
+/*
+log_sealed: dice si mycalc.log (con st) es ya el ultimo segmento cerrado
+Pasa si una rotacion se corto despues de apuntar el segmento en el
+manifiesto y antes de quitar mycalc.log: los dos nombres son el mismo
+fichero, asi que solo hay que mirarlo si tiene mas de un nombre.
+*/
+int log_sealed(const struct stat *st) {
+  char path[SEGMENT_PATH_MAX];
+  struct stat segment_st;
+  long segments;
+  int fd;
+
+  if (st->st_nlink < 2) {
+    return 0;
+  }
+  fd = open(SEGMENT_MANIFEST, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  segments = manifest_segments(fd);
+  close(fd);
+  if (segments == 0) {
+    return 0;
+  }
+  segment_path(path, segments - 1, "");
+  return stat(path, &segment_st) == 0 && segment_st.st_dev == st->st_dev && segment_st.st_ino == st->st_ino;
+}
+
+/*
+log_full: dice si hay que pasar mycalc.log (con st) a segmento cerrado antes de escribir en el
+need es lo que ocupa la siguiente linea que vamos a escribir: si ya no
+cabe, el segmento esta lleno. Si no, y room no es NULL, deja en room lo
+que aun cabe hasta cada limite (0 si ese no tiene limite). Las lineas solo
+las contamos si hay limite de lineas (con el indice al dia es un pread).
+*/
+int log_full(const struct stat *st, const SegmentLimits *limits, uint64_t need, SegmentLimits *room) {
+  long lines;
+  int fd;
+
+  lines = 0;
+  if (st->st_size > 0) {
+    if (log_sealed(st) || (limits->max_bytes > 0 && (uint64_t)st->st_size + need > limits->max_bytes)) {
+      return 1;
+    }
+    if (limits->max_lines > 0) {
+      fd = open("mycalc.log", O_RDONLY);
+      lines = fd >= 0 ? text_line_count(fd, INDEX_FILE) : -1;
+      if (fd >= 0) {
+        close(fd);
+      }
+      if (lines >= limits->max_lines) {
+        return 1;
+      }
+      if (lines < 0) {
+        lines = 0; /*sin poder contarlas no partimos lo que se escribe*/
+      }
+    }
+  }
+  if (room != NULL) {
+    room->max_bytes = limits->max_bytes > 0 ? limits->max_bytes - (uint64_t)st->st_size : 0;
+    room->max_lines = limits->max_lines > 0 ? limits->max_lines - lines : 0;
+  }
+  return 0;
+}
+
+/*
+log_rotate: pasa mycalc.log (con st) a ser el siguiente segmento cerrado
+
+Se llama con mycalc.log bloqueado en exclusivo, asi que nadie escribe ni
+lee en el mientras tanto. Contamos sus lineas (completando el indice), le
+damos su nombre de segmento con link (rename es de stdio.h), lo apuntamos
+en el manifiesto y solo entonces quitamos mycalc.log y su indice: el
+siguiente que escriba empieza un mycalc.log nuevo. Si se corta antes de
+apuntarlo no ha cambiado nada (el segmento a medio crear se borra en la
+siguiente rotacion); si se corta despues, la termina el siguiente que
+escriba (ver log_sealed).
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int log_rotate(const struct stat *st) {
+  char path[SEGMENT_PATH_MAX];
+  char idx_path[SEGMENT_PATH_MAX];
+  Segment segment;
+  long segments;
+  int manifest_fd;
+  int fd;
+
+  if (log_sealed(st)) {
+    unlink(INDEX_FILE);
+    return unlink("mycalc.log");
+  }
+  fd = open("mycalc.log", O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  segment.lines = text_line_count(fd, INDEX_FILE);
+  close(fd);
+  manifest_fd = open(SEGMENT_MANIFEST, O_RDWR | O_CREAT, 0644);
+  if (segment.lines < 0 || manifest_fd < 0) {
+    if (manifest_fd >= 0) {
+      close(manifest_fd);
+    }
+    return -1;
+  }
+  segments = manifest_segments(manifest_fd);
+  segment.first_line = manifest_next_line(manifest_fd, segments);
+  segment.bytes = (uint64_t)st->st_size;
+  segment.flags = 0;
+  segment_path(path, segments, "");
+  segment_path(idx_path, segments, ".idx");
+  unlink(path);
+  unlink(idx_path);
+  if (segment.first_line < 0 || link("mycalc.log", path) < 0) {
+    close(manifest_fd);
+    return -1;
+  }
+  /*el indice ya esta completo; si no se puede enlazar, el modo historial lo rehace*/
+  if (link(INDEX_FILE, idx_path) < 0) {
+    unlink(idx_path);
+  }
+  if (manifest_write(manifest_fd, segments, &segment) < 0) {
+    unlink(path);
+    unlink(idx_path);
+    close(manifest_fd);
+    return -1;
+  }
+  close(manifest_fd);
+  unlink(INDEX_FILE);
+  unlink("mycalc.log");
+  return 0;
+}
+
+/*
+log_lock: bloquea mycalc.log (*fd, abierto para leer y añadir) antes de escribir en el
+
+Sin limites lo bloqueamos en compartido, asi que pueden escribir varios a
+la vez. Con --segment-* lo bloqueamos en exclusivo: lo que cabe aun en el
+segmento solo es exacto si nadie mas escribe mientras tanto. Despues
+comprobamos que *fd sigue siendo mycalc.log: si otro proceso lo ha rotado
+mientras esperabamos, lo volvemos a abrir. Si ha llegado a los limites de
+limits lo rotamos nosotros, con el bloqueo en exclusivo, antes de escribir
+need bytes (la primera linea que se va a escribir). Si room no es NULL
+deja en el lo que cabe aun en el log (ver log_full): quien escribe varias
+lineas de una vez las parte ahi para no pasarse del limite. El bloqueo se
+suelta con flock(LOCK_UN) o al cerrar *fd.
+Devuelve 1 si *fd es ahora otro fichero (un mycalc.log nuevo), 0 si es el
+mismo y -1 si hubo algun error; entonces cierra *fd y lo deja en -1.
+*/
+int log_lock(int *fd, const SegmentLimits *limits, uint64_t need, SegmentLimits *room) {
+  struct stat st;
+  int reopened;
+  int lock;
+  int full;
+
+  reopened = 0;
+  lock = limits->max_bytes > 0 || limits->max_lines > 0 ? LOCK_EX : LOCK_SH;
+  while (1) {
+    if (flock(*fd, lock) < 0) {
+      break;
+    }
+    if (log_current(*fd, &st)) {
+      if (!log_full(&st, limits, need, room)) {
+        return reopened;
+      }
+      full = 1;
+      if (lock == LOCK_SH) {
+        /*al pasar a exclusivo se suelta el compartido: otro puede haberlo rotado ya*/
+        if (flock(*fd, LOCK_EX) < 0) {
+          break;
+        }
+        full = log_current(*fd, &st) && log_full(&st, limits, need, NULL);
+      }
+      if (full && log_rotate(&st) < 0) {
+        print_error("Error: no se pudo cerrar el segmento de mycalc.log\n", 51);
+        break;
+      }
+    }
+    close(*fd);
+    *fd = open("mycalc.log", O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (*fd < 0) {
+      print_error("Error: no se pudo abrir mycalc.log\n", 35);
+      return -1;
+    }
+    reopened = 1;
+  }
+  close(*fd);
+  *fd = -1;
+  return -1;
+}
+
+/*
+lz_put_varint: escribe value en 7 bits por byte, los de menos peso primero
+(el bit alto dice si sigue otro byte). Devuelve cuantos bytes ha escrito.
+*/
+size_t lz_put_varint(unsigned char *out, size_t value) {
+  size_t len;
+
+  len = 0;
+  while (value >= 0x80) {
+    out[len++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (unsigned char)value;
+  return len;
+}
+
+/*
+lz_get_varint: lee en *pos un numero escrito con lz_put_varint (de como mucho 3 bytes)
+Devuelve el numero, o -1 si se sale de los n bytes de src.
+*/
+long lz_get_varint(const unsigned char *src, size_t n, size_t *pos) {
+  long value;
+  int shift;
+
+  value = 0;
+  for (shift = 0; shift < 21; shift += 7) {
+    if (*pos >= n) {
+      return -1;
+    }
+    value |= (long)(src[*pos] & 0x7f) << shift;
+    if ((src[(*pos)++] & 0x80) == 0) {
+      return value;
+    }
+  }
+  return -1;
+}
+
+/*
+lz_compress: comprime un bloque de n bytes (n <= LZ_BLOCK) en out, que tiene sitio para LZ_BOUND
+
+Es un LZ77 sencillo, del estilo de LZ4. El bloque se escribe como una
+serie de [literales][repeticion]: literales es cuantos bytes van tal cual
+(varint) y esos bytes, y repeticion es su longitud - LZ_MIN_MATCH + 1
+(varint; 0 es el final del bloque) y cuantos bytes hacia atras esta lo que
+se repite (2 bytes, por eso los bloques no pasan de 64 KiB). Para encontrar
+repeticiones apuntamos en una tabla hash, por cada LZ_MIN_MATCH bytes,
+la ultima posicion donde los hemos visto. Las lineas del log se parecen
+mucho entre si ("Operación: ", " = ", los numeros de las anteriores), asi
+que casi todo acaban siendo repeticiones.
+Devuelve cuantos bytes ha escrito.
+*/
+size_t lz_compress(const unsigned char *src, size_t n, unsigned char *out) {
+  int table[1 << LZ_HASH_BITS];
+  uint32_t word;
+  uint32_t hash;
+  size_t anchor;
+  size_t used;
+  size_t len;
+  size_t dist;
+  size_t i;
+  int candidate;
+
+  for (i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+    table[i] = -1;
+  }
+  anchor = 0;
+  used = 0;
+  i = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    memcpy(&word, src + i, sizeof(word));
+    hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+    candidate = table[hash];
+    table[hash] = (int)i;
+    if (candidate < 0 || memcmp(src + candidate, src + i, LZ_MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+    len = LZ_MIN_MATCH;
+    while (i + len < n && src[(size_t)candidate + len] == src[i + len]) {
+      len++;
+    }
+    dist = i - (size_t)candidate;
+    used += lz_put_varint(out + used, i - anchor);
+    memcpy(out + used, src + anchor, i - anchor);
+    used += i - anchor;
+    used += lz_put_varint(out + used, len - LZ_MIN_MATCH + 1);
+    out[used++] = (unsigned char)dist;
+    out[used++] = (unsigned char)(dist >> 8);
+    i += len;
+    anchor = i;
+  }
+  used += lz_put_varint(out + used, n - anchor);
+  memcpy(out + used, src + anchor, n - anchor);
+  used += n - anchor;
+  out[used++] = 0;
+  return used;
+}
+
+/*
+lz_decompress: descomprime un bloque de lz_compress (src, n bytes) en out, con sitio para cap bytes
+Comprobamos cada longitud y distancia, asi un bloque estropeado da error y
+no escribe fuera de out.
+Devuelve cuantos bytes ha escrito, o -1 si el bloque no es valido.
+*/
+long lz_decompress(const unsigned char *src, size_t n, unsigned char *out, size_t cap) {
+  size_t pos;
+  size_t used;
+  size_t len;
+  size_t dist;
+  size_t i;
+  long value;
+
+  pos = 0;
+  used = 0;
+  while (1) {
+    value = lz_get_varint(src, n, &pos);
+    if (value < 0 || (size_t)value > n - pos || (size_t)value > cap - used) {
+      return -1;
+    }
+    memcpy(out + used, src + pos, (size_t)value);
+    pos += (size_t)value;
+    used += (size_t)value;
+    value = lz_get_varint(src, n, &pos);
+    if (value <= 0) {
+      return value == 0 && pos == n ? (long)used : -1;
+    }
+    len = (size_t)value + LZ_MIN_MATCH - 1;
+    if (n - pos < 2) {
+      return -1;
+    }
+    dist = (size_t)src[pos] | (size_t)src[pos + 1] << 8;
+    pos += 2;
+    if (dist == 0 || dist > used || len > cap - used) {
+      return -1;
+    }
+    /*byte a byte: lo que se repite puede solaparse con lo que estamos escribiendo*/
+    for (i = 0; i < len; i++) {
+      out[used + i] = out[used + i - dist];
+    }
+    used += len;
+  }
+}
+
+/*
+lz_compress_segment: comprime el segmento de texto in_fd en out_fd
+
+Leemos el segmento en bloques de hasta LZ_BLOCK bytes cortados justo
+despues de un '\n', para que cada linea este entera en un bloque, y cada
+uno sale con una cabecera de LZ_HEADER_SIZE bytes: cuantas lineas tiene,
+cuantos bytes ocupa sin comprimir y cuantos comprimido.
+Devuelve cuantos bytes ha escrito, o -1 si hubo algun error (o una linea
+no cabe en un bloque).
+*/
+long lz_compress_segment(int in_fd, int out_fd) {
+  unsigned char *raw;
+  unsigned char *block;
+  const unsigned char *p;
+  const unsigned char *nl;
+  size_t have;
+  size_t len;
+  size_t comp_len;
+  ssize_t nread;
+  uint32_t lines;
+  long total;
+  int end_of_file;
+
+  raw = malloc(LZ_BLOCK);
+  block = malloc(LZ_HEADER_SIZE + LZ_BOUND);
+  if (raw == NULL || block == NULL) {
+    free(raw);
+    free(block);
+    return -1;
+  }
+  total = 0;
+  have = 0;
+  end_of_file = 0;
+  while (total >= 0) {
+    while (!end_of_file && have < LZ_BLOCK) {
+      nread = read(in_fd, raw + have, LZ_BLOCK - have);
+      if (nread < 0) {
+        total = -1;
+        break;
+      }
+      end_of_file = nread == 0;
+      have += (size_t)nread;
+    }
+    if (total < 0 || have == 0) {
+      break;
+    }
+    /*el bloque acaba en su ultimo '\n', salvo el ultimo del segmento*/
+    len = have;
+    if (!end_of_file) {
+      nl = memrchr(raw, '\n', have);
+      if (nl == NULL) {
+        total = -1;
+        break;
+      }
+      len = (size_t)(nl - raw) + 1;
+    }
+    lines = 0;
+    if (raw[len - 1] != '\n') {
+      lines = 1;
+    }
+    for (p = raw; (nl = memchr(p, '\n', len - (size_t)(p - raw))) != NULL; p = nl + 1) {
+      lines++;
+    }
+    comp_len = lz_compress(raw, len, block + LZ_HEADER_SIZE);
+    put_u32(block, lines);
+    put_u32(block + 4, (uint32_t)len);
+    put_u32(block + 8, (uint32_t)comp_len);
+    if (write_checked(out_fd, (const char *)block, (int)(LZ_HEADER_SIZE + comp_len)) < 0) {
+      total = -1;
+      break;
+    }
+    total += (long)(LZ_HEADER_SIZE + comp_len);
+    memmove(raw, raw + len, have - len);
+    have -= len;
+  }
+  free(raw);
+  free(block);
+  return total;
+}
+
+/*
+lz_lines: escribe las lineas first..last de un segmento comprimido (fd), numeradas desde base + first
+
+Los bloques van uno detras de otro: de los que hay antes del que tiene la
+linea first solo leemos la cabecera, y descomprimimos de uno en uno los
+que tienen lineas del rango, asi que nunca hay en memoria mas que un
+bloque.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int lz_lines(int fd, int base, int first, int last) {
+  unsigned char header[LZ_HEADER_SIZE];
+  unsigned char *block;
+  unsigned char *raw;
+  const unsigned char *nl;
+  uint32_t lines;
+  uint32_t raw_len;
+  uint32_t comp_len;
+  size_t start;
+  off_t pos;
+  long line;
+  long count;
+  int status;
+
+  block = malloc(LZ_BOUND);
+  raw = malloc(LZ_BLOCK);
+  if (block == NULL || raw == NULL) {
+    print_error("Error: memoria insuficiente\n", 28);
+    free(block);
+    free(raw);
+    return -1;
+  }
+  status = 0;
+  pos = 0;
+  line = 1; /*la primera linea del bloque que toca*/
+  while (status == 0 && first <= last && pread_full(fd, header, LZ_HEADER_SIZE, pos) == 0) {
+    lines = get_u32(header);
+    raw_len = get_u32(header + 4);
+    comp_len = get_u32(header + 8);
+    if (line + lines > first) {
+      if (raw_len > LZ_BLOCK || comp_len > LZ_BOUND ||
+          pread_full(fd, block, comp_len, pos + LZ_HEADER_SIZE) < 0 ||
+          lz_decompress(block, comp_len, raw, raw_len) != (long)raw_len) {
+        print_error("Error: segmento comprimido de mycalc.log danado\n", 48);
+        status = -1;
+        break;
+      }
+      start = 0;
+      for (count = first - line; count > 0 && start < raw_len; count--) {
+        nl = memchr(raw + start, '\n', raw_len - start);
+        start = nl != NULL ? (size_t)(nl - raw) + 1 : raw_len;
+      }
+      count = (last < line + lines - 1 ? last : line + lines - 1) - first + 1;
+      status = print_lines((const char *)raw, raw_len, start, base + first, count);
+      first += (int)count;
+    }
+    line += lines;
+    pos += LZ_HEADER_SIZE + (off_t)comp_len;
+  }
+  if (status == 0 && first <= last) {
+    print_error("Error: El numero de linea no es valido\n", 39);
+    status = -1;
+  }
+  free(block);
+  free(raw);
+  return status;
+}
+
+/*
+log_exclusive: abre mycalc.log (lo crea si no esta) y lo bloquea en exclusivo
+Deja en *st como esta. Devuelve el descriptor, o -1 si no se pudo.
+*/
+int log_exclusive(struct stat *st) {
+  int fd;
+
+  while (1) {
+    fd = open("mycalc.log", O_RDONLY | O_CREAT, 0644);
+    if (fd < 0) {
+      return -1;
+    }
+    if (flock(fd, LOCK_EX) < 0) {
+      close(fd);
+      return -1;
+    }
+    if (log_current(fd, st)) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+/*
+log_compress: comprime los segmentos cerrados que aun no lo estan (./mycalc --compress)
+
+Cada segmento se comprime en mycalc.log.<k>.lz.tmp sin bloquear nada: un
+segmento cerrado ya no cambia. Para cambiarlo por el de texto bloqueamos
+mycalc.log en exclusivo, como al rotar, asi ningun modo historial lo esta
+leyendo cuando desaparece: ponemos el .lz en su sitio, lo marcamos en el
+manifiesto y borramos el de texto y su indice. Si algo falla a medias, el
+segmento sigue como estaba. El manifiesto lo bloqueamos mientras tanto
+para que no haya dos --compress a la vez.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int log_compress(void) {
+  char path[SEGMENT_PATH_MAX];
+  char lz_path[SEGMENT_PATH_MAX];
+  char tmp_path[SEGMENT_PATH_MAX];
+  char text[NUMTEXT_LONG_MAX];
+  struct stat st;
+  struct stat log_st;
+  Segment segment;
+  long segments;
+  long comp_size;
+  long k;
+  int manifest_fd;
+  int in_fd;
+  int out_fd;
+  int log_fd;
+  int compressed;
+  int status;
+  int len;
+
+  manifest_fd = open(SEGMENT_MANIFEST, O_RDWR);
+  if (manifest_fd < 0 && errno == ENOENT) {
+    return write_checked(1, "mycalc.log no tiene segmentos cerrados\n", 39);
+  }
+  if (manifest_fd < 0 || flock(manifest_fd, LOCK_EX) < 0) {
+    print_error("Error: no se pudo abrir mycalc.log.manifest\n", 44);
+    if (manifest_fd >= 0) {
+      close(manifest_fd);
+    }
+    return -1;
+  }
+  segments = manifest_segments(manifest_fd);
+  status = 0;
+  compressed = 0;
+  for (k = 0; k < segments; k++) {
+    segment_path(path, k, "");
+    segment_path(lz_path, k, ".lz");
+    segment_path(tmp_path, k, ".lz.tmp");
+    if (manifest_read(manifest_fd, k, &segment) < 0) {
+      status = -1;
+      break;
+    }
+    if ((segment.flags & SEGMENT_COMPRESSED) != 0) {
+      continue;
+    }
+    in_fd = open(path, O_RDONLY);
+    out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    comp_size = in_fd >= 0 && out_fd >= 0 ? lz_compress_segment(in_fd, out_fd) : -1;
+    if (in_fd >= 0) {
+      close(in_fd);
+    }
+    if (out_fd >= 0 && (close(out_fd) < 0 || comp_size < 0)) {
+      comp_size = -1;
+    }
+    if (comp_size < 0) {
+      unlink(tmp_path);
+      status = -1;
+      break;
+    }
+
+    log_fd = log_exclusive(&log_st);
+    if (log_fd < 0 || stat(path, &st) < 0) {
+      status = -1;
+    } else if (st.st_dev != log_st.st_dev || st.st_ino != log_st.st_ino) {
+      /*si son el mismo fichero, la rotacion se corto: lo dejamos para la proxima vez*/
+      segment.flags |= SEGMENT_COMPRESSED;
+      unlink(lz_path);
+      if (link(tmp_path, lz_path) < 0 || manifest_write(manifest_fd, k, &segment) < 0) {
+        unlink(lz_path);
+        status = -1;
+      } else {
+        unlink(path);
+        segment_path(path, k, ".idx");
+        unlink(path);
+        compressed++;
+        len = format_long(k, text);
+        if (write_checked(1, "Segmento ", 9) < 0 || write_checked(1, text, len) < 0 ||
+            write_checked(1, ": ", 2) < 0) {
+          status = -1;
+        }
+        len = format_long((long)segment.bytes, text);
+        if (status == 0 && (write_checked(1, text, len) < 0 || write_checked(1, " -> ", 4) < 0)) {
+          status = -1;
+        }
+        len = format_long(comp_size, text);
+        if (status == 0 && (write_checked(1, text, len) < 0 || write_checked(1, " bytes\n", 7) < 0)) {
+          status = -1;
+        }
+      }
+    }
+    if (log_fd >= 0) {
+      close(log_fd);
+    }
+    unlink(tmp_path);
+    if (status < 0) {
+      break;
+    }
+  }
+  close(manifest_fd);
+  if (status < 0) {
+    print_error("Error: no se pudo comprimir el segmento ", 40);
+    len = format_long(k, text);
+    print_error(text, len);
+    print_error(" de mycalc.log\n", 15);
+    return -1;
+  }
+  len = format_int(compressed, text);
+  if (write_checked(1, "Comprimidos ", 12) < 0 || write_checked(1, text, len) < 0 ||
+      write_checked(1, " segmentos\n", 11) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+LogView: el log de texto tal como lo ve el modo historial
+*/
+typedef struct {
+  int fd;           /*mycalc.log bloqueado en compartido, o -1 si no hay*/
+  int manifest_fd;  /*-1 si el log no tiene segmentos*/
+  long segments;    /*segmentos cerrados*/
+  long first_line;  /*numero de la primera linea de mycalc.log*/
+} LogView;
+
+/*
+log_view_close: suelta mycalc.log y cierra el manifiesto
+*/
+void log_view_close(LogView *view) {
+  if (view->fd >= 0) {
+    close(view->fd);
+  }
+  if (view->manifest_fd >= 0) {
+    close(view->manifest_fd);
+  }
+}
+
+/*
+log_view_open: abre mycalc.log y el manifiesto para leer el historial
+
+mycalc.log se queda bloqueado en compartido mientras leemos: asi nadie lo
+rota ni cambia un segmento por su version comprimida hasta que
+terminemos, y lo que dice el manifiesto cuadra con los ficheros. Si ya hay
+segmentos, mycalc.log puede no existir (nadie ha escrito desde la ultima
+rotacion) y entonces no tiene lineas.
+Devuelve 0 si fue bien, -1 si no hay historial que leer.
+*/
+int log_view_open(LogView *view) {
+  struct stat st;
+
+  while (1) {
+    view->fd = open("mycalc.log", O_RDONLY);
+    if (view->fd < 0) {
+      break;
+    }
+    flock(view->fd, LOCK_SH);
+    if (log_current(view->fd, &st)) {
+      break;
+    }
+    close(view->fd);
+  }
+  view->manifest_fd = open(SEGMENT_MANIFEST, O_RDONLY);
+  view->segments = manifest_segments(view->manifest_fd);
+  view->first_line = manifest_next_line(view->manifest_fd, view->segments);
+  if (view->fd >= 0 && st.st_nlink > 1 && log_sealed(&st)) {
+    /*una rotacion cortada: mycalc.log ya es el ultimo segmento y el de ahora esta vacio*/
+    close(view->fd);
+    view->fd = -1;
+  }
+  if (view->fd < 0 && view->segments == 0) {
+    print_error("Error: no se pudo abrir mycalc.log\n", 35);
+    log_view_close(view);
+    return -1;
+  }
+  if (view->first_line < 0) {
+    print_error("Error: no se pudo leer mycalc.log.manifest\n", 43);
+    log_view_close(view);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+text_line: escribe la linea line_number de un log de texto (fd) con su indice idx_path
+Es lo que hacia siempre -b N con mycalc.log: con el indice si se puede
+abrir y, si no, recorriendo el log. Sale numerada como base + line_number.
+*/
+int text_line(int fd, const char *idx_path, int line_number, int base) {
+  int idx_fd;
+  int status;
+
+  if (fd < 0) {
+    print_error("Error: El numero de linea no es valido\n", 39);
+    return -1;
+  }
+  /*el indice lo podemos tener que completar, asi que lo abrimos tambien para escribir*/
+  idx_fd = open(idx_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (idx_fd < 0) {
+    return print_line_scan(fd, line_number, base);
+  }
+  status = print_line_indexed(fd, idx_fd, line_number, base);
+  close(idx_fd);
+  return status;
+}
+
+/*
+segment_lines: escribe las lineas first..last (numeros de todo el historial) del segmento cerrado k
+Un segmento comprimido se lee con lz_lines; uno de texto como mycalc.log, con su propio indice.
+*/
+int segment_lines(long k, const Segment *segment, int first, int last) {
+  char path[SEGMENT_PATH_MAX];
+  char idx_path[SEGMENT_PATH_MAX];
+  int base;
+  int fd;
+  int status;
+
+  base = (int)(segment->first_line - 1);
+  segment_path(path, k, (segment->flags & SEGMENT_COMPRESSED) != 0 ? ".lz" : "");
+  segment_path(idx_path, k, ".idx");
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    print_error("Error: no se pudo abrir un segmento de mycalc.log\n", 50);
+    return -1;
+  }
+  if ((segment->flags & SEGMENT_COMPRESSED) != 0) {
+    status = lz_lines(fd, base, first - base, last - base);
+  } else if (first == last) {
+    status = text_line(fd, idx_path, first - base, base);
+  } else {
+    status = text_lines(fd, idx_path, base, first - base, last - base, 0);
+  }
+  close(fd);
+  return status;
+}
+
+/*
+history_line: escribe la linea line_number del historial (-b N)
+Si esta en mycalc.log es lo de siempre; si no, buscamos su segmento en el
+manifiesto y solo abrimos ese.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int history_line(int line_number) {
+  LogView view;
+  Segment segment;
+  long k;
+  int status;
+
+  if (log_view_open(&view) < 0) {
+    return -1;
+  }
+  if (line_number >= view.first_line) {
+    status = text_line(view.fd, INDEX_FILE, line_number - (int)(view.first_line - 1), (int)(view.first_line - 1));
+  } else {
+    k = manifest_find(view.manifest_fd, view.segments, line_number, &segment);
+    if (k < 0) {
+      print_error("Error: no se pudo leer mycalc.log.manifest\n", 43);
+      status = -1;
+    } else {
+      status = segment_lines(k, &segment, line_number, line_number);
+    }
+  }
+  log_view_close(&view);
+  return status;
+}
+
+/*
+history_range: escribe las lineas first..last (first <= last <= total) de un log con segmentos
+Empieza en el segmento de first (lo buscamos en el manifiesto) y sigue por
+los siguientes, y por mycalc.log, mientras quede rango.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int history_range(LogView *view, int first, int last) {
+  Segment segment;
+  long upto;
+  long k;
+  int base;
+  int status;
+
+  base = (int)(view->first_line - 1);
+  status = 0;
+  if (first <= base) {
+    k = manifest_find(view->manifest_fd, view->segments, first, &segment);
+    while (status == 0 && first <= last && first <= base) {
+      if (k < 0 || manifest_read(view->manifest_fd, k, &segment) < 0) {
+        print_error("Error: no se pudo leer mycalc.log.manifest\n", 43);
+        return -1;
+      }
+      upto = segment.first_line + segment.lines - 1;
+      if (upto > last) {
+        upto = last;
+      }
+      status = segment_lines(k, &segment, first, (int)upto);
+      first = (int)upto + 1;
+      k++;
+    }
+  }
+  if (status == 0 && first <= last) {
+    status = text_lines(view->fd, INDEX_FILE, base, first - base, last - base, 0);
+  }
+  return status;
+}
+
+/*
+history_lines: escribe un rango de lineas del historial o las ultimas tail
+
+Sin segmentos es text_lines sobre mycalc.log. Con segmentos contamos las
+lineas de mycalc.log para saber cuantas hay en total: las ultimas tail, si
+caben en mycalc.log, se buscan hacia atras como siempre y si no, igual que
+un rango, con history_range.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int history_lines(int first, int last, int tail) {
+  LogView view;
+  long active;
+  long total;
+  int status;
+
+  if (log_view_open(&view) < 0) {
+    return -1;
+  }
+  if (view.segments == 0) {
+    status = text_lines(view.fd, INDEX_FILE, 0, first, last, tail);
+    log_view_close(&view);
+    return status;
+  }
+  active = view.fd >= 0 ? text_line_count(view.fd, INDEX_FILE) : 0;
+  total = view.first_line - 1 + active;
+  if (active < 0) {
+    print_error("Error: no se pudo leer mycalc.log\n", 34);
+    status = -1;
+  } else if (tail > 0 && tail <= active) {
+    status = text_lines(view.fd, INDEX_FILE, (int)(view.first_line - 1), 0, 0, tail);
+  } else {
+    if (tail > 0) {
+      first = tail < total ? (int)(total - tail + 1) : 1;
+      last = (int)total;
+    }
+    if (first > total) {
+      print_error("Error: El numero de linea no es valido\n", 39);
+      status = -1;
+    } else {
+      status = history_range(&view, first, last < total ? last : (int)total);
+    }
+  }
+  log_view_close(&view);
+  return status;
+}
+
+/*
+compute_result: realiza la operación entre dos numeros y devuelve el resultado.
+
+Usamomos long para el resultado intermedio para detectar posibles overflow.
+
+Aceptamos tanto '*' como 'x' para la multiplicacion, aunque la practica pide 'x', es comodo tener los dos.
+
+Codigos de retorno:
+  0: operacion exitosa, el resultado se guarda en *out
+  -1: operador invalido
+  -2: division por cero
+  -3: overflow en la operacion
+*/
+int compute_result(int a, int b, char op, int *out) {
+  long tmp;
+
+  if (op == '+') {
+    tmp = (long)a + (long)b;
+  } else if (op == '-') {
+    tmp = (long)a - (long)b;
+  } else if (op == '*' || op == 'x') {
+    tmp = (long)a * (long)b;
+  } else if (op == '/') {
+    if (b == 0) {
+      return -2; /*No se puede dividir entre cero*/
+    }
+    if (a == INT_MIN && b == -1) {
+      return -3; /* caso que desbordaria*/
+    }
+    tmp = a / b;
+  } else {
+    return -1; /*operador invalido*/
+  }
+/*verificamos que el resultado no desborde los limites de int*/
+  if (tmp < INT_MIN || tmp > INT_MAX) {
+    return -3;
+  }
+
+  *out = (int)tmp;
+  return 0;
+}
+
+/*
+KERNELS POR COLUMNAS
+
+En el modo por lotes no calculamos las operaciones una a una: las juntamos
+por operador en columnas (todos los num1 en a, todos los num2 en b) y cada
+columna de sumas, restas o multiplicaciones se calcula de 4 en 4 (SSE4.1) o
+de 8 en 8 (AVX2) con enteros de 32 bits, marcando en cada carril si el
+resultado no cabe en un int. Las divisiones, y lo que sobra al final de
+cada columna, van por compute_result. El codigo de cada operacion es el
+mismo que devolveria compute_result (0 o -3), asi que el resultado es
+identico al de calcularlas una a una.
+*/
+
+/*
+ColumnKernel: calcula las n operaciones op de las columnas a y b
+Deja el resultado de cada una en result y su codigo de compute_result en status.
+*/
+typedef void (*ColumnKernel)(char op, const int *a, const int *b, int *result, int *status, int n);
+
+/*
+column_scalar: kernel sin SIMD, operacion a operacion con compute_result
+*/
+void column_scalar(char op, const int *a, const int *b, int *result, int *status, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    status[i] = compute_result(a[i], b[i], op, &result[i]);
+  }
+}
+
+#ifdef COLUMN_SIMD
+/*
+column_sse4: kernel de 4 carriles con SSE4.1
+
+Sumas y restas se desbordan si el signo del resultado no cuadra con el de
+los operandos. En la multiplicacion calculamos tambien el producto entero
+de 64 bits (los carriles pares y los impares por separado, _mm_mul_epi32
+solo mira los pares) y hay desbordamiento si su mitad alta no es la
+extension de signo de la baja.
+*/
+__attribute__((target("sse4.1"))) void column_sse4(char op, const int *a, const int *b, int *result, int *status,
+                                                    int n) {
+  const __m128i overflow_code = _mm_set1_epi32(-3);
+  const __m128i all_ones = _mm_set1_epi32(-1);
+  __m128i va;
+  __m128i vb;
+  __m128i vr;
+  __m128i overflow;
+  __m128i even;
+  __m128i odd;
+  __m128i high;
+  int i;
+
+  i = 0;
+  while (op != '/' && i + 4 <= n) {
+    va = _mm_loadu_si128((const __m128i *)(a + i));
+    vb = _mm_loadu_si128((const __m128i *)(b + i));
+    if (op == '+') {
+      vr = _mm_add_epi32(va, vb);
+      overflow = _mm_srai_epi32(_mm_and_si128(_mm_xor_si128(va, vr), _mm_xor_si128(vb, vr)), 31);
+    } else if (op == '-') {
+      vr = _mm_sub_epi32(va, vb);
+      overflow = _mm_srai_epi32(_mm_and_si128(_mm_xor_si128(va, vb), _mm_xor_si128(va, vr)), 31);
+    } else {
+      vr = _mm_mullo_epi32(va, vb);
+      even = _mm_mul_epi32(va, vb);
+      odd = _mm_mul_epi32(_mm_srli_epi64(va, 32), _mm_srli_epi64(vb, 32));
+      high = _mm_blend_epi16(_mm_srli_epi64(even, 32), odd, 0xCC);
+      overflow = _mm_xor_si128(_mm_cmpeq_epi32(high, _mm_srai_epi32(vr, 31)), all_ones);
+    }
+    _mm_storeu_si128((__m128i *)(result + i), vr);
+    _mm_storeu_si128((__m128i *)(status + i), _mm_and_si128(overflow, overflow_code));
+    i += 4;
+  }
+  column_scalar(op, a + i, b + i, result + i, status + i, n - i);
+}
+
+/*
+column_avx2: el mismo kernel que column_sse4 con 8 carriles (AVX2)
+*/
+__attribute__((target("avx2"))) void column_avx2(char op, const int *a, const int *b, int *result, int *status,
+                                                  int n) {
+  const __m256i overflow_code = _mm256_set1_epi32(-3);
+  const __m256i all_ones = _mm256_set1_epi32(-1);
+  __m256i va;
+  __m256i vb;
+  __m256i vr;
+  __m256i overflow;
+  __m256i even;
+  __m256i odd;
+  __m256i high;
+  int i;
+
+  i = 0;
+  while (op != '/' && i + 8 <= n) {
+    va = _mm256_loadu_si256((const __m256i *)(a + i));
+    vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    if (op == '+') {
+      vr = _mm256_add_epi32(va, vb);
+      overflow = _mm256_srai_epi32(_mm256_and_si256(_mm256_xor_si256(va, vr), _mm256_xor_si256(vb, vr)), 31);
+    } else if (op == '-') {
+      vr = _mm256_sub_epi32(va, vb);
+      overflow = _mm256_srai_epi32(_mm256_and_si256(_mm256_xor_si256(va, vb), _mm256_xor_si256(va, vr)), 31);
+    } else {
+      vr = _mm256_mullo_epi32(va, vb);
+      even = _mm256_mul_epi32(va, vb);
+      odd = _mm256_mul_epi32(_mm256_srli_epi64(va, 32), _mm256_srli_epi64(vb, 32));
+      high = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+      overflow = _mm256_xor_si256(_mm256_cmpeq_epi32(high, _mm256_srai_epi32(vr, 31)), all_ones);
+    }
+    _mm256_storeu_si256((__m256i *)(result + i), vr);
+    _mm256_storeu_si256((__m256i *)(status + i), _mm256_and_si256(overflow, overflow_code));
+    i += 8;
+  }
+  column_scalar(op, a + i, b + i, result + i, status + i, n - i);
+}
+#endif
+
+/*
+column_kernel_select: elige el kernel de las columnas segun lo que tenga la CPU
+
+Con la variable de entorno MYCALC_SIMD=scalar|sse4|avx2 se fuerza uno (si
+la CPU no lo tiene se usa el escalar), para medirlos y compararlos.
+Devuelve el kernel.
+*/
+ColumnKernel column_kernel_select(void) {
+  const char *forced;
+
+  forced = getenv("MYCALC_SIMD");
+  if (forced != NULL && strcmp(forced, "scalar") == 0) {
+    return column_scalar;
+  }
+#ifdef COLUMN_SIMD
+  __builtin_cpu_init();
+  if ((forced == NULL || strcmp(forced, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+    return column_avx2;
+  }
+  if ((forced == NULL || strcmp(forced, "sse4") == 0) && __builtin_cpu_supports("sse4.1")) {
+    return column_sse4;
+  }
+#endif
+  return column_scalar;
+}
+
+/*
+Batch: estado del modo por lotes (./mycalc -f <fichero> o ./mycalc -)
+
+En out juntamos las lineas "Operación: ..." ya calculadas; como la salida
+estandar y el log llevan exactamente lo mismo, el mismo buffer se escribe
+primero en fd=1 y luego en el log. En idx vamos apuntando donde terminara
+cada linea en el log, y en err los errores de cada linea. Con --binlog el
+log es mycalc.log.bin: lo que va a el son los registros de bin, y out
+solo sale por fd=1 (o es la respuesta del servidor).
+*/
+typedef struct {
+  int to_stdout;     /*escribir tambien en fd=1 lo que va al log*/
+  int sync;          /*SYNC_NONE, SYNC_BATCH o SYNC_ALWAYS*/
+  int binary;        /*el log es el binario (--binlog)*/
+  SegmentLimits limits;  /*cuando rotar mycalc.log (ver log_lock)*/
+  uint32_t stamp;    /*marca de tiempo de los registros, se renueva en cada escritura*/
+  int log_fd;
+  int idx_fd;        /*-1 si el indice no esta al dia y no lo tocamos*/
+  uint64_t log_end;  /*donde caera en el log el principio de out*/
+  char *out;
+  size_t out_used;
+  unsigned char *idx;
+  size_t idx_used;
+  unsigned char *bin;
+  size_t bin_used;
+  char *err;
+  size_t err_used;
+  int line_number;   /*linea de la entrada que estamos procesando*/
+  int errors;        /*lineas con error*/
+} Batch;
+
+/*
+batch_close: cierra los ficheros y libera los buffers (sin escribir lo pendiente)
+*/
+void batch_close(Batch *batch) {
+  if (batch->idx_fd >= 0) {
+    close(batch->idx_fd);
+  }
+  close(batch->log_fd);
+  free(batch->out);
+  free(batch->idx);
+  free(batch->bin);
+  free(batch->err);
+}
+
+/*
+batch_index: se pone al final de mycalc.log y vuelve a abrir el indice si llega justo hasta ahi
+Las entradas que ya hay en idx se mueven con el: despues de rotar el log,
+sus lineas caeran en el mycalc.log nuevo.
+*/
+void batch_index(Batch *batch) {
+  off_t log_end;
+  size_t i;
+
+  if (batch->idx_fd >= 0) {
+    close(batch->idx_fd);
+  }
+  batch->idx_fd = -1;
+  log_end = lseek(batch->log_fd, 0, SEEK_END);
+  if (log_end < 0) {
+    batch->log_end = 0;
+    return;
+  }
+  for (i = 0; i < batch->idx_used; i += INDEX_ENTRY_SIZE) {
+    put_u64(batch->idx + i, get_u64(batch->idx + i) - batch->log_end + (uint64_t)log_end);
+  }
+  batch->log_end = (uint64_t)log_end;
+  /*solo seguimos apuntando en el indice si llega justo hasta el final del log*/
+  batch->idx_fd = open(INDEX_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (batch->idx_fd >= 0 && !index_in_sync(batch->idx_fd, batch->log_fd, batch->log_end)) {
+    close(batch->idx_fd);
+    batch->idx_fd = -1;
+  }
+}
+
+/*
+batch_open: abre mycalc.log y el indice y reserva los buffers de batch
+Con to_stdout = 1 lo que se escribe en el log sale tambien por fd=1, sync
+es la politica de --sync, con binary = 1 el log es el binario y limits
+dice cuando rotar mycalc.log.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int batch_open(Batch *batch, int to_stdout, int sync, int binary, const SegmentLimits *limits) {
+  memset(batch, 0, sizeof(*batch));
+  batch->to_stdout = to_stdout;
+  batch->sync = sync;
+  batch->binary = binary;
+  batch->limits = *limits;
+  if (binary) {
+    batch->log_fd = binlog_open();
+    if (batch->log_fd < 0) {
+      return -1;
+    }
+    batch->stamp = binlog_stamp(time(NULL));
+    batch->idx_fd = -1;
+    batch->out = malloc(BATCH_OUT_SIZE);
+    /*cada registro ocupa menos que su linea de texto: bin nunca se llena antes que out*/
+    batch->bin = malloc(BATCH_OUT_SIZE);
+    batch->err = malloc(BATCH_ERR_SIZE);
+    if (batch->out == NULL || batch->bin == NULL || batch->err == NULL) {
+      print_error("Error: memoria insuficiente\n", 28);
+      batch_close(batch);
+      return -1;
+    }
+    return 0;
+  }
+  batch->log_fd = open("mycalc.log", O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (batch->log_fd < 0) {
+    print_error("Error: no se pudo abrir mycalc.log\n", 35);
+    return -1;
+  }
+  batch->out = malloc(BATCH_OUT_SIZE);
+  /*cada linea de salida ocupa al menos 16 bytes: no puede haber mas entradas que esto*/
+  batch->idx = malloc(BATCH_OUT_SIZE / 16 * INDEX_ENTRY_SIZE);
+  batch->err = malloc(BATCH_ERR_SIZE);
+  if (batch->out == NULL || batch->idx == NULL || batch->err == NULL) {
+    print_error("Error: memoria insuficiente\n", 28);
+    batch->idx_fd = -1;
+    batch_close(batch);
+    return -1;
+  }
+  batch->idx_fd = -1;
+  batch_index(batch);
+  return 0;
+}
+
+/*
+batch_piece: cuantas de las entradas de idx desde first caben en room
+Son las lineas que van juntas en la siguiente escritura al log: todas si
+no hay limites, y si no las que caben en lo que queda del segmento (al
+menos una, para avanzar aunque una sola linea se pase del limite).
+Devuelve cuantos bytes de idx ocupan esas entradas.
+*/
+size_t batch_piece(const Batch *batch, size_t first, const SegmentLimits *room) {
+  size_t last;
+  long lines;
+
+  if (room->max_bytes == 0 && room->max_lines == 0) {
+    return batch->idx_used - first;
+  }
+  last = first + INDEX_ENTRY_SIZE;
+  lines = 1;
+  while (last < batch->idx_used && (room->max_lines == 0 || lines < room->max_lines) &&
+         (room->max_bytes == 0 || get_u64(batch->idx + last) - batch->log_end <= room->max_bytes)) {
+    last += INDEX_ENTRY_SIZE;
+    lines++;
+  }
+  return last - first;
+}
+
+/*
+batch_flush: escribe lo que tenemos acumulado en la salida, el log y el indice
+
+Lo acumulado va al log en un solo write por segmento: son lineas enteras,
+asi que con O_APPEND ninguna se mezcla con las de otro proceso. Mientras
+escribimos tenemos mycalc.log bloqueado (log_lock); si con --segment-* no
+cabe todo en el segmento actual escribimos solo las lineas que caben
+(batch_piece) y el siguiente log_lock lo rota antes de seguir con el
+resto. Si lo ha rotado otro, seguimos en el nuevo. Con --sync=batch o
+--sync=always hacemos fdatasync del log antes de seguir, y solo entonces
+damos las lineas por escritas. Antes de apuntarlas en el indice
+comprobamos, con el bloqueado, que han caido en el log donde esperabamos y
+que nadie mas ha tocado el indice; si no, dejamos de tocarlo y ya lo
+completara el modo historial. Mientras tanto log_end es donde caera la
+siguiente linea por escribir (la de done en out). El log binario no tiene
+indice: solo escribimos sus registros.
+Devuelve 0 si fue bien, -1 si no se pudo escribir la salida o el log.
+*/
+int batch_flush(Batch *batch) {
+  SegmentLimits room;
+  off_t end;
+  uint64_t shift;
+  size_t done;
+  size_t idx_done;
+  size_t idx_len;
+  size_t len;
+  size_t i;
+  int reopened;
+
+  if (batch->binary && batch->out_used > 0) {
+    if ((batch->to_stdout && write_checked(1, batch->out, (int)batch->out_used) < 0) ||
+        write_checked(batch->log_fd, (const char *)batch->bin, (int)batch->bin_used) < 0) {
+      return -1;
+    }
+    if (batch->sync != SYNC_NONE && fdatasync(batch->log_fd) < 0) {
+      return -1;
+    }
+    batch->stamp = binlog_stamp(time(NULL));
+    batch->out_used = 0;
+    batch->bin_used = 0;
+  } else if (batch->out_used > 0) {
+    if (batch->to_stdout && write_checked(1, batch->out, (int)batch->out_used) < 0) {
+      return -1;
+    }
+    done = 0;
+    idx_done = 0;
+    while (done < batch->out_used) {
+      len = (size_t)(get_u64(batch->idx + idx_done) - batch->log_end); /*lo que ocupa la primera linea*/
+      reopened = log_lock(&batch->log_fd, &batch->limits, len, &room);
+      if (reopened < 0) {
+        return -1;
+      }
+      if (reopened) {
+        batch_index(batch);
+      }
+      idx_len = batch_piece(batch, idx_done, &room);
+      len = (size_t)(get_u64(batch->idx + idx_done + idx_len - INDEX_ENTRY_SIZE) - batch->log_end);
+      if (write_checked(batch->log_fd, batch->out + done, (int)len) < 0) {
+        return -1;
+      }
+      if (batch->sync != SYNC_NONE && fdatasync(batch->log_fd) < 0) {
+        return -1;
+      }
+      end = lseek(batch->log_fd, 0, SEEK_CUR);
+      if (batch->idx_fd >= 0 && end == (off_t)(batch->log_end + len) && flock(batch->idx_fd, LOCK_EX) == 0) {
+        if (!index_in_sync(batch->idx_fd, batch->log_fd, batch->log_end) ||
+            index_write(batch->idx_fd, batch->log_fd, batch->idx + idx_done, idx_len) < 0) {
+          close(batch->idx_fd); /*al cerrarlo se suelta el bloqueo*/
+          batch->idx_fd = -1;
+        } else {
+          flock(batch->idx_fd, LOCK_UN);
+        }
+      } else if (batch->idx_fd >= 0) {
+        close(batch->idx_fd);
+        batch->idx_fd = -1;
+      }
+      flock(batch->log_fd, LOCK_UN);
+      done += len;
+      idx_done += idx_len;
+      /*si han escrito otros entre medias, las lineas que quedan caen mas adelante*/
+      shift = (uint64_t)end - batch->log_end - len;
+      for (i = idx_done; shift != 0 && i < batch->idx_used; i += INDEX_ENTRY_SIZE) {
+        put_u64(batch->idx + i, get_u64(batch->idx + i) + shift);
+      }
+      batch->log_end = (uint64_t)end;
+    }
+    batch->out_used = 0;
+    batch->idx_used = 0;
+  }
+  if (batch->err_used > 0) {
+    if (write_checked(2, batch->err, (int)batch->err_used) < 0) {
+      return -1;
+    }
+    batch->err_used = 0;
+  }
+  return 0;
+}
+
+/*
+format_error_line: escribe en out "Error: linea N: msg\n"
+Devuelve cuantos bytes ha escrito (como mucho 27 mas los de msg).
+*/
+int format_error_line(char *out, int line_number, const char *msg) {
+  int len;
+  int msg_len;
+
+  memcpy(out, "Error: linea ", 13);
+  len = 13 + format_int(line_number, out + 13);
+  memcpy(out + len, ": ", 2);
+  msg_len = str_len(msg);
+  memcpy(out + len + 2, msg, (size_t)msg_len);
+  out[len + 2 + msg_len] = '\n';
+  return len + 3 + msg_len;
+}
+
+/*
+batch_error: apunta "Error: linea N: msg" para la linea actual
+Devuelve 0 si fue bien, -1 si no se pudo escribir.
+*/
+int batch_error(Batch *batch, const char *msg) {
+  batch->errors++;
+  if (batch->err_used + (size_t)(27 + str_len(msg)) > BATCH_ERR_SIZE && batch_flush(batch) < 0) {
+    return -1;
+  }
+  batch->err_used += (size_t)format_error_line(batch->err + batch->err_used, batch->line_number, msg);
+  return 0;
+}
+
+/*
+Operation: una linea "num1 op num2" ya separada en sus campos
+
+num1 y num2 apuntan a los numeros tal cual vienen en la linea (para
+escribirlos igual en la salida) y a y b son sus valores.
+*/
+typedef struct {
+  const char *num1;
+  const char *num2;
+  size_t num1_len;
+  size_t num2_len;
+  char op;
+  int a;
+  int b;
+} Operation;
+
+/*
+parse_operation: separa una linea "num1 op num2" en sus campos
+
+Los tres campos van separados por espacios o tabuladores. Los numeros se
+leen con parse_int directamente en la propia linea, sin copiarlos. El
+operador solo se comprueba que sea un caracter; si es uno valido lo dice
+compute_result.
+Devuelve 1 si la linea es una operacion, 0 si esta en blanco y -1 si tiene
+un error (con el motivo en *error).
+*/
+int parse_operation(char *line, size_t len, Operation *operation, const char **error) {
+  char *fields[3];
+  size_t field_len[3];
+  size_t i;
+  int nfields;
+
+  if (len > BATCH_LINE_MAX) {
+    *error = "linea demasiado larga";
+    return -1;
+  }
+  nfields = 0;
+  i = 0;
+  while (i < len) {
+    if (line[i] == ' ' || line[i] == '\t' || line[i] == '\r') {
+      i++;
+      continue;
+    }
+    if (nfields == 3) {
+      nfields++;
+      break;
+    }
+    fields[nfields] = line + i;
+    while (i < len && line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+      i++;
+    }
+    field_len[nfields] = (size_t)(line + i - fields[nfields]);
+    nfields++;
+  }
+  if (nfields == 0) {
+    return 0; /*linea en blanco*/
+  }
+  if (nfields != 3) {
+    *error = "se esperaba <num1> <op> <num2>";
+    return -1;
+  }
+  if (parse_int(fields[0], field_len[0], &operation->a) != 0 ||
+      parse_int(fields[2], field_len[2], &operation->b) != 0) {
+    *error = "numeros invalidos";
+    return -1;
+  }
+  if (field_len[1] != 1) {
+    *error = "operador invalido";
+    return -1;
+  }
+  operation->num1 = fields[0];
+  operation->num1_len = field_len[0];
+  operation->op = fields[1][0];
+  operation->num2 = fields[2];
+  operation->num2_len = field_len[2];
+  return 1;
+}
+
+/*
+calc_error: motivo de un codigo de error de compute_result
+*/
+const char *calc_error(int calc_status) {
+  if (calc_status == -1) {
+    return "operador invalido";
+  }
+  if (calc_status == -2) {
+    return "Division por cero";
+  }
+  return "overflow en operacion";
+}
+
+/*
+format_operation: escribe en out la linea "Operación: num1 op num2 = result"
+igual que la del modo calculadora (out tiene que tener sitio para
+OPERATION_TEXT_MAX bytes).
+Devuelve los bytes escritos.
+*/
+int format_operation(char *out, const Operation *operation, int result) {
+  char *p;
+
+  /*"Operación: " ocupa 12 bytes (la o con tilde son dos)*/
+  p = out;
+  memcpy(p, "Operación: ", 12);
+  p += 12;
+  memcpy(p, operation->num1, operation->num1_len);
+  p += operation->num1_len;
+  p[0] = ' ';
+  p[1] = operation->op;
+  p[2] = ' ';
+  p += 3;
+  memcpy(p, operation->num2, operation->num2_len);
+  p += operation->num2_len;
+  memcpy(p, " = ", 3);
+  p += 3;
+  p += format_int(result, p);
+  *p = '\n';
+  return (int)(p + 1 - out);
+}
+
+/*
+eval_operation: calcula una linea "num1 op num2" y escribe su resultado en out
+
+Separa la linea con parse_operation, la calcula con compute_result y deja
+en out la linea "Operación: ..." con format_operation. Si record no es
+NULL dejamos ahi tambien su registro del log binario, con la marca de
+tiempo stamp. Los errores son los mismos que en el modo calculadora.
+Devuelve los bytes escritos en out, 0 si la linea esta en blanco y -1 si
+tiene un error (con el motivo en *error).
+*/
+int eval_operation(char *line, size_t len, char *out, unsigned char *record, uint32_t stamp, const char **error) {
+  Operation operation;
+  int parsed;
+  int result;
+  int calc_status;
+
+  parsed = parse_operation(line, len, &operation, error);
+  if (parsed <= 0) {
+    return parsed;
+  }
+  calc_status = compute_result(operation.a, operation.b, operation.op, &result);
+  if (calc_status != 0) {
+    *error = calc_error(calc_status);
+    return -1;
+  }
+  if (record != NULL) {
+    binlog_encode(record, operation.a, operation.op, operation.b, result, stamp);
+  }
+  return format_operation(out, &operation, result);
+}
+
+/*
+batch_reserve: se asegura de que caben en out OPERATION_TEXT_MAX bytes mas
+Devuelve 0 si fue bien, -1 si no se pudo escribir lo acumulado.
+*/
+int batch_reserve(Batch *batch) {
+  if (batch->out_used + OPERATION_TEXT_MAX > BATCH_OUT_SIZE) {
+    return batch_flush(batch);
+  }
+  return 0;
+}
+
+/*
+batch_commit: da por buena la linea de len bytes escrita al final de out
+(la apuntamos para el indice, o con --binlog su registro ya escrito en bin). Con --sync=always la escribimos ya, sola.
+Devuelve 0 si fue bien, -1 si no se pudo escribir.
+*/
+int batch_commit(Batch *batch, size_t len) {
+  batch->out_used += len;
+  if (batch->binary) {
+    batch->bin_used += BINLOG_RECORD_SIZE;
+  } else {
+    put_u64(batch->idx + batch->idx_used, batch->log_end + batch->out_used);
+    batch->idx_used += INDEX_ENTRY_SIZE;
+  }
+  if (batch->sync == SYNC_ALWAYS) {
+    return batch_flush(batch);
+  }
+  return 0;
+}
+
+/*
+Columns: lineas del modo por lotes pendientes de calcular, por columnas
+
+Cada linea que no esta en blanco ocupa un carril (lane): guardamos su
+Operation para escribirla despues, su numero de linea y, si ya tiene un
+error de formato o de operador, el motivo. Las que se pueden calcular van
+ademas al grupo de su operador (suma, resta, multiplicacion o division):
+num1 y num2 a las columnas a y b del grupo, y en slot el sitio que ocupan
+(grupo * COLUMN_LANES + posicion), para encontrar luego su resultado.
+Las Operation apuntan a la entrada, asi que hay que calcular lo pendiente
+antes de moverla.
+*/
+typedef struct {
+  ColumnKernel kernel;
+  int lanes;
+  Operation operation[COLUMN_LANES];
+  const char *error[COLUMN_LANES];
+  int line_number[COLUMN_LANES];
+  int slot[COLUMN_LANES];
+  int count[COLUMN_GROUPS];
+  int a[COLUMN_GROUPS][COLUMN_LANES];
+  int b[COLUMN_GROUPS][COLUMN_LANES];
+  int result[COLUMN_GROUPS][COLUMN_LANES];
+  int status[COLUMN_GROUPS][COLUMN_LANES];
+} Columns;
+
+/*
+column_group: grupo de un operador (su posicion en COLUMN_OPS), o -1 si no es valido
+*/
+int column_group(char op) {
+  if (op == '*') {
+    op = 'x'; /*las dos son la multiplicacion*/
+  }
+  if (op == '+') {
+    return 0;
+  }
+  if (op == '-') {
+    return 1;
+  }
+  if (op == 'x') {
+    return 2;
+  }
+  if (op == '/') {
+    return 3;
+  }
+  return -1;
+}
+
+/*
+columns_flush: calcula las lineas pendientes y las escribe en orden
+
+Primero cada grupo entero con el kernel y despues, carril a carril, la
+linea "Operación: ..." o el error, como si se hubieran calculado una a una.
+Devuelve 0 si fue bien, -1 si no se pudo escribir.
+*/
+int columns_flush(Columns *columns, Batch *batch) {
+  const char *error;
+  unsigned char *record;
+  int saved_line;
+  int lane;
+  int group;
+  int slot;
+  int len;
+
+  for (group = 0; group < COLUMN_GROUPS; group++) {
+    if (columns->count[group] > 0) {
+      columns->kernel(COLUMN_OPS[group], columns->a[group], columns->b[group], columns->result[group],
+                      columns->status[group], columns->count[group]);
+    }
+  }
+  saved_line = batch->line_number;
+  for (lane = 0; lane < columns->lanes; lane++) {
+    batch->line_number = columns->line_number[lane];
+    error = columns->error[lane];
+    group = columns->slot[lane] / COLUMN_LANES;
+    slot = columns->slot[lane] % COLUMN_LANES;
+    if (error == NULL && columns->status[group][slot] != 0) {
+      error = calc_error(columns->status[group][slot]);
+    }
+    if (error != NULL) {
+      if (batch_error(batch, error) < 0) {
+        return -1;
+      }
+      continue;
+    }
+    if (batch_reserve(batch) < 0) {
+      return -1;
+    }
+    if (batch->binary) {
+      record = batch->bin + batch->bin_used;
+      binlog_encode(record, columns->operation[lane].a, columns->operation[lane].op, columns->operation[lane].b,
+                    columns->result[group][slot], batch->stamp);
+    }
+    len = format_operation(batch->out + batch->out_used, &columns->operation[lane], columns->result[group][slot]);
+    if (batch_commit(batch, (size_t)len) < 0) {
+      return -1;
+    }
+  }
+  batch->line_number = saved_line;
+  columns->lanes = 0;
+  for (group = 0; group < COLUMN_GROUPS; group++) {
+    columns->count[group] = 0;
+  }
+  return 0;
+}
+
+/*
+columns_add: separa una linea de la entrada y la deja pendiente en su carril
+Si se llenan los carriles las calcula todas.
+Devuelve 0 si fue bien, -1 si no se pudo escribir.
+*/
+int columns_add(Columns *columns, Batch *batch, char *line, size_t len) {
+  Operation *operation;
+  const char *error;
+  int lane;
+  int group;
+  int parsed;
+  int k;
+
+  lane = columns->lanes;
+  operation = &columns->operation[lane];
+  parsed = parse_operation(line, len, operation, &error);
+  if (parsed == 0) {
+    return 0;
+  }
+  columns->line_number[lane] = batch->line_number;
+  columns->error[lane] = NULL;
+  columns->slot[lane] = 0;
+  if (parsed < 0) {
+    columns->error[lane] = error;
+  } else {
+    group = column_group(operation->op);
+    if (group < 0) {
+      columns->error[lane] = calc_error(-1);
+    } else {
+      k = columns->count[group]++;
+      columns->a[group][k] = operation->a;
+      columns->b[group][k] = operation->b;
+      columns->slot[lane] = group * COLUMN_LANES + k;
+    }
+  }
+  columns->lanes++;
+  if (columns->lanes == COLUMN_LANES) {
+    return columns_flush(columns, batch);
+  }
+  return 0;
+}
+
+/*
+batch_run: modo por lotes, calcula todas las lineas que lleguen por in_fd
+
+Leemos la entrada en bloques de BATCH_IN_SIZE bytes y procesamos las lineas
+completas de cada bloque; el trozo de la ultima que queda a medias lo
+movemos al principio y seguimos leyendo detras. Una linea que no cabe en
+todo el buffer se da por erronea y se salta hasta su '\n'. Las lineas no
+se calculan al leerlas: se separan en Columns y se calculan por columnas al
+llenarse los carriles y antes de mover la entrada. sync es la politica de
+--sync (ver batch_flush), con binary = 1 se escribe en el log binario y
+limits dice cuando rotar mycalc.log.
+Devuelve 0 si todas las lineas fueron bien, -1 si alguna tuvo un error.
+*/
+int batch_run(int in_fd, int sync, int binary, const SegmentLimits *limits) {
+  Batch batch;
+  Columns *columns;
+  char *in;
+  char *p;
+  char *nl;
+  size_t have;
+  size_t rest;
+  ssize_t nread;
+  int skipping;
+  int status;
+
+  in = malloc(BATCH_IN_SIZE + 1);
+  columns = malloc(sizeof(Columns));
+  if (in == NULL || columns == NULL) {
+    print_error("Error: memoria insuficiente\n", 28);
+    free(in);
+    free(columns);
+    return -1;
+  }
+  if (batch_open(&batch, 1, sync, binary, limits) < 0) {
+    free(in);
+    free(columns);
+    return -1;
+  }
+  memset(columns->count, 0, sizeof(columns->count));
+  columns->lanes = 0;
+  columns->kernel = column_kernel_select();
+
+  status = 0;
+  have = 0;
+  skipping = 0;
+  while (status == 0) {
+    nread = read(in_fd, in + have, BATCH_IN_SIZE - have);
+    if (nread < 0) {
+      print_error("Error: no se pudo leer la entrada\n", 34);
+      status = -1;
+      break;
+    }
+    have += (size_t)nread;
+    p = in;
+    while (status == 0 && (nl = memchr(p, '\n', (size_t)(in + have - p))) != NULL) {
+      batch.line_number++;
+      if (skipping) {
+        skipping = 0; /*final de una linea demasiado larga que ya hemos contado*/
+      } else {
+        status = columns_add(columns, &batch, p, (size_t)(nl - p));
+      }
+      p = nl + 1;
+    }
+    rest = (size_t)(in + have - p);
+    if (nread == 0) {
+      /*ultima linea sin '\n'*/
+      if (status == 0 && rest > 0 && !skipping) {
+        batch.line_number++;
+        status = columns_add(columns, &batch, p, rest);
+      }
+      break;
+    }
+    /*antes de mover la entrada calculamos las lineas que apuntan a ella*/
+    if (status == 0) {
+      status = columns_flush(columns, &batch);
+    }
+    if (rest == BATCH_IN_SIZE) {
+      /*una linea que ocupa varios buffers solo se cuenta una vez*/
+      if (!skipping) {
+        batch.line_number++;
+        status = batch_error(&batch, "linea demasiado larga");
+        batch.line_number--;
+      }
+      skipping = 1;
+      rest = 0;
+    }
+    memmove(in, p, rest);
+    have = rest;
+  }
+  if (status == 0) {
+    status = columns_flush(columns, &batch);
+  }
+  if (batch_flush(&batch) < 0) {
+    status = -1;
+  }
+
+  free(in);
+  free(columns);
+  batch_close(&batch);
+  if (status == 0 && batch.errors > 0) {
+    status = -1;
+  }
+  return status;
+}
+
+/*
+EXPRESIONES
+
+./mycalc -e "<expresion>" [<fichero> | -] calcula una expresion entera con
++, -, x (o *) y /, parentesis, signo delante y variables, con la
+precedencia de siempre (x y / antes que + y -, de izquierda a derecha). La
+'x' es la multiplicacion cuando va detras de un operando y no la sigue una
+letra, asi que "a x b" y "2x3" multiplican pero "axb" es una variable.
+
+La expresion se compila una sola vez a un programa de registros: cada
+registro es una constante, una variable o el resultado de una
+instruccion, y cada instruccion es una operacion de compute_result entre
+dos registros. Las operaciones entre constantes se calculan al compilar.
+
+Con fichero (o stdin), su primera linea no vacia nombra las columnas y
+cada una de las siguientes da los valores de una fila (las columnas que no
+usa la expresion pueden tener cualquier cosa). Las filas se juntan en
+bloques de EXPR_ROWS y el programa se ejecuta instruccion a instruccion
+sobre todo el bloque con los kernels por columnas del modo por lotes, asi
+que cada paso tiene las mismas comprobaciones que compute_result. Por cada
+fila se escribe su resultado o "Error: linea N: motivo". Las expresiones no
+se guardan en mycalc.log: el historial es de operaciones num1 op num2.
+*/
+
+/*
+ExprInsn: instruccion dst = a op b del programa de una expresion
+*/
+typedef struct {
+  char op;   /*'+', '-', 'x' o '/'*/
+  int dst;
+  int a;
+  int b;
+} ExprInsn;
+
+/*
+ExprProgram: una expresion compilada, y el estado mientras se compila
+*/
+typedef struct {
+  const char *text;   /*expresion que estamos compilando*/
+  size_t pos;         /*por donde vamos leyendola*/
+  int depth;          /*parentesis y signos anidados*/
+  const char *error;
+  int nregs;
+  int is_const[EXPR_REGS];
+  int value[EXPR_REGS];    /*valor de los registros constantes*/
+  int nvars;
+  int var_reg[EXPR_VARS];
+  char var_name[EXPR_VARS][EXPR_NAME_MAX + 1];
+  int ninsns;
+  ExprInsn insn[EXPR_REGS];
+  int result;         /*registro con el valor de la expresion*/
+} ExprProgram;
+
+/*
+expr_name_char: dice si c puede ir en el nombre de una variable (con first = 1, al principio)
+*/
+int expr_name_char(char c, int first) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (!first && c >= '0' && c <= '9');
+}
+
+/*
+expr_peek: salta los espacios y devuelve el siguiente caracter de la expresion ('\0' al final)
+*/
+char expr_peek(ExprProgram *program) {
+  while (program->text[program->pos] == ' ' || program->text[program->pos] == '\t') {
+    program->pos++;
+  }
+  return program->text[program->pos];
+}
+
+/*
+expr_new_reg: reserva un registro (una constante si is_const = 1)
+Devuelve su numero, o -1 si ya no quedan.
+*/
+int expr_new_reg(ExprProgram *program, int is_const, int value) {
+  if (program->nregs == EXPR_REGS) {
+    program->error = "expresion demasiado larga";
+    return -1;
+  }
+  program->is_const[program->nregs] = is_const;
+  program->value[program->nregs] = value;
+  program->nregs++;
+  return program->nregs - 1;
+}
+
+/*
+expr_emit: anade la instruccion a op b al programa
+Si a y b son constantes y la operacion no da error la calculamos ya; si da
+error (1 / 0) la dejamos, para que salga en cada fila como al calcularla.
+Devuelve el registro con el resultado, o -1 si hubo algun error.
+*/
+int expr_emit(ExprProgram *program, char op, int a, int b) {
+  ExprInsn *insn;
+  int value;
+  int dst;
+
+  if (a < 0 || b < 0) {
+    return -1;
+  }
+  if (program->is_const[a] && program->is_const[b] &&
+      compute_result(program->value[a], program->value[b], op, &value) == 0) {
+    return expr_new_reg(program, 1, value);
+  }
+  dst = expr_new_reg(program, 0, 0);
+  if (dst < 0) {
+    return -1;
+  }
+  insn = &program->insn[program->ninsns++];
+  insn->op = op;
+  insn->dst = dst;
+  insn->a = a;
+  insn->b = b;
+  return dst;
+}
+
+/*
+expr_number: lee un numero (con '-' delante si negative = 1) que empieza en pos
+Devuelve su registro, o -1 si no cabe en un int.
+*/
+int expr_number(ExprProgram *program, int negative) {
+  const char *start;
+  size_t len;
+  int value;
+
+  start = program->text + program->pos - (negative ? 1 : 0);
+  len = negative ? 1 : 0;
+  while (start[len] >= '0' && start[len] <= '9') {
+    len++;
+  }
+  if (parse_int(start, len, &value) != 0) {
+    program->error = "numero demasiado grande";
+    return -1;
+  }
+  program->pos = (size_t)(start + len - program->text);
+  return expr_new_reg(program, 1, value);
+}
+
+/*
+expr_variable: lee el nombre de una variable que empieza en pos
+Cada variable distinta tiene su registro, que se rellena con su columna.
+Devuelve su registro, o -1 si hubo algun error.
+*/
+int expr_variable(ExprProgram *program) {
+  const char *name;
+  size_t len;
+  int reg;
+  int i;
+
+  name = program->text + program->pos;
+  len = 0;
+  while (expr_name_char(name[len], len == 0)) {
+    len++;
+  }
+  program->pos += len;
+  if (len > EXPR_NAME_MAX) {
+    program->error = "nombre de variable demasiado largo";
+    return -1;
+  }
+  for (i = 0; i < program->nvars; i++) {
+    if (memcmp(program->var_name[i], name, len) == 0 && program->var_name[i][len] == '\0') {
+      return program->var_reg[i];
+    }
+  }
+  if (program->nvars == EXPR_VARS) {
+    program->error = "demasiadas variables";
+    return -1;
+  }
+  reg = expr_new_reg(program, 0, 0);
+  if (reg < 0) {
+    return -1;
+  }
+  memcpy(program->var_name[program->nvars], name, len);
+  program->var_name[program->nvars][len] = '\0';
+  program->var_reg[program->nvars] = reg;
+  program->nvars++;
+  return reg;
+}
+
+int expr_sum(ExprProgram *program);
+
+/*
+expr_unary: operando con signo delante: ['-' | '+'] (numero | variable | '(' suma ')')
+Un '-' pegado a un numero es parte del numero, para poder escribir -2147483648.
+Devuelve el registro con su valor, o -1 si hubo algun error.
+*/
+int expr_unary(ExprProgram *program) {
+  char c;
+  int reg;
+
+  if (program->depth == EXPR_DEPTH) {
+    program->error = "expresion demasiado anidada";
+    return -1;
+  }
+  c = expr_peek(program);
+  if (c >= '0' && c <= '9') {
+    return expr_number(program, 0);
+  }
+  if (expr_name_char(c, 1)) {
+    return expr_variable(program);
+  }
+  if (c != '(' && c != '-' && c != '+') {
+    program->error = c == '\0' ? "falta un operando al final" : "se esperaba un numero, una variable o '('";
+    return -1;
+  }
+  program->pos++;
+  if (c == '-' && program->text[program->pos] >= '0' && program->text[program->pos] <= '9') {
+    return expr_number(program, 1);
+  }
+  program->depth++;
+  reg = c == '(' ? expr_sum(program) : expr_unary(program);
+  program->depth--;
+  if (reg < 0) {
+    return -1;
+  }
+  if (c == '(') {
+    if (expr_peek(program) != ')') {
+      program->error = "falta ')'";
+      return -1;
+    }
+    program->pos++;
+    return reg;
+  }
+  if (c == '+') {
+    return reg;
+  }
+  return expr_emit(program, '-', expr_new_reg(program, 1, 0), reg);
+}
+
+/*
+expr_product: operandos separados por x, * o /
+Devuelve el registro con su valor, o -1 si hubo algun error.
+*/
+int expr_product(ExprProgram *program) {
+  char c;
+  int reg;
+
+  reg = expr_unary(program);
+  while (reg >= 0) {
+    c = expr_peek(program);
+    if (c != '*' && c != '/' && (c != 'x' || expr_name_char(program->text[program->pos + 1], 1))) {
+      break;
+    }
+    program->pos++;
+    reg = expr_emit(program, c == '/' ? '/' : 'x', reg, expr_unary(program));
+  }
+  return reg;
+}
+
+/*
+expr_sum: productos separados por + o -
+Devuelve el registro con su valor, o -1 si hubo algun error.
+*/
+int expr_sum(ExprProgram *program) {
+  char c;
+  int reg;
+
+  reg = expr_product(program);
+  while (reg >= 0) {
+    c = expr_peek(program);
+    if (c != '+' && c != '-') {
+      break;
+    }
+    program->pos++;
+    reg = expr_emit(program, c, reg, expr_product(program));
+  }
+  return reg;
+}
+
+/*
+expr_compile: compila text en program
+Si hay un error escribe "Error: expresion: motivo (posicion N)".
+Devuelve 0 si fue bien, -1 si la expresion no es valida.
+*/
+int expr_compile(ExprProgram *program, const char *text) {
+  char message[128];
+  int len;
+
+  memset(program, 0, sizeof(*program));
+  program->text = text;
+  program->result = expr_sum(program);
+  if (program->result >= 0 && expr_peek(program) != '\0') {
+    program->error = expr_peek(program) == ')' ? "sobra un ')'" : "falta un operador";
+    program->result = -1;
+  }
+  if (program->result >= 0) {
+    return 0;
+  }
+  len = str_len(program->error);
+  memcpy(message, "Error: expresion: ", 18);
+  memcpy(message + 18, program->error, (size_t)len);
+  memcpy(message + 18 + len, " (posicion ", 11);
+  len += 29;
+  len += format_int((int)program->pos + 1, message + len);
+  memcpy(message + len, ")\n", 2);
+  print_error(message, len + 2);
+  return -1;
+}
+
+/*
+ExprRun: estado de ./mycalc -e al calcular una expresion fila a fila
+
+regs tiene EXPR_ROWS valores por registro: los de las constantes se
+rellenan una vez y los de las variables con cada fila que llega.
+column_reg dice en que registro va cada columna de la entrada (-1 si la
+expresion no la usa); ncolumns es 0 hasta leer la cabecera.
+*/
+typedef struct {
+  ExprProgram program;
+  ColumnKernel kernel;
+  int *regs;
+  int column_reg[EXPR_COLUMNS];
+  int ncolumns;
+  int line_number;                 /*linea de la entrada que estamos leyendo*/
+  int errors;                      /*filas con error*/
+  int rows;                        /*filas del bloque*/
+  int row_line[EXPR_ROWS];
+  const char *row_error[EXPR_ROWS];  /*error al leer la fila, o NULL*/
+  int status[EXPR_ROWS];           /*primer codigo de compute_result distinto de 0*/
+  int step[EXPR_ROWS];
+  char *out;
+  size_t out_used;
+  char *err;
+  size_t err_used;
+} ExprRun;
+
+/*
+expr_reg: los EXPR_ROWS valores del registro reg
+*/
+int *expr_reg(ExprRun *run, int reg) {
+  return run->regs + (size_t)reg * EXPR_ROWS;
+}
+
+/*
+expr_flush: escribe los resultados y los errores acumulados
+Devuelve 0 si fue bien, -1 si no se pudo escribir.
+*/
+int expr_flush(ExprRun *run) {
+  if (run->out_used > 0 && write_checked(1, run->out, (int)run->out_used) < 0) {
+    return -1;
+  }
+  if (run->err_used > 0 && write_checked(2, run->err, (int)run->err_used) < 0) {
+    return -1;
+  }
+  run->out_used = 0;
+  run->err_used = 0;
+  return 0;
+}
+
+/*
+expr_eval: ejecuta el programa sobre las filas del bloque
+Cada instruccion se calcula con el kernel para todas las filas; en cada
+fila nos quedamos con el primer error, que es el que daria calcular la
+expresion paso a paso.
+*/
+void expr_eval(ExprRun *run) {
+  const ExprInsn *insn;
+  int i;
+  int r;
+
+  for (r = 0; r < run->rows; r++) {
+    run->status[r] = 0;
+  }
+  for (i = 0; i < run->program.ninsns; i++) {
+    insn = &run->program.insn[i];
+    run->kernel(insn->op, expr_reg(run, insn->a), expr_reg(run, insn->b), expr_reg(run, insn->dst), run->step,
+                run->rows);
+    for (r = 0; r < run->rows; r++) {
+      if (run->status[r] == 0) {
+        run->status[r] = run->step[r];
+      }
+    }
+  }
+}
+
+/*
+expr_rows_flush: calcula las filas del bloque y apunta su resultado o su error
+Devuelve 0 si fue bien, -1 si no se pudo escribir.
+*/
+int expr_rows_flush(ExprRun *run) {
+  const int *result;
+  const char *error;
+  int r;
+
+  expr_eval(run);
+  result = expr_reg(run, run->program.result);
+  for (r = 0; r < run->rows; r++) {
+    if ((run->out_used + NUMTEXT_INT_MAX + 1 > BATCH_OUT_SIZE || run->err_used + 128 > BATCH_ERR_SIZE) &&
+        expr_flush(run) < 0) {
+      return -1;
+    }
+    error = run->row_error[r] != NULL ? run->row_error[r] : run->status[r] != 0 ? calc_error(run->status[r]) : NULL;
+    if (error != NULL) {
+      run->errors++;
+      run->err_used += (size_t)format_error_line(run->err + run->err_used, run->row_line[r], error);
+    } else {
+      run->out_used += (size_t)format_int(result[r], run->out + run->out_used);
+      run->out[run->out_used++] = '\n';
+    }
+  }
+  run->rows = 0;
+  return 0;
+}
+
+/*
+expr_header: lee la cabecera con los nombres de las columnas
+Devuelve 0 si fue bien, -1 si falta alguna variable o hay demasiadas columnas.
+*/
+int expr_header(ExprRun *run, const char *line, size_t len) {
+  char message[EXPR_NAME_MAX + 64];
+  const char *name;
+  size_t name_len;
+  size_t i;
+  int found[EXPR_VARS];
+  int v;
+
+  memset(found, 0, sizeof(found));
+  i = 0;
+  while (i < len) {
+    if (line[i] == ' ' || line[i] == '\t' || line[i] == '\r') {
+      i++;
+      continue;
+    }
+    name = line + i;
+    while (i < len && line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+      i++;
+    }
+    name_len = (size_t)(line + i - name);
+    if (run->ncolumns == EXPR_COLUMNS) {
+      print_error("Error: demasiadas columnas en la cabecera\n", 42);
+      return -1;
+    }
+    run->column_reg[run->ncolumns] = -1;
+    for (v = 0; v < run->program.nvars; v++) {
+      if (!found[v] && name_len <= EXPR_NAME_MAX && memcmp(run->program.var_name[v], name, name_len) == 0 &&
+          run->program.var_name[v][name_len] == '\0') {
+        found[v] = 1;
+        run->column_reg[run->ncolumns] = run->program.var_reg[v];
+      }
+    }
+    run->ncolumns++;
+  }
+  for (v = 0; v < run->program.nvars; v++) {
+    if (!found[v]) {
+      len = (size_t)str_len(run->program.var_name[v]);
+      memcpy(message, "Error: la variable ", 19);
+      memcpy(message + 19, run->program.var_name[v], len);
+      memcpy(message + 19 + len, " no esta en la cabecera\n", 24);
+      print_error(message, (int)len + 43);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+expr_add_line: anade una linea de la entrada (la primera no vacia es la cabecera)
+Los valores de las columnas que usa la expresion van a sus registros; las
+demas no se leen. Una fila con un valor invalido o con distinto numero de
+valores que la cabecera se apunta con su error.
+Devuelve 0 si fue bien, -1 si hubo un error que para todo.
+*/
+int expr_add_line(ExprRun *run, const char *line, size_t len) {
+  const char *field;
+  const char *error;
+  size_t i;
+  int column;
+  int reg;
+  int row;
+
+  i = 0;
+  while (i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) {
+    i++;
+  }
+  if (i == len) {
+    return 0; /*linea en blanco*/
+  }
+  if (run->ncolumns == 0) {
+    return expr_header(run, line, len);
+  }
+  row = run->rows;
+  error = NULL;
+  column = 0;
+  while (i < len) {
+    if (line[i] == ' ' || line[i] == '\t' || line[i] == '\r') {
+      i++;
+      continue;
+    }
+    field = line + i;
+    while (i < len && line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+      i++;
+    }
+    reg = column < run->ncolumns ? run->column_reg[column] : -1;
+    if (reg >= 0 && error == NULL && parse_int(field, (size_t)(line + i - field), &expr_reg(run, reg)[row]) != 0) {
+      error = "numeros invalidos";
+    }
+    column++;
+  }
+  if (column != run->ncolumns) {
+    error = "el numero de valores no coincide con la cabecera";
+  }
+  run->row_line[row] = run->line_number;
+  run->row_error[row] = error;
+  run->rows++;
+  if (run->rows == EXPR_ROWS) {
+    return expr_rows_flush(run);
+  }
+  return 0;
+}
+
+/*
+expr_once: calcula una expresion sin variables y escribe su resultado
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int expr_once(ExprRun *run) {
+  const char *error;
+  char text[NUMTEXT_INT_MAX + 1];
+  int len;
+
+  if (run->program.nvars > 0) {
+    print_error("Error: la expresion tiene variables: sus valores van en <fichero> o por stdin (-)\n", 82);
+    return -1;
+  }
+  run->rows = 1;
+  expr_eval(run);
+  if (run->status[0] != 0) {
+    error = calc_error(run->status[0]);
+    if (write_checked(2, "Error: ", 7) < 0 || write_checked(2, error, str_len(error)) < 0 ||
+        write_checked(2, "\n", 1) < 0) {
+      return -1;
+    }
+    return -1;
+  }
+  len = format_int(expr_reg(run, run->program.result)[0], text);
+  text[len++] = '\n';
+  return write_checked(1, text, len);
+}
+
+/*
+expr_run: modo expresion, ./mycalc -e "<expresion>" [<fichero> | -]
+Con in_fd = -1 no hay filas: la expresion no puede tener variables y se
+calcula una vez. Si no, se lee la entrada como en batch_run (en bloques,
+saltando las lineas que no caben en el buffer).
+Devuelve 0 si todas las filas fueron bien, -1 si alguna tuvo un error.
+*/
+int expr_run(const char *expression, int in_fd) {
+  ExprRun *run;
+  char *in;
+  char *p;
+  char *nl;
+  size_t have;
+  size_t rest;
+  ssize_t nread;
+  int skipping;
+  int status;
+  int reg;
+  int r;
+
+  run = malloc(sizeof(ExprRun));
+  if (run == NULL) {
+    print_error("Error: memoria insuficiente\n", 28);
+    return -1;
+  }
+  if (expr_compile(&run->program, expression) < 0) {
+    free(run);
+    return -1;
+  }
+  run->kernel = column_kernel_select();
+  run->regs = calloc((size_t)run->program.nregs * EXPR_ROWS, sizeof(int));
+  run->out = malloc(BATCH_OUT_SIZE);
+  run->err = malloc(BATCH_ERR_SIZE);
+  in = in_fd >= 0 ? malloc(BATCH_IN_SIZE + 1) : NULL;
+  if (run->regs == NULL || run->out == NULL || run->err == NULL || (in_fd >= 0 && in == NULL)) {
+    print_error("Error: memoria insuficiente\n", 28);
+    free(run->regs);
+    free(run->out);
+    free(run->err);
+    free(run);
+    free(in);
+    return -1;
+  }
+  for (reg = 0; reg < run->program.nregs; reg++) {
+    for (r = 0; run->program.is_const[reg] && r < EXPR_ROWS; r++) {
+      expr_reg(run, reg)[r] = run->program.value[reg];
+    }
+  }
+  run->ncolumns = 0;
+  run->line_number = 0;
+  run->errors = 0;
+  run->rows = 0;
+  run->out_used = 0;
+  run->err_used = 0;
+
+  status = 0;
+  have = 0;
+  skipping = 0;
+  while (in_fd >= 0 && status == 0) {
+    nread = read(in_fd, in + have, BATCH_IN_SIZE - have);
+    if (nread < 0) {
+      print_error("Error: no se pudo leer la entrada\n", 34);
+      status = -1;
+      break;
+    }
+    have += (size_t)nread;
+    p = in;
+    while (status == 0 && (nl = memchr(p, '\n', (size_t)(in + have - p))) != NULL) {
+      run->line_number++;
+      if (skipping) {
+        skipping = 0; /*final de una linea demasiado larga que ya hemos contado*/
+      } else {
+        status = expr_add_line(run, p, (size_t)(nl - p));
+      }
+      p = nl + 1;
+    }
+    rest = (size_t)(in + have - p);
+    if (nread == 0) {
+      /*ultima linea sin '\n'*/
+      if (status == 0 && rest > 0 && !skipping) {
+        run->line_number++;
+        status = expr_add_line(run, p, rest);
+      }
+      break;
+    }
+    if (rest == BATCH_IN_SIZE) {
+      /*se cuenta como fila con error (la cabecera no puede ser tan larga), una sola vez aunque ocupe varios buffers*/
+      if (!skipping) {
+        run->row_line[run->rows] = run->line_number + 1;
+        run->row_error[run->rows] = "linea demasiado larga";
+        run->rows++;
+        if (run->rows == EXPR_ROWS) {
+          status = expr_rows_flush(run);
+        }
+      }
+      skipping = 1;
+      rest = 0;
+    }
+    memmove(in, p, rest);
+    have = rest;
+  }
+  if (in_fd < 0) {
+    status = expr_once(run);
+  } else if (status == 0) {
+    status = expr_rows_flush(run);
+  }
+  if (expr_flush(run) < 0) {
+    status = -1;
+  }
+
+  free(in);
+  free(run->regs);
+  free(run->out);
+  free(run->err);
+  if (status == 0 && run->errors > 0) {
+    status = -1;
+  }
+  free(run);
+  return status;
+}
+
+/*
+Connection: un cliente del modo servidor
+
+En in guardamos lo que llega hasta tener lineas completas y en out las
+respuestas que aun no hemos podido enviar. events son los eventos que
+tenemos pedidos a epoll para su descriptor.
+*/
+typedef struct {
+  int fd;
+  uint32_t events;
+  int closing;       /*el cliente ya no va a mandar mas: le contestamos y cerramos*/
+  int dead;          /*error al leer o al escribir: cerramos sin contestar*/
+  char in[SERVER_IN_SIZE + 1];
+  size_t in_used;
+  char *out;
+  size_t out_used;
+  size_t out_sent;
+  size_t out_cap;
+} Connection;
+
+/*
+server_clear: deja libre la ruta socket_path (con direccion addr) para el bind
+
+Solo borramos lo que haya en la ruta si es un socket al que ya no escucha
+nadie (el de un servidor que murio): nunca un fichero (mycalc.log, por
+ejemplo) ni el socket de otro servidor que sigue vivo. Para saber si esta
+vivo probamos a conectarnos: si nadie escucha connect falla con
+ECONNREFUSED.
+Devuelve 0 si la ruta esta libre, -1 si no (y ya se ha dado el error).
+*/
+int server_clear(const char *socket_path, const struct sockaddr_un *addr) {
+  struct stat st;
+  int fd;
+  int status;
+
+  if (lstat(socket_path, &st) < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    print_error("Error: no se pudo escuchar en el socket\n", 40);
+    return -1;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    print_error("Error: la ruta del socket existe y no es un socket\n", 51);
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    print_error("Error: no se pudo crear el socket\n", 34);
+    return -1;
+  }
+  status = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+  if (status < 0 && errno == ECONNREFUSED) {
+    close(fd);
+    if (unlink(socket_path) < 0 && errno != ENOENT) {
+      print_error("Error: no se pudo escuchar en el socket\n", 40);
+      return -1;
+    }
+    return 0;
+  }
+  close(fd);
+  if (status == 0) {
+    print_error("Error: ya hay un servidor escuchando en el socket\n", 50);
+  } else {
+    print_error("Error: no se pudo escuchar en el socket\n", 40);
+  }
+  return -1;
+}
+
+/*
+server_listen: crea el socket Unix en el que escucha el servidor
+Si en la ruta queda el socket de un servidor que ya no esta, lo sustituye
+(ver server_clear).
+Devuelve su descriptor, o -1 si hubo algun error.
+*/
+int server_listen(const char *socket_path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    print_error("Error: ruta del socket demasiado larga\n", 39);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, socket_path, strlen(socket_path));
+  if (server_clear(socket_path, &addr) < 0) {
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    print_error("Error: no se pudo crear el socket\n", 34);
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SERVER_BACKLOG) < 0) {
+    print_error("Error: no se pudo escuchar en el socket\n", 40);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+conn_reply: añade len bytes de text a las respuestas pendientes de conn
+Si no hay memoria para guardarlas damos el cliente por perdido.
+*/
+void conn_reply(Connection *conn, const char *text, size_t len) {
+  char *bigger;
+  size_t cap;
+
+  if (conn->out_used + len > conn->out_cap) {
+    cap = conn->out_cap > 0 ? conn->out_cap : SERVER_IN_SIZE;
+    while (cap < conn->out_used + len) {
+      cap *= 2;
+    }
+    bigger = realloc(conn->out, cap);
+    if (bigger == NULL) {
+      conn->dead = 1;
+      return;
+    }
+    conn->out = bigger;
+    conn->out_cap = cap;
+  }
+  memcpy(conn->out + conn->out_used, text, len);
+  conn->out_used += len;
+}
+
+/*
+conn_request: calcula una linea "num1 op num2" de conn y prepara su respuesta
+
+La linea "Operación: ..." se escribe en out de batch, que es lo que ira al
+log en la siguiente escritura en grupo, y se copia tal cual como respuesta.
+Los errores solo se le contestan al cliente ("Error: ..."), como los
+escribiria el modo calculador. A cada linea le corresponde una respuesta,
+asi que una en blanco tambien es un error.
+Devuelve 0 si fue bien, -1 si no se pudo escribir en el log.
+*/
+int conn_request(Connection *conn, Batch *batch, char *line, size_t len) {
+  char text[OPERATION_TEXT_MAX];
+  const char *error;
+  int written;
+  int error_len;
+
+  if (batch_reserve(batch) < 0) {
+    return -1;
+  }
+  written = eval_operation(line, len, batch->out + batch->out_used,
+                           batch->binary ? batch->bin + batch->bin_used : NULL, batch->stamp, &error);
+  if (written > 0) {
+    conn_reply(conn, batch->out + batch->out_used, (size_t)written);
+    return batch_commit(batch, (size_t)written);
+  }
+  if (written == 0) {
+    error = "se esperaba <num1> <op> <num2>";
+  }
+  error_len = str_len(error);
+  memcpy(text, "Error: ", 7);
+  memcpy(text + 7, error, (size_t)error_len);
+  text[7 + error_len] = '\n';
+  conn_reply(conn, text, (size_t)(7 + error_len + 1));
+  return 0;
+}
+
+/*
+conn_read: lee lo que haya llegado de conn y atiende sus lineas completas
+
+Si el cliente cierra, la ultima linea aunque no lleve '\n' tambien se
+calcula. Una linea que no cabe en in se contesta con un error y se cierra
+la conexion, porque ya no sabriamos donde empieza la siguiente.
+Devuelve 0 si fue bien, -1 si no se pudo escribir en el log.
+*/
+int conn_read(Connection *conn, Batch *batch) {
+  ssize_t nread;
+  char *p;
+  char *nl;
+  size_t rest;
+
+  nread = read(conn->fd, conn->in + conn->in_used, SERVER_IN_SIZE - conn->in_used);
+  if (nread < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      conn->dead = 1;
+    }
+    return 0;
+  }
+  if (nread == 0) {
+    conn->closing = 1;
+  }
+  conn->in_used += (size_t)nread;
+  p = conn->in;
+  while ((nl = memchr(p, '\n', (size_t)(conn->in + conn->in_used - p))) != NULL) {
+    if (conn_request(conn, batch, p, (size_t)(nl - p)) < 0) {
+      return -1;
+    }
+    p = nl + 1;
+  }
+  rest = (size_t)(conn->in + conn->in_used - p);
+  if (conn->closing && rest > 0) {
+    if (conn_request(conn, batch, p, rest) < 0) {
+      return -1;
+    }
+    rest = 0;
+  }
+  if (rest == SERVER_IN_SIZE) {
+    conn_reply(conn, "Error: linea demasiado larga\n", 29);
+    conn->closing = 1;
+    rest = 0;
+  }
+  memmove(conn->in, p, rest);
+  conn->in_used = rest;
+  return 0;
+}
+
+/*
+conn_send: envia todo lo que se pueda de las respuestas pendientes de conn
+*/
+void conn_send(Connection *conn) {
+  ssize_t sent;
+
+  while (!conn->dead && conn->out_sent < conn->out_used) {
+    /*MSG_NOSIGNAL: un cliente que cierra antes de leer no debe matar al servidor con SIGPIPE*/
+    sent = send(conn->fd, conn->out + conn->out_sent, conn->out_used - conn->out_sent, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        conn->dead = 1;
+      }
+      break;
+    }
+    conn->out_sent += (size_t)sent;
+  }
+  if (conn->out_sent == conn->out_used) {
+    conn->out_used = 0;
+    conn->out_sent = 0;
+  }
+}
+
+/*
+conn_update: pide a epoll los eventos que ahora interesan de conn
+
+Dejamos de leer de un cliente que tiene mas de SERVER_OUT_MAX bytes de
+respuestas sin recoger, hasta que las lea; y esperamos a poder escribir
+solo cuando queda algo por enviar.
+Devuelve 0 si la conexion sigue, -1 si ya se puede cerrar.
+*/
+int conn_update(int epoll_fd, Connection *conn) {
+  struct epoll_event ev;
+  uint32_t events;
+
+  if (conn->dead) {
+    return -1;
+  }
+  events = 0;
+  if (!conn->closing && conn->out_used - conn->out_sent <= SERVER_OUT_MAX) {
+    events |= EPOLLIN;
+  }
+  if (conn->out_sent < conn->out_used) {
+    events |= EPOLLOUT;
+  }
+  if (events == 0) {
+    return -1;
+  }
+  if (events != conn->events) {
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+      return -1;
+    }
+    conn->events = events;
+  }
+  return 0;
+}
+
+/*
+conn_close: cierra la conexion y libera su memoria
+*/
+void conn_close(Connection *conn) {
+  close(conn->fd); /*al cerrar el descriptor epoll ya no lo vigila*/
+  free(conn->out);
+  free(conn);
+}
+
+/*
+server_accept: acepta todas las conexiones que esten esperando
+*/
+void server_accept(int epoll_fd, int listen_fd) {
+  struct epoll_event ev;
+  Connection *conn;
+  int fd;
+
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    conn = calloc(1, sizeof(Connection));
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      conn_close(conn);
+    }
+  }
+}
+
+/*
+server_run: modo servidor, atiende operaciones por el socket Unix socket_path
+
+Un solo proceso atiende a todos los clientes con epoll. Cada vuelta del
+bucle lee de todos los clientes que tienen algo, calcula sus lineas en el
+mismo Batch que el modo por lotes, escribe de una vez en el log todas las
+operaciones de la vuelta (escritura en grupo, con su indice) y solo
+entonces envia las respuestas: cuando un cliente recibe su resultado la
+linea ya esta en mycalc.log. Como no queda nada a medias entre vueltas, el
+servidor se puede matar en cualquier momento. Con --sync=batch cada
+escritura en grupo paga un solo fdatasync para todos los clientes, con
+binary = 1 las operaciones van al log binario y limits dice cuando rotar
+mycalc.log.
+Solo termina si hay un error (o si lo matan). Devuelve -1.
+*/
+int server_run(const char *socket_path, int sync, int binary, const SegmentLimits *limits) {
+  struct epoll_event events[SERVER_EVENTS];
+  struct epoll_event ev;
+  Connection *ready[SERVER_EVENTS];
+  Connection *conn;
+  Batch batch;
+  int listen_fd;
+  int epoll_fd;
+  int nevents;
+  int nready;
+  int status;
+  int i;
+
+  listen_fd = server_listen(socket_path);
+  if (listen_fd < 0) {
+    return -1;
+  }
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    print_error("Error: epoll no esta disponible\n", 32);
+    close(listen_fd);
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; /*el socket de escucha es el unico sin Connection*/
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0 || batch_open(&batch, 0, sync, binary, limits) < 0) {
+    close(epoll_fd);
+    close(listen_fd);
+    return -1;
+  }
+  if (write_checked(1, "Escuchando en ", 14) < 0 ||
+      write_checked(1, socket_path, str_len(socket_path)) < 0 || write_checked(1, "\n", 1) < 0) {
+    status = -1;
+  } else {
+    status = 0;
+  }
+
+  while (status == 0) {
+    nevents = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+    if (nevents < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    nready = 0;
+    for (i = 0; i < nevents && status == 0; i++) {
+      conn = events[i].data.ptr;
+      if (conn == NULL) {
+        server_accept(epoll_fd, listen_fd);
+        continue;
+      }
+      if ((conn->events & EPOLLIN) != 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0) {
+        status = conn_read(conn, &batch);
+      }
+      ready[nready++] = conn;
+    }
+    if (status < 0 || batch_flush(&batch) < 0) {
+      print_error("Error: no se pudo escribir en mycalc.log\n", 41);
+      break;
+    }
+    for (i = 0; i < nready; i++) {
+      conn_send(ready[i]);
+      if (conn_update(epoll_fd, ready[i]) < 0) {
+        conn_close(ready[i]);
+      }
+    }
+  }
+
+  batch_close(&batch);
+  close(epoll_fd);
+  close(listen_fd);
+  return -1;
+}
+
+/*
+client_run: modo cliente, manda una operacion al servidor de socket_path
+
+args son num1, op y num2, como en el modo calculadora, y la respuesta se
+escribe igual que la escribiria el: el resultado por stdout y los errores
+por stderr. Los espacios separan los campos en el protocolo, asi que un
+argumento con espacios (o vacio) ya es un error aqui.
+Devuelve 0 si la operacion fue bien, -1 si no.
+*/
+int client_run(const char *socket_path, char *args[]) {
+  struct sockaddr_un addr;
+  char request[BATCH_LINE_MAX + 1];
+  char reply[OPERATION_TEXT_MAX + 1];
+  size_t used;
+  ssize_t nread;
+  int arg_len;
+  int len;
+  int fd;
+  int i;
+  int j;
+
+  len = 0;
+  for (i = 0; i < 3; i++) {
+    arg_len = str_len(args[i]);
+    j = 0;
+    while (j < arg_len && args[i][j] != ' ' && args[i][j] != '\t' && args[i][j] != '\r' && args[i][j] != '\n') {
+      j++;
+    }
+    if (arg_len == 0 || j < arg_len || len + arg_len + 1 > BATCH_LINE_MAX) {
+      if (i == 1) {
+        print_error("Error: operador invalido\n", 25);
+      } else {
+        print_error("Error: numeros invalidos\n", 25);
+      }
+      return -1;
+    }
+    memcpy(request + len, args[i], (size_t)arg_len);
+    request[len + arg_len] = i < 2 ? ' ' : '\n';
+    len += arg_len + 1;
+  }
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    print_error("Error: ruta del socket demasiado larga\n", 39);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, socket_path, strlen(socket_path));
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    print_error("Error: no se pudo conectar con el servidor\n", 43);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  if (write_checked(fd, request, len) < 0) {
+    close(fd);
+    return -1;
+  }
+  /*la respuesta es una sola linea*/
+  used = 0;
+  while (used == 0 || reply[used - 1] != '\n') {
+    nread = read(fd, reply + used, sizeof(reply) - used);
+    if (nread <= 0 || used + (size_t)nread == sizeof(reply)) {
+      print_error("Error: respuesta invalida del servidor\n", 39);
+      close(fd);
+      return -1;
+    }
+    used += (size_t)nread;
+  }
+  close(fd);
+  if (used >= 7 && memcmp(reply, "Error: ", 7) == 0) {
+    print_error(reply, (int)used);
+    return -1;
+  }
+  return write_checked(1, reply, (int)used);
+}
+
+/*
+binlog_convert: pasa el log de texto mycalc.log al log binario mycalc.log.bin
+
+Cada linea "Operación: num1 op num2 = resultado" se vuelve a calcular con
+eval_operation y se guarda como registro, con marca de tiempo 0 porque el
+log de texto no la tiene. Una linea que no es una operacion o cuyo
+resultado no coincide para la conversion. Las que tienen algun numero
+escrito de otra forma (por ejemplo "007", "+3" o " 4", que to_int tambien
+acepta) se convierten, pero desde
+el binario saldran escritas de la forma normal: las contamos y lo decimos
+al terminar. Escribimos en un fichero temporal y al final lo ponemos en
+lugar del anterior (con link y unlink: rename es de stdio.h), asi si algo
+falla el mycalc.log.bin anterior sigue como estaba. Un mycalc.log con
+segmentos no se convierte.
+Devuelve 0 si fue bien, -1 si hubo algun error.
+*/
+int binlog_convert(void) {
+  unsigned char records[BINLOG_READ_RECORDS * BINLOG_RECORD_SIZE];
+  char line[BATCH_LINE_MAX + 1];
+  char text[OPERATION_TEXT_MAX];
+  struct stat st;
+  const char *map;
+  const char *nl;
+  const char *eq;
+  const char *res;
+  const char *error;
+  size_t size;
+  size_t pos;
+  size_t len;
+  size_t res_len;
+  int pending;
+  int converted;
+  int changed;
+  int written;
+  int in_fd;
+  int out_fd;
+  int status;
+
+  /*solo convertimos un log de un solo fichero*/
+  in_fd = open(SEGMENT_MANIFEST, O_RDONLY);
+  if (in_fd >= 0) {
+    status = manifest_segments(in_fd) > 0 ? -1 : 0;
+    close(in_fd);
+    if (status < 0) {
+      print_error("Error: --convert no admite un mycalc.log con segmentos\n", 55);
+      return -1;
+    }
+  }
+  in_fd = open("mycalc.log", O_RDONLY);
+  if (in_fd < 0) {
+    print_error("Error: no se pudo abrir mycalc.log\n", 35);
+    return -1;
+  }
+  if (fstat(in_fd, &st) < 0) {
+    close(in_fd);
+    return -1;
+  }
+  size = (size_t)st.st_size;
+  map = NULL;
+  if (size > 0) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if (map == MAP_FAILED) {
+      print_error("Error: no se pudo leer mycalc.log\n", 34);
+      close(in_fd);
+      return -1;
+    }
+  }
+  out_fd = open(BINLOG_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0) {
+    print_error("Error: no se pudo crear mycalc.log.bin\n", 39);
+    if (map != NULL) {
+      munmap((void *)map, size);
+    }
+    close(in_fd);
+    return -1;
+  }
+
+  status = 0;
+  pos = 0;
+  pending = 0;
+  converted = 0;
+  changed = 0;
+  while (status == 0 && pos < size) {
+    nl = memchr(map + pos, '\n', size - pos);
+    len = nl != NULL ? (size_t)(nl - map) - pos : size - pos;
+    /*"Operación: " delante y " = resultado" detras; lo de en medio es lo que calculamos*/
+    eq = len > 12 ? memmem(map + pos + 12, len - 12, " = ", 3) : NULL;
+    if (eq == NULL || memcmp(map + pos, "Operación: ", 12) != 0 ||
+        (size_t)(eq - map) - pos - 12 > BATCH_LINE_MAX) {
+      status = -1;
+      break;
+    }
+    memcpy(line, map + pos + 12, (size_t)(eq - map) - pos - 12);
+    written = eval_operation(line, (size_t)(eq - map) - pos - 12, text,
+                             records + pending * BINLOG_RECORD_SIZE, 0, &error);
+    /*el resultado tiene que ser el mismo; los numeros pueden estar escritos de otra forma (" 4", "007", "+3")*/
+    res_len = len - ((size_t)(eq - map) - pos) - 3;
+    res = written > 12 ? memmem(text + 12, (size_t)written - 12, " = ", 3) : NULL;
+    if (res == NULL || (size_t)(text + written - 1 - (res + 3)) != res_len || memcmp(res + 3, eq + 3, res_len) != 0) {
+      status = -1;
+      break;
+    }
+    written = binlog_render(records + pending * BINLOG_RECORD_SIZE, text);
+    if ((size_t)written != len + 1 || memcmp(text, map + pos, len) != 0) {
+      changed++;
+    }
+    converted++;
+    pending++;
+    if (pending == BINLOG_READ_RECORDS) {
+      status = write_checked(out_fd, (const char *)records, pending * BINLOG_RECORD_SIZE);
+      pending = 0;
+    }
+    pos += len + 1;
+  }
+  if (status == 0 && pending > 0) {
+    status = write_checked(out_fd, (const char *)records, pending * BINLOG_RECORD_SIZE);
+  }
+  if (map != NULL) {
+    munmap((void *)map, size);
+  }
+  close(in_fd);
+  if (close(out_fd) < 0 || status < 0 || (unlink(BINLOG_FILE) < 0 && errno != ENOENT) ||
+      link(BINLOG_FILE ".tmp", BINLOG_FILE) < 0) {
+    if (pos < size) {
+      print_error("Error: la linea ", 16);
+      written = format_int(converted + 1, text);
+      print_error(text, written);
+      print_error(" de mycalc.log no es una operacion valida\n", 42);
+    } else {
+      print_error("Error: no se pudo escribir mycalc.log.bin\n", 42);
+    }
+    unlink(BINLOG_FILE ".tmp");
+    return -1;
+  }
+  unlink(BINLOG_FILE ".tmp");
+
+  written = format_int(converted, text);
+  if (write_checked(1, "Convertidas ", 12) < 0 || write_checked(1, text, written) < 0 ||
+      write_checked(1, " operaciones a mycalc.log.bin\n", 30) < 0) {
+    return -1;
+  }
+  if (changed > 0) {
+    written = format_int(changed, text);
+    if (write_checked(1, text, written) < 0 ||
+        write_checked(1, " tienen numeros escritos de otra forma y saldran normalizados\n", 62) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+parse_sync: convierte el valor de --sync= (none, batch o always) en SYNC_*
+Devuelve la politica, o -1 si el valor no es valido.
+*/
+int parse_sync(const char *text) {
+  if (strcmp(text, "none") == 0) {
+    return SYNC_NONE;
+  }
+  if (strcmp(text, "batch") == 0) {
+    return SYNC_BATCH;
+  }
+  if (strcmp(text, "always") == 0) {
+    return SYNC_ALWAYS;
+  }
+  return -1;
+}
+
+/*
+main: punto de entrada y logica principal del programa.
+
+Lo primero es mirar los argumentos para ver el modo que estamos.
+Si el el primer argumento es '-b' y hay 3 argumentos, estamos en modo historial.
+(si el segundo es "primera:ultima" escribimos ese rango de lineas).
+Si el primer argumento es '-t' y hay 3 argumentos, escribimos las ultimas N operaciones.
+Con '-f <fichero>' o '-' calculamos todas las operaciones del fichero o de stdin.
+Con '-s <socket>' hacemos de servidor y con '-c <socket> <num1> <op> <num2>' de cliente.
+Delante de cualquier modo puede ir '--sync=none|batch|always', que dice cuando
+hacemos fdatasync del log en los modos que escriben en el (por defecto nunca),
+y '--binlog', para usar el log binario mycalc.log.bin en lugar de mycalc.log.
+Con '--convert' pasamos mycalc.log a mycalc.log.bin.
+Delante tambien pueden ir '--segment-size=<bytes>' y '--segment-lines=<N>', que
+dicen cuando pasa mycalc.log a ser un segmento cerrado (por defecto nunca), y con
+'--compress' comprimimos los segmentos cerrados.
+Con '-e <expresion>' calculamos una expresion, una vez o por cada fila de un fichero o de stdin.
+Si hay 4 argumentos, estamos en modo calculadora.
+Cualquier otra combinacion de argumentos es invalida y mostramos el mensaje de uso.
+*/
+int main(int argc, char *argv[]) {
+  int a;
+  int b;
+  int result;
+  int line_number;
+  int last_line;
+  int range;
+  int fd;
+  int status;
+  char op;
+  char result_text[20];
+  int result_len;
+  int line_len;
+  int calc_status;
+  int sync;
+  int binary;
+  int value;
+  SegmentLimits limits;
+  unsigned char record[BINLOG_RECORD_SIZE];
+
+  /*--sync=none|batch|always, --binlog y --segment-* van siempre lo primero; los quitamos de los argumentos*/
+  sync = SYNC_NONE;
+  binary = 0;
+  limits.max_bytes = 0;
+  limits.max_lines = 0;
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1] == '-') {
+    if (strncmp(argv[1], "--sync=", 7) == 0) {
+      sync = parse_sync(argv[1] + 7);
+      if (sync < 0) {
+        print_error("Error: --sync debe ser none, batch o always\n", 44);
+        return -1;
+      }
+    } else if (strcmp(argv[1], "--binlog") == 0) {
+      binary = 1;
+    } else if (strncmp(argv[1], "--segment-size=", 15) == 0) {
+      if (to_int(argv[1] + 15, &value) != 0 || value < 0) {
+        print_error("Error: --segment-size debe ser un numero de bytes\n", 50);
+        return -1;
+      }
+      limits.max_bytes = (uint64_t)value;
+    } else if (strncmp(argv[1], "--segment-lines=", 16) == 0) {
+      if (to_int(argv[1] + 16, &value) != 0 || value < 0) {
+        print_error("Error: --segment-lines debe ser un numero de lineas\n", 52);
+        return -1;
+      }
+      limits.max_lines = value;
+    } else {
+      break;
+    }
+    argc--;
+    argv++;
+  }
+
+  /*CONVERSION: ./mycalc --convert pasa mycalc.log a mycalc.log.bin*/
+  if (argc == 2 && strcmp(argv[1], "--convert") == 0) {
+    return binlog_convert();
+  }
+
+  /*COMPRESION: ./mycalc --compress comprime los segmentos cerrados de mycalc.log*/
+  if (argc == 2 && strcmp(argv[1], "--compress") == 0) {
+    return log_compress();
+  }
+
+  /*MODO HISTOSIAL: ./ mycalc -b <numero_de_linea> */
+  if (argc == 3 && is_history_mode(argv[1]) == 1) {
+    /*con "primera:ultima" escribimos todo el rango de una vez*/
+    range = parse_range(argv[2], &line_number, &last_line);
+    if (range < 0) {
+      print_error("Error: rango de lineas invalido\n", 32);
+      return -1;
+    }
+    if (range == 1) {
+      return binary ? binlog_lines(line_number, last_line, 0) : history_lines(line_number, last_line, 0);
+    }
+    /*el numero de linea tiene que ser un entero positivo*/
+    if (to_int(argv[2], &line_number) != 0 || line_number <= 0) {
+      print_error("Error: numero de operacion invalido\n", 36);
+      return -1;
+    }
+    /*en el log binario la linea esta en una posicion fija: un solo pread*/
+    if (binary) {
+      return binlog_lines(line_number, line_number, 0);
+    }
+    /*en el de texto, en mycalc.log o en el segmento que diga el manifiesto*/
+    return history_line(line_number);
+  }
+
+  /*MODO COLA: ./mycalc -t <N> escribe las N ultimas operaciones*/
+  if (argc == 3 && is_tail_mode(argv[1]) == 1) {
+    if (to_int(argv[2], &line_number) != 0 || line_number <= 0) {
+      print_error("Error: numero de operaciones invalido\n", 38);
+      return -1;
+    }
+    return binary ? binlog_lines(0, 0, line_number) : history_lines(0, 0, line_number);
+  }
+
+  /*MODO POR LOTES: ./mycalc -f <fichero> o ./mycalc - (stdin)*/
+  if (argc == 2 && argv[1][0] == '-' && argv[1][1] == '\0') {
+    return batch_run(0, sync, binary, &limits);
+  }
+  if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 'f' && argv[1][2] == '\0') {
+    fd = open(argv[2], O_RDONLY);
+    if (fd < 0) {
+      print_error("Error: no se pudo abrir el fichero de operaciones\n", 50);
+      return -1;
+    }
+    status = batch_run(fd, sync, binary, &limits);
+    close(fd);
+    return status;
+  }
+
+  /*MODO SERVIDOR: ./mycalc -s <socket>, y su cliente: ./mycalc -c <socket> <num1> <op> <num2>*/
+  if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 's' && argv[1][2] == '\0') {
+    return server_run(argv[2], sync, binary, &limits);
+  }
+  if (argc == 6 && argv[1][0] == '-' && argv[1][1] == 'c' && argv[1][2] == '\0') {
+    return client_run(argv[2], argv + 3);
+  }
+
+  /*MODO EXPRESION: ./mycalc -e "<expresion>" [<fichero> | -]*/
+  if ((argc == 3 || argc == 4) && argv[1][0] == '-' && argv[1][1] == 'e' && argv[1][2] == '\0') {
+    if (argc == 3) {
+      return expr_run(argv[2], -1);
+    }
+    if (argv[3][0] == '-' && argv[3][1] == '\0') {
+      return expr_run(argv[2], 0);
+    }
+    fd = open(argv[3], O_RDONLY);
+    if (fd < 0) {
+      print_error("Error: no se pudo abrir el fichero de valores\n", 46);
+      return -1;
+    }
+    status = expr_run(argv[2], fd);
+    close(fd);
+    return status;
+  }
+
+  /*MODO CALCULADORA: ./mycalc <num1> <op> <num2>*/
+
+  if (argc != 4) {
+    print_usage();
+    return -1;
+  }
+  /*convertimos los argumentos de texto a entero*/
+  if (to_int(argv[1], &a) != 0 || to_int(argv[3], &b) != 0) {
+    print_error("Error: numeros invalidos\n", 25);
+    return -1;
+  }
+  /* el operador tiene que ser exactamente un caracter, no mas */
+  if (argv[2][1] != '\0') {
+    print_error("Error: operador invalido\n", 25);
+    return -1;
+  }
+
+  op = argv[2][0];
+  /* calculamos y gestionamos cada tipo de error posible */
+  calc_status = compute_result(a, b, op, &result);
+  if (calc_status == -1) {
+    print_error("Error: operador invalido\n", 25);
+    return -1;
+  }
+  if (calc_status == -2) {
+    print_error("Error: Division por cero\n", 25);
+    return -1;
+  }
+  if (calc_status == -3) {
+    print_error("Error: overflow en operacion\n", str_len("Error: overflow en operacion\n"));
+    return -1;
+  }
+  
+  /*
+  abrimos el log para añadir la operación al final
+  usamos O_APPEND para no borrar el contenido existente. O_CREAT para crear el archivo si no existe 
+  con --binlog el log es mycalc.log.bin
+  mycalc.log lo bloqueamos hasta terminar (y lo rotamos antes si la linea ya no cabe, ver log_lock)
+  */
+  result_len = format_int(result, result_text);
+  result_text[result_len] = '\0';
+  /*lo que ocupa la linea en mycalc.log (ver write_operation)*/
+  line_len = 18 + str_len(argv[1]) + str_len(argv[2]) + str_len(argv[3]) + result_len;
+  if (binary) {
+    fd = binlog_open();
+  } else {
+    fd = open("mycalc.log", O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+      print_error("Error: no se pudo abrir mycalc.log\n", 35);
+    } else if (log_lock(&fd, &limits, (uint64_t)line_len, NULL) < 0) {
+      fd = -1;
+    }
+  }
+  if (fd < 0) {
+    return -1;
+  }
+
+  /* primero mostramos la operacion por pantalla (fd=1 es stdout) */
+  if (write_operation(1, argv[1], argv[2], argv[3], result_text) < 0) {
+    close(fd);
+    return -1;
+  }
+  /* luego guardamos exactamente la misma linea en el fichero de log (o su registro en el binario) */
+  if (binary) {
+    binlog_encode(record, a, op, b, result, binlog_stamp(time(NULL)));
+    status = write_checked(fd, (const char *)record, BINLOG_RECORD_SIZE);
+  } else {
+    status = write_operation(fd, argv[1], argv[2], argv[3], result_text);
+  }
+  if (status < 0) {
+    close(fd);
+    return -1;
+  }
+  /* con --sync=batch o always la linea tiene que llegar al disco antes de terminar */
+  if (sync != SYNC_NONE && fdatasync(fd) < 0) {
+    print_error("Error: no se pudo sincronizar mycalc.log\n", 41);
+    close(fd);
+    return -1;
+  }
+  /* y apuntamos en el indice donde termina (el log binario no lo necesita) */
+  if (!binary) {
+    index_append(fd, str_len("Operación: ") + str_len(argv[1]) + str_len(argv[2]) + str_len(argv[3]) + result_len + 6);
+  }
+
+  close(fd);
+  return 0;
+}
@@ -1,320 +1,5768 @@
-/*
-mydu.c - Calculador del tamaño de directorios con historial 
-
-Este programa recorre un directorio de forma recursiva y calcula cuanto espacio
-ocupa en KB. Ademas guarda cada resultado en un fichero binario "mydu.bin" para poder consultarlo posteriormente.
-
-Aqui hemos utilizado printf y perror para mostrar cosas por pantalla. 
-
-Modos de uso:
-./mydu : analiza el directorio actual
-./mydu <directorio> : analiza el directorio especificado
-./mydu -b : muestra el contenido del historial guardado en mydu.bin
-*/
-#include <dirent.h>
-#include <fcntl.h>
-#include <stdio.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
-/* longitud maxima que puede tener una ruta en el sistema */
-#define MAX_PATH_LEN 4096
-#define MAX_ENTRIES 1000
-/* nombre fijo del fichero binario donde guardamos el historial */
-const char *binary_file = "mydu.bin";
-
-/*
- DirEntry: estructura que define como guardamos cada entrada en el fichero binario
-
-Decidimos usar una estrucructura con tamaño fijo para facilitar la lectura y escritura en el 
-fichero binario. Cada entrada tiene un campo de tamaño en KB y otro campo con la ruta del directorio.
- */
-typedef struct {
-  long size_kb; /* tamano del directorio en kilobytes */
-  char path[512]; /* ruta del directorio (maximo 512 caracteres) */
-} DirEntry;
-
-long calculate_dir_size(const char *dirpath);
-/*
- write_binary_entry: guarda una entrada en el fichero binario
-
- Rellenamos la estructura DirEntry y la escribimos de golpe con write().
- Al escribir la estructura entera de una vez nos aseguramos de que
- el fichero tiene siempre entradas de tamano fijo, lo que facilita
- leerlas despues en read_binary_history().
- Devuelve 0 si fue bien, -1 si hubo algun error.
- */
-int write_binary_entry(int fd, long size_kb, const char *path) {
-  DirEntry entry;
-
-  entry.size_kb = size_kb;
-  /* nos aseguramos de que la ruta no es mas larga de lo que cabe en el campo */
-  if (strlen(path) >= sizeof(entry.path)) {
-    fprintf(stderr, "Error: ruta demasiado larga\n");
-    return -1;
-  }
-  strcpy(entry.path, path);
-  /* write devuelve cuantos bytes escribio. Si no son exactamente sizeof(entry), algo fallo */
-  if (write(fd, &entry, sizeof(entry)) != sizeof(entry)) {
-    return -1;
-  }
-  return 0;
-}
-
-/*
- calculate_dir_size: calcula el tamano total de un directorio de forma recursiva
- 
- Esta es la funcion mas importante del programa. La idea es:
- 1. Abrir el directorio y leer sus entradas una a una
- 2. Para cada entrada que sea un subdirectorio, llamarnos a nosotros mismos
- recursividad) para calcular su tamano y sumarlo al total
- 3. Para cada fichero regular, sumar directamente su tamano en bytes
- 
- Usamos lstat() en lugar de stat() porque si hubiera enlaces simbolicos,
- stat() los seguiria y podriamos entrar en un bucle infinito. lstat()
- nos da informacion del enlace en si, no de donde apunta.
- 
- Devuelve el tamano total en BYTES (la conversion a KB la hacemos fuera).
- Devuelve -1 si ocurre algun error.
- */
-long calculate_dir_size(const char *dirpath) {
-  DIR *dir;
-  struct dirent *entry;
-  struct stat st;
-  char fullpath[MAX_PATH_LEN];
-  long total_blocks;
-  long subdir_blocks;
-  long subdir_kb;
-  int fd;
-
-  /* sumamos los bloques del propio directorio primero */
-  if (lstat(dirpath, &st) < 0) {
-    fprintf(stderr, "Error: no se pudo acceder a %s\n", dirpath);
-    return -1;
-  }
-  total_blocks = st.st_blocks;
-
-  /* intentamos abrir el directorio para poder leer sus entradas */
-  dir = opendir(dirpath);
-  if (dir == NULL) {
-    fprintf(stderr, "Error: no se pudo abrir directorio %s\n", dirpath);
-    return -1;
-  }
-
-
-  /*
-   readdir nos va dando las entradas del directorio una a una.
-   Cuando no quedan mas devuelve NULL y salimos del bucle.
-   */
-  while ((entry = readdir(dir)) != NULL) {
-    /*
-     Todos los directorios tienen dos entradas especiales:
-      "."  apunta al propio directorio (a si mismo)
-      ".." apunta al directorio padre
-     Si no las saltamos, la recursion no terminaria nunca.
-     */
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
-
-      /*
-     Construimos la ruta completa uniendo el directorio padre con el nombre de la entrada. Por ejemplo: "testdir" + "subdir1"
-     se convierte en "testdir/subdir1". snprintf nos protege de desbordamientos limitando la longitud.
-     */
-    if (snprintf(fullpath, sizeof(fullpath), "%s/%s", dirpath, entry->d_name) >= MAX_PATH_LEN) {
-      fprintf(stderr, "Error: ruta demasiado larga\n");
-      closedir(dir);
-      return -1;
-    }
-    /* obtenemos informacion sobre este fichero o directorio */
-    if (lstat(fullpath, &st) < 0) {
-      fprintf(stderr, "Error: no se pudo acceder a %s\n", fullpath);
-      closedir(dir);
-      return -1;
-    }
-
-    if (S_ISDIR(st.st_mode)) {
-      /*
-       Es un subdirectorio: nos llamamos a nosotros mismos con su ruta.
-       El resultado es la cantidad de bloques de ese subdirectorio, que sumamos al total del directorio padre.
-       */
-      subdir_blocks = calculate_dir_size(fullpath);
-      if (subdir_blocks < 0) {
-        closedir(dir);
-        return -1;
-      }
-      total_blocks += subdir_blocks;
-        /*
-       Convertimos a KB antes de guardar en el binario.
-       st.st_blocks devuelve los bloques de 512 bytes, asi que para pasarlo a KB (1024 bytes) usamos / 2.
-       */
-      subdir_kb = subdir_blocks / 2;
-      /* guardamos esta entrada en el fichero binario */
-      fd = open(binary_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-      if (fd < 0) {
-        fprintf(stderr, "Error: no se pudo abrir mydu.bin\n");
-        closedir(dir);
-        return -1;
-      }
-      if (write_binary_entry(fd, subdir_kb, fullpath) < 0) {
-        close(fd);
-        closedir(dir);
-        return -1;
-      }
-      close(fd);
-      /* mostramos el subdirectorio y su tamano por pantalla */
-      printf("%ld\t%s\n", subdir_kb, fullpath);
-    } else {
-      /* Es un fichero regular: sumamos sus bloques (de 512B) al total */
-      total_blocks += st.st_blocks;
-    }
-  }
-
-  closedir(dir);
-  return total_blocks;
-}
-
-/*
- read_binary_history: lee el fichero binario y muestra su contenido
- 
- Aprovechamos que las entradas tienen tamano fijo (sizeof(DirEntry))
- para leer el fichero de forma muy sencilla: leemos bloques del
- tamano exacto de la estructura en un bucle hasta llegar al final.
- 
- Si read() devuelve 0 es que llegamos al fin del fichero (normal).
- Si devuelve un numero distinto de sizeof(DirEntry) es que el
- fichero esta corrupto o se escribio mal.
- */
-int read_binary_history(void) {
-  int fd;
-  DirEntry entry;
-  ssize_t nread;
-
-  fd = open(binary_file, O_RDONLY);
-  if (fd < 0) {
-    fprintf(stderr, "Error: no se pudo abrir mydu.bin\n");
-    return -1;
-  }
-
-  printf("--- Contenido del archivo binario ---\n");
-
-  while (1) {
-    /* intentamos leer exactamente una estructura entera */
-    nread = read(fd, &entry, sizeof(entry));
-    if (nread < 0) {
-      fprintf(stderr, "Error: no se pudo leer mydu.bin\n");
-      close(fd);
-      return -1;
-    }
-    if (nread == 0) {
-      break; /* fin de fichero, hemos leido todas las entradas */
-    }
-    if (nread != sizeof(entry)) {
-      /* leimos menos de lo esperado: el fichero no esta bien formado */
-      fprintf(stderr, "Error: entradas binarias corruptas\n");
-      close(fd);
-      return -1;
-    }
-
-    /* mostramos la entrada en formato legible */
-    printf("%ld\t%s\n", entry.size_kb, entry.path);
-  }
-
-  close(fd);
-  return 0;
-}
-
-/*
-is_directory: comprueba si una ruta apunta a un directorio
-
- Usamos lstat() para obtener la informacion y luego la macro S_ISDIR() para comprobar si el campo st_mode indica que es un directorio.
- Esta funcion la necesitamos para rechazar ficheros como argumento, ya que el enunciado dice que solo se aceptan directorios.
- 
- Devuelve: 1 si es directorio, 0 si existe pero no es directorio, -1 si error
- */
-int is_directory(const char *path) {
-  struct stat st;
-
-  if (lstat(path, &st) < 0) {
-    return -1; /* no se pudo acceder: no existe o sin permisos */
-  }
-
-  if (S_ISDIR(st.st_mode)) {
-    return 1;
-  }
-  return 0; /* existe pero es un fichero u otro tipo */
-}
-
-/*
- main: decide que hace el programa segun los argumentos recibidos
- 
- La logica de argumentos es sencilla:
- - Sin argumentos: analizamos "." (el directorio actual)
- - Con "-b": mostramos el historial del binario y terminamos
- - Con un directorio: lo analizamos
- - Con mas de un argumento o un fichero: error
- 
- Tras calcular el tamano, guardamos el directorio raiz en mydu.bin
- y lo mostramos por pantalla como ultima linea de la salida.
- */
-int main(int argc, char *argv[]) {
-  char *target_path;
-  long total_blocks;
-  long total_kb;
-  int fd;
-
-  (void)argc;
-  (void)argv;
-  /* determinamos el directorio objetivo segun los argumentos */
-  if (argc == 1) {
-    /* sin argumentos analizamos el directorio donde estamos */
-    target_path = ".";
-  } else if (argc == 2) {
-    if (strcmp(argv[1], "-b") == 0) {
-      /* modo lectura del historial: solo leemos y mostramos el binario */
-      return read_binary_history();
-    }
-    target_path = argv[1];
-  } else {
-    /* demasiados argumentos, mostramos como se usa */
-    fprintf(stderr, "Uso: ./mydu [<directorio>]\n");
-    fprintf(stderr, "Uso: ./mydu [-b]\n");
-    return -1;
-  }
-
-    /*
-   Comprobamos que el argumento sea un directorio.
-   Si alguien hace ./mydu mycalc.c no tiene sentido y lo rechazamos.
-   El enunciado dice que en ese caso mostramos el nombre y un error.
-   */
-
-  if (is_directory(target_path) != 1) {
-    fprintf(stderr, "%s: No es un directorio\n", target_path);
-    return -1;
-  }
-
-  /* calculamos los bloques totales del directorio de forma recursiva */
-  total_blocks = calculate_dir_size(target_path);
-  if (total_blocks < 0) {
-    return -1;
-  }
-  /* convertimos a KB (cada bloque en st.st_blocks equivale a 512 bytes) */
-  total_kb = total_blocks / 2;
-
-  /* guardamos el resultado en el fichero binario */
-  fd = open(binary_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-  if (fd < 0) {
-    fprintf(stderr, "Error: no se pudo abrir mydu.bin\n");
-    return -1;
-  }
-  if (write_binary_entry(fd, total_kb, target_path) < 0) {
-    close(fd);
-    return -1;
-  }
-  close(fd);
-  /* mostramos el tamaño total del directorio raiz como ultima linea */
-  printf("%ld\t%s\n", total_kb, target_path);
-
-  return 0;
-}
+/*
+mydu.c - Calculador del tamaño de directorios con historial 
+
+Este programa recorre un directorio de forma recursiva y calcula cuanto espacio
+ocupa en KB. Ademas guarda cada resultado en un fichero binario "mydu.bin" para poder consultarlo posteriormente.
+
+Aqui hemos utilizado printf y perror para mostrar cosas por pantalla. 
+
+Modos de uso:
+./mydu : analiza el directorio actual
+./mydu <directorio> : analiza el directorio especificado
+./mydu -b : muestra el contenido del historial guardado en mydu.bin
+./mydu -b [--prefix <ruta> | --path <ruta>] [--last] [--top <N>] [--runs] : consulta el historial
+  (con --runs cada ejecucion va precedida de una linea con su fecha y su raiz)
+./mydu --diff <A> <B> [--threshold <KB>] : que directorios cambiaron entre las ejecuciones A y B (1 = primera, -1 = ultima)
+./mydu --daemon <socket> [<directorio>] : vigila el directorio con inotify y responde consultas por el socket
+./mydu --query <socket> [<ruta>] : pregunta a un mydu --daemon el tamano de una ruta
+./mydu -j <N> [<directorio>] : reparte el recorrido entre N hilos
+./mydu -u [<directorio>] : pide los stat en bloque con io_uring (si el kernel lo permite)
+./mydu -i [<directorio>] : recorrido incremental con la cache mydu.cache
+./mydu -l [<directorio>] : cuenta cada enlace duro (por defecto cada fichero se cuenta una vez)
+./mydu -x [<directorio>] : no sale del sistema de ficheros del directorio
+./mydu --max-depth <N> [<directorio>] : solo muestra los directorios hasta N niveles por debajo
+./mydu --top <N> [<directorio>] : solo muestra los N directorios mas grandes, de mayor a menor
+./mydu --stats[=json] [<directorio>] : al terminar muestra por stderr contadores y tiempos
+./mydu --exclude <patron> [<directorio>] : no cuenta ni recorre las entradas cuyo nombre casa con el patron (se puede repetir)
+./mydu --exclude-from <fichero> [<directorio>] : lo mismo con los patrones de un fichero, uno por linea
+*/
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "numtext.h"
+
+/* capacidad inicial de los buffers de rutas y nombres (crecen si hace falta) */
+#define PATH_INITIAL_CAP 256
+#define MAX_ENTRIES 1000
+/* tamano del buffer donde getdents64 deja las entradas de un directorio */
+#define DENTS_BUF_SIZE (64 * 1024)
+/* una entrada de getdents64 ocupa al menos 24 bytes: cuantas caben como mucho en el buffer */
+#define DENTS_MAX_ENTRIES (DENTS_BUF_SIZE / 24)
+/* huecos del anillo de io_uring (peticiones statx en vuelo a la vez) */
+#define URING_ENTRIES 256
+/* tamano de cada trozo del buffer de mydu.bin y del buffer de stdout */
+#define HISTORY_CHUNK_SIZE (1024 * 1024)
+#define STDOUT_BUF_SIZE (1024 * 1024)
+/* trozos que pasamos como mucho en cada writev (IOV_MAX en Linux) */
+#define HISTORY_MAX_IOV 1024
+/* numero maximo de hilos que aceptamos con -j */
+#define MAX_THREADS 256
+/* capacidad inicial de la cola de trabajo de cada hilo */
+#define DEQUE_INITIAL_CAP 64
+/* maximo de directorios abiertos a la vez en el modo paralelo */
+#define MAX_OPEN_DIRS 256
+/* maximo de directorios abiertos a la vez en el recorrido secuencial (ademas del raiz) */
+#define WALK_OPEN_DIRS 64
+/* descriptores que dejamos libres para lo que no son directorios (stdio, mydu.bin, la cache...) */
+#define OPEN_FD_RESERVE 8
+/* niveles de la pila del recorrido secuencial que reservamos al principio */
+#define WALK_INITIAL_DEPTH 64
+/* capacidad inicial de la lista de ficheros con varios enlaces de un directorio */
+#define LINKS_INITIAL_CAP 16
+/* huecos iniciales de la tabla de inodos ya contados (potencia de dos) */
+#define INODE_SET_INITIAL_CAP 1024
+/* maximo de directorios que se pueden pedir con --top */
+#define TOP_MAX 1000000
+/* maxima profundidad que se puede pedir con --max-depth */
+#define DEPTH_MAX 1000000
+/* memoria que usa --diff para ordenar (se reparte entre sus tres ordenaciones) */
+#define DIFF_MEM_BUDGET (96 * 1024 * 1024)
+/* capacidad inicial del indice de cada ordenacion de --diff */
+#define DIFF_INDEX_INITIAL_CAP 1024
+/* buffer de lectura de cada tramo volcado a disco por --diff */
+#define DIFF_SPILL_BUF_SIZE (64 * 1024)
+/* eventos que vigila el modo demonio en cada directorio */
+#define DAEMON_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | \
+                           IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+/* tamano del buffer donde leemos los eventos de inotify */
+#define DAEMON_EVENT_BUF_SIZE (64 * 1024)
+/* capacidades iniciales de la tabla wd -> nodo y de la lista de directorios pendientes */
+#define DAEMON_WATCHES_INITIAL_CAP 1024
+#define DAEMON_DIRTY_INITIAL_CAP 64
+/* longitud maxima de una consulta al demonio y conexiones en espera */
+#define DAEMON_REQUEST_MAX 4096
+#define DAEMON_BACKLOG 64
+/* clientes que el demonio atiende a la vez y tiempo que le damos a cada uno */
+#define DAEMON_CLIENTS_MAX 64
+#define DAEMON_CLIENT_TIMEOUT_MS 1000
+/* huecos del histograma de latencias de --stats (hasta 2^31 ns, unos 2 s) */
+#define STATS_BUCKETS 32
+/* formatos de --stats */
+#define STATS_TEXT 1
+#define STATS_JSON 2
+/* nombre fijo del fichero binario donde guardamos el historial */
+const char *binary_file = "mydu.bin";
+/* cache del modo incremental (-i), junto a mydu.bin */
+const char *cache_file = "mydu.cache";
+const char *cache_tmp_file = "mydu.cache.tmp";
+#define CACHE_MAGIC "MYDUCACH"
+#define CACHE_MAGIC_LEN 8
+#define CACHE_VERSION 1
+#define CACHE_HEADER_SIZE 32
+#define CACHE_RECORD_SIZE 56
+
+/*
+ ScanOptions: opciones del recorrido que se eligen por linea de comandos
+
+ Las guardamos en una variable global igual que el nombre del binario, asi
+ no hay que pasarlas por todas las funciones del recorrido.
+ */
+typedef struct {
+  int nthreads;  /* hilos del recorrido (-j), 1 = secuencial */
+  int use_uring; /* pedir los stat con io_uring (-u) */
+  int incremental; /* reutilizar mydu.cache para los directorios sin cambios (-i) */
+  int count_links; /* contar los enlaces duros cada vez que aparecen (-l) */
+  int one_fs;      /* no salir del sistema de ficheros del directorio raiz (-x) */
+  dev_t root_dev;  /* dispositivo del directorio raiz, para -x */
+  long max_depth;  /* solo se escriben los directorios hasta esta profundidad (--max-depth), -1 = todos */
+  size_t top;      /* solo se escriben los top mayores (--top), 0 = todos */
+  int save_selected; /* guardar en mydu.bin solo lo que se escribe (--save-selected) */
+  int stats;       /* mostrar estadisticas al terminar (--stats): 0, STATS_TEXT o STATS_JSON */
+} ScanOptions;
+
+ScanOptions options = {1, 0, 0, 0, 0, 0, -1, 0, 0, 0};
+
+/*
+ DirEntry: estructura que define como guardamos cada entrada en el fichero binario (formato v1)
+
+Decidimos usar una estrucructura con tamaño fijo para facilitar la lectura y escritura en el 
+fichero binario. Cada entrada tiene un campo de tamaño en KB y otro campo con la ruta del directorio.
+Es el formato de las primeras versiones: lo seguimos leyendo y, si mydu.bin ya
+existe en este formato, seguimos anadiendo entradas asi para no mezclar formatos.
+ */
+typedef struct {
+  long size_kb; /* tamano del directorio en kilobytes */
+  char path[512]; /* ruta del directorio (maximo 512 caracteres) */
+} DirEntry;
+
+/*
+ FORMATO v2 DE mydu.bin
+
+ Cada entrada v1 ocupa 520 bytes aunque la ruta sea "testdir/subdir", no cabe
+ una ruta de mas de 511 bytes y no se sabe donde empieza cada ejecucion. El
+ formato v2 es asi (enteros fijos en little endian):
+
+   cabecera del fichero: "MYDUBIN\0", version (u32 = 2), reservado (u32)
+   por cada ejecucion:
+     cabecera: magic 'MRUN' (u32), reservado (u32), fecha (i64, segundos
+               desde 1970), numero de entradas (u64), bytes de las entradas
+               (u64), longitud de la raiz (u32) y la raiz
+     entradas: tamano en KB, bytes compartidos con la ruta anterior y
+               longitud del resto (los tres en varint) y el resto de la ruta
+     pie:      magic 'MEND' (u32), reservado (u32), numero de entradas (u64)
+               y bytes desde el inicio de la cabecera de la ejecucion (u64)
+
+ Las rutas se guardan con codificacion frontal: como las entradas salen en
+ postorden, cada ruta comparte casi todo su principio con la anterior y solo
+ guardamos lo que cambia. Un varint usa 7 bits por byte, asi que los numeros
+ pequenos ocupan un solo byte. La cabecera permite recorrer el fichero hacia
+ delante y el pie de tamano fijo permite saltar hacia atras desde el final
+ (por ejemplo, para leer solo la ultima ejecucion).
+ */
+#define HISTORY_MAGIC "MYDUBIN"
+#define HISTORY_MAGIC_LEN 8
+#define HISTORY_VERSION 2
+#define FILE_HEADER_SIZE 16
+#define RUN_MAGIC 0x4E55524DU /* 'M' 'R' 'U' 'N' */
+#define RUN_END_MAGIC 0x444E454DU /* 'M' 'E' 'N' 'D' */
+#define RUN_HEADER_SIZE 36 /* sin contar la raiz */
+#define RUN_FOOTER_SIZE 24
+/* posiciones dentro de la cabecera de ejecucion de los campos que se rellenan al final */
+#define RUN_COUNT_OFFSET 16
+#define RUN_BYTES_OFFSET 24
+/* un varint de 64 bits ocupa como mucho 10 bytes */
+#define VARINT_MAX_LEN 10
+
+long calculate_dir_size(int dirfd, const char *dirpath);
+/*
+ ESTADISTICAS (--stats)
+
+ Para saber si una ejecucion lenta se va en los stat, en escribir mydu.bin o
+ en la salida, mydu cuenta lo que hace y mide cuanto tarda cada fase. Los
+ contadores del recorrido (ScanStats) son de cada hilo, dentro de su
+ ScanBuf, asi que no hay que sincronizar nada mientras se recorre: solo se
+ suman a run_stats al terminar. Las latencias de stat y getdents64 se
+ guardan en un histograma logaritmico: el hueco k cuenta las llamadas que
+ tardaron entre 2^k y 2^(k+1) nanosegundos. Sin --stats no se lee el reloj.
+ */
+
+/*
+ ScanStats: contadores del recorrido de un hilo
+ */
+typedef struct {
+  uint64_t dirs;        /* directorios leidos */
+  uint64_t cached_dirs; /* de ellos, sin leer sus ficheros gracias a -i */
+  uint64_t files;       /* entradas que no son directorios */
+  uint64_t excluded;    /* entradas saltadas por --exclude */
+  uint64_t stat_calls;
+  uint64_t dents_calls;
+  uint64_t stat_hist[STATS_BUCKETS];
+  uint64_t dents_hist[STATS_BUCKETS];
+} ScanStats;
+
+/*
+ Fases de una ejecucion que medimos por separado
+ */
+enum {
+  PHASE_SETUP,   /* abrir el directorio, mydu.bin y la cache */
+  PHASE_SCAN,    /* recorrido (en modo secuencial incluye ir escribiendo la salida) */
+  PHASE_REPORT,  /* ultima linea y, con --top, los N mayores */
+  PHASE_HISTORY, /* escribir la ejecucion en mydu.bin */
+  PHASE_CACHE,   /* guardar mydu.cache con -i */
+  PHASE_COUNT
+};
+
+/*
+ RunStats: estadisticas de toda la ejecucion
+ */
+typedef struct {
+  ScanStats scan;
+  uint64_t history_bytes;
+  uint64_t history_writes;
+  uint64_t output_bytes;
+  uint64_t phase_ns[PHASE_COUNT];
+  pthread_mutex_t lock; /* para sumar los ScanStats de cada hilo */
+} RunStats;
+
+RunStats run_stats = {{0, 0, 0, 0, 0, 0, {0}, {0}}, 0, 0, 0, {0}, PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ stats_now: reloj monotono en nanosegundos
+ */
+uint64_t stats_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ stats_start: empieza a medir una llamada (0 si no hay --stats)
+ */
+uint64_t stats_start(void) {
+  return options.stats ? stats_now() : 0;
+}
+
+/*
+ stats_stop: apunta en el histograma hist lo que ha tardado la llamada empezada en start
+ */
+void stats_stop(uint64_t *hist, uint64_t start) {
+  uint64_t ns;
+  int bucket;
+
+  if (!options.stats) {
+    return;
+  }
+  ns = stats_now() - start;
+  bucket = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+  hist[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+}
+
+/*
+ stats_phase: suma a la fase phase el tiempo desde *mark y mueve *mark a ahora
+ */
+void stats_phase(int phase, uint64_t *mark) {
+  uint64_t now;
+
+  if (!options.stats) {
+    return;
+  }
+  now = stats_now();
+  run_stats.phase_ns[phase] += now - *mark;
+  *mark = now;
+}
+
+/*
+ stats_merge: suma los contadores de un hilo a los de la ejecucion
+ */
+void stats_merge(const ScanStats *stats) {
+  int i;
+
+  pthread_mutex_lock(&run_stats.lock);
+  run_stats.scan.dirs += stats->dirs;
+  run_stats.scan.cached_dirs += stats->cached_dirs;
+  run_stats.scan.files += stats->files;
+  run_stats.scan.excluded += stats->excluded;
+  run_stats.scan.stat_calls += stats->stat_calls;
+  run_stats.scan.dents_calls += stats->dents_calls;
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    run_stats.scan.stat_hist[i] += stats->stat_hist[i];
+    run_stats.scan.dents_hist[i] += stats->dents_hist[i];
+  }
+  pthread_mutex_unlock(&run_stats.lock);
+}
+
+/*
+ stats_print_hist: muestra los huecos no vacios de un histograma
+ Con json lo escribe como array con todos los huecos.
+ */
+void stats_print_hist(const char *name, const uint64_t *hist, int json) {
+  int i;
+
+  if (json) {
+    fprintf(stderr, ",\"%s\":[", name);
+    for (i = 0; i < STATS_BUCKETS; i++) {
+      fprintf(stderr, "%s%llu", i > 0 ? "," : "", (unsigned long long)hist[i]);
+    }
+    fprintf(stderr, "]");
+    return;
+  }
+  fprintf(stderr, "latencia de %s:\n", name);
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if (hist[i] > 0) {
+      fprintf(stderr, "  >= %llu ns\t%llu\n", i == 0 ? 0ULL : 1ULL << i, (unsigned long long)hist[i]);
+    }
+  }
+}
+
+/*
+ stats_print: muestra las estadisticas por stderr
+
+ Por defecto en texto; con --stats=json en una sola linea JSON para
+ procesarla con otras herramientas.
+ */
+void stats_print(void) {
+  static const char *phase_names[PHASE_COUNT] = {"preparacion", "recorrido", "salida", "historial", "cache"};
+  static const char *phase_keys[PHASE_COUNT] = {"setup", "scan", "report", "history", "cache"};
+  const RunStats *s;
+  uint64_t total;
+  int json;
+  int i;
+
+  s = &run_stats;
+  json = options.stats == STATS_JSON;
+  total = 0;
+  for (i = 0; i < PHASE_COUNT; i++) {
+    total += s->phase_ns[i];
+  }
+  if (json) {
+    fprintf(stderr,
+            "{\"dirs\":%llu,\"cached_dirs\":%llu,\"files\":%llu,\"excluded\":%llu,\"stat_calls\":%llu,\"getdents_calls\":%llu,"
+            "\"history_bytes\":%llu,\"history_writes\":%llu,\"output_bytes\":%llu,\"threads\":%d",
+            (unsigned long long)s->scan.dirs, (unsigned long long)s->scan.cached_dirs,
+            (unsigned long long)s->scan.files, (unsigned long long)s->scan.excluded,
+            (unsigned long long)s->scan.stat_calls,
+            (unsigned long long)s->scan.dents_calls, (unsigned long long)s->history_bytes,
+            (unsigned long long)s->history_writes, (unsigned long long)s->output_bytes, options.nthreads);
+    for (i = 0; i < PHASE_COUNT; i++) {
+      fprintf(stderr, ",\"%s_ns\":%llu", phase_keys[i], (unsigned long long)s->phase_ns[i]);
+    }
+    fprintf(stderr, ",\"total_ns\":%llu", (unsigned long long)total);
+    stats_print_hist("stat_log2_ns", s->scan.stat_hist, 1);
+    stats_print_hist("getdents_log2_ns", s->scan.dents_hist, 1);
+    fprintf(stderr, "}\n");
+    return;
+  }
+  fprintf(stderr, "--- Estadisticas ---\n");
+  fprintf(stderr, "directorios: %llu (%llu sin releer con -i)\n", (unsigned long long)s->scan.dirs,
+          (unsigned long long)s->scan.cached_dirs);
+  fprintf(stderr, "ficheros: %llu\n", (unsigned long long)s->scan.files);
+  fprintf(stderr, "entradas excluidas: %llu\n", (unsigned long long)s->scan.excluded);
+  fprintf(stderr, "llamadas a stat: %llu\n", (unsigned long long)s->scan.stat_calls);
+  fprintf(stderr, "llamadas a getdents64: %llu\n", (unsigned long long)s->scan.dents_calls);
+  fprintf(stderr, "mydu.bin: %llu bytes en %llu escrituras\n", (unsigned long long)s->history_bytes,
+          (unsigned long long)s->history_writes);
+  fprintf(stderr, "salida: %llu bytes\n", (unsigned long long)s->output_bytes);
+  for (i = 0; i < PHASE_COUNT; i++) {
+    fprintf(stderr, "tiempo de %s: %.3f ms\n", phase_names[i], (double)s->phase_ns[i] / 1e6);
+  }
+  fprintf(stderr, "tiempo total: %.3f ms\n", (double)total / 1e6);
+  stats_print_hist(options.use_uring ? "stat (por lote de io_uring)" : "stat", s->scan.stat_hist, 0);
+  stats_print_hist("getdents64", s->scan.dents_hist, 0);
+}
+
+/*
+ TopHeap: los N directorios mas grandes vistos hasta ahora
+
+ Es un monticulo de minimos de como mucho limit elementos: la raiz es el mas
+ pequeno de los que guardamos, asi que un directorio nuevo solo entra si es
+ mayor que ella, y entonces la sustituye. La memoria es O(N) por grande que
+ sea el arbol o el historial. Solo copiamos la ruta cuando el directorio
+ entra en el monticulo.
+ */
+typedef struct {
+  long size_kb;
+  char *path;
+  int64_t when; /* fecha de la ejecucion (solo al leer el historial) */
+} TopItem;
+
+typedef struct {
+  TopItem *items;
+  size_t count;
+  size_t limit;
+} TopHeap;
+
+/*
+ top_heap_init: prepara un monticulo para los limit mayores
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int top_heap_init(TopHeap *heap, size_t limit) {
+  heap->count = 0;
+  heap->limit = limit;
+  heap->items = calloc(limit > 0 ? limit : 1, sizeof(TopItem));
+  if (heap->items == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ top_heap_sift_down: hunde el elemento de la posicion i hasta su sitio
+ (usamos solo las n primeras posiciones del array)
+ */
+void top_heap_sift_down(TopHeap *heap, size_t i, size_t n) {
+  TopItem tmp;
+  size_t smallest;
+  size_t child;
+
+  while (1) {
+    smallest = i;
+    child = 2 * i + 1;
+    if (child < n && heap->items[child].size_kb < heap->items[smallest].size_kb) {
+      smallest = child;
+    }
+    child++;
+    if (child < n && heap->items[child].size_kb < heap->items[smallest].size_kb) {
+      smallest = child;
+    }
+    if (smallest == i) {
+      return;
+    }
+    tmp = heap->items[i];
+    heap->items[i] = heap->items[smallest];
+    heap->items[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+/*
+ top_heap_offer: propone un directorio para el monticulo
+
+ Mientras no esta lleno lo anadimos y lo subimos a su sitio. Si esta lleno
+ solo entra si es mayor que la raiz; en ese caso reutilizamos la memoria de
+ la ruta que sale.
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int top_heap_offer(TopHeap *heap, long size_kb, const char *path, size_t len, int64_t when) {
+  TopItem *item;
+  TopItem tmp;
+  char *copy;
+  size_t i;
+
+  if (heap->limit == 0 || (heap->count == heap->limit && size_kb <= heap->items[0].size_kb)) {
+    return 0;
+  }
+  item = heap->count < heap->limit ? &heap->items[heap->count] : &heap->items[0];
+  copy = realloc(item->path, len + 1);
+  if (copy == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  memcpy(copy, path, len);
+  copy[len] = '\0';
+  item->path = copy;
+  item->size_kb = size_kb;
+  item->when = when;
+
+  if (heap->count < heap->limit) {
+    /* lo subimos mientras sea menor que su padre */
+    i = heap->count;
+    heap->count++;
+    while (i > 0 && heap->items[(i - 1) / 2].size_kb > heap->items[i].size_kb) {
+      tmp = heap->items[i];
+      heap->items[i] = heap->items[(i - 1) / 2];
+      heap->items[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+    }
+  } else {
+    top_heap_sift_down(heap, 0, heap->count);
+  }
+  return 0;
+}
+
+/*
+ top_heap_sort: deja los elementos ordenados de mayor a menor
+
+ Es el paso final de heapsort: llevamos la raiz (el menor) al final y
+ recolocamos el resto. Despues de esto el array ya no es un monticulo.
+ */
+void top_heap_sort(TopHeap *heap) {
+  TopItem tmp;
+  size_t n;
+
+  for (n = heap->count; n > 1; n--) {
+    tmp = heap->items[0];
+    heap->items[0] = heap->items[n - 1];
+    heap->items[n - 1] = tmp;
+    top_heap_sift_down(heap, 0, n - 1);
+  }
+}
+
+/*
+ top_heap_free: libera las rutas y el array
+ */
+void top_heap_free(TopHeap *heap) {
+  size_t i;
+
+  for (i = 0; i < heap->limit; i++) {
+    free(heap->items[i].path);
+  }
+  free(heap->items);
+  heap->items = NULL;
+  heap->count = 0;
+}
+
+/*
+ write_all: escribe len bytes en fd aunque write escriba menos de lo pedido
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_all(int fd, const void *data, size_t len) {
+  const char *p;
+  ssize_t written;
+
+  p = data;
+  while (len > 0) {
+    written = write(fd, p, len);
+    if (written <= 0) {
+      return -1;
+    }
+    p += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+/*
+ put_u32 / put_u64 / get_u32 / get_u64: enteros fijos en little endian
+
+ Los escribimos byte a byte para que mydu.bin se pueda leer igual en
+ cualquier maquina, sin depender del orden de bytes ni del relleno de un struct.
+ */
+void put_u32(unsigned char *p, uint32_t value) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+void put_u64(unsigned char *p, uint64_t value) {
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    p[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+uint32_t get_u32(const unsigned char *p) {
+  uint32_t value;
+  int i;
+
+  value = 0;
+  for (i = 3; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+uint64_t get_u64(const unsigned char *p) {
+  uint64_t value;
+  int i;
+
+  value = 0;
+  for (i = 7; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+/*
+ put_varint: escribe value en p con 7 bits por byte (el bit alto indica que sigue otro)
+ Devuelve cuantos bytes ha usado.
+ */
+size_t put_varint(unsigned char *p, uint64_t value) {
+  size_t n;
+
+  n = 0;
+  while (value >= 0x80) {
+    p[n] = (unsigned char)(value | 0x80);
+    value >>= 7;
+    n++;
+  }
+  p[n] = (unsigned char)value;
+  return n + 1;
+}
+
+/*
+ get_varint: lee un varint de [*p, end) y avanza *p
+ Devuelve 0 si fue bien, -1 si el varint esta cortado o es demasiado largo.
+ */
+int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *out) {
+  uint64_t value;
+  int shift;
+
+  value = 0;
+  for (shift = 0; shift < 64 && *p < end; shift += 7) {
+    value |= (uint64_t)(**p & 0x7F) << shift;
+    (*p)++;
+    if ((*(*p - 1) & 0x80) == 0) {
+      *out = value;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ HistoryWriter: escritor de mydu.bin para toda una ejecucion
+
+ Antes abriamos mydu.bin, escribiamos una entrada y lo cerrabamos por cada
+ subdirectorio: tres llamadas al sistema por directorio. Ahora abrimos el
+ fichero una sola vez y vamos guardando las entradas en memoria, en trozos de
+ HISTORY_CHUNK_SIZE bytes. Al terminar el recorrido lo escribimos todo de
+ golpe con writev, asi una ejecucion que falla o se interrumpe a medias no
+ deja entradas sueltas en el historial.
+
+ version es 2 salvo que mydu.bin ya existiera en formato v1. prev guarda la
+ ruta de la entrada anterior para la codificacion frontal y run_start la
+ posicion de la cabecera de la ejecucion dentro del buffer, para rellenar al
+ final el numero de entradas y su tamano.
+ */
+typedef struct {
+  int fd;
+  off_t start;   /* tamano de mydu.bin al abrirlo, para deshacer si falla */
+  char **chunks;
+  size_t nchunks;
+  size_t cap;
+  size_t used;   /* bytes ocupados del ultimo trozo */
+  int version;
+  uint64_t records;
+  size_t run_start;
+  size_t records_start;
+  char *prev;
+  size_t prev_len;
+  size_t prev_cap;
+} HistoryWriter;
+
+HistoryWriter history = {-1, 0, NULL, 0, 0, 0, HISTORY_VERSION, 0, 0, 0, NULL, 0, 0};
+
+/*
+ history_append: copia len bytes al final del buffer del historial
+
+ Si el ultimo trozo esta lleno reservamos otro; el dato puede quedar partido
+ entre dos trozos, no importa porque writev los escribe seguidos.
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int history_append(const void *data, size_t len) {
+  const char *src;
+  char **chunks;
+  size_t n;
+
+  src = data;
+  while (len > 0) {
+    if (history.nchunks == 0 || history.used == HISTORY_CHUNK_SIZE) {
+      if (history.nchunks == history.cap) {
+        history.cap = history.cap > 0 ? history.cap * 2 : 16;
+        chunks = realloc(history.chunks, history.cap * sizeof(char *));
+        if (chunks == NULL) {
+          fprintf(stderr, "Error: memoria insuficiente\n");
+          return -1;
+        }
+        history.chunks = chunks;
+      }
+      history.chunks[history.nchunks] = malloc(HISTORY_CHUNK_SIZE);
+      if (history.chunks[history.nchunks] == NULL) {
+        fprintf(stderr, "Error: memoria insuficiente\n");
+        return -1;
+      }
+      history.nchunks++;
+      history.used = 0;
+    }
+    n = HISTORY_CHUNK_SIZE - history.used;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(history.chunks[history.nchunks - 1] + history.used, src, n);
+    history.used += n;
+    src += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ history_size: bytes acumulados en el buffer hasta ahora
+ */
+size_t history_size(void) {
+  if (history.nchunks == 0) {
+    return 0;
+  }
+  return (history.nchunks - 1) * HISTORY_CHUNK_SIZE + history.used;
+}
+
+/*
+ history_patch: sobrescribe len bytes ya acumulados a partir de offset
+ Lo usamos para completar la cabecera de la ejecucion antes de escribirla.
+ */
+void history_patch(size_t offset, const unsigned char *data, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    history.chunks[(offset + i) / HISTORY_CHUNK_SIZE][(offset + i) % HISTORY_CHUNK_SIZE] = (char)data[i];
+  }
+}
+
+/*
+ history_close: libera los buffers y cierra mydu.bin
+ */
+void history_close(void) {
+  size_t i;
+
+  for (i = 0; i < history.nchunks; i++) {
+    free(history.chunks[i]);
+  }
+  free(history.chunks);
+  free(history.prev);
+  history.chunks = NULL;
+  history.nchunks = 0;
+  history.cap = 0;
+  history.used = 0;
+  history.prev = NULL;
+  history.prev_len = 0;
+  history.prev_cap = 0;
+  history.records = 0;
+  if (history.fd >= 0) {
+    close(history.fd);
+  }
+  history.fd = -1;
+}
+
+/*
+ history_check_tail: comprueba que mydu.bin v2 acaba en una ejecucion completa
+
+ Lo normal es que el fichero termine con el pie de la ultima ejecucion, y eso
+ se comprueba con dos lecturas. Si no (el sistema se cayo mientras se
+ escribia una ejecucion), recorremos las cabeceras desde el principio hasta
+ la ultima ejecucion entera y recortamos lo que sobra; si no lo hicieramos,
+ las ejecuciones nuevas quedarian detras de basura y no se podrian leer.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int history_check_tail(void) {
+  unsigned char footer[RUN_FOOTER_SIZE];
+  unsigned char header[RUN_HEADER_SIZE];
+  off_t pos;
+  off_t next;
+  uint64_t run_bytes;
+
+  if (history.start >= FILE_HEADER_SIZE + RUN_FOOTER_SIZE &&
+      pread(history.fd, footer, sizeof(footer), history.start - RUN_FOOTER_SIZE) == (ssize_t)sizeof(footer) &&
+      get_u32(footer) == RUN_END_MAGIC) {
+    run_bytes = get_u64(footer + 16);
+    if (run_bytes <= (uint64_t)(history.start - RUN_FOOTER_SIZE - FILE_HEADER_SIZE) &&
+        pread(history.fd, header, 4, history.start - RUN_FOOTER_SIZE - (off_t)run_bytes) == 4 &&
+        get_u32(header) == RUN_MAGIC) {
+      return 0;
+    }
+  }
+  if (history.start == FILE_HEADER_SIZE) {
+    return 0; /* solo la cabecera del fichero: no hay ejecuciones */
+  }
+
+  pos = FILE_HEADER_SIZE;
+  while (pos + RUN_HEADER_SIZE <= history.start &&
+         pread(history.fd, header, sizeof(header), pos) == (ssize_t)sizeof(header) && get_u32(header) == RUN_MAGIC) {
+    next = pos + RUN_HEADER_SIZE + (off_t)get_u32(header + 32) + (off_t)get_u64(header + RUN_BYTES_OFFSET);
+    if (next + RUN_FOOTER_SIZE > history.start ||
+        pread(history.fd, footer, 4, next) != 4 || get_u32(footer) != RUN_END_MAGIC) {
+      break;
+    }
+    pos = next + RUN_FOOTER_SIZE;
+  }
+  fprintf(stderr, "Aviso: mydu.bin tenia una ejecucion incompleta al final, se descarta\n");
+  if (ftruncate(history.fd, pos) < 0) {
+    fprintf(stderr, "Error: no se pudo reparar mydu.bin\n");
+    return -1;
+  }
+  history.start = pos;
+  return 0;
+}
+
+/*
+ history_open: abre mydu.bin para anadir la ejecucion que empieza sobre root
+
+ Si el fichero esta vacio empezamos con la cabecera v2. Si ya tiene datos
+ miramos los primeros bytes: con la cabecera v2 anadimos una ejecucion mas y
+ sin ella es un fichero antiguo y seguimos escribiendo entradas v1.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int history_open(const char *root) {
+  unsigned char header[RUN_HEADER_SIZE];
+  char magic[HISTORY_MAGIC_LEN];
+  size_t root_len;
+
+  history.fd = open(binary_file, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (history.fd < 0) {
+    fprintf(stderr, "Error: no se pudo abrir mydu.bin\n");
+    return -1;
+  }
+  history.start = lseek(history.fd, 0, SEEK_END);
+  history.version = HISTORY_VERSION;
+  if (history.start > 0) {
+    if (pread(history.fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        memcmp(magic, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0) {
+      history.version = 1;
+      return 0;
+    }
+    if (history_check_tail() < 0) {
+      return -1;
+    }
+  } else {
+    memset(header, 0, FILE_HEADER_SIZE);
+    memcpy(header, HISTORY_MAGIC, HISTORY_MAGIC_LEN);
+    put_u32(header + 8, HISTORY_VERSION);
+    if (history_append(header, FILE_HEADER_SIZE) < 0) {
+      return -1;
+    }
+  }
+
+  /* cabecera de la ejecucion: el numero de entradas y su tamano se rellenan en history_commit */
+  root_len = strlen(root);
+  memset(header, 0, sizeof(header));
+  put_u32(header, RUN_MAGIC);
+  put_u64(header + 8, (uint64_t)time(NULL));
+  put_u32(header + 32, (uint32_t)root_len);
+  history.run_start = history_size();
+  if (history_append(header, sizeof(header)) < 0 || history_append(root, root_len) < 0) {
+    return -1;
+  }
+  history.records_start = history_size();
+  return 0;
+}
+
+/*
+ history_finish_run: cierra la ejecucion v2 antes de escribirla
+
+ Anade el pie y rellena en la cabecera el numero de entradas y los bytes que
+ ocupan, que hasta ahora no conociamos.
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int history_finish_run(void) {
+  unsigned char footer[RUN_FOOTER_SIZE];
+  unsigned char field[8];
+  size_t records_end;
+
+  records_end = history_size();
+  put_u64(field, history.records);
+  history_patch(history.run_start + RUN_COUNT_OFFSET, field, 8);
+  put_u64(field, (uint64_t)(records_end - history.records_start));
+  history_patch(history.run_start + RUN_BYTES_OFFSET, field, 8);
+
+  memset(footer, 0, sizeof(footer));
+  put_u32(footer, RUN_END_MAGIC);
+  put_u64(footer + 8, history.records);
+  put_u64(footer + 16, (uint64_t)(records_end - history.run_start));
+  return history_append(footer, sizeof(footer));
+}
+
+/*
+ history_commit: escribe en mydu.bin todo lo acumulado y cierra el fichero
+
+ Pasamos todos los trozos a writev en una sola llamada (o en grupos de
+ HISTORY_MAX_IOV si hay muchisimos). writev puede escribir menos de lo
+ pedido, asi que seguimos desde donde se quedo. Si algo falla recortamos el fichero al tamano
+ que tenia al abrirlo para no dejar la ejecucion a medias.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int history_commit(void) {
+  struct iovec iov[HISTORY_MAX_IOV];
+  size_t first;
+  size_t skip;
+  size_t len;
+  int count;
+  int status;
+  ssize_t written;
+
+  status = 0;
+  if (history.version == HISTORY_VERSION && history_finish_run() < 0) {
+    status = -1;
+  }
+  first = 0;
+  skip = 0;
+  while (status == 0 && first < history.nchunks) {
+    /* preparamos los trozos pendientes, el primero sin lo que ya se escribio */
+    for (count = 0; count < HISTORY_MAX_IOV && first + (size_t)count < history.nchunks; count++) {
+      len = first + (size_t)count + 1 == history.nchunks ? history.used : HISTORY_CHUNK_SIZE;
+      iov[count].iov_base = history.chunks[first + (size_t)count];
+      iov[count].iov_len = len;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + skip;
+    iov[0].iov_len -= skip;
+
+    written = writev(history.fd, iov, count);
+    if (written <= 0) {
+      status = -1;
+      break;
+    }
+    run_stats.history_bytes += (uint64_t)written;
+    run_stats.history_writes++;
+    /* avanzamos por los trozos completos que se escribieron */
+    skip += (size_t)written;
+    while (first < history.nchunks) {
+      len = first + 1 == history.nchunks ? history.used : HISTORY_CHUNK_SIZE;
+      if (skip < len) {
+        break;
+      }
+      skip -= len;
+      first++;
+    }
+  }
+
+  if (status < 0) {
+    fprintf(stderr, "Error: no se pudo escribir mydu.bin\n");
+    if (ftruncate(history.fd, history.start) < 0) {
+      fprintf(stderr, "Error: mydu.bin puede haber quedado incompleto\n");
+    }
+  }
+  history_close();
+  return status;
+}
+
+/*
+ write_binary_entry: guarda una entrada en el historial
+
+ En formato v2 solo guardamos lo que cambia respecto a la ruta anterior:
+ contamos los bytes que comparten, escribimos el tamano y esas dos
+ longitudes como varint y despues el resto de la ruta. Todo se anade al
+ buffer del historial, que se escribe al terminar la ejecucion.
+
+ En un mydu.bin antiguo rellenamos la estructura DirEntry como antes. Al
+ escribir siempre la estructura completa el fichero tiene entradas de tamano
+ fijo, lo que facilita leerlas despues en read_binary_history().
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int write_binary_entry(long size_kb, const char *path) {
+  DirEntry entry;
+  unsigned char head[3 * VARINT_MAX_LEN];
+  size_t head_len;
+  size_t path_len;
+  size_t shared;
+  size_t cap;
+  char *prev;
+
+  if (history.version == HISTORY_VERSION) {
+    path_len = strlen(path);
+    shared = 0;
+    while (shared < history.prev_len && shared < path_len && history.prev[shared] == path[shared]) {
+      shared++;
+    }
+    head_len = put_varint(head, (uint64_t)size_kb);
+    head_len += put_varint(head + head_len, shared);
+    head_len += put_varint(head + head_len, path_len - shared);
+    if (history_append(head, head_len) < 0 || history_append(path + shared, path_len - shared) < 0) {
+      return -1;
+    }
+    history.records++;
+
+    /* guardamos esta ruta para comparar con la siguiente entrada */
+    if (path_len + 1 > history.prev_cap) {
+      cap = history.prev_cap > 0 ? history.prev_cap : PATH_INITIAL_CAP;
+      while (cap < path_len + 1) {
+        cap *= 2;
+      }
+      prev = realloc(history.prev, cap);
+      if (prev == NULL) {
+        fprintf(stderr, "Error: memoria insuficiente\n");
+        return -1;
+      }
+      history.prev = prev;
+      history.prev_cap = cap;
+    }
+    memcpy(history.prev + shared, path + shared, path_len - shared + 1);
+    history.prev_len = path_len;
+    return 0;
+  }
+
+  /* ponemos la estructura a cero para no volcar basura de la pila tras la ruta */
+  memset(&entry, 0, sizeof(entry));
+  entry.size_kb = size_kb;
+  /* nos aseguramos de que la ruta no es mas larga de lo que cabe en el campo */
+  if (strlen(path) >= sizeof(entry.path)) {
+    fprintf(stderr, "Error: ruta demasiado larga\n");
+    return -1;
+  }
+  strcpy(entry.path, path);
+  return history_append(&entry, sizeof(entry));
+}
+
+/* directorios guardados con --top hasta el final del recorrido */
+TopHeap report_heap;
+
+/*
+ print_size_line: escribe por stdout "<size_kb>\t<ruta>\n"
+ El tamano se escribe con format_long (numtext.c) en lugar de printf, que
+ con muchos directorios era lo que mas se notaba al mostrar la salida.
+ Devuelve cuantos bytes ha escrito.
+ */
+int print_size_line(long size_kb, const char *path, size_t len) {
+  char number[NUMTEXT_LONG_MAX + 1];
+  int n;
+
+  n = format_long(size_kb, number);
+  number[n++] = '\t';
+  fwrite(number, 1, (size_t)n, stdout);
+  fwrite(path, 1, len, stdout);
+  putchar('\n');
+  return n + (int)len + 1;
+}
+
+/*
+ report_dir: registra un subdirectorio cuyo tamano ya conocemos
+
+ Guarda la entrada en el historial y la muestra por pantalla. La usan tanto
+ el recorrido secuencial como el paralelo, de forma que los dos generan
+ exactamente la misma salida. depth es la profundidad del directorio (0 la
+ raiz): con --max-depth solo escribimos los que no pasan del limite, y con
+ --top los dejamos en un monticulo de N elementos, asi que la memoria no
+ depende del tamano del arbol. Los totales se calculan siempre completos.
+ Con --save-selected mydu.bin solo recibe lo que se escribe por pantalla.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int report_dir(long size_kb, const char *path, long depth) {
+  int n;
+
+  if (!options.save_selected && write_binary_entry(size_kb, path) < 0) {
+    return -1;
+  }
+  if (options.max_depth >= 0 && depth > options.max_depth) {
+    return 0;
+  }
+  if (options.top > 0) {
+    /* con --top solo lo guardamos; se escribe al final (ver report_top) */
+    return top_heap_offer(&report_heap, size_kb, path, strlen(path), 0);
+  }
+  if (options.save_selected && write_binary_entry(size_kb, path) < 0) {
+    return -1;
+  }
+  n = print_size_line(size_kb, path, strlen(path));
+  run_stats.output_bytes += (uint64_t)n;
+  return 0;
+}
+
+/*
+ report_top: escribe los directorios guardados por --top, de mayor a menor
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int report_top(void) {
+  size_t i;
+  int n;
+
+  top_heap_sort(&report_heap);
+  for (i = 0; i < report_heap.count; i++) {
+    if (options.save_selected && write_binary_entry(report_heap.items[i].size_kb, report_heap.items[i].path) < 0) {
+      return -1;
+    }
+    n = print_size_line(report_heap.items[i].size_kb, report_heap.items[i].path,
+                        strlen(report_heap.items[i].path));
+    run_stats.output_bytes += (uint64_t)n;
+  }
+  return 0;
+}
+
+/*
+ linux_dirent64: formato de cada entrada que devuelve getdents64 (ver man getdents)
+
+ glibc no exporta esta estructura sin _GNU_SOURCE, asi que la definimos igual
+ que en la pagina del manual. d_reclen es lo que ocupa la entrada completa.
+ */
+struct linux_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/*
+ PathBuf: ruta del directorio que estamos recorriendo, en un buffer que crece
+
+ En lugar de construir con snprintf la ruta completa de cada entrada, vamos
+ anadiendo "/nombre" al bajar a un subdirectorio y lo quitamos al volver.
+ Solo necesitamos la ruta para mostrarla o guardarla, nunca para el kernel.
+ */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} PathBuf;
+
+/*
+ SubdirList: subdirectorios encontrados al leer un directorio
+
+ Guardamos los nombres seguidos en un unico bloque (separados por '\0') y los
+ bloques que nos dio fstatat para cada uno, asi no hace falta volver a hacer
+ stat del subdirectorio cuando lo recorremos.
+ */
+typedef struct {
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  long *blocks;
+  size_t count;
+  size_t cap;
+} SubdirList;
+
+/*
+ path_reserve: se asegura de que en la ruta caben needed bytes
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int path_reserve(PathBuf *path, size_t needed) {
+  char *data;
+  size_t cap;
+
+  if (needed <= path->cap) {
+    return 0;
+  }
+  cap = path->cap > 0 ? path->cap : PATH_INITIAL_CAP;
+  while (cap < needed) {
+    cap *= 2;
+  }
+  data = realloc(path->data, cap);
+  if (data == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  path->data = data;
+  path->cap = cap;
+  return 0;
+}
+
+/*
+ path_set: pone en la ruta el texto indicado (normalmente el directorio raiz)
+ */
+int path_set(PathBuf *path, const char *text) {
+  size_t len;
+
+  len = strlen(text);
+  if (path_reserve(path, len + 1) < 0) {
+    return -1;
+  }
+  memcpy(path->data, text, len + 1);
+  path->len = len;
+  return 0;
+}
+
+/*
+ path_push: anade "/name" al final de la ruta
+ Devuelve la longitud anterior para poder deshacerlo con path_pop, o -1 si no hay memoria.
+ */
+long path_push(PathBuf *path, const char *name) {
+  size_t old_len;
+  size_t name_len;
+
+  old_len = path->len;
+  name_len = strlen(name);
+  if (path_reserve(path, old_len + name_len + 2) < 0) {
+    return -1;
+  }
+  path->data[old_len] = '/';
+  memcpy(path->data + old_len + 1, name, name_len + 1);
+  path->len = old_len + name_len + 1;
+  return (long)old_len;
+}
+
+/*
+ path_pop: vuelve a dejar la ruta como estaba antes de path_push
+ */
+void path_pop(PathBuf *path, long old_len) {
+  path->len = (size_t)old_len;
+  path->data[path->len] = '\0';
+}
+
+/*
+ subdir_add: apunta un subdirectorio (nombre y bloques) al final de la lista
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int subdir_add(SubdirList *list, const char *name, long blocks) {
+  char *names;
+  long *blocks_array;
+  size_t len;
+  size_t cap;
+
+  len = strlen(name) + 1;
+  if (list->names_len + len > list->names_cap) {
+    cap = list->names_cap > 0 ? list->names_cap : PATH_INITIAL_CAP;
+    while (cap < list->names_len + len) {
+      cap *= 2;
+    }
+    names = realloc(list->names, cap);
+    if (names == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    list->names = names;
+    list->names_cap = cap;
+  }
+  if (list->count == list->cap) {
+    cap = list->cap > 0 ? list->cap * 2 : 16;
+    blocks_array = realloc(list->blocks, cap * sizeof(long));
+    if (blocks_array == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    list->blocks = blocks_array;
+    list->cap = cap;
+  }
+  memcpy(list->names + list->names_len, name, len);
+  list->names_len += len;
+  list->blocks[list->count] = blocks;
+  list->count++;
+  return 0;
+}
+
+/*
+ subdir_clear / subdir_free: vacian la lista (conservando la memoria) o la liberan
+ */
+void subdir_clear(SubdirList *list) {
+  list->names_len = 0;
+  list->count = 0;
+}
+
+void subdir_free(SubdirList *list) {
+  free(list->names);
+  free(list->blocks);
+  list->names = NULL;
+  list->blocks = NULL;
+  list->names_len = 0;
+  list->names_cap = 0;
+  list->count = 0;
+  list->cap = 0;
+}
+
+/*
+ open_dirs_limit: cuantos directorios podemos tener abiertos a la vez, como mucho wanted
+
+ Los limites WALK_OPEN_DIRS y MAX_OPEN_DIRS no sirven si el proceso tiene
+ un RLIMIT_NOFILE mas bajo (ulimit -n): lo que cabe de verdad es ese limite
+ menos OPEN_FD_RESERVE y menos reserved (otros descriptores de quien llama,
+ como el anillo de io_uring de cada hilo). Siempre dejamos al menos uno.
+ */
+int open_dirs_limit(int wanted, int reserved) {
+  struct rlimit limit;
+  rlim_t room;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY) {
+    return wanted;
+  }
+  room = (rlim_t)(OPEN_FD_RESERVE + reserved);
+  if (limit.rlim_cur <= room + 1) {
+    return 1;
+  }
+  return limit.rlim_cur - room < (rlim_t)wanted ? (int)(limit.rlim_cur - room) : wanted;
+}
+
+/*
+ open_subdir: abre el subdirectorio name relativo al descriptor dirfd
+
+ O_NOFOLLOW evita seguir enlaces simbolicos (lo mismo que conseguiamos con
+ lstat) y O_DIRECTORY hace que falle si la entrada ya no es un directorio.
+ */
+int open_subdir(int dirfd, const char *name) {
+  return openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/*
+ BACKEND IO_URING (-u)
+
+ En sistemas de ficheros de red cada fstatat es un viaje de ida y vuelta al
+ servidor y el recorrido se pasa casi todo el tiempo esperando. Con -u
+ pedimos los statx de todas las entradas de un bloque de getdents64 de una
+ vez a traves de io_uring y esperamos a que terminen todas juntas, de forma
+ que el kernel puede tener muchas peticiones en vuelo a la vez.
+
+ No usamos liburing: preparamos el anillo con las llamadas io_uring_setup e
+ io_uring_enter directamente, como se explica en man io_uring. Si el kernel
+ no tiene io_uring (o no soporta statx por esa via) seguimos con fstatat.
+ */
+
+/*
+ UringCtx: anillo de io_uring de un hilo
+
+ sq_* son los punteros a la cola de envio y cq_* a la de resultados, todos
+ dentro de la memoria que compartimos con el kernel mediante mmap. stx es un
+ struct statx por hueco del anillo, donde el kernel deja cada resultado.
+ */
+typedef struct {
+  int fd;
+  unsigned entries;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct statx *stx;
+} UringCtx;
+
+/*
+ uring_free: deshace todo lo que hizo uring_init (vale con el anillo a medias)
+ */
+void uring_free(UringCtx *ring) {
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  free(ring->stx);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/*
+ uring_statx_batch: hace statx de count nombres relativos a dirfd
+
+ Rellenamos un hueco de la cola de envio por nombre (como mucho entries),
+ avisamos al kernel con un solo io_uring_enter que ademas espera a que esten
+ todos y recogemos los resultados. user_data guarda la posicion de cada
+ peticion, porque el kernel puede terminarlas en cualquier orden. El
+ resultado de names[i] queda en ring->stx[i] y su codigo en results[i]
+ (0 o -errno).
+ Devuelve 0 si fue bien, -1 si fallo el propio io_uring.
+ */
+int uring_statx_batch(UringCtx *ring, int dirfd, const char **names, unsigned count, int *results) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned tail;
+  unsigned head;
+  unsigned done;
+  unsigned i;
+  long ret;
+
+  tail = *ring->sq_tail;
+  for (i = 0; i < count; i++) {
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long)names[i];
+    /* solo pedimos lo que usamos: el tipo (va en stx_mode), los bloques y lo necesario para los enlaces duros */
+    sqe->len = STATX_TYPE | STATX_BLOCKS | STATX_NLINK | STATX_INO;
+    sqe->off = (unsigned long)&ring->stx[i];
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = i;
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    tail++;
+  }
+  /* el kernel no debe ver la nueva cola antes que el contenido de los huecos */
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  done = 0;
+  while (done < count) {
+    ret = syscall(__NR_io_uring_enter, ring->fd, count - done, count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR) {
+      return -1;
+    }
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      if (cqe->user_data < count) {
+        results[cqe->user_data] = cqe->res;
+        done++;
+      }
+      head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/*
+ uring_init: crea un anillo de entries huecos para hacer statx
+
+ Pedimos el anillo con io_uring_setup y mapeamos sus tres zonas (cola de
+ envio, cola de resultados y array de peticiones). Al final hacemos un statx
+ de prueba porque los kernels anteriores a 5.6 tienen io_uring pero no
+ IORING_OP_STATX.
+ Devuelve 0 si el anillo esta listo, -1 si hay que usar fstatat.
+ */
+int uring_init(UringCtx *ring, unsigned entries) {
+  struct io_uring_params params;
+  const char *probe_name;
+  int probe_result;
+  long fd;
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  memset(&params, 0, sizeof(params));
+  fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return -1;
+  }
+  ring->fd = (int)fd;
+  ring->entries = params.sq_entries;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0 && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    uring_free(ring);
+    return -1;
+  }
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      uring_free(ring);
+      return -1;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    uring_free(ring);
+    return -1;
+  }
+
+  ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+  ring->stx = malloc(ring->entries * sizeof(struct statx));
+  if (ring->stx == NULL) {
+    uring_free(ring);
+    return -1;
+  }
+
+  probe_name = ".";
+  if (uring_statx_batch(ring, AT_FDCWD, &probe_name, 1, &probe_result) < 0 || probe_result < 0) {
+    uring_free(ring);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ ENLACES DUROS
+
+ Un fichero con varios enlaces duros aparece en varios directorios pero
+ ocupa el espacio una sola vez. Igual que du, por defecto contamos cada
+ (dispositivo, inodo) una sola vez, en el primer directorio donde lo
+ encontramos en el orden del recorrido secuencial (con -l se cuentan todos).
+ Solo hace falta recordar los ficheros con mas de un enlace, que son pocos
+ incluso en arboles con millones de ficheros.
+ */
+
+/*
+ LinkedFile: fichero con mas de un enlace encontrado al leer un directorio
+ */
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  long blocks;
+} LinkedFile;
+
+/*
+ LinkList: ficheros con varios enlaces de un directorio, pendientes de
+ decidir si se cuentan (ver list_directory y settle_links)
+ */
+typedef struct {
+  LinkedFile *items;
+  size_t count;
+  size_t cap;
+} LinkList;
+
+/*
+ InodeSet: conjunto de (dispositivo, inodo) ya contados
+
+ Tabla hash de direccionamiento abierto con sondeo lineal: cada hueco son
+ dos enteros, sin punteros ni listas, y (0, 0) marca un hueco libre porque
+ ningun fichero tiene el inodo 0. Crece al doble al llenarse a la mitad.
+ Solo la usa un hilo cada vez (en paralelo se resuelve al final), asi que
+ no lleva cerrojo.
+ */
+typedef struct {
+  uint64_t *keys; /* cap parejas dev, ino */
+  size_t cap;     /* siempre potencia de dos */
+  size_t count;
+} InodeSet;
+
+InodeSet inode_set;
+
+/*
+ link_add: apunta un fichero con varios enlaces en list
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int link_add(LinkList *list, uint64_t dev, uint64_t ino, long blocks) {
+  LinkedFile *items;
+  size_t new_cap;
+
+  if (list->count == list->cap) {
+    new_cap = list->cap == 0 ? LINKS_INITIAL_CAP : list->cap * 2;
+    items = realloc(list->items, new_cap * sizeof(LinkedFile));
+    if (items == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    list->items = items;
+    list->cap = new_cap;
+  }
+  list->items[list->count].dev = dev;
+  list->items[list->count].ino = ino;
+  list->items[list->count].blocks = blocks;
+  list->count++;
+  return 0;
+}
+
+/*
+ inode_hash: mezcla dispositivo e inodo para elegir el hueco de la tabla
+
+ Los inodos suelen ser consecutivos, asi que mezclamos los bits (el
+ finalizador de splitmix64) para que no caigan todos en huecos seguidos.
+ */
+uint64_t inode_hash(uint64_t dev, uint64_t ino) {
+  uint64_t h;
+
+  h = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h;
+}
+
+/*
+ inode_set_grow: dobla la tabla y recoloca todas las claves
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int inode_set_grow(InodeSet *set) {
+  uint64_t *keys;
+  uint64_t *old_keys;
+  size_t old_cap;
+  size_t new_cap;
+  size_t i;
+  size_t slot;
+
+  old_keys = set->keys;
+  old_cap = set->cap;
+  new_cap = old_cap == 0 ? INODE_SET_INITIAL_CAP : old_cap * 2;
+  keys = calloc(new_cap * 2, sizeof(uint64_t));
+  if (keys == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  for (i = 0; i < old_cap; i++) {
+    if (old_keys[2 * i] == 0 && old_keys[2 * i + 1] == 0) {
+      continue;
+    }
+    slot = (size_t)inode_hash(old_keys[2 * i], old_keys[2 * i + 1]) & (new_cap - 1);
+    while (keys[2 * slot] != 0 || keys[2 * slot + 1] != 0) {
+      slot = (slot + 1) & (new_cap - 1);
+    }
+    keys[2 * slot] = old_keys[2 * i];
+    keys[2 * slot + 1] = old_keys[2 * i + 1];
+  }
+  free(old_keys);
+  set->keys = keys;
+  set->cap = new_cap;
+  return 0;
+}
+
+/*
+ inode_set_insert: anade (dev, ino) al conjunto
+ Devuelve 1 si no estaba (hay que contarlo), 0 si ya estaba y -1 si no hay memoria.
+ */
+int inode_set_insert(InodeSet *set, uint64_t dev, uint64_t ino) {
+  size_t slot;
+
+  if ((set->count + 1) * 2 > set->cap && inode_set_grow(set) < 0) {
+    return -1;
+  }
+  slot = (size_t)inode_hash(dev, ino) & (set->cap - 1);
+  while (set->keys[2 * slot] != 0 || set->keys[2 * slot + 1] != 0) {
+    if (set->keys[2 * slot] == dev && set->keys[2 * slot + 1] == ino) {
+      return 0;
+    }
+    slot = (slot + 1) & (set->cap - 1);
+  }
+  set->keys[2 * slot] = dev;
+  set->keys[2 * slot + 1] = ino;
+  set->count++;
+  return 1;
+}
+
+/*
+ inode_set_free: libera la tabla
+ */
+void inode_set_free(InodeSet *set) {
+  free(set->keys);
+  memset(set, 0, sizeof(*set));
+}
+
+/*
+ count_links: suma a *blocks los ficheros de list que aun no se habian contado
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int count_links(const LinkList *list, long *blocks) {
+  size_t i;
+  int status;
+
+  for (i = 0; i < list->count; i++) {
+    status = inode_set_insert(&inode_set, list->items[i].dev, list->items[i].ino);
+    if (status < 0) {
+      return -1;
+    }
+    if (status == 1) {
+      *blocks += list->items[i].blocks;
+    }
+  }
+  return 0;
+}
+
+/*
+ stat_names: hace el stat de count entradas de dirfd y las clasifica
+
+ Es la parte comun de list_directory para los dos motores: con ring == NULL
+ usamos fstatat entrada a entrada; si no, mandamos las entradas a io_uring
+ en grupos del tamano del anillo. Despues procesamos los resultados en el
+ mismo orden en que venian, para que los subdirectorios salgan igual.
+ Los ficheros con varios enlaces no se suman aqui sino que se apuntan en
+ links (salvo con -l), y con -x se saltan los subdirectorios de otro
+ sistema de ficheros. Las llamadas se cuentan en stats.
+ Devuelve 0 si fue bien, -1 si hubo algun error (con *bad_name como en list_directory).
+ */
+int stat_names(int dirfd, UringCtx *ring, const char **names, unsigned count, int *results,
+               SubdirList *subdirs, LinkList *links, long *blocks, ScanStats *stats, const char **bad_name) {
+  struct stat st;
+  uint64_t t0;
+  unsigned start;
+  unsigned chunk;
+  unsigned i;
+  mode_t mode;
+  long entry_blocks;
+  dev_t dev;
+
+  if (ring == NULL) {
+    for (i = 0; i < count; i++) {
+      /* AT_SYMLINK_NOFOLLOW hace que fstatat se comporte como lstat */
+      t0 = stats_start();
+      if (fstatat(dirfd, names[i], &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        *bad_name = names[i];
+        return -1;
+      }
+      stats_stop(stats->stat_hist, t0);
+      stats->stat_calls++;
+      if (S_ISDIR(st.st_mode)) {
+        if (options.one_fs && st.st_dev != options.root_dev) {
+          continue; /* punto de montaje de otro sistema de ficheros */
+        }
+        if (subdir_add(subdirs, names[i], st.st_blocks) < 0) {
+          return -1;
+        }
+      } else {
+        stats->files++;
+        if (st.st_nlink > 1 && !options.count_links) {
+          if (link_add(links, st.st_dev, st.st_ino, st.st_blocks) < 0) {
+            return -1;
+          }
+        } else {
+          /* Es un fichero regular: sumamos sus bloques (de 512B) al total */
+          *blocks += st.st_blocks;
+        }
+      }
+    }
+    return 0;
+  }
+
+  for (start = 0; start < count; start += chunk) {
+    chunk = count - start < ring->entries ? count - start : ring->entries;
+    t0 = stats_start();
+    if (uring_statx_batch(ring, dirfd, names + start, chunk, results) < 0) {
+      return -1;
+    }
+    /* con io_uring no vemos cada statx: medimos el lote entero */
+    stats_stop(stats->stat_hist, t0);
+    stats->stat_calls += chunk;
+    for (i = 0; i < chunk; i++) {
+      if (results[i] < 0) {
+        errno = -results[i];
+        *bad_name = names[start + i];
+        return -1;
+      }
+      mode = ring->stx[i].stx_mode;
+      entry_blocks = (long)ring->stx[i].stx_blocks;
+      dev = makedev(ring->stx[i].stx_dev_major, ring->stx[i].stx_dev_minor);
+      if (S_ISDIR(mode)) {
+        if (options.one_fs && dev != options.root_dev) {
+          continue;
+        }
+        if (subdir_add(subdirs, names[start + i], entry_blocks) < 0) {
+          return -1;
+        }
+      } else {
+        stats->files++;
+        if (ring->stx[i].stx_nlink > 1 && !options.count_links) {
+          if (link_add(links, dev, ring->stx[i].stx_ino, entry_blocks) < 0) {
+            return -1;
+          }
+        } else {
+          *blocks += entry_blocks;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ EXCLUSIONES (--exclude, --exclude-from)
+
+ Los patrones se comparan con el nombre de cada entrada (d_name) nada mas
+ leerlo con getdents64, antes de su stat: una entrada excluida no se cuenta
+ y, si es un directorio, no se abre ni se recorre. Igual que en du se
+ compara el nombre y no la ruta, y un '*' tambien casa con un punto inicial.
+
+ Al arrancar clasificamos los patrones. Los nombres literales (".git",
+ "node_modules") van a una tabla hash, y los de la forma "*literal" o
+ "literal*" (como "*.o" o "cache*") a otras dos tablas de sufijos y
+ prefijos, buscando solo las longitudes que hay en cada una. Asi cientos de
+ patrones cuestan unas pocas busquedas por nombre; solo los demas (con '?',
+ '[' o varios '*') pasan por fnmatch uno a uno.
+ */
+
+/*
+ LiteralSet: conjunto de textos (no terminados en '\0') para buscar por igualdad
+
+ Direccionamiento abierto con sondeo lineal, como InodeSet: keys[i] == NULL
+ es un hueco libre. Los textos apuntan a los patrones, que no se copian.
+ lengths son las longitudes distintas que hay, para buscar sufijos y
+ prefijos solo de esas longitudes.
+ */
+typedef struct {
+  const char **keys;
+  size_t *lens;
+  size_t cap; /* siempre potencia de dos */
+  size_t count;
+  unsigned char has_len[NAME_MAX + 1];
+  size_t lengths[NAME_MAX + 1];
+  size_t nlengths;
+} LiteralSet;
+
+/*
+ ExcludeSet: patrones de --exclude y --exclude-from ya clasificados
+ */
+typedef struct {
+  LiteralSet names;    /* nombres exactos */
+  LiteralSet suffixes; /* "*literal", guardado sin el '*' */
+  LiteralSet prefixes; /* "literal*", guardado sin el '*' */
+  const char **globs;  /* el resto, para fnmatch */
+  size_t nglobs;
+  size_t globs_cap;
+  char **files; /* contenido de los ficheros de --exclude-from (los patrones apuntan dentro) */
+  size_t nfiles;
+  uint32_t fingerprint; /* resumen de los patrones, para no usar una cache hecha con otros */
+  int active;
+} ExcludeSet;
+
+ExcludeSet excludes;
+
+/*
+ literal_hash: hash FNV-1a de len bytes de text
+ */
+uint64_t literal_hash(const char *text, size_t len) {
+  uint64_t hash;
+  size_t i;
+
+  hash = 1469598103934665603ULL;
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/*
+ literal_set_find: dice si text (de len bytes) esta en set
+ */
+int literal_set_find(const LiteralSet *set, const char *text, size_t len) {
+  size_t slot;
+
+  if (set->count == 0 || !set->has_len[len]) {
+    return 0;
+  }
+  slot = (size_t)literal_hash(text, len) & (set->cap - 1);
+  while (set->keys[slot] != NULL) {
+    if (set->lens[slot] == len && memcmp(set->keys[slot], text, len) == 0) {
+      return 1;
+    }
+    slot = (slot + 1) & (set->cap - 1);
+  }
+  return 0;
+}
+
+/*
+ literal_set_grow: dobla el tamano de la tabla y recoloca los textos
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int literal_set_grow(LiteralSet *set) {
+  const char **keys;
+  size_t *lens;
+  size_t new_cap;
+  size_t i;
+  size_t slot;
+
+  new_cap = set->cap == 0 ? 64 : set->cap * 2;
+  keys = calloc(new_cap, sizeof(const char *));
+  lens = malloc(new_cap * sizeof(size_t));
+  if (keys == NULL || lens == NULL) {
+    free(keys);
+    free(lens);
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  for (i = 0; i < set->cap; i++) {
+    if (set->keys[i] == NULL) {
+      continue;
+    }
+    slot = (size_t)literal_hash(set->keys[i], set->lens[i]) & (new_cap - 1);
+    while (keys[slot] != NULL) {
+      slot = (slot + 1) & (new_cap - 1);
+    }
+    keys[slot] = set->keys[i];
+    lens[slot] = set->lens[i];
+  }
+  free(set->keys);
+  free(set->lens);
+  set->keys = keys;
+  set->lens = lens;
+  set->cap = new_cap;
+  return 0;
+}
+
+/*
+ literal_set_insert: anade text (de len bytes, como mucho NAME_MAX) a set
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int literal_set_insert(LiteralSet *set, const char *text, size_t len) {
+  size_t slot;
+
+  if (literal_set_find(set, text, len)) {
+    return 0;
+  }
+  if ((set->count + 1) * 2 > set->cap && literal_set_grow(set) < 0) {
+    return -1;
+  }
+  slot = (size_t)literal_hash(text, len) & (set->cap - 1);
+  while (set->keys[slot] != NULL) {
+    slot = (slot + 1) & (set->cap - 1);
+  }
+  set->keys[slot] = text;
+  set->lens[slot] = len;
+  set->count++;
+  if (!set->has_len[len]) {
+    set->has_len[len] = 1;
+    set->lengths[set->nlengths++] = len;
+  }
+  return 0;
+}
+
+/*
+ exclude_add: clasifica un patron y lo anade a excludes
+
+ El texto del patron tiene que seguir existiendo mientras se recorre (es un
+ argumento o esta dentro de excludes.files). Los patrones vacios se ignoran.
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int exclude_add(const char *pattern) {
+  const char **globs;
+  size_t len;
+  size_t stars;
+  size_t cap;
+  size_t i;
+  int special;
+
+  len = strlen(pattern);
+  if (len == 0) {
+    return 0;
+  }
+  for (i = 0; i <= len; i++) {
+    excludes.fingerprint = (excludes.fingerprint ^ (unsigned char)pattern[i]) * 16777619U;
+  }
+  excludes.active = 1;
+
+  stars = 0;
+  special = 0;
+  for (i = 0; i < len; i++) {
+    if (pattern[i] == '*') {
+      stars++;
+    } else if (pattern[i] == '?' || pattern[i] == '[' || pattern[i] == '\\') {
+      special = 1;
+    }
+  }
+  /* un texto de mas de NAME_MAX bytes no puede coincidir con ningun nombre */
+  if (!special && stars == 0) {
+    return len > NAME_MAX ? 0 : literal_set_insert(&excludes.names, pattern, len);
+  }
+  if (!special && stars == 1 && len > 1 && pattern[0] == '*') {
+    return len - 1 > NAME_MAX ? 0 : literal_set_insert(&excludes.suffixes, pattern + 1, len - 1);
+  }
+  if (!special && stars == 1 && len > 1 && pattern[len - 1] == '*') {
+    return len - 1 > NAME_MAX ? 0 : literal_set_insert(&excludes.prefixes, pattern, len - 1);
+  }
+
+  if (excludes.nglobs == excludes.globs_cap) {
+    cap = excludes.globs_cap > 0 ? excludes.globs_cap * 2 : 16;
+    globs = realloc(excludes.globs, cap * sizeof(const char *));
+    if (globs == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    excludes.globs = globs;
+    excludes.globs_cap = cap;
+  }
+  excludes.globs[excludes.nglobs++] = pattern;
+  return 0;
+}
+
+/*
+ exclude_add_file: anade los patrones de un fichero, uno por linea
+
+ Se ignoran las lineas vacias y las que empiezan por '#'. Guardamos el
+ contenido entero en excludes.files y partimos las lineas en su sitio, asi
+ los patrones no se copian uno a uno.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int exclude_add_file(const char *file) {
+  struct stat st;
+  char **files;
+  char *data;
+  char *line;
+  char *end;
+  size_t used;
+  ssize_t n;
+  int fd;
+
+  fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "Error: no se pudo leer %s\n", file);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  files = realloc(excludes.files, (excludes.nfiles + 1) * sizeof(char *));
+  data = malloc((size_t)st.st_size + 1);
+  if (files != NULL) {
+    excludes.files = files;
+  }
+  if (files == NULL || data == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    free(data);
+    close(fd);
+    return -1;
+  }
+  excludes.files[excludes.nfiles++] = data;
+  used = 0;
+  while (used < (size_t)st.st_size && (n = read(fd, data + used, (size_t)st.st_size - used)) > 0) {
+    used += (size_t)n;
+  }
+  close(fd);
+  data[used] = '\0';
+
+  for (line = data; line < data + used; line = end + 1) {
+    end = memchr(line, '\n', (size_t)(data + used - line));
+    if (end == NULL) {
+      end = data + used;
+    }
+    *end = '\0';
+    if (end > line && end[-1] == '\r') {
+      end[-1] = '\0';
+    }
+    if (line[0] != '#' && exclude_add(line) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ exclude_match: dice si la entrada name esta excluida
+ */
+int exclude_match(const char *name) {
+  const LiteralSet *set;
+  size_t len;
+  size_t n;
+  size_t i;
+
+  if (!excludes.active) {
+    return 0;
+  }
+  len = strlen(name);
+  if (len > NAME_MAX) {
+    return 0;
+  }
+  if (literal_set_find(&excludes.names, name, len)) {
+    return 1;
+  }
+  set = &excludes.suffixes;
+  for (i = 0; i < set->nlengths; i++) {
+    n = set->lengths[i];
+    if (n <= len && literal_set_find(set, name + len - n, n)) {
+      return 1;
+    }
+  }
+  set = &excludes.prefixes;
+  for (i = 0; i < set->nlengths; i++) {
+    n = set->lengths[i];
+    if (n <= len && literal_set_find(set, name, n)) {
+      return 1;
+    }
+  }
+  for (i = 0; i < excludes.nglobs; i++) {
+    if (fnmatch(excludes.globs[i], name, 0) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ exclude_free: libera los patrones (fingerprint se queda para guardar la cache)
+ */
+void exclude_free(void) {
+  uint32_t fingerprint;
+  size_t i;
+
+  free(excludes.names.keys);
+  free(excludes.names.lens);
+  free(excludes.suffixes.keys);
+  free(excludes.suffixes.lens);
+  free(excludes.prefixes.keys);
+  free(excludes.prefixes.lens);
+  free(excludes.globs);
+  for (i = 0; i < excludes.nfiles; i++) {
+    free(excludes.files[i]);
+  }
+  free(excludes.files);
+  fingerprint = excludes.fingerprint;
+  memset(&excludes, 0, sizeof(excludes));
+  excludes.fingerprint = fingerprint;
+}
+
+/*
+ CACHE INCREMENTAL (-i)
+
+ Si mydu se ejecuta cada pocos minutos sobre el mismo arbol casi nada cambia
+ entre ejecuciones, pero aun asi hacemos un stat de cada fichero. Con -i
+ guardamos en mydu.cache (junto a mydu.bin), por cada directorio, su
+ dispositivo e inodo, su mtime y ctime, cuantas entradas tenia y cuantos
+ bloques sumaban sus ficheros. Crear, borrar o renombrar una entrada cambia
+ el mtime del directorio, asi que si el directorio no ha cambiado
+ reutilizamos la suma de sus ficheros y solo bajamos a sus subdirectorios,
+ que reconocemos por el d_type de getdents64 sin hacer stat. Queda un stat
+ (el fstat del propio directorio) por directorio en lugar de uno por fichero.
+
+ Esto es una limitacion de -i: si un fichero cambia de tamano sin que se cree,
+ borre o renombre ninguna entrada (por ejemplo, al escribir al final de un
+ fichero que ya existia) el directorio no cambia de fecha y seguimos usando la
+ suma anterior. du no tiene cache y si lo ve; para eso hay que hacer una
+ ejecucion normal.
+
+ El fichero tiene una cabecera ("MYDUCACH", version, resumen de los patrones
+ de --exclude y de -l y -x, fecha del recorrido que lo genero y numero de registros) y registros de tamano fijo ordenados por
+ (dispositivo, inodo), asi que lo mapeamos y buscamos con busqueda binaria
+ sin copiarlo a memoria.
+ */
+
+/*
+ CacheEntry: lo que sabemos de un directorio en el recorrido actual
+ */
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t mtime_sec;
+  int64_t ctime_sec;
+  uint32_t mtime_nsec;
+  uint32_t ctime_nsec;
+  uint64_t entries;
+  uint64_t file_blocks;
+} CacheEntry;
+
+/*
+ CacheList: directorios vistos en este recorrido (uno por hilo)
+ */
+typedef struct {
+  CacheEntry *items;
+  size_t count;
+  size_t cap;
+} CacheList;
+
+/*
+ DirCache: cache de la ejecucion anterior (mapeado) y lo recogido en esta
+ */
+typedef struct {
+  unsigned char *map;
+  size_t map_size;
+  const unsigned char *records;
+  uint64_t count;
+  int64_t scan_time;
+  CacheList seen;
+  pthread_mutex_t lock;
+} DirCache;
+
+DirCache dir_cache = {NULL, 0, NULL, 0, 0, {NULL, 0, 0}, PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ cache_put_record / cache_get_record: pasan un CacheEntry a su formato en el fichero y al reves
+ */
+void cache_put_record(unsigned char *p, const CacheEntry *entry) {
+  put_u64(p, entry->dev);
+  put_u64(p + 8, entry->ino);
+  put_u64(p + 16, (uint64_t)entry->mtime_sec);
+  put_u64(p + 24, (uint64_t)entry->ctime_sec);
+  put_u32(p + 32, entry->mtime_nsec);
+  put_u32(p + 36, entry->ctime_nsec);
+  put_u64(p + 40, entry->entries);
+  put_u64(p + 48, entry->file_blocks);
+}
+
+void cache_get_record(const unsigned char *p, CacheEntry *entry) {
+  entry->dev = get_u64(p);
+  entry->ino = get_u64(p + 8);
+  entry->mtime_sec = (int64_t)get_u64(p + 16);
+  entry->ctime_sec = (int64_t)get_u64(p + 24);
+  entry->mtime_nsec = get_u32(p + 32);
+  entry->ctime_nsec = get_u32(p + 36);
+  entry->entries = get_u64(p + 40);
+  entry->file_blocks = get_u64(p + 48);
+}
+
+/*
+ cache_compare: orden de los registros, primero por dispositivo y luego por inodo
+ */
+int cache_compare(const void *a, const void *b) {
+  const CacheEntry *x;
+  const CacheEntry *y;
+
+  x = a;
+  y = b;
+  if (x->dev != y->dev) {
+    return x->dev < y->dev ? -1 : 1;
+  }
+  if (x->ino != y->ino) {
+    return x->ino < y->ino ? -1 : 1;
+  }
+  return 0;
+}
+
+/*
+ cache_fingerprint: resumen de las opciones que cambian las sumas de la cache
+
+ Ademas de los patrones de --exclude, -l cambia lo que cuentan los ficheros
+ con varios enlaces y -x los subdirectorios que se apuntan, asi que una cache
+ hecha con otras opciones no vale.
+ */
+uint32_t cache_fingerprint(void) {
+  uint32_t fingerprint;
+
+  fingerprint = excludes.fingerprint;
+  fingerprint = (fingerprint ^ (uint32_t)(options.count_links ? 1 : 0)) * 16777619U;
+  fingerprint = (fingerprint ^ (uint32_t)(options.one_fs ? 1 : 0)) * 16777619U;
+  return fingerprint;
+}
+
+/*
+ cache_load: mapea mydu.cache si existe y es valido
+
+ Si no existe o no se entiende empezamos sin cache (la ejecucion sera como una
+ normal y dejara la cache preparada para la siguiente).
+ */
+void cache_load(void) {
+  struct stat st;
+  unsigned char *map;
+  uint64_t count;
+  int fd;
+
+  fd = open(cache_file, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < CACHE_HEADER_SIZE) {
+    close(fd);
+    return;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+  count = get_u64(map + 24);
+  /* con otros patrones de --exclude, o con otros -l y -x, las sumas guardadas no valen */
+  if (memcmp(map, CACHE_MAGIC, CACHE_MAGIC_LEN) != 0 || get_u32(map + 8) != CACHE_VERSION ||
+      get_u32(map + 12) != cache_fingerprint() || count > ((uint64_t)st.st_size - CACHE_HEADER_SIZE) / CACHE_RECORD_SIZE) {
+    munmap(map, (size_t)st.st_size);
+    return;
+  }
+  dir_cache.map = map;
+  dir_cache.map_size = (size_t)st.st_size;
+  dir_cache.scan_time = (int64_t)get_u64(map + 16);
+  dir_cache.records = map + CACHE_HEADER_SIZE;
+  dir_cache.count = count;
+}
+
+/*
+ cache_lookup: busca un directorio en la cache de la ejecucion anterior
+
+ Solo damos el resultado por bueno si el mtime y el ctime coinciden y, ademas,
+ el ctime es anterior al momento en que empezo el recorrido que escribio la
+ cache: si el directorio cambio durante ese mismo segundo podria haber
+ cambiado otra vez sin que se notara en la fecha.
+ Devuelve 1 si se puede reutilizar (con el registro en *out), 0 si no.
+ */
+int cache_lookup(const struct stat *st, CacheEntry *out) {
+  CacheEntry key;
+  uint64_t low;
+  uint64_t high;
+  uint64_t mid;
+  int cmp;
+
+  key.dev = (uint64_t)st->st_dev;
+  key.ino = (uint64_t)st->st_ino;
+  low = 0;
+  high = dir_cache.count;
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    cache_get_record(dir_cache.records + mid * CACHE_RECORD_SIZE, out);
+    cmp = cache_compare(&key, out);
+    if (cmp == 0) {
+      return out->mtime_sec == (int64_t)st->st_mtim.tv_sec && out->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+             out->ctime_sec == (int64_t)st->st_ctim.tv_sec && out->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec &&
+             out->ctime_sec < dir_cache.scan_time;
+    }
+    if (cmp < 0) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ cache_add: apunta un directorio visto en este recorrido en la lista del hilo
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int cache_add(CacheList *list, const struct stat *st, uint64_t entries, uint64_t file_blocks) {
+  CacheEntry *items;
+  CacheEntry *entry;
+  size_t cap;
+
+  if (list->count == list->cap) {
+    cap = list->cap > 0 ? list->cap * 2 : 256;
+    items = realloc(list->items, cap * sizeof(CacheEntry));
+    if (items == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    list->items = items;
+    list->cap = cap;
+  }
+  entry = &list->items[list->count];
+  entry->dev = (uint64_t)st->st_dev;
+  entry->ino = (uint64_t)st->st_ino;
+  entry->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+  entry->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+  entry->ctime_sec = (int64_t)st->st_ctim.tv_sec;
+  entry->ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+  entry->entries = entries;
+  entry->file_blocks = file_blocks;
+  list->count++;
+  return 0;
+}
+
+/*
+ cache_collect: pasa la lista de un hilo a la lista comun y la vacia
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int cache_collect(CacheList *list) {
+  CacheList *seen;
+  CacheEntry *items;
+  size_t cap;
+  int status;
+
+  status = 0;
+  pthread_mutex_lock(&dir_cache.lock);
+  seen = &dir_cache.seen;
+  if (seen->count + list->count > seen->cap) {
+    cap = seen->cap > 0 ? seen->cap : 256;
+    while (cap < seen->count + list->count) {
+      cap *= 2;
+    }
+    items = realloc(seen->items, cap * sizeof(CacheEntry));
+    if (items == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      status = -1;
+    } else {
+      seen->items = items;
+      seen->cap = cap;
+    }
+  }
+  if (status == 0 && list->count > 0) {
+    memcpy(seen->items + seen->count, list->items, list->count * sizeof(CacheEntry));
+    seen->count += list->count;
+  }
+  pthread_mutex_unlock(&dir_cache.lock);
+  free(list->items);
+  memset(list, 0, sizeof(*list));
+  return status;
+}
+
+/*
+ cache_save: escribe la cache nueva y libera la anterior
+
+ Ordenamos los directorios de este recorrido y los mezclamos en una pasada
+ con los de la cache anterior que no hemos visitado (por ejemplo, de otros
+ arboles analizados en otras ejecuciones). Escribimos en un fichero temporal
+ y lo renombramos, asi nunca queda una cache a medias.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int cache_save(int64_t scan_time) {
+  unsigned char header[CACHE_HEADER_SIZE];
+  unsigned char *out;
+  CacheEntry old;
+  CacheList *seen;
+  uint64_t i;
+  uint64_t total;
+  size_t j;
+  size_t used;
+  int fd;
+  int status;
+
+  seen = &dir_cache.seen;
+  /* si no se vio ningun directorio items sigue a NULL, y qsort no lo admite */
+  if (seen->count > 0) {
+    qsort(seen->items, seen->count, sizeof(CacheEntry), cache_compare);
+  }
+  out = malloc((seen->count + dir_cache.count) * CACHE_RECORD_SIZE + 1);
+  if (out == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+
+  used = 0;
+  total = 0;
+  i = 0;
+  j = 0;
+  while (i < dir_cache.count || j < seen->count) {
+    if (i < dir_cache.count) {
+      cache_get_record(dir_cache.records + i * CACHE_RECORD_SIZE, &old);
+    }
+    if (j < seen->count && (i == dir_cache.count || cache_compare(&seen->items[j], &old) <= 0)) {
+      if (i < dir_cache.count && cache_compare(&seen->items[j], &old) == 0) {
+        i++; /* el registro antiguo queda sustituido por el nuevo */
+      }
+      /* un directorio con enlaces duros no existe, pero el mismo puede verse dos veces con -j */
+      if (j == 0 || cache_compare(&seen->items[j - 1], &seen->items[j]) != 0) {
+        cache_put_record(out + used, &seen->items[j]);
+        used += CACHE_RECORD_SIZE;
+        total++;
+      }
+      j++;
+    } else {
+      cache_put_record(out + used, &old);
+      used += CACHE_RECORD_SIZE;
+      total++;
+      i++;
+    }
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, CACHE_MAGIC, CACHE_MAGIC_LEN);
+  put_u32(header + 8, CACHE_VERSION);
+  put_u32(header + 12, cache_fingerprint());
+  put_u64(header + 16, (uint64_t)scan_time);
+  put_u64(header + 24, total);
+
+  status = -1;
+  fd = open(cache_tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    if (write_all(fd, header, sizeof(header)) == 0 && write_all(fd, out, used) == 0 && close(fd) == 0) {
+      status = rename(cache_tmp_file, cache_file);
+    } else {
+      unlink(cache_tmp_file);
+    }
+  }
+  if (status < 0) {
+    fprintf(stderr, "Error: no se pudo escribir %s\n", cache_file);
+  }
+  free(out);
+  return status;
+}
+
+/*
+ cache_free: libera la cache mapeada y la lista de directorios vistos
+ */
+void cache_free(void) {
+  if (dir_cache.map != NULL) {
+    munmap(dir_cache.map, dir_cache.map_size);
+  }
+  free(dir_cache.seen.items);
+  dir_cache.map = NULL;
+  dir_cache.records = NULL;
+  dir_cache.count = 0;
+  memset(&dir_cache.seen, 0, sizeof(dir_cache.seen));
+}
+
+/*
+ ScanBuf: memoria de trabajo para leer directorios
+
+ dents es el buffer de getdents64, names los nombres del bloque que estamos
+ procesando y results el resultado de cada statx de io_uring. Solo se usa
+ ring si use_ring vale 1. seen son los directorios que este hilo ha visto
+ con -i. links son los ficheros con varios enlaces del ultimo directorio
+ leido: si defer_links vale 1 (modo paralelo) se quedan ahi para quien
+ llama, si no se cuentan al momento. stats son los contadores de --stats
+ de este hilo. Cada hilo tiene el suyo; el recorrido
+ secuencial comparte uno entre todos los niveles.
+ */
+typedef struct {
+  char *dents;
+  const char **names;
+  int *results;
+  UringCtx ring;
+  int use_ring;
+  CacheList seen;
+  LinkList links;
+  int defer_links;
+  ScanStats stats;
+} ScanBuf;
+
+/*
+ scan_buf_init: reserva los buffers y, con -u, intenta preparar io_uring
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int scan_buf_init(ScanBuf *buf) {
+  memset(buf, 0, sizeof(*buf));
+  buf->ring.fd = -1;
+  buf->dents = malloc(DENTS_BUF_SIZE);
+  buf->names = malloc(DENTS_MAX_ENTRIES * sizeof(const char *));
+  buf->results = malloc(DENTS_MAX_ENTRIES * sizeof(int));
+  if (buf->dents == NULL || buf->names == NULL || buf->results == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  /* si io_uring no esta disponible seguimos sin avisar con fstatat */
+  if (options.use_uring && uring_init(&buf->ring, URING_ENTRIES) == 0) {
+    buf->use_ring = 1;
+  }
+  return 0;
+}
+
+/*
+ scan_buf_free: libera lo reservado por scan_buf_init
+
+ Con -i antes pasamos los directorios que ha visto este hilo a la lista
+ comun, que se guarda en mydu.cache al terminar, y sumamos sus contadores
+ a los de la ejecucion.
+ */
+void scan_buf_free(ScanBuf *buf) {
+  if (options.incremental) {
+    cache_collect(&buf->seen);
+  }
+  stats_merge(&buf->stats);
+  if (buf->use_ring) {
+    uring_free(&buf->ring);
+  }
+  free(buf->dents);
+  free(buf->names);
+  free(buf->results);
+  free(buf->links.items);
+  memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ read_dents: pide a getdents64 el siguiente bloque de entradas de dirfd
+ Devuelve los bytes leidos (0 si no quedan entradas) o -1 si hubo algun error.
+ */
+long read_dents(int dirfd, ScanBuf *buf) {
+  uint64_t t0;
+  long nread;
+
+  t0 = stats_start();
+  nread = syscall(SYS_getdents64, dirfd, buf->dents, DENTS_BUF_SIZE);
+  stats_stop(buf->stats.dents_hist, t0);
+  buf->stats.dents_calls++;
+  return nread;
+}
+
+/*
+ is_dot_entry: dice si el nombre es "." o ".."
+
+ Todos los directorios tienen estas dos entradas especiales: "." apunta al
+ propio directorio y ".." al padre. Si no las saltamos, la recursion no
+ terminaria nunca.
+ */
+int is_dot_entry(const char *name) {
+  return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/*
+ list_directory_full: lee y hace stat de todas las entradas de dirfd
+
+ Pedimos las entradas a getdents64 en bloques grandes (DENTS_BUF_SIZE bytes)
+ en lugar de una a una con readdir, y hacemos el stat de cada una sobre su
+ nombre relativo a dirfd, asi el kernel no tiene que volver a resolver toda
+ la ruta. Los bloques de los ficheros se suman a *file_blocks, las entradas
+ se cuentan en *entries y los subdirectorios se apuntan en subdirs, en el
+ mismo orden en que aparecen. Las entradas excluidas (--exclude) se saltan
+ sin hacer su stat.
+ Devuelve 0 si fue bien, -1 si hubo algun error (ver list_directory).
+ */
+int list_directory_full(int dirfd, ScanBuf *buf, SubdirList *subdirs, long *file_blocks, uint64_t *entries,
+                        const char **bad_name) {
+  struct linux_dirent64 *d;
+  unsigned count;
+  long nread;
+  long pos;
+
+  while (1) {
+    nread = read_dents(dirfd, buf);
+    if (nread < 0) {
+      return -1;
+    }
+    if (nread == 0) {
+      break; /* no quedan mas entradas */
+    }
+
+    count = 0;
+    for (pos = 0; pos < nread; pos += d->d_reclen) {
+      d = (struct linux_dirent64 *)(buf->dents + pos);
+      if (is_dot_entry(d->d_name)) {
+        continue;
+      }
+      if (exclude_match(d->d_name)) {
+        buf->stats.excluded++;
+        continue;
+      }
+      buf->names[count] = d->d_name;
+      count++;
+    }
+    *entries += count;
+    if (stat_names(dirfd, buf->use_ring ? &buf->ring : NULL, buf->names, count, buf->results,
+                   subdirs, &buf->links, file_blocks, &buf->stats, bad_name) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ list_directory_cached: lee un directorio que no ha cambiado desde la cache
+
+ Solo buscamos los subdirectorios, que nos dice el d_type de getdents64 sin
+ hacer stat (si el sistema de ficheros no lo rellena, DT_UNKNOWN, o si con
+ -x hay que mirar su dispositivo, hacemos stat de esa entrada). Los bloques de cada subdirectorio los pondra el fstat
+ que se hace al recorrerlo. Por si acaso comprobamos que el numero de
+ entradas coincide con el de la cache.
+ Devuelve 1 si coincide, 0 si no (y entonces hay que leerlo entero) y -1 si hubo algun error.
+ */
+int list_directory_cached(int dirfd, ScanBuf *buf, SubdirList *subdirs, const CacheEntry *cached,
+                          const char **bad_name) {
+  struct linux_dirent64 *d;
+  struct stat st;
+  uint64_t entries;
+  uint64_t t0;
+  long nread;
+  long pos;
+
+  entries = 0;
+  while (1) {
+    nread = read_dents(dirfd, buf);
+    if (nread < 0) {
+      return -1;
+    }
+    if (nread == 0) {
+      break;
+    }
+    for (pos = 0; pos < nread; pos += d->d_reclen) {
+      d = (struct linux_dirent64 *)(buf->dents + pos);
+      if (is_dot_entry(d->d_name)) {
+        continue;
+      }
+      if (exclude_match(d->d_name)) {
+        buf->stats.excluded++;
+        continue;
+      }
+      entries++;
+      if (d->d_type == DT_UNKNOWN || (d->d_type == DT_DIR && options.one_fs)) {
+        t0 = stats_start();
+        if (fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+          *bad_name = d->d_name;
+          return -1;
+        }
+        stats_stop(buf->stats.stat_hist, t0);
+        buf->stats.stat_calls++;
+        if (S_ISDIR(st.st_mode) && (!options.one_fs || st.st_dev == options.root_dev) &&
+            subdir_add(subdirs, d->d_name, st.st_blocks) < 0) {
+          return -1;
+        }
+      } else if (d->d_type == DT_DIR && subdir_add(subdirs, d->d_name, 0) < 0) {
+        return -1;
+      }
+    }
+  }
+  return entries == cached->entries ? 1 : 0;
+}
+
+/*
+ list_directory: lee todas las entradas del directorio abierto en dirfd
+
+ Los bloques de los ficheros se suman a *blocks y los subdirectorios se
+ apuntan en subdirs (ver list_directory_full).
+
+ Con -i primero hacemos fstat del directorio: *blocks pasa a ser sus propios
+ bloques y, si la cache dice que no ha cambiado, sumamos la suma de ficheros
+ guardada sin hacer stat de ninguno. Si ha cambiado lo leemos entero. En los
+ dos casos lo apuntamos para la cache de la siguiente ejecucion, salvo si
+ tiene ficheros con varios enlaces: lo que se cuenta de ellos depende de los
+ directorios que se hayan visto antes, asi que esos se leen siempre enteros.
+
+ Los ficheros con varios enlaces quedan en buf->links; si buf->defer_links
+ vale 0 los contamos aqui mismo (ver count_links).
+
+ Si falla el stat de una entrada, *bad_name apunta a su nombre (dentro de
+ dents, valido hasta la siguiente llamada) para que quien llama pueda
+ construir la ruta del mensaje de error. Si falla la lectura queda a NULL.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int list_directory(int dirfd, ScanBuf *buf, SubdirList *subdirs, long *blocks, const char **bad_name) {
+  struct stat st;
+  CacheEntry cached;
+  uint64_t entries;
+  uint64_t t0;
+  long file_blocks;
+  size_t mark_count;
+  size_t mark_len;
+  int status;
+
+  *bad_name = NULL;
+  entries = 0;
+  file_blocks = 0;
+  buf->links.count = 0;
+  buf->stats.dirs++;
+  if (!options.incremental) {
+    if (list_directory_full(dirfd, buf, subdirs, &file_blocks, &entries, bad_name) < 0) {
+      return -1;
+    }
+    *blocks += file_blocks;
+    return buf->defer_links ? 0 : count_links(&buf->links, blocks);
+  }
+
+  t0 = stats_start();
+  if (fstat(dirfd, &st) < 0) {
+    return -1;
+  }
+  stats_stop(buf->stats.stat_hist, t0);
+  buf->stats.stat_calls++;
+  *blocks = st.st_blocks;
+  if (cache_lookup(&st, &cached)) {
+    mark_count = subdirs->count;
+    mark_len = subdirs->names_len;
+    status = list_directory_cached(dirfd, buf, subdirs, &cached, bad_name);
+    if (status < 0) {
+      return -1;
+    }
+    if (status == 1) {
+      buf->stats.cached_dirs++;
+      *blocks += (long)cached.file_blocks;
+      return cache_add(&buf->seen, &st, cached.entries, cached.file_blocks);
+    }
+    /* no coincide: deshacemos lo apuntado y volvemos a leer desde el principio */
+    subdirs->count = mark_count;
+    subdirs->names_len = mark_len;
+    if (lseek(dirfd, 0, SEEK_SET) < 0) {
+      return -1;
+    }
+  }
+
+  if (list_directory_full(dirfd, buf, subdirs, &file_blocks, &entries, bad_name) < 0) {
+    return -1;
+  }
+  *blocks += file_blocks;
+  if (buf->links.count > 0) {
+    return buf->defer_links ? 0 : count_links(&buf->links, blocks);
+  }
+  return cache_add(&buf->seen, &st, entries, (uint64_t)file_blocks);
+}
+
+/*
+ WalkFrame: un nivel de la pila del recorrido secuencial
+
+ subdirs son los subdirectorios de este nivel que faltan por recorrer (next
+ es el siguiente y next_name su nombre dentro de subdirs.names) y
+ total_blocks lo que llevamos sumado. saved_len es la longitud de la ruta
+ antes de anadir este nivel, para quitarlo al volver.
+
+ Solo los niveles mas profundos tienen el directorio abierto: WALK_OPEN_DIRS,
+ o menos si el limite de ficheros abiertos no da para tantos (ver
+ open_dirs_limit).
+ Si cerramos uno guardamos antes su dev/ino para reabrirlo con ".." desde
+ el hijo al volver y comprobar que es el mismo directorio.
+ */
+typedef struct {
+  SubdirList subdirs;
+  const char *next_name;
+  size_t next;
+  long total_blocks;
+  long saved_len;
+  dev_t dev;
+  ino_t ino;
+  int fd;
+} WalkFrame;
+
+/*
+ WalkStack: pila de niveles del recorrido
+
+ Crece en el heap segun la profundidad del arbol y no se encoge: al volver
+ a bajar reutilizamos los SubdirList de los niveles que ya usamos.
+ */
+typedef struct {
+  WalkFrame *frames;
+  size_t depth;
+  size_t cap;
+} WalkStack;
+
+/*
+ walk_push: anade un nivel a la pila para el directorio abierto en fd
+ Devuelve el nuevo nivel, o NULL si no hay memoria.
+ */
+WalkFrame *walk_push(WalkStack *stack, int fd, long dir_blocks, long saved_len) {
+  WalkFrame *frames;
+  WalkFrame *frame;
+  size_t new_cap;
+
+  if (stack->depth == stack->cap) {
+    new_cap = stack->cap == 0 ? WALK_INITIAL_DEPTH : stack->cap * 2;
+    frames = realloc(stack->frames, new_cap * sizeof(WalkFrame));
+    if (frames == NULL) {
+      fprintf(stderr, "Error: no hay memoria suficiente\n");
+      return NULL;
+    }
+    memset(frames + stack->cap, 0, (new_cap - stack->cap) * sizeof(WalkFrame));
+    stack->frames = frames;
+    stack->cap = new_cap;
+  }
+  frame = &stack->frames[stack->depth];
+  stack->depth++;
+  subdir_clear(&frame->subdirs);
+  frame->next_name = NULL;
+  frame->next = 0;
+  frame->total_blocks = dir_blocks;
+  frame->saved_len = saved_len;
+  frame->fd = fd;
+  return frame;
+}
+
+/*
+ walk_release: cierra el directorio de un nivel que ya no es de los mas
+ profundos, apuntando su dev/ino para poder reabrirlo despues
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int walk_release(WalkFrame *frame) {
+  struct stat st;
+
+  if (fstat(frame->fd, &st) < 0) {
+    return -1;
+  }
+  frame->dev = st.st_dev;
+  frame->ino = st.st_ino;
+  close(frame->fd);
+  frame->fd = -1;
+  return 0;
+}
+
+/*
+ walk_reopen: vuelve a abrir el directorio de un nivel cerrado usando ".."
+ desde el hijo que acabamos de terminar
+ Devuelve 0 si fue bien, -1 si no se pudo abrir o ya no es el mismo
+ directorio (lo han movido durante el recorrido).
+ */
+int walk_reopen(WalkFrame *frame, int childfd) {
+  struct stat st;
+  int fd;
+
+  fd = openat(childfd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_dev != frame->dev || st.st_ino != frame->ino) {
+    close(fd);
+    return -1;
+  }
+  frame->fd = fd;
+  return 0;
+}
+
+/*
+ walk_free: cierra los directorios que siguen abiertos en la pila (menos el
+ raiz, que es de quien llama) y libera toda su memoria
+ */
+void walk_free(WalkStack *stack) {
+  size_t i;
+
+  for (i = 1; i < stack->depth; i++) {
+    if (stack->frames[i].fd >= 0) {
+      close(stack->frames[i].fd);
+    }
+  }
+  for (i = 0; i < stack->cap; i++) {
+    subdir_free(&stack->frames[i].subdirs);
+  }
+  free(stack->frames);
+}
+
+/*
+ walk_list: lee el directorio del nivel de arriba de la pila
+ Devuelve 0 si fue bien, -1 si hubo algun error (ya escrito por pantalla).
+ */
+int walk_list(WalkFrame *frame, PathBuf *path, ScanBuf *buf) {
+  const char *bad_name;
+
+  if (list_directory(frame->fd, buf, &frame->subdirs, &frame->total_blocks, &bad_name) < 0) {
+    if (bad_name != NULL) {
+      fprintf(stderr, "Error: no se pudo acceder a %s/%s\n", path->data, bad_name);
+    } else {
+      fprintf(stderr, "Error: no se pudo leer directorio %s\n", path->data);
+    }
+    return -1;
+  }
+  frame->next_name = frame->subdirs.names;
+  return 0;
+}
+
+/*
+ scan_dir_fd: recorrido de calculate_dir_size con una pila explicita
+
+ dirfd es el directorio ya abierto, dir_blocks sus propios bloques (los que
+ nos dio el stat) y path su ruta, que solo usamos para escribir. Cada
+ directorio se lee entero y despues bajamos a sus subdirectorios en el orden
+ de getdents, igual que haria una funcion recursiva, pero los niveles viven
+ en una pila en el heap (WalkStack) y la ruta en un solo buffer (PathBuf)
+ al que cada nivel solo anade su nombre. Asi un arbol muy profundo no agota
+ la pila del programa ni el limite de ficheros abiertos.
+ Devuelve los bloques totales, o -1 si hubo algun error.
+ */
+long scan_dir_fd(int dirfd, long dir_blocks, PathBuf *path, ScanBuf *buf) {
+  WalkStack stack;
+  WalkFrame *frame;
+  WalkFrame *parent;
+  long saved_len;
+  long total_blocks;
+  size_t window;
+  int childfd;
+
+  memset(&stack, 0, sizeof(stack));
+  window = (size_t)open_dirs_limit(WALK_OPEN_DIRS, 0);
+  total_blocks = -1;
+  frame = walk_push(&stack, dirfd, dir_blocks, 0);
+  if (frame == NULL || walk_list(frame, path, buf) < 0) {
+    walk_free(&stack);
+    return -1;
+  }
+
+  while (1) {
+    frame = &stack.frames[stack.depth - 1];
+
+    if (frame->next < frame->subdirs.count) {
+      /* bajamos al siguiente subdirectorio de este nivel */
+      saved_len = path_push(path, frame->next_name);
+      if (saved_len < 0) {
+        break;
+      }
+      childfd = open_subdir(frame->fd, frame->next_name);
+      if (childfd < 0) {
+        fprintf(stderr, "Error: no se pudo abrir directorio %s\n", path->data);
+        break;
+      }
+      frame = walk_push(&stack, childfd, frame->subdirs.blocks[frame->next], saved_len);
+      if (frame == NULL) {
+        close(childfd);
+        break;
+      }
+      /* el nivel que se queda fuera de los window mas profundos se cierra (el raiz nunca) */
+      if (stack.depth > window + 1 && stack.frames[stack.depth - window - 1].fd >= 0 &&
+          walk_release(&stack.frames[stack.depth - window - 1]) < 0) {
+        fprintf(stderr, "Error: no se pudo acceder a %s\n", path->data);
+        break;
+      }
+      if (walk_list(frame, path, buf) < 0) {
+        break;
+      }
+      continue;
+    }
+
+    /* este nivel esta terminado */
+    if (stack.depth == 1) {
+      total_blocks = frame->total_blocks;
+      break;
+    }
+    parent = &stack.frames[stack.depth - 2];
+    if (parent->fd < 0 && walk_reopen(parent, frame->fd) < 0) {
+      fprintf(stderr, "Error: el directorio padre de %s ha cambiado durante el recorrido\n", path->data);
+      break;
+    }
+    close(frame->fd);
+    frame->fd = -1;
+    stack.depth--;
+    parent->total_blocks += frame->total_blocks;
+    /*
+     Convertimos a KB antes de guardar en el binario.
+     st.st_blocks devuelve los bloques de 512 bytes, asi que para pasarlo a KB (1024 bytes) usamos / 2.
+     */
+    if (report_dir(frame->total_blocks / 2, path->data, (long)stack.depth) < 0) {
+      break;
+    }
+    path_pop(path, frame->saved_len);
+    parent->next++;
+    parent->next_name += strlen(parent->next_name) + 1;
+  }
+
+  walk_free(&stack);
+  return total_blocks;
+}
+
+/*
+ calculate_dir_size: calcula el tamano total de un directorio de forma recursiva
+ 
+ Esta es la funcion mas importante del programa. La idea es:
+ 1. Leer todas las entradas del directorio (list_directory)
+ 2. Para cada fichero, sumar directamente su tamano en bloques
+ 3. Para cada subdirectorio, calcular su tamano de la misma forma y
+ sumarlo al total (scan_dir_fd lo hace con una pila en lugar de recursion)
+ 
+ Todo el recorrido trabaja con descriptores de directorio (openat, fstatat)
+ en lugar de rutas completas: el kernel solo resuelve un nombre por entrada
+ aunque el arbol sea muy profundo. Usamos AT_SYMLINK_NOFOLLOW y O_NOFOLLOW
+ porque si siguieramos los enlaces simbolicos podriamos entrar en un bucle
+ infinito.
+ 
+ dirfd es el directorio raiz ya abierto (ver open_directory) y dirpath su
+ ruta, que se usa para escribir las lineas de salida.
+ Devuelve el tamano total en bloques de 512B (la conversion a KB la hacemos fuera).
+ Devuelve -1 si ocurre algun error.
+ */
+long calculate_dir_size(int dirfd, const char *dirpath) {
+  struct stat st;
+  PathBuf path;
+  ScanBuf buf;
+  long total_blocks;
+
+  /* sumamos los bloques del propio directorio primero */
+  if (fstat(dirfd, &st) < 0) {
+    fprintf(stderr, "Error: no se pudo acceder a %s\n", dirpath);
+    return -1;
+  }
+
+  memset(&path, 0, sizeof(path));
+  if (path_set(&path, dirpath) < 0) {
+    return -1;
+  }
+  if (scan_buf_init(&buf) < 0) {
+    scan_buf_free(&buf);
+    free(path.data);
+    return -1;
+  }
+
+  total_blocks = scan_dir_fd(dirfd, st.st_blocks, &path, &buf);
+
+  scan_buf_free(&buf);
+  free(path.data);
+  return total_blocks;
+}
+
+/*
+ RECORRIDO PARALELO (-j N)
+
+ Con arboles muy grandes un solo hilo hace todo el trabajo mientras el disco
+ esta casi parado. En modo paralelo cada subdirectorio es una tarea que puede
+ escanear cualquier hilo. Cada hilo tiene su propia cola doble (deque): mete
+ y saca tareas por el final (lo mas reciente, que suele estar en cache) y,
+ cuando se queda sin trabajo, roba tareas del principio de la cola de otro
+ hilo (lo mas antiguo, que suele ser un subarbol grande).
+
+ Como los hilos terminan en cualquier orden, no escribimos nada durante el
+ recorrido: guardamos un nodo por directorio y, al acabar, lo recorremos en
+ el mismo orden que la version recursiva. Asi la salida por pantalla y
+ mydu.bin son identicas a las de la ejecucion secuencial.
+ */
+
+/*
+ DirNode: nodo del arbol de directorios que construye el modo paralelo
+
+ Los hijos se enlazan en el orden en que readdir los devuelve. El contador
+ pending vale "hijos sin terminar + 1" (el +1 es el escaneo del propio
+ directorio). Cuando llega a cero el directorio esta completo y podemos sumar
+ los totales de sus hijos y avisar al padre.
+
+ Igual que en el recorrido secuencial no guardamos rutas completas: cada nodo
+ solo tiene su nombre y la ruta se reconstruye subiendo por los padres
+ cuando hay que escribirla.
+ */
+typedef struct DirNode {
+  struct DirNode *parent;
+  struct DirNode *first_child;
+  struct DirNode *last_child;
+  struct DirNode *next_sibling;
+  long own_blocks;   /* bloques del propio directorio y de sus ficheros */
+  long total_blocks; /* own_blocks mas el total de los hijos */
+  LinkList links;    /* ficheros con varios enlaces, sin contar aun en own_blocks */
+  atomic_int pending;
+  int fd;            /* descriptor ya abierto por el padre, o -1 */
+  int wd;            /* descriptor de inotify en modo demonio, o -1 */
+  int dirty;         /* modo demonio: tiene eventos pendientes */
+  int seen;          /* modo demonio: sigue existiendo al releer el padre */
+  char name[];       /* nombre dentro del padre (la raiz guarda su ruta) */
+} DirNode;
+
+/*
+ WorkDeque: cola doble de tareas de un hilo
+
+ items[top..bottom) son las tareas pendientes. El dueno trabaja por bottom y
+ los ladrones por top. Un mutex por cola es suficiente: solo hay competencia
+ cuando alguien roba, y eso pasa poco comparado con el coste de un readdir.
+ */
+typedef struct {
+  DirNode **items;
+  size_t top;
+  size_t bottom;
+  size_t cap;
+  pthread_mutex_t lock;
+} WorkDeque;
+
+/*
+ WorkPool: estado compartido por todos los hilos
+
+ pending cuenta los directorios encolados o en proceso: cuando llega a cero el
+ recorrido ha terminado. queued cuenta solo los que esperan en alguna cola y
+ sleeping los hilos dormidos, para despertarlos solo cuando hace falta.
+ open_dirs cuenta los descriptores de directorio abiertos: los nodos que
+ esperan en las colas no pueden quedarse todos con uno abierto, como mucho
+ max_open_dirs (MAX_OPEN_DIRS o lo que deje el limite de ficheros abiertos).
+ */
+typedef struct {
+  WorkDeque *deques;
+  int nthreads;
+  atomic_long pending;
+  atomic_long queued;
+  atomic_int sleeping;
+  atomic_int failed;
+  atomic_int open_dirs;
+  int max_open_dirs;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+} WorkPool;
+
+/*
+ WorkerArg: argumento que recibe cada hilo
+
+ Ademas del pool y su numero de cola, cada hilo tiene sus propios buffers
+ de lectura (y su anillo de io_uring con -u), su lista de subdirectorios y su
+ ruta, que reutiliza entre directorios para no reservar memoria en cada uno.
+ */
+typedef struct {
+  WorkPool *pool;
+  int id;
+  ScanBuf scan;
+  SubdirList subdirs;
+  PathBuf path;
+} WorkerArg;
+
+/*
+ new_dir_node: reserva un nodo para el directorio name y lo cuelga de parent
+
+ blocks son los bloques del propio directorio, que ya conocemos por el stat
+ del padre. Solo el hilo que escanea el padre anade hijos, asi que la lista
+ de hijos no necesita cerrojo. Devuelve NULL si no hay memoria.
+ */
+DirNode *new_dir_node(DirNode *parent, const char *name, long blocks) {
+  DirNode *node;
+  size_t len;
+
+  len = strlen(name);
+  node = malloc(sizeof(DirNode) + len + 1);
+  if (node == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return NULL;
+  }
+  node->parent = parent;
+  node->first_child = NULL;
+  node->last_child = NULL;
+  node->next_sibling = NULL;
+  node->own_blocks = blocks;
+  node->total_blocks = 0;
+  memset(&node->links, 0, sizeof(node->links));
+  atomic_init(&node->pending, 1);
+  node->fd = -1;
+  node->wd = -1;
+  node->dirty = 0;
+  node->seen = 0;
+  memcpy(node->name, name, len + 1);
+
+  if (parent != NULL) {
+    if (parent->last_child == NULL) {
+      parent->first_child = node;
+    } else {
+      parent->last_child->next_sibling = node;
+    }
+    parent->last_child = node;
+  }
+  return node;
+}
+
+/*
+ free_dir_tree: libera un nodo y todos sus descendientes
+
+ Si el recorrido se corto por un error puede quedar algun descriptor abierto
+ en nodos que nunca se escanearon, asi que tambien los cerramos aqui.
+ */
+void free_dir_tree(DirNode *node) {
+  DirNode *child;
+  DirNode *next;
+
+  child = node->first_child;
+  while (child != NULL) {
+    next = child->next_sibling;
+    free_dir_tree(child);
+    child = next;
+  }
+  if (node->fd >= 0) {
+    close(node->fd);
+  }
+  free(node->links.items);
+  free(node);
+}
+
+/*
+ build_node_path: escribe en path la ruta completa de node
+
+ Primero sumamos la longitud de todos los nombres hasta la raiz y despues
+ los copiamos de derecha a izquierda, sin ningun buffer intermedio.
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int build_node_path(const DirNode *node, PathBuf *path) {
+  const DirNode *n;
+  size_t len;
+  size_t name_len;
+  char *end;
+
+  len = 0;
+  for (n = node; n != NULL; n = n->parent) {
+    len += strlen(n->name);
+    if (n->parent != NULL) {
+      len++; /* la barra que lo separa del padre */
+    }
+  }
+  if (path_reserve(path, len + 1) < 0) {
+    return -1;
+  }
+  path->len = len;
+  path->data[len] = '\0';
+  end = path->data + len;
+  for (n = node; n != NULL; n = n->parent) {
+    name_len = strlen(n->name);
+    end -= name_len;
+    memcpy(end, n->name, name_len);
+    if (n->parent != NULL) {
+      end--;
+      *end = '/';
+    }
+  }
+  return 0;
+}
+
+/*
+ deque_push: el dueno mete una tarea por el final de su cola
+
+ Si no queda hueco al final primero reaprovechamos lo que los ladrones han
+ dejado libre al principio y, si aun asi no cabe, duplicamos la capacidad.
+ */
+int deque_push(WorkDeque *dq, DirNode *node) {
+  DirNode **items;
+  size_t count;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom == dq->cap) {
+    count = dq->bottom - dq->top;
+    if (dq->top > 0) {
+      memmove(dq->items, dq->items + dq->top, count * sizeof(DirNode *));
+    }
+    dq->top = 0;
+    dq->bottom = count;
+    if (count == dq->cap) {
+      items = realloc(dq->items, dq->cap * 2 * sizeof(DirNode *));
+      if (items == NULL) {
+        pthread_mutex_unlock(&dq->lock);
+        fprintf(stderr, "Error: memoria insuficiente\n");
+        return -1;
+      }
+      dq->items = items;
+      dq->cap *= 2;
+    }
+  }
+  dq->items[dq->bottom] = node;
+  dq->bottom++;
+  pthread_mutex_unlock(&dq->lock);
+  return 0;
+}
+
+/*
+ deque_pop: el dueno saca la tarea mas reciente (por el final)
+ */
+DirNode *deque_pop(WorkDeque *dq) {
+  DirNode *node;
+
+  node = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom > dq->top) {
+    dq->bottom--;
+    node = dq->items[dq->bottom];
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return node;
+}
+
+/*
+ deque_steal: otro hilo roba la tarea mas antigua (por el principio)
+ */
+DirNode *deque_steal(WorkDeque *dq) {
+  DirNode *node;
+
+  node = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom > dq->top) {
+    node = dq->items[dq->top];
+    dq->top++;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return node;
+}
+
+/*
+ pool_wake_all: despierta a todos los hilos dormidos (fin del recorrido o error)
+ */
+void pool_wake_all(WorkPool *pool) {
+  pthread_mutex_lock(&pool->idle_lock);
+  pthread_cond_broadcast(&pool->idle_cond);
+  pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/*
+ pool_push: publica un directorio nuevo en la cola del hilo self
+
+ Primero contamos la tarea como pendiente para que nadie crea que el recorrido
+ ha terminado mientras la estamos metiendo. Solo cogemos el cerrojo de los
+ hilos dormidos si de verdad hay alguno esperando.
+ */
+int pool_push(WorkPool *pool, int self, DirNode *node) {
+  atomic_fetch_add(&pool->pending, 1);
+  if (deque_push(&pool->deques[self], node) < 0) {
+    atomic_fetch_sub(&pool->pending, 1);
+    return -1;
+  }
+  atomic_fetch_add(&pool->queued, 1);
+  if (atomic_load(&pool->sleeping) > 0) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+  return 0;
+}
+
+/*
+ pool_take: busca la siguiente tarea para el hilo self
+
+ Miramos primero nuestra propia cola y, si esta vacia, intentamos robar de las
+ demas empezando por la siguiente a la nuestra para repartir los robos.
+ */
+DirNode *pool_take(WorkPool *pool, int self) {
+  DirNode *node;
+  int i;
+
+  node = deque_pop(&pool->deques[self]);
+  for (i = 1; node == NULL && i < pool->nthreads; i++) {
+    node = deque_steal(&pool->deques[(self + i) % pool->nthreads]);
+  }
+  if (node != NULL) {
+    atomic_fetch_sub(&pool->queued, 1);
+  }
+  return node;
+}
+
+/*
+ finish_node: marca como terminado el escaneo de un directorio o de un hijo
+
+ Cuando el contador de un nodo llega a cero ya conocemos el total de todos sus
+ hijos, asi que calculamos su total y subimos al padre, que puede completarse
+ a su vez. Es la misma suma que hace la recursion, pero de abajo a arriba.
+ */
+void finish_node(DirNode *node) {
+  DirNode *child;
+
+  while (node != NULL) {
+    if (atomic_fetch_sub(&node->pending, 1) != 1) {
+      return;
+    }
+    node->total_blocks = node->own_blocks;
+    for (child = node->first_child; child != NULL; child = child->next_sibling) {
+      node->total_blocks += child->total_blocks;
+    }
+    node = node->parent;
+  }
+}
+
+/*
+ scan_dir_node: lee las entradas de un directorio en modo paralelo
+
+ Es el mismo trabajo que scan_dir_fd, pero en lugar de bajar a cada
+ subdirectorio crea su nodo y lo mete en la cola del hilo. Mientras
+ haya descriptores libres abrimos cada hijo con openat sobre el padre; si no,
+ el hijo se abrira por su ruta completa cuando algun hilo lo coja.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int scan_dir_node(WorkPool *pool, WorkerArg *worker, DirNode *node) {
+  const char *bad_name;
+  const char *name;
+  DirNode *child;
+  size_t i;
+  int status;
+
+  if (node->fd < 0) {
+    if (build_node_path(node, &worker->path) < 0) {
+      return -1;
+    }
+    node->fd = open(worker->path.data, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (node->fd < 0) {
+      fprintf(stderr, "Error: no se pudo abrir directorio %s\n", worker->path.data);
+      return -1;
+    }
+    atomic_fetch_add(&pool->open_dirs, 1);
+  }
+
+  subdir_clear(&worker->subdirs);
+  status = list_directory(node->fd, &worker->scan, &worker->subdirs, &node->own_blocks, &bad_name);
+  if (status < 0 && build_node_path(node, &worker->path) == 0) {
+    if (bad_name != NULL) {
+      fprintf(stderr, "Error: no se pudo acceder a %s/%s\n", worker->path.data, bad_name);
+    } else {
+      fprintf(stderr, "Error: no se pudo leer directorio %s\n", worker->path.data);
+    }
+  }
+  /* los ficheros con varios enlaces se cuentan al final, en el orden secuencial (ver settle_links) */
+  if (status == 0 && worker->scan.links.count > 0) {
+    node->links = worker->scan.links;
+    memset(&worker->scan.links, 0, sizeof(worker->scan.links));
+  }
+
+  name = worker->subdirs.names;
+  for (i = 0; status == 0 && i < worker->subdirs.count; i++) {
+    /* el hijo queda pendiente hasta que algun hilo lo escanee */
+    child = new_dir_node(node, name, worker->subdirs.blocks[i]);
+    if (child == NULL) {
+      status = -1;
+      break;
+    }
+    if (atomic_fetch_add(&pool->open_dirs, 1) < pool->max_open_dirs) {
+      child->fd = open_subdir(node->fd, name);
+      if (child->fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+        atomic_fetch_sub(&pool->open_dirs, 1); /* sin descriptores libres: se abrira por su ruta */
+      } else if (child->fd < 0) {
+        atomic_fetch_sub(&pool->open_dirs, 1);
+        if (build_node_path(child, &worker->path) == 0) {
+          fprintf(stderr, "Error: no se pudo abrir directorio %s\n", worker->path.data);
+        }
+        status = -1;
+        break;
+      }
+    } else {
+      atomic_fetch_sub(&pool->open_dirs, 1);
+    }
+    atomic_fetch_add(&node->pending, 1);
+    if (pool_push(pool, worker->id, child) < 0) {
+      atomic_fetch_sub(&node->pending, 1);
+      status = -1;
+      break;
+    }
+    name += strlen(name) + 1;
+  }
+
+  close(node->fd);
+  node->fd = -1;
+  atomic_fetch_sub(&pool->open_dirs, 1);
+  return status;
+}
+
+/*
+ parallel_worker: bucle principal de cada hilo del modo paralelo
+
+ Coge tareas mientras las haya. Si no encuentra ninguna se duerme hasta que
+ otro hilo publique trabajo nuevo o el recorrido termine. Si algun hilo falla,
+ el resto sigue vaciando las colas sin escanear para poder terminar limpio.
+ */
+void *parallel_worker(void *arg) {
+  WorkerArg *worker;
+  WorkPool *pool;
+  DirNode *node;
+  int done;
+
+  worker = arg;
+  pool = worker->pool;
+  while (1) {
+    node = pool_take(pool, worker->id);
+    if (node != NULL) {
+      if (atomic_load(&pool->failed) == 0 && scan_dir_node(pool, worker, node) < 0) {
+        atomic_store(&pool->failed, 1);
+        pool_wake_all(pool);
+      }
+      finish_node(node);
+      if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pool_wake_all(pool); /* era la ultima tarea: despertamos a todos para salir */
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->sleeping, 1);
+    while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0 &&
+           atomic_load(&pool->failed) == 0) {
+      pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+    }
+    atomic_fetch_sub(&pool->sleeping, 1);
+    done = atomic_load(&pool->pending) == 0 || atomic_load(&pool->failed) != 0;
+    pthread_mutex_unlock(&pool->idle_lock);
+    if (done) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/*
+ settle_links: cuenta los ficheros con varios enlaces del arbol y rehace los totales
+
+ Los hilos terminan en cualquier orden, asi que durante el recorrido cada
+ nodo solo guarda sus ficheros con varios enlaces. Aqui los contamos en el
+ mismo orden que el recorrido secuencial (primero los del directorio, luego
+ cada hijo en el orden de getdents), de forma que cada fichero se suma al
+ mismo directorio que sin -j.
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int settle_links(DirNode *node) {
+  DirNode *child;
+
+  if (count_links(&node->links, &node->own_blocks) < 0) {
+    return -1;
+  }
+  node->total_blocks = node->own_blocks;
+  for (child = node->first_child; child != NULL; child = child->next_sibling) {
+    if (settle_links(child) < 0) {
+      return -1;
+    }
+    node->total_blocks += child->total_blocks;
+  }
+  return 0;
+}
+
+/*
+ report_dir_tree: escribe los subdirectorios de node en el orden secuencial
+
+ La version secuencial escribe cada subdirectorio justo despues de terminar
+ con todo su contenido, en el orden de getdents. Recorremos el arbol igual
+ (postorden) para que la salida coincida linea a linea, construyendo la ruta
+ en path a medida que bajamos.
+ */
+int report_dir_tree(DirNode *node, PathBuf *path, long depth) {
+  DirNode *child;
+  long saved_len;
+
+  for (child = node->first_child; child != NULL; child = child->next_sibling) {
+    saved_len = path_push(path, child->name);
+    if (saved_len < 0 || report_dir_tree(child, path, depth + 1) < 0) {
+      return -1;
+    }
+    if (report_dir(child->total_blocks / 2, path->data, depth + 1) < 0) {
+      return -1;
+    }
+    path_pop(path, saved_len);
+  }
+  return 0;
+}
+
+/*
+ scan_dir_tree: construye el arbol de directorios de dirpath con nthreads hilos
+
+ Prepara una cola por hilo, mete el directorio raiz en la primera y lanza
+ nthreads - 1 hilos; el hilo principal trabaja como uno mas. Al terminar
+ cada nodo tiene sus bloques propios y los totales de su subarbol.
+ Devuelve la raiz del arbol (que hay que liberar con free_dir_tree), o NULL
+ si hubo algun error.
+ */
+DirNode *scan_dir_tree(int dirfd, const char *dirpath) {
+  WorkPool pool;
+  WorkerArg args[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  struct stat st;
+  DirNode *root;
+  int nthreads;
+  int ok;
+  int started;
+  int i;
+
+  if (fstat(dirfd, &st) < 0) {
+    fprintf(stderr, "Error: no se pudo acceder a %s\n", dirpath);
+    return NULL;
+  }
+  root = new_dir_node(NULL, dirpath, st.st_blocks);
+  if (root == NULL) {
+    return NULL;
+  }
+
+  nthreads = options.nthreads;
+  pool.nthreads = nthreads;
+  atomic_init(&pool.pending, 0);
+  atomic_init(&pool.queued, 0);
+  atomic_init(&pool.sleeping, 0);
+  atomic_init(&pool.failed, 0);
+  atomic_init(&pool.open_dirs, 0);
+  /* los que esperan en las colas (descontando el anillo y el directorio de cada hilo) mas los que se leen */
+  pool.max_open_dirs = open_dirs_limit(MAX_OPEN_DIRS, 2 * nthreads) + nthreads;
+  pthread_mutex_init(&pool.idle_lock, NULL);
+  pthread_cond_init(&pool.idle_cond, NULL);
+  pool.deques = calloc((size_t)nthreads, sizeof(WorkDeque));
+  if (pool.deques == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    free(root);
+    return NULL;
+  }
+  memset(args, 0, sizeof(args));
+  for (i = 0; i < nthreads; i++) {
+    pool.deques[i].items = malloc(DEQUE_INITIAL_CAP * sizeof(DirNode *));
+    pool.deques[i].cap = DEQUE_INITIAL_CAP;
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    args[i].pool = &pool;
+    args[i].id = i;
+    if (scan_buf_init(&args[i].scan) < 0) {
+      atomic_store(&pool.failed, 1);
+    }
+    args[i].scan.defer_links = 1;
+    if (pool.deques[i].items == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      atomic_store(&pool.failed, 1);
+    }
+  }
+
+  /* el hilo que escanee la raiz cierra su descriptor, asi que le damos una copia */
+  root->fd = dup(dirfd);
+  if (root->fd < 0) {
+    fprintf(stderr, "Error: no se pudo abrir directorio %s\n", dirpath);
+    atomic_store(&pool.failed, 1);
+  } else {
+    atomic_fetch_add(&pool.open_dirs, 1);
+  }
+
+  if (atomic_load(&pool.failed) == 0 && pool_push(&pool, 0, root) == 0) {
+    /* si no se puede crear algun hilo seguimos con los que haya */
+    for (started = 1; started < nthreads; started++) {
+      if (pthread_create(&threads[started], NULL, parallel_worker, &args[started]) != 0) {
+        break;
+      }
+    }
+    parallel_worker(&args[0]);
+    for (i = 1; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  } else {
+    atomic_store(&pool.failed, 1);
+  }
+
+  ok = atomic_load(&pool.failed) == 0 && settle_links(root) == 0;
+
+  for (i = 0; i < nthreads; i++) {
+    free(pool.deques[i].items);
+    pthread_mutex_destroy(&pool.deques[i].lock);
+    scan_buf_free(&args[i].scan);
+    subdir_free(&args[i].subdirs);
+    free(args[i].path.data);
+  }
+  free(pool.deques);
+  pthread_mutex_destroy(&pool.idle_lock);
+  pthread_cond_destroy(&pool.idle_cond);
+  if (!ok) {
+    free_dir_tree(root);
+    return NULL;
+  }
+  return root;
+}
+
+/*
+ calculate_dir_size_parallel: version de calculate_dir_size con nthreads hilos
+
+ Construye el arbol con scan_dir_tree, escribe todos los subdirectorios y
+ devuelve el total en bloques de 512B (o -1 si hubo algun error), igual que
+ calculate_dir_size.
+ */
+long calculate_dir_size_parallel(int dirfd, const char *dirpath) {
+  DirNode *root;
+  PathBuf path;
+  long total_blocks;
+
+  root = scan_dir_tree(dirfd, dirpath);
+  if (root == NULL) {
+    return -1;
+  }
+  memset(&path, 0, sizeof(path));
+  total_blocks = -1;
+  if (path_set(&path, dirpath) == 0 && report_dir_tree(root, &path, 0) == 0) {
+    total_blocks = root->total_blocks;
+  }
+  free(path.data);
+  free_dir_tree(root);
+  return total_blocks;
+}
+
+/*
+ HistoryReader: recorre un mydu.bin v2 que ya esta en memoria
+
+ pos apunta a la siguiente ejecucion. De la ejecucion actual guardamos su
+ fecha, su raiz y la zona de entradas [rec, rec_end). De la entrada actual
+ guardamos el tamano y la ruta completa, que hay que reconstruir en path
+ porque en el fichero solo esta lo que cambia respecto a la anterior.
+ */
+typedef struct {
+  const unsigned char *end;
+  const unsigned char *pos;
+  int64_t run_time;
+  const char *root;
+  size_t root_len;
+  uint64_t run_records;
+  const unsigned char *rec;
+  const unsigned char *rec_end;
+  long size_kb;
+  char *path;
+  size_t path_len;
+  size_t path_cap;
+} HistoryReader;
+
+/*
+ history_reader_init: prepara el lector para el contenido de un mydu.bin v2
+ Devuelve 0 si la cabecera del fichero es valida, -1 si no.
+ */
+int history_reader_init(HistoryReader *reader, const unsigned char *data, size_t size) {
+  memset(reader, 0, sizeof(*reader));
+  if (size < FILE_HEADER_SIZE || memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0 ||
+      get_u32(data + 8) != HISTORY_VERSION) {
+    return -1;
+  }
+  reader->end = data + size;
+  reader->pos = data + FILE_HEADER_SIZE;
+  return 0;
+}
+
+/*
+ history_next_run: pasa a la siguiente ejecucion
+
+ Comprobamos que la cabecera, las entradas y el pie caben en el fichero antes
+ de dar la ejecucion por buena; una ejecucion cortada solo puede quedar al
+ final si el sistema se cayo mientras se escribia.
+ Devuelve 1 si hay ejecucion, 0 si no quedan mas y -1 si el fichero esta corrupto.
+ */
+int history_next_run(HistoryReader *reader) {
+  const unsigned char *p;
+  uint64_t records_bytes;
+  size_t left;
+
+  p = reader->pos;
+  if (p == reader->end) {
+    return 0;
+  }
+  left = (size_t)(reader->end - p);
+  if (left < RUN_HEADER_SIZE || get_u32(p) != RUN_MAGIC) {
+    return -1;
+  }
+  reader->run_time = (int64_t)get_u64(p + 8);
+  reader->run_records = get_u64(p + RUN_COUNT_OFFSET);
+  records_bytes = get_u64(p + RUN_BYTES_OFFSET);
+  reader->root_len = get_u32(p + 32);
+  if (reader->root_len > left - RUN_HEADER_SIZE ||
+      records_bytes > left - RUN_HEADER_SIZE - reader->root_len ||
+      RUN_FOOTER_SIZE > left - RUN_HEADER_SIZE - reader->root_len - records_bytes) {
+    return -1;
+  }
+  reader->root = (const char *)(p + RUN_HEADER_SIZE);
+  reader->rec = p + RUN_HEADER_SIZE + reader->root_len;
+  reader->rec_end = reader->rec + records_bytes;
+  if (get_u32(reader->rec_end) != RUN_END_MAGIC) {
+    return -1;
+  }
+  reader->pos = reader->rec_end + RUN_FOOTER_SIZE;
+  reader->path_len = 0; /* la codificacion frontal empieza de cero en cada ejecucion */
+  return 1;
+}
+
+/*
+ history_next_record: decodifica la siguiente entrada de la ejecucion actual
+ Devuelve 1 si hay entrada, 0 si se acabo la ejecucion y -1 si esta corrupta.
+ */
+int history_next_record(HistoryReader *reader) {
+  uint64_t size_kb;
+  uint64_t shared;
+  uint64_t suffix;
+  size_t cap;
+  char *path;
+
+  if (reader->rec == reader->rec_end) {
+    return 0;
+  }
+  if (get_varint(&reader->rec, reader->rec_end, &size_kb) < 0 ||
+      get_varint(&reader->rec, reader->rec_end, &shared) < 0 ||
+      get_varint(&reader->rec, reader->rec_end, &suffix) < 0 ||
+      shared > reader->path_len || suffix > (uint64_t)(reader->rec_end - reader->rec)) {
+    return -1;
+  }
+  if (shared + suffix + 1 > reader->path_cap) {
+    cap = reader->path_cap > 0 ? reader->path_cap : PATH_INITIAL_CAP;
+    while (cap < shared + suffix + 1) {
+      cap *= 2;
+    }
+    path = realloc(reader->path, cap);
+    if (path == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    reader->path = path;
+    reader->path_cap = cap;
+  }
+  memcpy(reader->path + shared, reader->rec, suffix);
+  reader->rec += suffix;
+  reader->path_len = shared + suffix;
+  reader->path[reader->path_len] = '\0';
+  reader->size_kb = (long)size_kb;
+  return 1;
+}
+
+/*
+ HistoryQuery: que queremos sacar del historial con -b
+
+ Sin opciones se muestra todo, como siempre. Las opciones se pueden combinar:
+ prefix se queda con las rutas que empiezan asi, last_run solo mira la ultima
+ ejecucion, top muestra los N mayores y path muestra como ha cambiado el
+ tamano de esa ruta exacta en cada ejecucion. Con runs, cada ejecucion va
+ precedida de una linea con su fecha y su raiz; sin runs la salida es la de
+ siempre, solo lineas "<KB>\t<ruta>".
+ */
+typedef struct {
+  const char *prefix;
+  size_t prefix_len;
+  int last_run;
+  int runs;
+  size_t top;
+  const char *path;
+  size_t path_len;
+} HistoryQuery;
+
+/*
+ format_run_time: escribe la fecha de una ejecucion como "AAAA-MM-DD hh:mm:ss"
+ */
+void format_run_time(int64_t run_time, char *date, size_t size) {
+  time_t when;
+  struct tm tm_info;
+
+  when = (time_t)run_time;
+  if (localtime_r(&when, &tm_info) == NULL || strftime(date, size, "%Y-%m-%d %H:%M:%S", &tm_info) == 0) {
+    strcpy(date, "?");
+  }
+}
+
+/*
+ print_run_header: muestra la linea que separa cada ejecucion al leer un v2
+ */
+void print_run_header(const HistoryReader *reader) {
+  char date[64];
+
+  format_run_time(reader->run_time, date, sizeof(date));
+  printf("--- Ejecucion %s: %.*s ---\n", date, (int)reader->root_len, reader->root);
+}
+
+/*
+ query_match: dice si una entrada pasa los filtros de la consulta
+ */
+int query_match(const HistoryQuery *query, const char *path, size_t len) {
+  if (query->path != NULL) {
+    return len == query->path_len && memcmp(path, query->path, len) == 0;
+  }
+  if (query->prefix != NULL) {
+    return len >= query->prefix_len && memcmp(path, query->prefix, query->prefix_len) == 0;
+  }
+  return 1;
+}
+
+/*
+ query_output: muestra (o guarda en el monticulo) una entrada que ha pasado los filtros
+
+ has_time indica si la entrada tiene fecha (en v1 no hay ejecuciones).
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int query_output(const HistoryQuery *query, TopHeap *heap, long size_kb, const char *path, size_t len,
+                 int has_time, int64_t run_time) {
+  char date[64];
+
+  if (query->top > 0) {
+    return top_heap_offer(heap, size_kb, path, len, has_time ? run_time : -1);
+  }
+  if (query->path != NULL && has_time) {
+    /* evolucion de una ruta: una linea por ejecucion con su fecha */
+    format_run_time(run_time, date, sizeof(date));
+    printf("%s\t%ld\n", date, size_kb);
+    return 0;
+  }
+  print_size_line(size_kb, path, len);
+  return 0;
+}
+
+/*
+ query_history_v2: responde a la consulta sobre un mydu.bin v2 ya mapeado
+
+ Con last_run no hace falta leer las ejecuciones anteriores: el pie de
+ tamano fijo del final del fichero nos dice donde empieza la ultima. Con
+ runs (y sin --top ni --path, que ya ponen la fecha en cada linea) cada
+ ejecucion empieza por su linea de separacion; con un prefijo solo se
+ muestran las de ejecuciones con alguna entrada que encaje.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int query_history_v2(const HistoryQuery *query, TopHeap *heap, const unsigned char *data, size_t size) {
+  HistoryReader reader;
+  uint64_t run_bytes;
+  int header_done;
+  int status;
+
+  status = history_reader_init(&reader, data, size);
+  if (status == 0 && query->last_run && size > FILE_HEADER_SIZE) {
+    run_bytes = size >= FILE_HEADER_SIZE + RUN_FOOTER_SIZE ? get_u64(data + size - RUN_FOOTER_SIZE + 16) : 0;
+    if (size < FILE_HEADER_SIZE + RUN_FOOTER_SIZE || get_u32(data + size - RUN_FOOTER_SIZE) != RUN_END_MAGIC ||
+        run_bytes > size - FILE_HEADER_SIZE - RUN_FOOTER_SIZE) {
+      status = -1;
+    } else {
+      reader.pos = data + size - RUN_FOOTER_SIZE - run_bytes;
+    }
+  }
+
+  while (status == 0 && (status = history_next_run(&reader)) == 1) {
+    header_done = !query->runs || query->top > 0 || query->path != NULL;
+    if (query->prefix == NULL && !header_done) {
+      print_run_header(&reader);
+      header_done = 1;
+    }
+    while ((status = history_next_record(&reader)) == 1) {
+      if (!query_match(query, reader.path, reader.path_len)) {
+        continue;
+      }
+      if (!header_done) {
+        print_run_header(&reader);
+        header_done = 1;
+      }
+      if (query_output(query, heap, reader.size_kb, reader.path, reader.path_len, 1, reader.run_time) < 0) {
+        status = -1;
+        break;
+      }
+    }
+  }
+  if (status < 0) {
+    fprintf(stderr, "Error: entradas binarias corruptas\n");
+  }
+  free(reader.path);
+  return status < 0 ? -1 : 0;
+}
+
+/*
+ query_history_v1: responde a la consulta sobre un mydu.bin antiguo ya mapeado
+
+ Aprovechamos que las entradas tienen tamano fijo (sizeof(DirEntry)): el
+ fichero mapeado es directamente un array de estructuras y las leemos en su
+ sitio, sin copiarlas. Si el tamano no es multiplo de sizeof(DirEntry) es que
+ el fichero esta corrupto o se escribio mal. Este formato no guarda
+ ejecuciones, asi que last_run se aplica a todo el fichero.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int query_history_v1(const HistoryQuery *query, TopHeap *heap, const unsigned char *data, size_t size) {
+  const DirEntry *entry;
+  size_t count;
+  size_t i;
+  size_t len;
+
+  count = size / sizeof(DirEntry);
+  for (i = 0; i < count; i++) {
+    entry = (const DirEntry *)(data + i * sizeof(DirEntry));
+    len = strnlen(entry->path, sizeof(entry->path));
+    if (query_match(query, entry->path, len) &&
+        query_output(query, heap, entry->size_kb, entry->path, len, 0, 0) < 0) {
+      return -1;
+    }
+  }
+  if (size % sizeof(DirEntry) != 0) {
+    /* leimos menos de lo esperado: el fichero no esta bien formado */
+    fprintf(stderr, "Error: entradas binarias corruptas\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ map_binary_file: mapea mydu.bin entero en memoria para leerlo
+
+ Si el fichero esta vacio *data queda a NULL y *size a 0.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int map_binary_file(unsigned char **data, size_t *size) {
+  struct stat st;
+  int fd;
+
+  *data = NULL;
+  *size = 0;
+  fd = open(binary_file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: no se pudo abrir mydu.bin\n");
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "Error: no se pudo leer mydu.bin\n");
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*data == MAP_FAILED) {
+      fprintf(stderr, "Error: no se pudo leer mydu.bin\n");
+      *data = NULL;
+      close(fd);
+      return -1;
+    }
+    *size = (size_t)st.st_size;
+    madvise(*data, *size, MADV_SEQUENTIAL);
+  }
+  close(fd); /* el mapeo sigue siendo valido sin el descriptor */
+  return 0;
+}
+
+/*
+ read_binary_history: lee el fichero binario y muestra su contenido
+
+ En lugar de hacer un read() por entrada mapeamos el fichero entero con mmap
+ y lo recorremos en memoria: el kernel trae las paginas segun las vamos
+ tocando (MADV_SEQUENTIAL le dice que lo hacemos en orden) y no copiamos
+ nada a buffers intermedios. Si el fichero empieza por la cabecera v2 lo
+ decodifica query_history_v2; si no, es un fichero antiguo (v1).
+
+ Con --top las entradas se van metiendo en un monticulo y al final se
+ muestran de mayor a menor.
+ */
+int read_binary_history(const HistoryQuery *query) {
+  TopHeap heap;
+  unsigned char *data;
+  char date[64];
+  size_t size;
+  size_t i;
+  int status;
+
+  if (map_binary_file(&data, &size) < 0) {
+    return -1;
+  }
+
+  memset(&heap, 0, sizeof(heap));
+  if (query->top > 0 && top_heap_init(&heap, query->top) < 0) {
+    if (data != NULL) {
+      munmap(data, size);
+    }
+    return -1;
+  }
+
+  printf("--- Contenido del archivo binario ---\n");
+
+  if (size >= HISTORY_MAGIC_LEN && memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_LEN) == 0) {
+    status = query_history_v2(query, &heap, data, size);
+  } else {
+    status = query_history_v1(query, &heap, data, size);
+  }
+
+  if (status == 0 && query->top > 0) {
+    top_heap_sort(&heap);
+    for (i = 0; i < heap.count; i++) {
+      if (heap.items[i].when >= 0) {
+        format_run_time(heap.items[i].when, date, sizeof(date));
+        printf("%ld\t%s\t%s\n", heap.items[i].size_kb, heap.items[i].path, date);
+      } else {
+        print_size_line(heap.items[i].size_kb, heap.items[i].path, strlen(heap.items[i].path));
+      }
+    }
+  }
+  if (query->top > 0) {
+    top_heap_free(&heap);
+  }
+  if (data != NULL) {
+    munmap(data, size);
+  }
+  return status;
+}
+
+/*
+ parse_number: convierte el argumento de una opcion en un numero
+
+ Usamos strtol igual que en mycalc y comprobamos que el texto sea entero y
+ que el numero este entre min y max.
+ Devuelve 0 si es valido, -1 si no.
+ */
+int parse_number(const char *text, long min, long max, long *out) {
+  char *end;
+  long value;
+
+  value = strtol(text, &end, 10);
+  if (text[0] == '\0' || *end != '\0' || value < min || value > max) {
+    return -1;
+  }
+  *out = value;
+  return 0;
+}
+
+/*
+ parse_count: como parse_number para un numero entre 1 y max
+ */
+int parse_count(const char *text, long max, long *out) {
+  return parse_number(text, 1, max, out);
+}
+
+/*
+ parse_history_query: lee las opciones que van detras de -b
+
+ Devuelve 0 si son validas, -1 si no.
+ */
+int parse_history_query(int argc, char *argv[], HistoryQuery *query) {
+  long value;
+  int i;
+
+  memset(query, 0, sizeof(*query));
+  for (i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--last") == 0) {
+      query->last_run = 1;
+    } else if (strcmp(argv[i], "--runs") == 0) {
+      query->runs = 1;
+    } else if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc && query->path == NULL) {
+      i++;
+      query->prefix = argv[i];
+      query->prefix_len = strlen(argv[i]);
+    } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc && query->prefix == NULL) {
+      i++;
+      query->path = argv[i];
+      query->path_len = strlen(argv[i]);
+    } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc && parse_count(argv[i + 1], TOP_MAX, &value) == 0) {
+      i++;
+      query->top = (size_t)value;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ DIFERENCIAS ENTRE EJECUCIONES (--diff)
+
+ Para saber que directorios han crecido entre dos ejecuciones ordenamos las
+ entradas de cada una por ruta y las recorremos a la vez, como en la mezcla
+ de mergesort: en una sola pasada sabemos que rutas estan en las dos, cuales
+ son nuevas y cuales han desaparecido. Los cambios que pasan del umbral se
+ vuelven a ordenar, esta vez por cuanto han cambiado.
+
+ Una ejecucion puede tener millones de directorios, asi que no ordenamos
+ todo en memoria: cada ordenacion (ExtSort) tiene un presupuesto fijo y,
+ cuando se llena, ordena lo que tiene y lo vuelca a un fichero temporal. Al
+ final mezclamos esos tramos ya ordenados leyendolos a la vez.
+ */
+
+/*
+ SortRec: entrada que se ordena
+
+ size_a y size_b son los KB de la ruta en cada ejecucion (-1 si no esta). En
+ memoria van seguidas en un solo buffer, cada una alineada a 8 bytes; en los
+ ficheros temporales van sin relleno.
+ */
+typedef struct {
+  int64_t size_a;
+  int64_t size_b;
+  uint32_t len;
+  char path[];
+} SortRec;
+
+/*
+ SpillReader: lector de un tramo ya ordenado volcado a disco
+ */
+typedef struct {
+  FILE *file;
+  SortRec *rec; /* entrada actual */
+  size_t cap;
+  int done;
+} SpillReader;
+
+/*
+ ExtSort: ordenacion con memoria acotada
+
+ Las entradas se copian en arena y index apunta a cada una; entre las dos
+ nunca ocupan mas de budget bytes. cmp decide el orden. Despues de
+ ext_sort_finish las entradas se sacan en orden con ext_sort_next, de
+ memoria si todo cupo o mezclando los tramos si hubo que volcar.
+ */
+typedef struct {
+  int (*cmp)(const SortRec *, const SortRec *);
+  char *arena;
+  size_t used;
+  size_t budget;
+  SortRec **index;
+  size_t count;
+  size_t index_cap;
+  size_t pos;
+  SpillReader *spills;
+  size_t nspills;
+  size_t last; /* tramo de la ultima entrada devuelta, hay que avanzarlo */
+} ExtSort;
+
+/* comparacion activa para qsort, que no deja pasar contexto */
+int (*sort_cmp)(const SortRec *, const SortRec *);
+
+/*
+ sort_rec_size: bytes que ocupa una entrada en memoria (alineada a 8)
+ */
+size_t sort_rec_size(size_t len) {
+  return (offsetof(SortRec, path) + len + 1 + 7) & ~(size_t)7;
+}
+
+/*
+ compare_path: orden por ruta (byte a byte, la mas corta primero si una es prefijo de la otra)
+ */
+int compare_path(const SortRec *a, const SortRec *b) {
+  int c;
+
+  c = memcmp(a->path, b->path, a->len < b->len ? a->len : b->len);
+  if (c != 0) {
+    return c;
+  }
+  return a->len < b->len ? -1 : (a->len > b->len ? 1 : 0);
+}
+
+/*
+ diff_delta: cuanto ha cambiado una ruta (una ruta que no esta cuenta como 0 KB)
+ */
+int64_t diff_delta(const SortRec *rec) {
+  return (rec->size_b < 0 ? 0 : rec->size_b) - (rec->size_a < 0 ? 0 : rec->size_a);
+}
+
+/*
+ compare_delta: orden por cambio, de lo que mas crece a lo que mas disminuye
+ */
+int compare_delta(const SortRec *a, const SortRec *b) {
+  int64_t da;
+  int64_t db;
+
+  da = diff_delta(a);
+  db = diff_delta(b);
+  if (da != db) {
+    return da > db ? -1 : 1;
+  }
+  return compare_path(a, b);
+}
+
+/*
+ compare_sort_index: adaptador de sort_cmp para qsort sobre el array de punteros
+ */
+int compare_sort_index(const void *a, const void *b) {
+  return sort_cmp(*(SortRec *const *)a, *(SortRec *const *)b);
+}
+
+/*
+ ext_sort_init: prepara una ordenacion que usa como mucho budget bytes
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int ext_sort_init(ExtSort *sort, int (*cmp)(const SortRec *, const SortRec *), size_t budget) {
+  memset(sort, 0, sizeof(*sort));
+  sort->cmp = cmp;
+  sort->budget = budget;
+  sort->arena = malloc(budget);
+  if (sort->arena == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ ext_sort_spill: ordena lo que hay en memoria y lo vuelca a un fichero temporal
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int ext_sort_spill(ExtSort *sort) {
+  SpillReader *spills;
+  FILE *file;
+  size_t i;
+
+  spills = realloc(sort->spills, (sort->nspills + 1) * sizeof(SpillReader));
+  if (spills == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    return -1;
+  }
+  sort->spills = spills;
+  file = tmpfile();
+  if (file == NULL) {
+    fprintf(stderr, "Error: no se pudo crear un fichero temporal\n");
+    return -1;
+  }
+  memset(&sort->spills[sort->nspills], 0, sizeof(SpillReader));
+  sort->spills[sort->nspills].file = file;
+  sort->nspills++;
+
+  sort_cmp = sort->cmp;
+  qsort(sort->index, sort->count, sizeof(SortRec *), compare_sort_index);
+  for (i = 0; i < sort->count; i++) {
+    if (fwrite(sort->index[i], offsetof(SortRec, path) + sort->index[i]->len, 1, file) != 1) {
+      fprintf(stderr, "Error: no se pudo escribir en el fichero temporal\n");
+      return -1;
+    }
+  }
+  if (fflush(file) != 0) {
+    fprintf(stderr, "Error: no se pudo escribir en el fichero temporal\n");
+    return -1;
+  }
+  sort->used = 0;
+  sort->count = 0;
+  return 0;
+}
+
+/*
+ ext_sort_add: anade una entrada a la ordenacion
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int ext_sort_add(ExtSort *sort, int64_t size_a, int64_t size_b, const char *path, size_t len) {
+  SortRec **index;
+  SortRec *rec;
+  size_t size;
+  size_t new_cap;
+
+  size = sort_rec_size(len);
+  if (sort->used + size + (sort->count + 1) * sizeof(SortRec *) > sort->budget) {
+    if (sort->count == 0) {
+      fprintf(stderr, "Error: ruta demasiado larga para ordenar\n");
+      return -1;
+    }
+    if (ext_sort_spill(sort) < 0) {
+      return -1;
+    }
+  }
+  if (sort->count == sort->index_cap) {
+    new_cap = sort->index_cap == 0 ? DIFF_INDEX_INITIAL_CAP : sort->index_cap * 2;
+    index = realloc(sort->index, new_cap * sizeof(SortRec *));
+    if (index == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    sort->index = index;
+    sort->index_cap = new_cap;
+  }
+  rec = (SortRec *)(sort->arena + sort->used);
+  rec->size_a = size_a;
+  rec->size_b = size_b;
+  rec->len = (uint32_t)len;
+  memcpy(rec->path, path, len);
+  rec->path[len] = '\0';
+  sort->used += size;
+  sort->index[sort->count] = rec;
+  sort->count++;
+  return 0;
+}
+
+/*
+ spill_reader_next: lee la siguiente entrada de un tramo volcado
+ Devuelve 0 si fue bien (done pasa a 1 al acabar el tramo), -1 si hubo algun error.
+ */
+int spill_reader_next(SpillReader *reader) {
+  SortRec header;
+  SortRec *rec;
+
+  if (fread(&header, offsetof(SortRec, path), 1, reader->file) != 1) {
+    if (ferror(reader->file)) {
+      fprintf(stderr, "Error: no se pudo leer el fichero temporal\n");
+      return -1;
+    }
+    reader->done = 1;
+    return 0;
+  }
+  if (sort_rec_size(header.len) > reader->cap) {
+    rec = realloc(reader->rec, sort_rec_size(header.len));
+    if (rec == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    reader->rec = rec;
+    reader->cap = sort_rec_size(header.len);
+  }
+  memcpy(reader->rec, &header, offsetof(SortRec, path));
+  if (header.len > 0 && fread(reader->rec->path, header.len, 1, reader->file) != 1) {
+    fprintf(stderr, "Error: no se pudo leer el fichero temporal\n");
+    return -1;
+  }
+  reader->rec->path[header.len] = '\0';
+  return 0;
+}
+
+/*
+ ext_sort_finish: termina de anadir entradas y prepara la lectura en orden
+
+ Si todo cupo en memoria basta con ordenar el indice. Si no, volcamos
+ tambien lo ultimo, liberamos la memoria y dejamos cada tramo en su primera
+ entrada para mezclarlos.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int ext_sort_finish(ExtSort *sort) {
+  size_t i;
+
+  sort->pos = 0;
+  sort->last = SIZE_MAX;
+  if (sort->nspills == 0) {
+    /* sin entradas index sigue a NULL, y qsort no lo admite ni con 0 elementos */
+    if (sort->count > 0) {
+      sort_cmp = sort->cmp;
+      qsort(sort->index, sort->count, sizeof(SortRec *), compare_sort_index);
+    }
+    return 0;
+  }
+  if (sort->count > 0 && ext_sort_spill(sort) < 0) {
+    return -1;
+  }
+  free(sort->arena);
+  free(sort->index);
+  sort->arena = NULL;
+  sort->index = NULL;
+  sort->index_cap = 0;
+  for (i = 0; i < sort->nspills; i++) {
+    setvbuf(sort->spills[i].file, NULL, _IOFBF, DIFF_SPILL_BUF_SIZE);
+    rewind(sort->spills[i].file);
+    if (spill_reader_next(&sort->spills[i]) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ ext_sort_next: devuelve en *out la siguiente entrada en orden
+
+ La entrada es valida hasta la siguiente llamada. Con tramos en disco
+ buscamos el menor de sus primeros elementos; hay pocos tramos (el total
+ entre el presupuesto), asi que basta con mirarlos todos.
+ Devuelve 1 si hay entrada, 0 si no quedan y -1 si hubo algun error.
+ */
+int ext_sort_next(ExtSort *sort, const SortRec **out) {
+  size_t best;
+  size_t i;
+
+  if (sort->nspills == 0) {
+    if (sort->pos == sort->count) {
+      return 0;
+    }
+    *out = sort->index[sort->pos];
+    sort->pos++;
+    return 1;
+  }
+
+  if (sort->last != SIZE_MAX && spill_reader_next(&sort->spills[sort->last]) < 0) {
+    return -1;
+  }
+  best = SIZE_MAX;
+  for (i = 0; i < sort->nspills; i++) {
+    if (!sort->spills[i].done &&
+        (best == SIZE_MAX || sort->cmp(sort->spills[i].rec, sort->spills[best].rec) < 0)) {
+      best = i;
+    }
+  }
+  sort->last = best;
+  if (best == SIZE_MAX) {
+    return 0;
+  }
+  *out = sort->spills[best].rec;
+  return 1;
+}
+
+/*
+ ext_sort_free: libera la memoria y cierra (y borra) los ficheros temporales
+ */
+void ext_sort_free(ExtSort *sort) {
+  size_t i;
+
+  for (i = 0; i < sort->nspills; i++) {
+    fclose(sort->spills[i].file);
+    free(sort->spills[i].rec);
+  }
+  free(sort->spills);
+  free(sort->arena);
+  free(sort->index);
+  memset(sort, 0, sizeof(*sort));
+}
+
+/*
+ DiffQuery: que ejecuciones comparamos con --diff
+
+ run_a y run_b cuentan desde 1 (la primera ejecucion del historial) o,
+ si son negativos, desde el final (-1 es la ultima). Solo se muestran los
+ directorios cuyo tamano cambia al menos threshold KB.
+ */
+typedef struct {
+  long run_a;
+  long run_b;
+  long threshold;
+} DiffQuery;
+
+/*
+ find_run: deja reader en la ejecucion numero run (ver DiffQuery)
+ Devuelve 1 si existe, 0 si no y -1 si el fichero esta corrupto.
+ */
+int find_run(HistoryReader *reader, const unsigned char *data, size_t size, long run) {
+  long count;
+  long target;
+  int status;
+
+  /* para contar desde el final primero contamos las ejecuciones: solo se leen las cabeceras */
+  count = 0;
+  if (history_reader_init(reader, data, size) < 0) {
+    return -1;
+  }
+  while ((status = history_next_run(reader)) == 1) {
+    count++;
+  }
+  if (status < 0) {
+    return -1;
+  }
+  target = run > 0 ? run : count + run + 1;
+  if (target < 1 || target > count) {
+    return 0;
+  }
+  history_reader_init(reader, data, size);
+  for (count = 0; count < target; count++) {
+    history_next_run(reader);
+  }
+  return 1;
+}
+
+/*
+ sort_run: mete las entradas de la ejecucion numero run en sort, ordenadas por ruta
+
+ which dice en que campo va el tamano (0 en size_a, 1 en size_b). reader
+ queda en esa ejecucion para poder mostrar su fecha y su raiz.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int sort_run(HistoryReader *reader, const unsigned char *data, size_t size, long run, int which, ExtSort *sort) {
+  int status;
+
+  status = find_run(reader, data, size, run);
+  if (status == 0) {
+    fprintf(stderr, "Error: no existe la ejecucion %ld\n", run);
+    return -1;
+  }
+  while (status == 1 && (status = history_next_record(reader)) == 1) {
+    if (ext_sort_add(sort, which == 0 ? reader->size_kb : -1, which == 0 ? -1 : reader->size_kb,
+                     reader->path, reader->path_len) < 0) {
+      return -1;
+    }
+  }
+  if (status < 0) {
+    fprintf(stderr, "Error: entradas binarias corruptas\n");
+    return -1;
+  }
+  return ext_sort_finish(sort);
+}
+
+/*
+ diff_offer: apunta en changes una ruta si su cambio llega al umbral
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int diff_offer(ExtSort *changes, long threshold, int64_t size_a, int64_t size_b, const SortRec *rec) {
+  int64_t delta;
+
+  delta = (size_b < 0 ? 0 : size_b) - (size_a < 0 ? 0 : size_a);
+  if (delta == 0 || (delta < 0 ? -delta : delta) < threshold) {
+    return 0;
+  }
+  return ext_sort_add(changes, size_a, size_b, rec->path, rec->len);
+}
+
+/*
+ print_diff_size: muestra un tamano de --diff ("-" si la ruta no estaba)
+ */
+void print_diff_size(int64_t size_kb) {
+  if (size_kb < 0) {
+    printf("-\t");
+  } else {
+    printf("%ld\t", (long)size_kb);
+  }
+}
+
+/*
+ diff_merge: recorre a la vez las dos ejecuciones ordenadas por ruta
+
+ Una ruta que esta en las dos compara sus tamanos, una que solo esta en la
+ primera ha desaparecido y una que solo esta en la segunda es nueva. Las que
+ llegan al umbral van a changes.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int diff_merge(ExtSort *sort_a, ExtSort *sort_b, ExtSort *changes, long threshold) {
+  const SortRec *rec_a;
+  const SortRec *rec_b;
+  int has_a;
+  int has_b;
+  int status;
+  int c;
+
+  rec_a = NULL;
+  rec_b = NULL;
+  has_a = ext_sort_next(sort_a, &rec_a);
+  has_b = ext_sort_next(sort_b, &rec_b);
+  while (has_a > 0 || has_b > 0) {
+    if (has_a > 0 && has_b > 0) {
+      c = compare_path(rec_a, rec_b);
+    } else {
+      c = has_a > 0 ? -1 : 1;
+    }
+    if (c == 0) {
+      status = diff_offer(changes, threshold, rec_a->size_a, rec_b->size_b, rec_a);
+    } else if (c < 0) {
+      status = diff_offer(changes, threshold, rec_a->size_a, -1, rec_a);
+    } else {
+      status = diff_offer(changes, threshold, -1, rec_b->size_b, rec_b);
+    }
+    if (status < 0) {
+      return -1;
+    }
+    if (c <= 0) {
+      has_a = ext_sort_next(sort_a, &rec_a);
+    }
+    if (c >= 0) {
+      has_b = ext_sort_next(sort_b, &rec_b);
+    }
+  }
+  return has_a < 0 || has_b < 0 ? -1 : 0;
+}
+
+/*
+ diff_history: compara dos ejecuciones de mydu.bin
+
+ Ordenamos cada ejecucion por ruta, las mezclamos (diff_merge) y mostramos
+ los cambios de lo que mas crece a lo que mas disminuye, como
+ "cambio  KB_antes  KB_despues  ruta" ("-" si la ruta no estaba).
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int diff_history(const DiffQuery *query) {
+  HistoryReader reader_a;
+  HistoryReader reader_b;
+  ExtSort sort_a;
+  ExtSort sort_b;
+  ExtSort changes;
+  const SortRec *rec;
+  unsigned char *data;
+  char date[64];
+  size_t size;
+  int status;
+
+  if (map_binary_file(&data, &size) < 0) {
+    return -1;
+  }
+  if (size < HISTORY_MAGIC_LEN || memcmp(data, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0) {
+    fprintf(stderr, "Error: mydu.bin no guarda ejecuciones (formato antiguo)\n");
+    if (data != NULL) {
+      munmap(data, size);
+    }
+    return -1;
+  }
+
+  memset(&reader_a, 0, sizeof(reader_a));
+  memset(&reader_b, 0, sizeof(reader_b));
+  memset(&sort_a, 0, sizeof(sort_a));
+  memset(&sort_b, 0, sizeof(sort_b));
+  memset(&changes, 0, sizeof(changes));
+  status = 0;
+  if (ext_sort_init(&sort_a, compare_path, DIFF_MEM_BUDGET / 3) < 0 ||
+      ext_sort_init(&sort_b, compare_path, DIFF_MEM_BUDGET / 3) < 0 ||
+      ext_sort_init(&changes, compare_delta, DIFF_MEM_BUDGET / 3) < 0 ||
+      sort_run(&reader_a, data, size, query->run_a, 0, &sort_a) < 0 ||
+      sort_run(&reader_b, data, size, query->run_b, 1, &sort_b) < 0 ||
+      diff_merge(&sort_a, &sort_b, &changes, query->threshold) < 0 || ext_sort_finish(&changes) < 0) {
+    status = -1;
+  }
+
+  if (status == 0) {
+    format_run_time(reader_a.run_time, date, sizeof(date));
+    printf("--- Diferencias entre la ejecucion %s: %.*s", date, (int)reader_a.root_len, reader_a.root);
+    format_run_time(reader_b.run_time, date, sizeof(date));
+    printf(" y la ejecucion %s: %.*s ---\n", date, (int)reader_b.root_len, reader_b.root);
+    while ((status = ext_sort_next(&changes, &rec)) == 1) {
+      printf("%+ld\t", (long)diff_delta(rec));
+      print_diff_size(rec->size_a);
+      print_diff_size(rec->size_b);
+      printf("%s\n", rec->path);
+    }
+  }
+
+  ext_sort_free(&sort_a);
+  ext_sort_free(&sort_b);
+  ext_sort_free(&changes);
+  free(reader_a.path);
+  free(reader_b.path);
+  munmap(data, size);
+  return status < 0 ? -1 : 0;
+}
+
+/*
+ parse_diff_query: lee las opciones de --diff
+ Devuelve 0 si son validas, -1 si no.
+ */
+int parse_diff_query(int argc, char *argv[], DiffQuery *query) {
+  long value;
+  int i;
+
+  memset(query, 0, sizeof(*query));
+  query->threshold = 1;
+  if (argc < 4 || parse_number(argv[2], -LONG_MAX, LONG_MAX, &query->run_a) < 0 || query->run_a == 0 ||
+      parse_number(argv[3], -LONG_MAX, LONG_MAX, &query->run_b) < 0 || query->run_b == 0) {
+    return -1;
+  }
+  for (i = 4; i < argc; i++) {
+    if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc &&
+        parse_count(argv[i + 1], LONG_MAX, &value) == 0) {
+      query->threshold = value;
+      i++;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ MODO DEMONIO (--daemon)
+
+ Para los directorios que se consultan a menudo ni siquiera -i basta: sigue
+ habiendo un stat por directorio en cada ejecucion. Con --daemon mydu hace
+ un solo recorrido (scan_dir_tree), se queda con el arbol de totales en
+ memoria y vigila cada directorio con inotify. Cuando llega un evento de un
+ directorio solo volvemos a leer ese directorio (sus ficheros, sin bajar a
+ los subdirectorios), y la diferencia con lo que tenia se suma a todos sus
+ antecesores. Los subdirectorios nuevos se recorren y se empiezan a vigilar,
+ y los que desaparecen se quitan del arbol.
+
+ Las consultas llegan por un socket Unix: cada conexion manda una ruta
+ terminada en '\n' (o una linea vacia para la raiz) y recibe
+ "KB<tab>ruta\n", el mismo formato que la salida normal. La respuesta sale
+ del arbol en memoria, sin tocar el disco. Los clientes no son bloqueantes y
+ estan en el mismo poll que inotify: uno lento o que no manda nada no para
+ los eventos ni a los demas clientes, y si tarda mas de
+ DAEMON_CLIENT_TIMEOUT_MS lo cerramos.
+
+ Si se llena la cola de inotify (IN_Q_OVERFLOW) no sabemos que eventos se
+ han perdido. No basta con mirar el mtime de cada directorio: un fichero que
+ crece sin que se cree ni borre ninguna entrada no lo cambia. Asi que
+ volvemos a leer todos los directorios del arbol, sin empezar de cero: los
+ nodos y los watches de inotify que ya tenemos se conservan.
+
+ En este modo los enlaces duros se cuentan cada vez que aparecen (como con
+ -l): al volver a leer un solo directorio no podemos saber en cual se conto
+ primero un fichero compartido.
+ */
+
+/*
+ DaemonClient: una conexion de consulta al demonio
+
+ Primero vamos leyendo la peticion en data; cuando esta entera (o el
+ cliente cierra) ponemos alli la respuesta y la vamos mandando.
+ */
+typedef struct {
+  int fd;
+  int replying;      /* 0 mientras leemos la peticion, 1 mientras mandamos la respuesta */
+  size_t len;        /* bytes de la peticion o de la respuesta que hay en data */
+  size_t sent;       /* bytes de la respuesta ya mandados */
+  uint64_t deadline; /* stats_now() a partir del cual cerramos la conexion */
+  char data[DAEMON_REQUEST_MAX + 64];
+} DaemonClient;
+
+/*
+ Daemon: estado del modo demonio
+
+ watches[wd] es el nodo vigilado con ese descriptor de inotify (los wd son
+ enteros pequenos y crecientes). dirty son los nodos con eventos pendientes
+ de procesar. scan, subdirs y path se reutilizan en cada relectura.
+ clients son las conexiones abiertas (client_count de DAEMON_CLIENTS_MAX).
+ */
+typedef struct {
+  DirNode *root;
+  DirNode **watches;
+  size_t watches_cap;
+  DirNode **dirty;
+  size_t dirty_count;
+  size_t dirty_cap;
+  int inotify_fd;
+  ScanBuf scan;
+  SubdirList subdirs;
+  PathBuf path;
+  DaemonClient *clients;
+  size_t client_count;
+} Daemon;
+
+/*
+ daemon_mark_dirty: apunta node para volver a leerlo
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int daemon_mark_dirty(Daemon *daemon, DirNode *node) {
+  DirNode **dirty;
+  size_t new_cap;
+
+  if (node->dirty) {
+    return 0;
+  }
+  if (daemon->dirty_count == daemon->dirty_cap) {
+    new_cap = daemon->dirty_cap == 0 ? DAEMON_DIRTY_INITIAL_CAP : daemon->dirty_cap * 2;
+    dirty = realloc(daemon->dirty, new_cap * sizeof(DirNode *));
+    if (dirty == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    daemon->dirty = dirty;
+    daemon->dirty_cap = new_cap;
+  }
+  daemon->dirty[daemon->dirty_count] = node;
+  daemon->dirty_count++;
+  node->dirty = 1;
+  return 0;
+}
+
+/*
+ daemon_watch_tree: empieza a vigilar node y todo su subarbol
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int daemon_watch_tree(Daemon *daemon, DirNode *node) {
+  DirNode **watches;
+  DirNode *child;
+  size_t new_cap;
+  int wd;
+
+  if (build_node_path(node, &daemon->path) < 0) {
+    return -1;
+  }
+  wd = inotify_add_watch(daemon->inotify_fd, daemon->path.data, DAEMON_WATCH_MASK);
+  if (wd < 0) {
+    fprintf(stderr, "Error: no se pudo vigilar %s\n", daemon->path.data);
+    return -1;
+  }
+  if ((size_t)wd >= daemon->watches_cap) {
+    new_cap = daemon->watches_cap == 0 ? DAEMON_WATCHES_INITIAL_CAP : daemon->watches_cap;
+    while (new_cap <= (size_t)wd) {
+      new_cap *= 2;
+    }
+    watches = realloc(daemon->watches, new_cap * sizeof(DirNode *));
+    if (watches == NULL) {
+      fprintf(stderr, "Error: memoria insuficiente\n");
+      return -1;
+    }
+    memset(watches + daemon->watches_cap, 0, (new_cap - daemon->watches_cap) * sizeof(DirNode *));
+    daemon->watches = watches;
+    daemon->watches_cap = new_cap;
+  }
+  /* si el directorio ya estaba vigilado (se ha movido) el wd pasa a este nodo */
+  daemon->watches[wd] = node;
+  node->wd = wd;
+
+  for (child = node->first_child; child != NULL; child = child->next_sibling) {
+    if (daemon_watch_tree(daemon, child) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ daemon_drop_tree: deja de vigilar node y su subarbol y lo libera
+
+ Solo quitamos el wd si sigue siendo de este nodo: si el directorio se ha
+ movido dentro del arbol puede que ya lo use el nodo nuevo.
+ */
+void daemon_drop_tree(Daemon *daemon, DirNode *node) {
+  DirNode *child;
+  DirNode *next;
+  size_t i;
+
+  for (child = node->first_child; child != NULL; child = next) {
+    next = child->next_sibling;
+    daemon_drop_tree(daemon, child);
+  }
+  if (node->wd >= 0 && daemon->watches[node->wd] == node) {
+    inotify_rm_watch(daemon->inotify_fd, node->wd);
+    daemon->watches[node->wd] = NULL;
+  }
+  if (node->dirty) {
+    for (i = 0; i < daemon->dirty_count; i++) {
+      if (daemon->dirty[i] == node) {
+        daemon->dirty[i] = NULL;
+      }
+    }
+  }
+  node->first_child = NULL; /* los hijos ya estan liberados */
+  free_dir_tree(node);
+}
+
+/*
+ daemon_graft: recorre el subdirectorio nuevo name de parent y lo cuelga del arbol
+
+ scan_dir_tree deja la ruta completa como nombre de la raiz del subarbol,
+ asi que creamos el nodo con su nombre y le pasamos los hijos.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int daemon_graft(Daemon *daemon, DirNode *parent, const char *name) {
+  DirNode *sub;
+  DirNode *node;
+  DirNode *child;
+  int fd;
+
+  if (build_node_path(parent, &daemon->path) < 0 || path_push(&daemon->path, name) < 0) {
+    return -1;
+  }
+  fd = open(daemon->path.data, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return 0; /* ya no existe: lo vera el siguiente evento del padre */
+  }
+  sub = scan_dir_tree(fd, daemon->path.data);
+  close(fd);
+  if (sub == NULL) {
+    return -1;
+  }
+  node = new_dir_node(parent, name, sub->own_blocks);
+  if (node == NULL) {
+    free_dir_tree(sub);
+    return -1;
+  }
+  node->total_blocks = sub->total_blocks;
+  node->first_child = sub->first_child;
+  node->last_child = sub->last_child;
+  for (child = node->first_child; child != NULL; child = child->next_sibling) {
+    child->parent = node;
+  }
+  sub->first_child = NULL;
+  free_dir_tree(sub);
+  node->seen = 1;
+  return daemon_watch_tree(daemon, node);
+}
+
+/*
+ daemon_rescan: vuelve a leer un directorio y actualiza sus totales y los de sus antecesores
+
+ Leemos sus ficheros como en el recorrido normal y comparamos la lista de
+ subdirectorios con sus hijos. Los hijos suelen salir en el mismo orden que
+ la vez anterior, asi que buscamos cada nombre a partir del ultimo hijo
+ encontrado. Si el directorio ya no existe se encarga su padre.
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int daemon_rescan(Daemon *daemon, DirNode *node) {
+  struct stat st;
+  DirNode *child;
+  DirNode *prev;
+  DirNode *next;
+  DirNode *cursor;
+  DirNode *start;
+  const char *bad_name;
+  const char *name;
+  long own_blocks;
+  long total_blocks;
+  long delta;
+  size_t i;
+  int fd;
+
+  if (build_node_path(node, &daemon->path) < 0) {
+    return -1;
+  }
+  fd = open(daemon->path.data, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (node->parent == NULL) {
+      fprintf(stderr, "Error: el directorio vigilado %s ya no existe\n", daemon->path.data);
+      return -1;
+    }
+    return daemon_mark_dirty(daemon, node->parent);
+  }
+  own_blocks = st.st_blocks;
+  subdir_clear(&daemon->subdirs);
+  if (list_directory(fd, &daemon->scan, &daemon->subdirs, &own_blocks, &bad_name) < 0) {
+    close(fd);
+    /* lo estan cambiando mientras lo leemos: lo intentamos con el siguiente evento */
+    return 0;
+  }
+  close(fd);
+
+  /* marcamos los hijos que siguen existiendo */
+  for (child = node->first_child; child != NULL; child = child->next_sibling) {
+    child->seen = 0;
+  }
+  cursor = node->first_child;
+  name = daemon->subdirs.names;
+  for (i = 0; i < daemon->subdirs.count; i++) {
+    start = cursor;
+    child = NULL;
+    while (cursor != NULL) {
+      if (strcmp(cursor->name, name) == 0) {
+        child = cursor;
+        break;
+      }
+      cursor = cursor->next_sibling != NULL ? cursor->next_sibling : node->first_child;
+      if (cursor == start) {
+        break;
+      }
+    }
+    if (child != NULL) {
+      child->seen = 1;
+      cursor = child->next_sibling != NULL ? child->next_sibling : node->first_child;
+    } else if (daemon_graft(daemon, node, name) < 0) {
+      return -1;
+    }
+    name += strlen(name) + 1;
+  }
+
+  /* quitamos los que han desaparecido y sumamos el resto */
+  total_blocks = own_blocks;
+  prev = NULL;
+  for (child = node->first_child; child != NULL; child = next) {
+    next = child->next_sibling;
+    if (!child->seen) {
+      if (prev == NULL) {
+        node->first_child = next;
+      } else {
+        prev->next_sibling = next;
+      }
+      if (node->last_child == child) {
+        node->last_child = prev;
+      }
+      child->next_sibling = NULL;
+      daemon_drop_tree(daemon, child);
+      continue;
+    }
+    total_blocks += child->total_blocks;
+    prev = child;
+  }
+
+  delta = total_blocks - node->total_blocks;
+  node->own_blocks = own_blocks;
+  for (; node != NULL; node = node->parent) {
+    node->total_blocks += delta;
+  }
+  return 0;
+}
+
+/*
+ daemon_verify: tras perder eventos, apunta todos los directorios del arbol para volver a leerlos
+
+ No miramos las fechas del directorio: el tamano de un fichero que se
+ reescribe en su sitio puede cambiar sin que cambien, y ese cambio se habria
+ perdido con los eventos.
+ Devuelve 0 si fue bien, -1 si no hay memoria.
+ */
+int daemon_verify(Daemon *daemon, DirNode *node) {
+  DirNode *child;
+
+  if (daemon_mark_dirty(daemon, node) < 0) {
+    return -1;
+  }
+  for (child = node->first_child; child != NULL; child = child->next_sibling) {
+    if (daemon_verify(daemon, child) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ daemon_events: lee los eventos de inotify y actualiza el arbol
+ Devuelve 0 si fue bien, -1 si hubo algun error.
+ */
+int daemon_events(Daemon *daemon) {
+  union {
+    struct inotify_event align; /* read de inotify necesita el buffer alineado */
+    char data[DAEMON_EVENT_BUF_SIZE];
+  } buf;
+  const struct inotify_event *event;
+  DirNode *node;
+  ssize_t len;
+  ssize_t pos;
+  size_t i;
+  int overflow;
+
+  overflow = 0;
+  while ((len = read(daemon->inotify_fd, buf.data, sizeof(buf.data))) > 0) {
+    for (pos = 0; pos < len; pos += (ssize_t)(sizeof(struct inotify_event) + event->len)) {
+      event = (const struct inotify_event *)(buf.data + pos);
+      if ((event->mask & IN_Q_OVERFLOW) != 0) {
+        overflow = 1;
+      } else if ((event->mask & IN_IGNORED) == 0 && event->wd >= 0 &&
+                 (size_t)event->wd < daemon->watches_cap && daemon->watches[event->wd] != NULL) {
+        if (daemon_mark_dirty(daemon, daemon->watches[event->wd]) < 0) {
+          return -1;
+        }
+      }
+    }
+  }
+  if (len < 0 && errno != EAGAIN) {
+    fprintf(stderr, "Error: no se pudieron leer los eventos de inotify\n");
+    return -1;
+  }
+  if (overflow && daemon_verify(daemon, daemon->root) < 0) {
+    return -1;
+  }
+
+  /* la lista puede crecer mientras la procesamos (un directorio que ya no existe apunta a su padre) */
+  for (i = 0; i < daemon->dirty_count; i++) {
+    node = daemon->dirty[i];
+    if (node == NULL) {
+      continue; /* quitado del arbol al procesar otro */
+    }
+    node->dirty = 0;
+    daemon->dirty[i] = NULL;
+    if (daemon_rescan(daemon, node) < 0) {
+      return -1;
+    }
+  }
+  daemon->dirty_count = 0;
+  return 0;
+}
+
+/*
+ daemon_find: busca en el arbol el nodo de una ruta (tal como sale en la salida normal)
+ Devuelve el nodo, o NULL si no esta.
+ */
+DirNode *daemon_find(DirNode *root, const char *path, size_t len) {
+  DirNode *node;
+  DirNode *child;
+  size_t root_len;
+  size_t end;
+  size_t pos;
+
+  root_len = strlen(root->name);
+  if (len == 0) {
+    return root;
+  }
+  if (len < root_len || memcmp(path, root->name, root_len) != 0 || (len > root_len && path[root_len] != '/')) {
+    return NULL;
+  }
+  node = root;
+  pos = root_len;
+  while (pos < len) {
+    pos++; /* saltamos la '/' */
+    end = pos;
+    while (end < len && path[end] != '/') {
+      end++;
+    }
+    for (child = node->first_child; child != NULL; child = child->next_sibling) {
+      if (strlen(child->name) == end - pos && memcmp(child->name, path + pos, end - pos) == 0) {
+        break;
+      }
+    }
+    if (child == NULL) {
+      return NULL;
+    }
+    node = child;
+    pos = end;
+  }
+  return node;
+}
+
+/*
+ daemon_reply: prepara en client la respuesta a la peticion que ha leido
+ Busca el total de la ruta en el arbol; una peticion sin '\n' es invalida.
+ */
+void daemon_reply(Daemon *daemon, DaemonClient *client) {
+  char reply[DAEMON_REQUEST_MAX + 64];
+  const char *request;
+  DirNode *node;
+  size_t len;
+  int n;
+
+  request = client->data;
+  len = client->len;
+  if (memchr(request, '\n', len) == NULL) {
+    n = snprintf(reply, sizeof(reply), "Error: peticion invalida\n");
+  } else {
+    len = (size_t)((const char *)memchr(request, '\n', len) - request);
+    node = daemon_find(daemon->root, request, len);
+    if (node == NULL) {
+      n = snprintf(reply, sizeof(reply), "Error: %.*s no esta en el arbol vigilado\n", (int)len, request);
+    } else if (len == 0) {
+      n = snprintf(reply, sizeof(reply), "%ld\t%s\n", node->total_blocks / 2, node->name);
+    } else {
+      n = snprintf(reply, sizeof(reply), "%ld\t%.*s\n", node->total_blocks / 2, (int)len, request);
+    }
+  }
+  if (n < 0) {
+    n = 0;
+  }
+  client->len = (size_t)n < sizeof(reply) ? (size_t)n : sizeof(reply) - 1;
+  memcpy(client->data, reply, client->len);
+  client->sent = 0;
+  client->replying = 1;
+}
+
+/*
+ daemon_client_io: avanza una conexion hasta que su socket ya no deja leer o escribir mas
+ Los errores del cliente no paran el demonio: solo cierran su conexion.
+ Devuelve 1 si la conexion sigue abierta, 0 si ya hemos terminado con ella.
+ */
+int daemon_client_io(Daemon *daemon, DaemonClient *client) {
+  ssize_t got;
+
+  if (!client->replying) {
+    while (client->len < DAEMON_REQUEST_MAX && memchr(client->data, '\n', client->len) == NULL) {
+      got = read(client->fd, client->data + client->len, DAEMON_REQUEST_MAX - client->len);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+      }
+      if (got <= 0) {
+        break;
+      }
+      client->len += (size_t)got;
+    }
+    daemon_reply(daemon, client);
+  }
+  while (client->sent < client->len) {
+    got = write(client->fd, client->data + client->sent, client->len - client->sent);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 1;
+    }
+    if (got <= 0) {
+      return 0;
+    }
+    client->sent += (size_t)got;
+  }
+  return 0;
+}
+
+/*
+ daemon_accept: acepta las conexiones que esperan, mientras quede sitio en clients
+ Cada cliente queda no bloqueante, con DAEMON_CLIENT_TIMEOUT_MS para terminar.
+ */
+void daemon_accept(Daemon *daemon, int listen_fd) {
+  DaemonClient *client;
+  int fd;
+
+  while (daemon->client_count < DAEMON_CLIENTS_MAX) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      return; /* EAGAIN: no queda ninguna; cualquier otro error es de ese cliente */
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+      close(fd);
+      continue;
+    }
+    client = &daemon->clients[daemon->client_count];
+    client->fd = fd;
+    client->replying = 0;
+    client->len = 0;
+    client->sent = 0;
+    client->deadline = stats_now() + (uint64_t)DAEMON_CLIENT_TIMEOUT_MS * 1000000ULL;
+    daemon->client_count++;
+  }
+}
+
+/*
+ daemon_close_client: cierra la conexion i y pone la ultima en su sitio
+ */
+void daemon_close_client(Daemon *daemon, size_t i) {
+  close(daemon->clients[i].fd);
+  daemon->client_count--;
+  daemon->clients[i] = daemon->clients[daemon->client_count];
+}
+
+/*
+ daemon_poll_timeout: milisegundos que puede esperar poll hasta que venza algun cliente
+ Devuelve -1 (sin limite) si no hay clientes.
+ */
+int daemon_poll_timeout(const Daemon *daemon) {
+  uint64_t first;
+  uint64_t now;
+  size_t i;
+
+  if (daemon->client_count == 0) {
+    return -1;
+  }
+  first = daemon->clients[0].deadline;
+  for (i = 1; i < daemon->client_count; i++) {
+    if (daemon->clients[i].deadline < first) {
+      first = daemon->clients[i].deadline;
+    }
+  }
+  now = stats_now();
+  return first <= now ? 0 : (int)((first - now) / 1000000ULL + 1);
+}
+
+/*
+ daemon_clear: deja libre la ruta socket_path (con direccion addr) para el bind
+
+ Solo borra lo que haya si es un socket al que ya no escucha nadie (el de
+ un demonio que murio, connect falla con ECONNREFUSED): nunca un fichero
+ como mydu.bin ni el socket de otro demonio que sigue vivo.
+ Devuelve 0 si la ruta esta libre, -1 si no.
+ */
+int daemon_clear(const char *socket_path, const struct sockaddr_un *addr) {
+  struct stat st;
+  int fd;
+  int status;
+
+  if (lstat(socket_path, &st) < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    fprintf(stderr, "Error: no se pudo escuchar en %s\n", socket_path);
+    return -1;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "Error: %s ya existe y no es un socket\n", socket_path);
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Error: no se pudo crear el socket\n");
+    return -1;
+  }
+  status = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+  if (status < 0 && errno == ECONNREFUSED) {
+    close(fd);
+    if (unlink(socket_path) < 0 && errno != ENOENT) {
+      fprintf(stderr, "Error: no se pudo escuchar en %s\n", socket_path);
+      return -1;
+    }
+    return 0;
+  }
+  close(fd);
+  if (status == 0) {
+    fprintf(stderr, "Error: ya hay un demonio escuchando en %s\n", socket_path);
+  } else {
+    fprintf(stderr, "Error: no se pudo escuchar en %s\n", socket_path);
+  }
+  return -1;
+}
+
+/*
+ daemon_listen: crea el socket Unix de las consultas
+ En bound deja el dispositivo y el inodo del socket creado, para que al
+ salir solo borremos la ruta si sigue siendo el nuestro.
+ Devuelve su descriptor, o -1 si hubo algun error.
+ */
+int daemon_listen(const char *socket_path, struct stat *bound) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: ruta del socket demasiado larga\n");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  if (daemon_clear(socket_path, &addr) < 0) {
+    return -1;
+  }
+  /* no bloqueante: si el cliente se va entre poll y accept, accept no espera */
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Error: no se pudo crear el socket\n");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || lstat(socket_path, bound) < 0 ||
+      listen(fd, DAEMON_BACKLOG) < 0) {
+    fprintf(stderr, "Error: no se pudo escuchar en %s\n", socket_path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ daemon_run: modo demonio sobre el directorio ya abierto en dirfd
+
+ Hace el recorrido inicial, vigila todo el arbol y despues espera con poll
+ a la vez eventos de inotify, conexiones nuevas y los clientes abiertos
+ (fds[2 + i] es clients[i]). Con DAEMON_CLIENTS_MAX clientes abiertos deja
+ de aceptar hasta que se cierre alguno. Solo termina si hay un error (o si
+ lo matan).
+ Devuelve -1.
+ */
+int daemon_run(int dirfd, const char *dirpath, const char *socket_path) {
+  Daemon daemon;
+  struct pollfd fds[2 + DAEMON_CLIENTS_MAX];
+  struct stat bound;
+  struct stat st;
+  uint64_t now;
+  size_t count;
+  size_t i;
+  int listen_fd;
+
+  memset(&daemon, 0, sizeof(daemon));
+  options.count_links = 1;
+  options.incremental = 0;
+  signal(SIGPIPE, SIG_IGN); /* un cliente que cierra antes de la respuesta no debe matar al demonio */
+  daemon.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (daemon.inotify_fd < 0) {
+    fprintf(stderr, "Error: inotify no esta disponible\n");
+    return -1;
+  }
+  daemon.clients = malloc(DAEMON_CLIENTS_MAX * sizeof(DaemonClient));
+  if (daemon.clients == NULL) {
+    fprintf(stderr, "Error: memoria insuficiente\n");
+    close(daemon.inotify_fd);
+    return -1;
+  }
+  listen_fd = daemon_listen(socket_path, &bound);
+  if (listen_fd < 0 || scan_buf_init(&daemon.scan) < 0) {
+    if (listen_fd >= 0) {
+      close(listen_fd);
+    }
+    close(daemon.inotify_fd);
+    free(daemon.clients);
+    return -1;
+  }
+
+  daemon.root = scan_dir_tree(dirfd, dirpath);
+  if (daemon.root != NULL && daemon_watch_tree(&daemon, daemon.root) == 0) {
+    printf("Vigilando %s (%ld KB), consultas en %s\n", dirpath, daemon.root->total_blocks / 2, socket_path);
+    fflush(stdout);
+
+    fds[0].fd = daemon.inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd;
+    while (1) {
+      fds[1].events = daemon.client_count < DAEMON_CLIENTS_MAX ? POLLIN : 0;
+      count = daemon.client_count;
+      for (i = 0; i < count; i++) {
+        fds[2 + i].fd = daemon.clients[i].fd;
+        fds[2 + i].events = daemon.clients[i].replying ? POLLOUT : POLLIN;
+        fds[2 + i].revents = 0;
+      }
+      if (poll(fds, (nfds_t)(2 + count), daemon_poll_timeout(&daemon)) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      if ((fds[0].revents & POLLIN) != 0 && daemon_events(&daemon) < 0) {
+        break;
+      }
+      /* de atras hacia delante: al cerrar i su sitio lo ocupa uno que ya hemos visto */
+      now = stats_now();
+      for (i = count; i-- > 0;) {
+        if ((fds[2 + i].revents != 0 && daemon_client_io(&daemon, &daemon.clients[i]) == 0) ||
+            now >= daemon.clients[i].deadline) {
+          daemon_close_client(&daemon, i);
+        }
+      }
+      if ((fds[1].revents & POLLIN) != 0) {
+        daemon_accept(&daemon, listen_fd);
+      }
+    }
+  }
+
+  if (daemon.root != NULL) {
+    free_dir_tree(daemon.root);
+  }
+  while (daemon.client_count > 0) {
+    daemon_close_client(&daemon, daemon.client_count - 1);
+  }
+  free(daemon.clients);
+  close(listen_fd);
+  if (lstat(socket_path, &st) == 0 && st.st_dev == bound.st_dev && st.st_ino == bound.st_ino) {
+    unlink(socket_path); /* si otro demonio ha puesto ya el suyo, no es nuestro */
+  }
+  close(daemon.inotify_fd);
+  scan_buf_free(&daemon.scan);
+  subdir_free(&daemon.subdirs);
+  free(daemon.path.data);
+  free(daemon.watches);
+  free(daemon.dirty);
+  return -1;
+}
+
+/*
+ daemon_query: cliente de --daemon (./mydu --query <socket> [<ruta>])
+
+ Manda la ruta y muestra la respuesta tal cual.
+ Devuelve 0 si el demonio respondio con un tamano, -1 si no.
+ */
+int daemon_query(const char *socket_path, const char *path) {
+  struct sockaddr_un addr;
+  char reply[DAEMON_REQUEST_MAX + 64];
+  ssize_t got;
+  size_t len;
+  int fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: ruta del socket demasiado larga\n");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Error: no se pudo conectar con %s\n", socket_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  if (write_all(fd, path, strlen(path)) < 0 || write_all(fd, "\n", 1) < 0) {
+    fprintf(stderr, "Error: no se pudo enviar la consulta\n");
+    close(fd);
+    return -1;
+  }
+  len = 0;
+  while (len < sizeof(reply) && (got = read(fd, reply + len, sizeof(reply) - len)) > 0) {
+    len += (size_t)got;
+  }
+  close(fd);
+  if (len == 0) {
+    fprintf(stderr, "Error: el demonio no respondio\n");
+    return -1;
+  }
+  if (len >= 6 && memcmp(reply, "Error:", 6) == 0) {
+    fprintf(stderr, "%.*s", (int)len, reply);
+    return -1;
+  }
+  printf("%.*s", (int)len, reply);
+  return 0;
+}
+
+/*
+open_directory: abre una ruta solo si apunta a un directorio
+
+ Antes comprobabamos el tipo con lstat() y despues el recorrido volvia a
+ resolver la ruta. Ahora la abrimos una sola vez: O_DIRECTORY hace que open
+ falle si no es un directorio y O_NOFOLLOW que falle si es un enlace
+ simbolico (igual que hacia lstat). El descriptor es el que usa despues
+ calculate_dir_size para todo el recorrido.
+ Esta funcion la necesitamos para rechazar ficheros como argumento, ya que el enunciado dice que solo se aceptan directorios.
+ 
+ Devuelve el descriptor del directorio, o -1 si no existe, no es un directorio o no se puede abrir.
+ */
+int open_directory(const char *path) {
+  return open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/*
+ print_usage: muestra como se usa el programa por stderr
+ */
+void print_usage(void) {
+  fprintf(stderr, "Uso: ./mydu [-j <hilos>] [-u] [-i] [-l] [-x] [--max-depth <N>] [--top <N>] [--save-selected]\n");
+  fprintf(stderr, "            [--stats | --stats=json] [--exclude <patron>] [--exclude-from <fichero>] [<directorio>]\n");
+  fprintf(stderr, "Uso: ./mydu -b [--prefix <ruta> | --path <ruta>] [--last] [--top <N>] [--runs]\n");
+  fprintf(stderr, "Uso: ./mydu --diff <ejecucion> <ejecucion> [--threshold <KB>]\n");
+  fprintf(stderr, "Uso: ./mydu --daemon <socket> [-j <hilos>] [-u] [-x] [--exclude <patron>] [<directorio>]\n");
+  fprintf(stderr, "Uso: ./mydu --query <socket> [<ruta>]\n");
+}
+
+/*
+ main: decide que hace el programa segun los argumentos recibidos
+ 
+ La logica de argumentos es sencilla:
+ - Sin argumentos: analizamos "." (el directorio actual)
+ - Con "-b": mostramos el historial del binario y terminamos (con --prefix, --path, --last o --top filtramos
+   y con --runs separamos las ejecuciones)
+ - Con "--diff A B": comparamos dos ejecuciones del historial y terminamos
+ - Con "--query": preguntamos a un mydu --daemon y terminamos
+ - Con "--daemon <socket>": en lugar de escribir los tamanos nos quedamos vigilando el directorio
+ - Con "-j N": repartimos el recorrido entre N hilos (N = 1 es el recorrido secuencial de siempre)
+ - Con "-u": pedimos los stat con io_uring en lugar de fstatat
+ - Con "-i": reutilizamos mydu.cache para no hacer stat en los directorios que no han cambiado
+ - Con "-l": contamos los enlaces duros cada vez que aparecen (por defecto una sola vez)
+ - Con "-x": no entramos en directorios de otro sistema de ficheros
+ - Con "--max-depth N" y "--top N": solo escribimos parte de los directorios (ver report_dir)
+ - Con "--stats": al terminar mostramos por stderr contadores y tiempos de cada fase
+ - Con "--exclude P" o "--exclude-from F": no contamos ni recorremos las entradas cuyo nombre casa con P (ver EXCLUSIONES)
+ - Con un directorio: lo analizamos
+ - Con mas de un directorio, un fichero o una opcion desconocida: error
+ 
+ Tras calcular el tamano, guardamos el directorio raiz en mydu.bin
+ y lo mostramos por pantalla como ultima linea de la salida.
+ */
+int main(int argc, char *argv[]) {
+  char *target_path;
+  long total_blocks;
+  long total_kb;
+  long value;
+  HistoryQuery query;
+  DiffQuery diff;
+  const char *daemon_socket;
+  uint64_t mark;
+  struct stat st;
+  time_t scan_time;
+  int dirfd;
+  int status;
+  int i;
+
+  /* consulta a un mydu --daemon */
+  if (argc >= 2 && strcmp(argv[1], "--query") == 0) {
+    if (argc < 3 || argc > 4) {
+      print_usage();
+      return -1;
+    }
+    return daemon_query(argv[2], argc == 4 ? argv[3] : "");
+  }
+
+  /* comparacion de dos ejecuciones del historial */
+  if (argc >= 2 && strcmp(argv[1], "--diff") == 0) {
+    if (parse_diff_query(argc, argv, &diff) < 0) {
+      print_usage();
+      return -1;
+    }
+    return diff_history(&diff);
+  }
+
+  /* modo lectura del historial: solo leemos y mostramos el binario */
+  if (argc >= 2 && strcmp(argv[1], "-b") == 0) {
+    if (parse_history_query(argc, argv, &query) < 0) {
+      print_usage();
+      return -1;
+    }
+    return read_binary_history(&query);
+  }
+
+  /* determinamos el directorio objetivo y el numero de hilos segun los argumentos */
+  target_path = NULL;
+  daemon_socket = NULL;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0) {
+      if (i + 1 >= argc || parse_count(argv[i + 1], MAX_THREADS, &value) < 0) {
+        fprintf(stderr, "Error: numero de hilos invalido (1-%d)\n", MAX_THREADS);
+        return -1;
+      }
+      options.nthreads = (int)value;
+      i++;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      options.use_uring = 1;
+    } else if (strcmp(argv[i], "-i") == 0) {
+      options.incremental = 1;
+    } else if (strcmp(argv[i], "-l") == 0) {
+      options.count_links = 1;
+    } else if (strcmp(argv[i], "-x") == 0) {
+      options.one_fs = 1;
+    } else if (strcmp(argv[i], "--max-depth") == 0) {
+      if (i + 1 >= argc || parse_number(argv[i + 1], 0, DEPTH_MAX, &value) < 0) {
+        fprintf(stderr, "Error: profundidad invalida (0-%d)\n", DEPTH_MAX);
+        return -1;
+      }
+      options.max_depth = value;
+      i++;
+    } else if (strcmp(argv[i], "--top") == 0) {
+      if (i + 1 >= argc || parse_count(argv[i + 1], TOP_MAX, &value) < 0) {
+        fprintf(stderr, "Error: numero de directorios invalido (1-%d)\n", TOP_MAX);
+        return -1;
+      }
+      options.top = (size_t)value;
+      i++;
+    } else if (strcmp(argv[i], "--save-selected") == 0) {
+      options.save_selected = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      options.stats = STATS_TEXT;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      options.stats = STATS_JSON;
+    } else if (strcmp(argv[i], "--exclude") == 0 && i + 1 < argc) {
+      if (exclude_add(argv[i + 1]) < 0) {
+        exclude_free();
+        return -1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--exclude-from") == 0 && i + 1 < argc) {
+      if (exclude_add_file(argv[i + 1]) < 0) {
+        exclude_free();
+        return -1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--daemon") == 0 && i + 1 < argc) {
+      daemon_socket = argv[i + 1];
+      i++;
+    } else if (target_path == NULL && strcmp(argv[i], "-b") != 0) {
+      target_path = argv[i];
+    } else {
+      /* demasiados argumentos, mostramos como se usa */
+      print_usage();
+      return -1;
+    }
+  }
+  if (target_path == NULL) {
+    /* sin directorio analizamos el directorio donde estamos */
+    target_path = ".";
+  }
+  mark = stats_start();
+
+    /*
+   Comprobamos que el argumento sea un directorio.
+   Si alguien hace ./mydu mycalc.c no tiene sentido y lo rechazamos.
+   El enunciado dice que en ese caso mostramos el nombre y un error.
+   */
+
+  dirfd = open_directory(target_path);
+  if (dirfd < 0) {
+    fprintf(stderr, "%s: No es un directorio\n", target_path);
+    return -1;
+  }
+  if (options.top > 0 && top_heap_init(&report_heap, options.top) < 0) {
+    close(dirfd);
+    return -1;
+  }
+  /* con -x solo entramos en los directorios del mismo dispositivo que la raiz */
+  if (fstat(dirfd, &st) < 0) {
+    fprintf(stderr, "Error: no se pudo acceder a %s\n", target_path);
+    close(dirfd);
+    return -1;
+  }
+  options.root_dev = st.st_dev;
+  if (daemon_socket != NULL) {
+    /* modo demonio: no escribe en mydu.bin */
+    return daemon_run(dirfd, target_path, daemon_socket);
+  }
+  if (history_open(target_path) < 0) {
+    close(dirfd);
+    return -1;
+  }
+  /*
+   Si la salida va a un fichero o a una tuberia la escribimos en bloques de
+   STDOUT_BUF_SIZE en lugar de los 4 KB de stdio. En un terminal dejamos el
+   buffer por lineas para que se vea el progreso.
+   */
+  if (isatty(1) == 0) {
+    setvbuf(stdout, NULL, _IOFBF, STDOUT_BUF_SIZE);
+  }
+
+  /*
+   Con -i cargamos la cache de la ejecucion anterior. Apuntamos la hora antes
+   de empezar: un directorio que cambie durante el recorrido no debe parecer
+   estable en la siguiente ejecucion.
+   */
+  scan_time = time(NULL);
+  if (options.incremental) {
+    cache_load();
+  }
+
+  stats_phase(PHASE_SETUP, &mark);
+
+  /* calculamos los bloques totales del directorio de forma recursiva o con varios hilos */
+  if (options.nthreads > 1) {
+    total_blocks = calculate_dir_size_parallel(dirfd, target_path);
+  } else {
+    total_blocks = calculate_dir_size(dirfd, target_path);
+  }
+  close(dirfd);
+  inode_set_free(&inode_set);
+  exclude_free();
+  stats_phase(PHASE_SCAN, &mark);
+  if (total_blocks < 0) {
+    history_close(); /* descartamos la ejecucion: no se escribe nada en mydu.bin */
+    top_heap_free(&report_heap);
+    cache_free();
+    return -1;
+  }
+  /* convertimos a KB (cada bloque en st.st_blocks equivale a 512 bytes) */
+  total_kb = total_blocks / 2;
+
+  /* guardamos el resultado en el fichero binario y mostramos el tamaño total del directorio raiz como ultima linea */
+  if (report_dir(total_kb, target_path, 0) < 0 || (options.top > 0 && report_top() < 0)) {
+    history_close();
+    top_heap_free(&report_heap);
+    cache_free();
+    return -1;
+  }
+  top_heap_free(&report_heap);
+  /* la salida tiene que estar escrita antes de medir (y de mostrar las estadisticas) */
+  fflush(stdout);
+  stats_phase(PHASE_REPORT, &mark);
+  /* escribimos toda la ejecucion en mydu.bin de una vez */
+  if (history_commit() < 0) {
+    cache_free();
+    return -1;
+  }
+  stats_phase(PHASE_HISTORY, &mark);
+  /* y la cache para la siguiente ejecucion con -i */
+  if (options.incremental) {
+    status = cache_save(scan_time);
+    cache_free();
+    if (status < 0) {
+      return -1;
+    }
+  }
+  stats_phase(PHASE_CACHE, &mark);
+  if (options.stats) {
+    stats_print();
+  }
+
+  return 0;
+}
@@ -0,0 +1,208 @@
+/*
+numtext.c - Lectura y escritura de numeros en texto, compartida por mycalc y mydu
+
+En los modos que procesan muchas lineas (mycalc -f, el servidor, el
+historial de mydu) casi todo el tiempo se iba en pasar numeros de texto a
+entero y al reves: strtol para leer y una division por cifra, guardando
+las cifras al reves en un buffer temporal, para escribir.
+
+parse_int hace las mismas comprobaciones que strtol + los limites de int
+(texto vacio, basura detras, numero que no cabe) pero lee ocho cifras de
+golpe: las carga en un entero de 64 bits, comprueba las ocho con unas
+pocas operaciones y las convierte con tres multiplicaciones (SWAR, "SIMD
+dentro de un registro").
+
+format_int y format_long calculan primero cuantas cifras tiene el numero y
+las escriben de derecha a izquierda directamente en el buffer de salida,
+dos por cada division usando una tabla con los pares "00".."99".
+
+No usa stdio, para que mycalc pueda seguir sin ella.
+*/
+#include "numtext.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+/* los pares de cifras "00".."99", uno detras de otro */
+const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* potencias de 10 que caben en 64 bits, para contar cifras */
+const uint64_t powers_of_ten[20] = {1ULL,
+                                    10ULL,
+                                    100ULL,
+                                    1000ULL,
+                                    10000ULL,
+                                    100000ULL,
+                                    1000000ULL,
+                                    10000000ULL,
+                                    100000000ULL,
+                                    1000000000ULL,
+                                    10000000000ULL,
+                                    100000000000ULL,
+                                    1000000000000ULL,
+                                    10000000000000ULL,
+                                    100000000000000ULL,
+                                    1000000000000000ULL,
+                                    10000000000000000ULL,
+                                    100000000000000000ULL,
+                                    1000000000000000000ULL,
+                                    10000000000000000000ULL};
+
+/*
+ load_eight: carga 8 bytes con el primero en el byte menos significativo
+ */
+uint64_t load_eight(const char *p) {
+  uint64_t chunk;
+
+  memcpy(&chunk, p, sizeof(chunk));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  chunk = __builtin_bswap64(chunk);
+#endif
+  return chunk;
+}
+
+/*
+ eight_digits: comprueba que los 8 bytes de chunk son cifras ('0'..'9')
+ Cada byte tiene que ser 0x3N con N <= 9: el nibble alto es 3 y al sumarle
+ 6 el nibble bajo no se pasa a 0x40. Si algun byte arrastra al siguiente,
+ ese byte ya no da 0x33 y el resultado es 0 igualmente.
+ Devuelve 1 si lo son, 0 si no.
+ */
+int eight_digits(uint64_t chunk) {
+  return ((chunk & 0xF0F0F0F0F0F0F0F0ULL) | (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+         0x3333333333333333ULL;
+}
+
+/*
+ eight_digits_value: valor de 8 cifras ya comprobadas con eight_digits
+ Se juntan de dos en dos (x10), luego de cuatro en cuatro (x100) y por
+ ultimo las dos mitades (x10000), cada paso sobre todos los bytes a la vez.
+ */
+uint32_t eight_digits_value(uint64_t chunk) {
+  chunk -= 0x3030303030303030ULL;
+  chunk = chunk * 10 + (chunk >> 8);
+  chunk = ((chunk & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+           ((chunk >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >>
+          32;
+  return (uint32_t)chunk;
+}
+
+/*
+ parse_int: convierte los len bytes de text a un int
+
+ Acepta lo mismo que strtol en base 10 cuando luego se exige que el numero
+ quepa en un int: espacios delante, un signo opcional, cifras (con tantos
+ ceros a la izquierda como se quiera) y nada mas detras. Quitados los
+ ceros, mas de 10 cifras nunca caben. Las ultimas hasta 8 cifras se leen
+ con SWAR, rellenando con '0' por la izquierda si son menos; las que haya
+ delante (1 o 2) una a una.
+ Devuelve 0 y deja el numero en *out si es valido, -1 si no.
+ */
+int parse_int(const char *text, size_t len, int *out) {
+  char chunk[8];
+  uint64_t value;
+  uint64_t word;
+  size_t digits;
+  size_t i;
+  int negative;
+
+  i = 0;
+  while (i < len && (text[i] == ' ' || (text[i] >= '\t' && text[i] <= '\r'))) {
+    i++;
+  }
+  negative = 0;
+  if (i < len && (text[i] == '-' || text[i] == '+')) {
+    negative = text[i] == '-';
+    i++;
+  }
+  if (i == len) {
+    return -1;
+  }
+  while (i < len - 1 && text[i] == '0') {
+    i++;
+  }
+  digits = len - i;
+  if (digits > 10) {
+    return -1;
+  }
+
+  value = 0;
+  while (digits > 8) {
+    if (text[i] < '0' || text[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + (uint64_t)(text[i] - '0');
+    i++;
+    digits--;
+  }
+  memset(chunk, '0', sizeof(chunk));
+  memcpy(chunk + sizeof(chunk) - digits, text + i, digits);
+  word = load_eight(chunk);
+  if (!eight_digits(word)) {
+    return -1;
+  }
+  value = value * 100000000ULL + eight_digits_value(word);
+
+  if (value > (negative ? (uint64_t)INT_MAX + 1 : (uint64_t)INT_MAX)) {
+    return -1;
+  }
+  *out = (int)(negative ? -(int64_t)value : (int64_t)value);
+  return 0;
+}
+
+/*
+ format_u64: escribe n en out sin terminar en '\0'
+ Devuelve cuantos bytes ha escrito.
+ */
+int format_u64(uint64_t n, char *out) {
+  unsigned pair;
+  char *p;
+  int len;
+
+  len = 1;
+  while (len < 20 && n >= powers_of_ten[len]) {
+    len++;
+  }
+  p = out + len;
+  while (n >= 100) {
+    pair = (unsigned)(n % 100) * 2;
+    n /= 100;
+    p -= 2;
+    p[0] = digit_pairs[pair];
+    p[1] = digit_pairs[pair + 1];
+  }
+  if (n >= 10) {
+    p[-2] = digit_pairs[n * 2];
+    p[-1] = digit_pairs[n * 2 + 1];
+  } else {
+    p[-1] = (char)('0' + n);
+  }
+  return len;
+}
+
+/*
+ format_int: escribe value en out (como mucho NUMTEXT_INT_MAX bytes, sin '\0')
+ Devuelve cuantos bytes ha escrito.
+ */
+int format_int(int value, char *out) {
+  return format_long(value, out);
+}
+
+/*
+ format_long: escribe value en out (como mucho NUMTEXT_LONG_MAX bytes, sin '\0')
+ El valor absoluto se calcula en unsigned para que LONG_MIN no desborde.
+ Devuelve cuantos bytes ha escrito.
+ */
+int format_long(long value, char *out) {
+  if (value < 0) {
+    out[0] = '-';
+    return 1 + format_u64(0 - (uint64_t)value, out + 1);
+  }
+  return format_u64((uint64_t)value, out);
+}
@@ -0,0 +1,19 @@
+/*
+numtext.h - Lectura y escritura de numeros en texto, compartida por mycalc y mydu
+
+Ver numtext.c.
+*/
+#ifndef NUMTEXT_H
+#define NUMTEXT_H
+
+#include <stddef.h>
+
+/* bytes que puede escribir format_int ("-2147483648") y format_long ("-9223372036854775808") */
+#define NUMTEXT_INT_MAX 11
+#define NUMTEXT_LONG_MAX 20
+
+int parse_int(const char *text, size_t len, int *out);
+int format_int(int value, char *out);
+int format_long(long value, char *out);
+
+#endif